@@ -0,0 +1,182 @@
+/* ************************ Latency and throughput benchmark ************************
+ * Runs the bridge against a TR40 emulator on the simulated clock and measures
+ *   - set topic to RS485 write: from a set message reaching the broker to the last
+ *     byte of the write leaving the bridge
+ *   - RS485 reply to publish: from the last byte of a reply that carries a change to
+ *     the change being published
+ *   - sustained command throughput: set messages sent as fast as Home Assistant can
+ *     send them, and how many reach the thermostat
+ * The times are simulated so they are the same on every run and every machine; the
+ * host CPU time per simulated second and the loop profile are printed as well.
+ *
+ *   bench_latency [--quick]
+ */
+#include "main.cpp"
+#include "sim.h"
+#include "tr40.h"
+
+#include <time.h>
+#include <algorithm>
+#include <vector>
+
+using namespace host;
+
+namespace {
+
+Tr40 livingRoom("1");
+
+const uint64_t PASS_TIME = 50;
+
+void runFor(uint64_t micros) {
+  uint64_t end = now() + micros;
+  while (now() < end) {
+    loop();
+    advance(PASS_TIME);
+  }
+}
+
+template <typename Condition>
+bool runUntil(Condition done, uint64_t micros) {
+  uint64_t end = now() + micros;
+  while (!done() && now() < end) {
+    loop();
+    advance(PASS_TIME);
+  }
+  return done();
+}
+
+double cpuSeconds() {
+  timespec time;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+void report(const char* name, std::vector<uint64_t> samples) {
+  if (samples.empty()) {
+    printf("%-34s no samples\n", name);
+    return;
+  }
+  std::sort(samples.begin(), samples.end());
+  auto at = [&](double percent) {
+    return samples[std::min(samples.size() - 1, (size_t)(percent / 100 * samples.size()))] / 1000.0;
+  };
+  printf("%-34s n %4zu  p50 %7.2f  p95 %7.2f  p99 %7.2f  max %7.2f ms\n", name, samples.size(), at(50), at(95),
+         at(99), samples.back() / 1000.0);
+}
+
+std::string topic(const char* key) {
+  return std::string(thermostats[0].topicPrefix) + "/" + key;
+}
+
+//From a set message to its write on the bus. The messages arrive at random points in 
+//the poll schedule and while the bridge is asleep, as they would from the network.
+std::vector<uint64_t> setToWrite(int samples) {
+  std::vector<uint64_t> latencies;
+  for (int i = 0; i < samples; i++) {
+    char value[8];
+    snprintf(value, sizeof(value), "%d", 60 + i % 20);
+    std::string expected = std::string("SPH=") + value;
+    uint64_t sentAt = now() + random(20000000);
+    uint64_t writtenAt = 0;
+    bus.onSent = [&](const Bus::Frame& frame) {
+      if (writtenAt == 0 && frame.text.find(expected) != std::string::npos) {
+        writtenAt = frame.at;
+      }
+    };
+    std::string payload = value;
+    at(sentAt, [payload] { broker.send(topic("SPH") + "/set", payload); });
+    if (runUntil([&] { return writtenAt != 0; }, 30000000)) {
+      latencies.push_back(writtenAt - sentAt);
+    }
+    bus.onSent = nullptr;
+  }
+  return latencies;
+}
+
+//From a reply carrying a change made at the wall unit to the change being published
+std::vector<uint64_t> replyToPublish(int samples) {
+  std::vector<uint64_t> latencies;
+  for (int i = 0; i < samples; i++) {
+    runFor(random(5000) * 1000ULL);
+    int setpoint = 78 + i % 10;
+    if (setpoint == livingRoom.setpointCool) {
+      setpoint ++;
+    }
+    livingRoom.setpointCool = setpoint;
+    std::string expected = std::to_string(setpoint);
+    uint64_t repliedAt = 0;
+    size_t replies = bus.replies.size();
+    uint64_t publishedAt = 0;
+    broker.onPublish = [&](const Broker::Message& message) {
+      if (publishedAt == 0 && message.topic == topic("SPC") && message.payload == expected) {
+        publishedAt = message.at;
+      }
+    };
+    if (runUntil([&] { return publishedAt != 0; }, 60000000)) {
+      for (size_t j = replies; j < bus.replies.size(); j++) {
+        if (bus.replies[j].text.find("SPC=" + expected) != std::string::npos) {
+          repliedAt = bus.replies[j].at;
+          break;
+        }
+      }
+      if (repliedAt != 0) {
+        latencies.push_back(publishedAt - repliedAt);
+      }
+    }
+    broker.onPublish = nullptr;
+  }
+  return latencies;
+}
+
+//Set messages sent every interval for a while, spread over the settable keys
+void throughput(uint64_t duration, uint64_t interval) {
+  static const char* const keys[] = {"SPH", "SPC", "FM", "M"};
+  static const char* const values[][2] = {{"66", "67"}, {"80", "81"}, {"0", "1"}, {"H", "A"}};
+  unsigned long writes = livingRoom.writes;
+  size_t frames = bus.sent.size();
+  unsigned long sent = 0;
+  uint64_t end = now() + duration;
+  uint64_t next = now();
+  while (now() < end) {
+    uint8_t key = sent % 4;
+    std::string payload = values[key][(sent / 4) % 2];
+    at(next, [key, payload] { broker.send(topic(keys[key]) + "/set", payload); });
+    sent ++;
+    next += interval;
+    runFor(next - now());
+  }
+  runFor(2000000);
+  double seconds = duration / 1e6;
+  printf("%-34s %lu sent every %.0f ms: %.1f writes/s reached the thermostat in %.1f frames/s\n",
+         "sustained commands", sent, interval / 1000.0, (livingRoom.writes - writes) / seconds,
+         (bus.sent.size() - frames) / seconds);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  bool quick = argc > 1 && strcmp(argv[1], "--quick") == 0;
+  int samples = quick ? 20 : 500;
+  //The thermostat takes between 20 and 60 ms to answer
+  livingRoom.turnaround = 20000;
+  livingRoom.jitter = 40000;
+  bus.attach(&livingRoom);
+  setup();
+  runFor(30000000);
+
+  double cpuStart = cpuSeconds();
+  uint64_t simulatedStart = now();
+  report("set topic -> RS485 write", setToWrite(samples));
+  report("RS485 reply -> publish", replyToPublish(samples));
+  throughput(quick ? 10000000 : 120000000, 50000);
+  throughput(quick ? 10000000 : 120000000, 250000);
+  double simulated = (now() - simulatedStart) / 1e6;
+  printf("%-34s %.1f us per simulated second over %.0f s\n", "host CPU",
+         (cpuSeconds() - cpuStart) * 1e6 / simulated, simulated);
+  //The loop profile over the whole run, printed the way the debug topic's "profile" 
+  //prints it on the device. The passes are timed on the simulated clock, so they show 
+  //where loop() blocks on the bus.
+  busFigures.request(FIGURES_FOR_SERIAL);
+  runUntil([] { return busFigures.phase.load() == FIGURES_IDLE; }, 1000000);
+  return 0;
+}
@@ -0,0 +1,84 @@
+/* ************************ Logger benchmark ************************
+ * The cost of a log call at the production settings, where the call's level is
+ * off: a LOG_DEBUG call, and the print() of a String built the way the call sites
+ * before the logger built it. The cost of a record that is kept in the ring is
+ * shown for comparison. A call above LOG_COMPILED_LEVEL is compiled out and costs
+ * nothing.
+ *
+ *   bench_logger [--quick]
+ */
+#include "main.cpp"
+#include "sim.h"
+
+#include <time.h>
+
+namespace {
+
+double seconds() {
+  timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+//Keeps the compiler from hoisting the level check out of the loop
+inline void barrier() {
+  asm volatile("" ::: "memory");
+}
+
+struct Result {
+  double nanosPerCall;
+  double allocationsPerCall;
+};
+
+template <typename Call>
+Result run(unsigned long count, Call call) {
+  unsigned long allocations = host::heapAllocations;
+  double start = seconds();
+  for (unsigned long i = 0; i < count; i++) {
+    call(i);
+    barrier();
+  }
+  double elapsed = seconds() - start;
+  return Result{elapsed * 1e9 / count, (double)(host::heapAllocations - allocations) / count};
+}
+
+void report(const char* name, const Result& result) {
+  printf("%-36s %8.1f ns/call %6.2f allocations/call\n", name, result.nanosPerCall, result.allocationsPerCall);
+}
+
+const char* const frame = "A=00 O=1 OA=88 Z=1 T=77 SP= 70 SPH=70 SPC=78 M=H FM=0";
+
+}  // namespace
+
+/**
+ * @brief The debug printing before the logger, off as it was by default
+ */
+namespace baseline {
+
+boolean debugPrint = false;
+
+void println(String Message) {
+  if (debugPrint)
+    Serial.println(Message);
+}
+
+}  // namespace baseline
+
+int main(int argc, char** argv) {
+  bool quick = argc > 1 && strcmp(argv[1], "--quick") == 0;
+  unsigned long count = quick ? 100000 : 20000000;
+  String message = frame;
+
+  Result disabled = run(count, [](unsigned long i) {
+    LOG_DEBUG("Message: %s, count = %lu", frame, i);
+  });
+  report("LOG_DEBUG, level off", disabled);
+  report("println(String + ...), debug off", run(count, [&](unsigned long i) {
+    baseline::println("Message: " + message + ", count = " + String((long)i));
+  }));
+  report("LOG_INFO, kept in the ring", run(count / 10, [](unsigned long i) {
+    LOG_INFO("Message: %s, count = %lu", frame, i);
+  }));
+  //A disabled call must not allocate
+  return disabled.allocationsPerCall == 0 ? 0 : 1;
+}
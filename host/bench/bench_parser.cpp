@@ -0,0 +1,303 @@
+/* ************************ Status frame parser benchmark ************************
+ * Parses a mix of R=1 and R=2 frames with the in place parser and with a copy of
+ * the String based parser it replaced, and reports frames per second and heap
+ * allocations per frame for each.
+ *
+ *   bench_parser [--quick]
+ */
+#include "main.cpp"
+#include "sim.h"
+
+#include <time.h>
+#include <new>
+
+namespace {
+
+double seconds() {
+  timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+}  // namespace
+
+void* operator new(size_t size) {
+  host::heapAllocations ++;
+  void* block = malloc(size);
+  if (block == NULL) {
+    throw std::bad_alloc();
+  }
+  return block;
+}
+
+void operator delete(void* block) noexcept {
+  free(block);
+}
+
+void operator delete(void* block, size_t size) noexcept {
+  free(block);
+}
+
+/**
+ * @brief The parser as it was before the in place parser, with its publishes going
+ * nowhere and its debug prints off, as they are by default
+ */
+namespace baseline {
+
+String lastSetpointHeat;
+String lastSetpointCool;
+String lastMode = "";
+String lastFanMode = "";
+String lastTemp = "";
+String lastAction = "";
+String serialAddr = "1";
+String originator = "00";
+String lastSent = "";
+String command = "";
+float lastOutsideAir = 0;
+boolean commandSent = false;
+boolean refresh = true;
+boolean processedR1 = false;
+boolean processedR2 = false;
+unsigned long publishes = 0;
+
+const char* outsideAirTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/OA";
+const char* currentTempTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/T";
+const char* setpointHeatTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/SPH";
+const char* setpointCoolTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/SPC";
+const char* modeTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/M";
+const char* fanModeTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/FM";
+const char* actionTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/action";
+const char* scheduleControlTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/SC";
+
+struct {
+  void publish(const char* topic, const char* payload) {
+    publishes ++;
+  }
+} client;
+
+void println(String message) {}
+
+void sendCmd(String cmd) {}
+
+void parseStatus(String Type, String Value) {
+  if (Type == "OA") {
+    if (lastOutsideAir != Value.toFloat() || refresh)
+      client.publish(outsideAirTopic, Value.c_str());
+    lastOutsideAir = Value.toFloat();
+  } else if (Type == "T") {
+    println("Current temperature=" + Value);
+    if (lastTemp != Value || refresh)
+      client.publish(currentTempTopic, Value.c_str());
+    lastTemp = Value;
+  } else if (Type == "SP") {
+    if ((lastMode == "H" || lastMode == "EH") && (lastSetpointHeat != Value || refresh)) {
+      println("Single setpoint Heat=" + Value);
+      client.publish(setpointHeatTopic, Value.c_str());
+      lastSetpointHeat = Value;
+    } else if (lastMode == "C" && (lastSetpointCool != Value || refresh)) {
+      println("Single setpoint cool=" + Value);
+      client.publish(setpointCoolTopic, Value.c_str());
+      lastSetpointCool = Value;
+    }
+  } else if (Type == "SPH") {
+    println("Heating set point=" + Value);
+    if (lastSetpointHeat != Value || refresh)
+      client.publish(setpointHeatTopic, Value.c_str());
+    lastSetpointHeat = Value;
+  } else if (Type == "SPC") {
+    println("Cooling set point=" + Value);
+    if (lastSetpointCool != Value || refresh)
+      client.publish(setpointCoolTopic, Value.c_str());
+    lastSetpointCool = Value;
+  } else if (Type == "M") {
+    println("mode=" + Value);
+    println("Set energy mode to normal");
+    if (lastMode != Value || refresh) {
+      client.publish(modeTopic, Value.c_str());
+      lastMode = Value;
+      if (Value == "O") {
+          println("Set to Off");
+      } else if (Value == "H") {
+          println("Set to Heating");
+      } else if (Value == "C") {
+          println("Set to Cooling");
+      } else if (Value == "A") {
+          println("Set to AutoChangeOver");
+      } else if (Value == "EH") {
+          println("Set to Emergency Heat");
+      }
+    }
+  } else if (Type == "FM") {
+    if (lastFanMode != Value || refresh) {
+      client.publish(fanModeTopic, Value.c_str());
+      lastFanMode = Value;
+      if (Value == "1") {
+        println("Set fan mode to ContinuousOn");
+      } else {
+        println("Set fan mode to Auto");
+      }
+    }
+  } else if (Type == "H1A" && Value == "1" && (lastAction != "H1" || refresh)) {
+    println("Set to heating Stage 1 Min");
+    client.publish(actionTopic, "H1");
+    lastAction = "H1";
+  } else if (Type == "H2A" && Value == "1" && (lastAction != "H2" || refresh)) {
+    println("Set to heating Stage 2 Normal");
+    client.publish(actionTopic, "H2");
+    lastAction = "H2";
+  } else if (Type == "H3A" && Value == "1" && (lastAction != "H3" || refresh)) {
+    println("Set to heating Stage 3 Max");
+    client.publish(actionTopic, "H3");
+    lastAction = "H3";
+  } else if (Type == "C1A" && Value == "1" && (lastAction != "C1" || refresh)) {
+    println("Set to cooling Stage 1 Normal");
+    client.publish(actionTopic, "C1");
+    lastAction = "C1";
+  } else if (Type == "C2A" && Value == "1" && (lastAction != "C2" || refresh)) {
+    println("Set to cooling Stage 2 Max");
+    client.publish(actionTopic, "C2");
+    lastAction = "C2";
+  } else if (((Type == "C1A" && lastMode == "C") || (Type == "H1A" && (lastMode == "H" || lastMode == "EH"))) && Value == "0" && (lastAction != "O" || refresh)) {
+    println("Set fan status to off");
+    client.publish(actionTopic, "O");
+    lastAction = "O";
+  } else if (Type == "FA" && (lastAction != "F" || refresh)) {
+    client.publish(actionTopic, "F");
+    lastAction = "F";
+    if (Value == "1") {
+      println("Set flow mode to ContinuousOn");
+    } else {
+      println("Set fan speed to auto");
+    }
+  } else if (Type == "SC") {
+    client.publish(scheduleControlTopic, Value.c_str());
+    if (Value == "0") {
+      println("Schedule control is set to Hold");
+    } else if (Value == "1") {
+      println("Schedule control is set to Run");
+    } else {
+      println("Unknown schedule control response");
+    }
+  } else if (Type == "VA") {
+  } else if (Type == "D1") {
+  } else if (Type == "SCP") {
+  }
+}
+
+void parseReceived(String Message) {
+  String StatusData;
+  String StatusString;
+  String Status;
+  String Type;
+  String Value;
+
+  int Index;
+  int Start;
+  //Left uninitialised in the original, which only worked by luck
+  int End = 0;
+  int StatIndex;
+
+  Index = Message.indexOf(' ');
+  Start = 0;
+
+  println("Message: " + Message);
+
+  if (Message.startsWith("A=" + originator + " O=" + serialAddr)) {
+    while (End != (int)Message.length()) {
+      End = (Index == -1) ? Message.length() : Index;
+      StatusString = Message.substring(Start, End);
+      Start = Index + 1;
+      Index = Message.indexOf(' ', Start);
+
+      StatIndex = StatusString.indexOf('=');
+      Type = StatusString.substring(0, StatIndex);
+      Value = StatusString.substring(StatIndex + 1);
+      parseStatus(Type, Value);
+    }
+    commandSent = false;
+    if (command == "R=1") {
+      processedR1 = true;
+    }
+    if (command == "R=2") {
+      processedR2 = true;
+    }
+    if (processedR1 && processedR2) {
+      refresh = processedR1 = processedR2 = false;
+    }
+    command = "";
+    println("");
+    println("Response received and processed");
+    println("");
+  } else {
+    sendCmd(lastSent);
+  }
+}
+
+}  // namespace baseline
+
+namespace {
+
+//What a thermostat sends over a few polls, a mix of R=1 and R=2 with values moving
+const char* const frames[] = {
+  "A=00 O=1 OA=88 Z=1 T=77 SP= 70 SPH=70 SPC=78 M=H FM=0",
+  "A=00 O=1 H1A=0 H2A=0 H3A=0 C1A=0 C2A=0 FA=0 VA=0 SM=H SCP=00",
+  "A=00 O=1 OA=87 Z=1 T=76 SP= 70 SPH=70 SPC=78 M=H FM=0",
+  "A=00 O=1 H1A=1 H2A=0 H3A=0 C1A=0 C2A=0 FA=0 VA=0 SM=H SCP=20",
+  "A=00 O=1 OA=87 Z=1 T=77 SP= 71 SPH=71 SPC=78 M=H FM=1",
+  "A=00 O=1 H1A=1 H2A=1 H3A=0 C1A=0 C2A=0 FA=1 VA=0 SM=H SCP=22",
+};
+const size_t FRAME_COUNT = sizeof(frames) / sizeof(frames[0]);
+
+struct Result {
+  double framesPerSecond;
+  double allocationsPerFrame;
+};
+
+Result runInPlace(unsigned long count) {
+  char frame[RX_BUFFER_SIZE];
+  StatusUpdate update;
+  unsigned long allocations = host::heapAllocations;
+  double start = seconds();
+  for (unsigned long i = 0; i < count; i++) {
+    const char* text = frames[i % FRAME_COUNT];
+    size_t length = strlen(text);
+    memcpy(frame, text, length + 1);
+    parseReceived(frame, length);
+    while (outboundStatus.pop(update)) {
+    }
+  }
+  double elapsed = seconds() - start;
+  return Result{count / elapsed, (double)(host::heapAllocations - allocations) / count};
+}
+
+Result runBaseline(unsigned long count) {
+  unsigned long allocations = host::heapAllocations;
+  double start = seconds();
+  for (unsigned long i = 0; i < count; i++) {
+    //The original read each frame into a String with readStringUntil()
+    String message(frames[i % FRAME_COUNT]);
+    baseline::parseReceived(message);
+  }
+  double elapsed = seconds() - start;
+  return Result{count / elapsed, (double)(host::heapAllocations - allocations) / count};
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  bool quick = argc > 1 && strcmp(argv[1], "--quick") == 0;
+  unsigned long count = quick ? 20000 : 2000000;
+  //Publishing the status needs the publish policies to see time pass
+  host::advance(1000000);
+  runInPlace(count / 10);
+  runBaseline(count / 10);
+  Result inPlace = runInPlace(count);
+  Result original = runBaseline(count);
+  printf("%-24s %12.0f frames/s %8.2f allocations/frame\n", "in place parser", inPlace.framesPerSecond,
+         inPlace.allocationsPerFrame);
+  printf("%-24s %12.0f frames/s %8.2f allocations/frame\n", "String parser", original.framesPerSecond,
+         original.allocationsPerFrame);
+  printf("%-24s %12.1fx faster\n", "", inPlace.framesPerSecond / original.framesPerSecond);
+  return inPlace.allocationsPerFrame == 0 ? 0 : 1;
+}
@@ -0,0 +1,139 @@
+/* ************************ Capture replay benchmark ************************
+ * Parses the frames received in RS485 capture files with the in place parser, into
+ * the replay's copy of the thermostats as a replay does, and reports frames per
+ * second for each file. Captures from a real bus are written by the Linux gateway
+ * with --capture. Without a file it records one from a TR40 emulator on the
+ * simulated bus, writes it to bench_replay.capture through the same sink and parses
+ * that.
+ *
+ *   bench_replay [--quick] [CAPTURE...]
+ */
+#include "main.cpp"
+#include "capture.h"
+#include "sim.h"
+#include "tr40.h"
+
+#include <time.h>
+#include <string>
+#include <vector>
+
+using namespace host;
+
+namespace {
+
+Tr40 livingRoom("1");
+
+const char* const RECORDED_PATH = "bench_replay.capture";
+
+double seconds() {
+  timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+//Runs the bridge against the emulator with capture on, the temperature and the 
+//heating moving now and then so the capture has changes in it
+bool record(const char* path, unsigned long minutes) {
+  if (!capture::openFile(path)) {
+    return false;
+  }
+  bus.attach(&livingRoom);
+  setup();
+  busCapture.sink = capture::writeRecord;
+  busCapture.enable(true);
+  for (unsigned long minute = 0; minute < minutes; minute++) {
+    livingRoom.temp = 70 + (int)(minute / 7 % 5);
+    livingRoom.stages[Tr40::H1] = minute % 20 < 8;
+    uint64_t end = now() + 60000000ULL;
+    while (now() < end) {
+      loop();
+      advance(50);
+    }
+  }
+  busCapture.enable(false);
+  busCapture.sink = NULL;
+  capture::closeFile();
+  return true;
+}
+
+//Parses one frame as a replay does, and drops what it publishes
+void parseReplayed(const std::string& text) {
+  char frame[RX_BUFFER_SIZE];
+  size_t length = std::min(text.size(), sizeof(frame) - 1);
+  memcpy(frame, text.data(), length);
+  frame[length] = '\0';
+  replay.parsing = true;
+  parseReceived(frame, length);
+  replay.parsing = false;
+  StatusUpdate update;
+  while (outboundStatus.pop(update)) {
+    replay.publishes ++;
+  }
+}
+
+bool benchmark(const char* path, unsigned long count) {
+  std::vector<capture::Record> records;
+  if (!capture::readFile(path, records)) {
+    printf("%s: not a whole capture\n", path);
+    return false;
+  }
+  std::vector<std::string> frames;
+  for (const capture::Record& record : records) {
+    if (record.direction == CAPTURE_RX) {
+      frames.push_back(record.frame);
+    }
+  }
+  printf("%s: %zu records, %zu received, %.0f s\n", path, records.size(), frames.size(),
+         records.empty() ? 0.0 : (records.back().time - records.front().time) / 1000.0);
+  if (frames.empty()) {
+    return true;
+  }
+  //Once through from an empty state, for what the frames publish
+  for (Thermostat& thermostat : replayThermostats) {
+    thermostat.state = ThermostatState();
+  }
+  replay.publishes = 0;
+  replay.malformedFrames = 0;
+  replay.foreignFrames = 0;
+  for (const std::string& frame : frames) {
+    parseReplayed(frame);
+  }
+  printf("%-24s %lu publishes, %lu malformed, %lu for other devices\n", "  one pass", replay.publishes,
+         replay.malformedFrames, replay.foreignFrames);
+  double start = seconds();
+  for (unsigned long i = 0; i < count; i++) {
+    parseReplayed(frames[i % frames.size()]);
+  }
+  double elapsed = seconds() - start;
+  printf("%-24s %12.0f frames/s %8.2f us/frame\n", "  in place parser", count / elapsed, elapsed * 1e6 / count);
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  bool quick = false;
+  std::vector<const char*> paths;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--quick") == 0) {
+      quick = true;
+    } else {
+      paths.push_back(argv[i]);
+    }
+  }
+  if (paths.empty()) {
+    if (!record(RECORDED_PATH, quick ? 10 : 120)) {
+      printf("Can not write %s\n", RECORDED_PATH);
+      return 1;
+    }
+    paths.push_back(RECORDED_PATH);
+  } else {
+    //Publishing the status needs the publish policies to see time pass
+    advance(1000000);
+  }
+  bool whole = true;
+  for (const char* path : paths) {
+    whole = benchmark(path, quick ? 20000 : 2000000) && whole;
+  }
+  return whole ? 0 : 1;
+}
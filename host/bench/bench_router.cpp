@@ -0,0 +1,143 @@
+/* ************************ Topic router benchmark ************************
+ * The cost of dispatching one MQTT message through callback(), from the topic to
+ * the command handed to the RS485 side, and of the route lookup on its own against
+ * the String(topic) compare chain the lookup replaced.
+ *
+ *   bench_router [--quick]
+ */
+#include "main.cpp"
+#include "sim.h"
+
+#include <time.h>
+#include <string>
+#include <vector>
+
+namespace {
+
+double seconds() {
+  timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/**
+ * @brief The topic matching of the callback before the router: a String made from the
+ * topic for each compare against the full set topic constants, in the order they were
+ * tested. Returns the index of the topic that matched.
+ */
+namespace baseline {
+
+const char* const topics[] = {
+  "casa_de_bemo/living_room/rcs_tr40_thermostat/SP/set",
+  "casa_de_bemo/living_room/rcs_tr40_thermostat/SPH/set",
+  "casa_de_bemo/living_room/rcs_tr40_thermostat/SPC/set",
+  "casa_de_bemo/living_room/rcs_tr40_thermostat/M/set",
+  "casa_de_bemo/living_room/rcs_tr40_thermostat/FM/set",
+  "casa_de_bemo/living_room/rcs_tr40_thermostat/TM/set",
+  "casa_de_bemo/living_room/rcs_tr40_thermostat/SC/set",
+  "casa_de_bemo/living_room/rcs_tr40_thermostat/OT/set",
+  "casa_de_bemo/living_room/rcs_tr40_thermostat/TIME/set",
+  "casa_de_bemo/living_room/rcs_tr40_thermostat/DATE/set",
+  "casa_de_bemo/living_room/rcs_tr40_thermostat/DOW/set",
+  "casa_de_bemo/living_room/rcs_tr40_thermostat/debug",
+};
+
+int dispatch(char* topic, byte* message, unsigned int length) {
+  String messageTemp;
+  for (unsigned int i = 0; i < length; i++) {
+    messageTemp += (char)message[i];
+  }
+  for (size_t i = 0; i < sizeof(topics) / sizeof(topics[0]); i++) {
+    if (String(topic) == topics[i]) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+}  // namespace baseline
+
+struct Message {
+  std::vector<char> topic;
+  std::string payload;
+};
+
+//What Home Assistant sends when a user moves the thermostat card around
+std::vector<Message> messages() {
+  static const char* const sets[][2] = {
+    {"SPH", "70"}, {"SPC", "78"}, {"M", "C"}, {"FM", "1"}, {"DOW", "3"}, {"TIME", "12:30:00"},
+  };
+  std::vector<Message> list;
+  for (const auto& set : sets) {
+    std::string topic = std::string(thermostats[0].topicPrefix) + "/" + set[0] + "/set";
+    Message message;
+    message.topic.assign(topic.begin(), topic.end());
+    message.topic.push_back('\0');
+    message.payload = set[1];
+    list.push_back(message);
+  }
+  return list;
+}
+
+double routerCost(std::vector<Message>& list, unsigned long count) {
+  Command command;
+  StatusUpdate update;
+  double start = seconds();
+  for (unsigned long i = 0; i < count; i++) {
+    Message& message = list[i % list.size()];
+    callback(message.topic.data(), (byte*)message.payload.data(), message.payload.size());
+    while (inboundCommands.pop(command)) {
+    }
+    while (outboundStatus.pop(update)) {
+    }
+  }
+  return (seconds() - start) / count;
+}
+
+//Only the part that replaced the compare chain: stripping the prefix and the table lookup
+double lookupCost(std::vector<Message>& list, unsigned long count) {
+  uintptr_t found = 0;
+  double start = seconds();
+  for (unsigned long i = 0; i < count; i++) {
+    Message& message = list[i % list.size()];
+    const char* key = topicKey(message.topic.data(), thermostats[0].topicPrefix);
+    const char* slash = strchr(key, '/');
+    found += (uintptr_t)findSetRoute(key, slash - key);
+  }
+  double cost = (seconds() - start) / count;
+  return found != 0 ? cost : 0;
+}
+
+double baselineCost(std::vector<Message>& list, unsigned long count) {
+  int matched = 0;
+  double start = seconds();
+  for (unsigned long i = 0; i < count; i++) {
+    Message& message = list[i % list.size()];
+    matched += baseline::dispatch(message.topic.data(), (byte*)message.payload.data(), message.payload.size());
+  }
+  double cost = (seconds() - start) / count;
+  return matched >= 0 ? cost : 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  bool quick = argc > 1 && strcmp(argv[1], "--quick") == 0;
+  unsigned long count = quick ? 20000 : 2000000;
+  std::vector<Message> list = messages();
+  routerCost(list, count / 10);
+  baselineCost(list, count / 10);
+  unsigned long allocations = host::heapAllocations;
+  double router = routerCost(list, count);
+  double routerAllocations = (double)(host::heapAllocations - allocations) / count;
+  double lookup = lookupCost(list, count);
+  allocations = host::heapAllocations;
+  double original = baselineCost(list, count);
+  double originalAllocations = (double)(host::heapAllocations - allocations) / count;
+  printf("%-30s %8.0f ns/message %6.2f String allocations/message\n", "callback() through the router", router * 1e9,
+         routerAllocations);
+  printf("%-30s %8.0f ns/message\n", "prefix strip and route lookup", lookup * 1e9);
+  printf("%-30s %8.0f ns/message %6.2f String allocations/message\n", "old compare chain, match only",
+         original * 1e9, originalAllocations);
+  return 0;
+}
@@ -0,0 +1,90 @@
+/* ************************ Per-frame state update benchmark ************************
+ * The cost of taking one status frame through the parser, the dirty bits and the
+ * publish stage up to the outbound queue, for frames that change nothing, frames
+ * that change one field and frames that change every field, and how many fields
+ * each kind publishes. The frames are spaced as they are polled at idle, so the
+ * heartbeats that come due are counted too.
+ *
+ *   bench_state [--quick]
+ */
+#include "main.cpp"
+#include "sim.h"
+
+#include <time.h>
+
+namespace {
+
+double seconds() {
+  timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+//How far apart the frames are, as they would be polled at idle. Moving the clock lets the
+//publish policies' minimum intervals pass the way they do on the bus.
+const uint64_t FRAME_SPACING = R1_POLL_PERIOD * 1000ULL / 2;
+
+struct Result {
+  double nanosPerFrame;
+  double publishesPerFrame;
+  double allocationsPerFrame;
+};
+
+//Runs a set of frames in turn, each parsed in place the way busLoop() does
+Result run(const char* const* frames, size_t frameCount, unsigned long count) {
+  char frame[RX_BUFFER_SIZE];
+  StatusUpdate update;
+  unsigned long publishes = 0;
+  unsigned long allocations = host::heapAllocations;
+  double start = seconds();
+  for (unsigned long i = 0; i < count; i++) {
+    const char* text = frames[i % frameCount];
+    size_t length = strlen(text);
+    memcpy(frame, text, length + 1);
+    parseReceived(frame, length);
+    host::advance(FRAME_SPACING);
+    while (outboundStatus.pop(update)) {
+      publishes ++;
+    }
+  }
+  double elapsed = seconds() - start;
+  return Result{elapsed * 1e9 / count, (double)publishes / count,
+                (double)(host::heapAllocations - allocations) / count};
+}
+
+void report(const char* name, const Result& result) {
+  printf("%-30s %8.0f ns/frame %6.2f fields published/frame %6.2f allocations/frame\n", name,
+         result.nanosPerFrame, result.publishesPerFrame, result.allocationsPerFrame);
+}
+
+const char* const unchanged[] = {
+  "A=00 O=1 OA=88 Z=1 T=77 SP= 70 SPH=70 SPC=78 M=H FM=0",
+  "A=00 O=1 H1A=0 H2A=0 H3A=0 C1A=0 C2A=0 FA=0 VA=0 SM=H SCP=00",
+};
+
+//The setpoint moves back and forth
+const char* const oneChange[] = {
+  "A=00 O=1 OA=88 Z=1 T=77 SP= 70 SPH=70 SPC=78 M=H FM=0",
+  "A=00 O=1 OA=88 Z=1 T=77 SP= 71 SPH=71 SPC=78 M=H FM=0",
+};
+
+//Every field of R=1 moves, and the action with R=2
+const char* const allChange[] = {
+  "A=00 O=1 OA=88 Z=1 T=77 SP= 70 SPH=70 SPC=78 M=H FM=0",
+  "A=00 O=1 H1A=1 H2A=0 H3A=0 C1A=0 C2A=0 FA=1 VA=0 SM=H SCP=00",
+  "A=00 O=1 OA=95 Z=1 T=80 SP= 74 SPH=66 SPC=74 M=C FM=1",
+  "A=00 O=1 H1A=0 H2A=0 H3A=0 C1A=1 C2A=0 FA=1 VA=0 SM=C SCP=00",
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  bool quick = argc > 1 && strcmp(argv[1], "--quick") == 0;
+  unsigned long count = quick ? 20000 : 2000000;
+  run(allChange, 4, count / 10);
+  report("unchanged frames", run(unchanged, 2, count));
+  report("one field changing", run(oneChange, 2, count));
+  Result all = run(allChange, 4, count);
+  report("every field changing", all);
+  return all.allocationsPerFrame == 0 ? 0 : 1;
+}
@@ -0,0 +1,67 @@
+/* ************************ RS485 capture files ************************
+ * Writing and reading the BusCapture record format with stdio.
+ */
+#include "capture.h"
+
+#include <stdio.h>
+
+namespace host {
+namespace capture {
+
+namespace {
+
+const size_t HEADER_SIZE = 6;
+
+FILE* file = NULL;
+
+}  // namespace
+
+bool openFile(const char* path) {
+  closeFile();
+  file = fopen(path, "wb");
+  return file != NULL;
+}
+
+void closeFile() {
+  if (file != NULL) {
+    fclose(file);
+    file = NULL;
+  }
+}
+
+void writeRecord(const uint8_t* header, const char* frame, size_t length) {
+  if (file == NULL) {
+    return;
+  }
+  fwrite(header, 1, HEADER_SIZE, file);
+  fwrite(frame, 1, length, file);
+  fflush(file);
+}
+
+bool readFile(const char* path, std::vector<Record>& records) {
+  FILE* in = fopen(path, "rb");
+  if (in == NULL) {
+    return false;
+  }
+  bool whole = true;
+  uint8_t header[HEADER_SIZE];
+  size_t read;
+  while ((read = fread(header, 1, HEADER_SIZE, in)) == HEADER_SIZE) {
+    Record record;
+    record.time = (unsigned long)header[0] | ((unsigned long)header[1] << 8) |
+                  ((unsigned long)header[2] << 16) | ((unsigned long)header[3] << 24);
+    record.direction = header[4];
+    record.frame.resize(header[5]);
+    if (fread(&record.frame[0], 1, header[5], in) != header[5]) {
+      whole = false;
+      break;
+    }
+    records.push_back(record);
+  }
+  whole = whole && read == 0 && !ferror(in);
+  fclose(in);
+  return whole;
+}
+
+}  // namespace capture
+}  // namespace host
@@ -0,0 +1,48 @@
+/* ************************ RS485 capture files ************************
+ * A capture file holds BusCapture records back to back, the same bytes a capture
+ * dumped over MQTT carries: a six byte header (the time in milliseconds, four bytes
+ * little endian, the direction and the frame length) and then the frame without its
+ * line end. The Linux gateway writes one with --capture, bench_replay records one on
+ * the simulated bus and parses the frames of any it is given.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace host {
+namespace capture {
+
+//A record of a capture
+struct Record {
+  unsigned long time;
+  uint8_t direction;
+  std::string frame;
+};
+
+/**
+ * @brief Opens a file for writeRecord() to write to, replacing what was in it
+ *
+ * @return false if it can not be opened, with errno set
+ */
+bool openFile(const char* path);
+void closeFile();
+
+/**
+ * @brief Writes a record to the file opened with openFile() and flushes it, so the
+ * file can be read while the gateway runs. It is a BusCapture sink.
+ */
+void writeRecord(const uint8_t* header, const char* frame, size_t length);
+
+/**
+ * @brief Reads the whole records of a capture file
+ *
+ * @param records Where the records are added
+ * @return false if the file can not be read or ends part way through a record
+ */
+bool readFile(const char* path, std::vector<Record>& records);
+
+}  // namespace capture
+}  // namespace host
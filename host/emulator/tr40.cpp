@@ -0,0 +1,195 @@
+/* ************************ Scripted TR40 emulator ************************/
+#include "tr40.h"
+
+#include <stdlib.h>
+
+namespace host {
+
+namespace {
+
+bool parseNumber(const std::string& text, int& value) {
+  if (text.empty() || text.size() > 4) {
+    return false;
+  }
+  size_t i = (text[0] == '-') ? 1 : 0;
+  if (i == text.size()) {
+    return false;
+  }
+  for (size_t j = i; j < text.size(); j++) {
+    if (text[j] < '0' || text[j] > '9') {
+      return false;
+    }
+  }
+  value = atoi(text.c_str());
+  return true;
+}
+
+bool inRange(const std::string& text, int low, int high, int& value) {
+  return parseNumber(text, value) && value >= low && value <= high;
+}
+
+//Three two digit numbers with a separator, such as hh:mm:ss, each in its range
+bool validTriple(const std::string& text, char separator, const int low[3], const int high[3]) {
+  if (text.size() != 8 || text[2] != separator || text[5] != separator) {
+    return false;
+  }
+  for (int i = 0; i < 3; i++) {
+    int value;
+    if (!inRange(text.substr(i * 3, 2), low[i], high[i], value)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+std::vector<std::string> splitParameters(const std::string& frame) {
+  std::vector<std::string> parameters;
+  std::string current;
+  bool quoted = false;
+  for (char c : frame) {
+    if (c == '"') {
+      quoted = !quoted;
+    }
+    if (c == ' ' && !quoted) {
+      if (!current.empty()) {
+        parameters.push_back(current);
+      }
+      current.clear();
+      continue;
+    }
+    current += c;
+  }
+  if (!current.empty()) {
+    parameters.push_back(current);
+  }
+  return parameters;
+}
+
+Tr40::Tr40(const std::string& address) : address(address), generator(1) {}
+
+std::string Tr40::statusR1() const {
+  char text[128];
+  int setpoint = (mode == "C") ? setpointCool : setpointHeat;
+  snprintf(text, sizeof(text), "A=00 O=%s OA=%d Z=%d T=%d SP= %d SPH=%d SPC=%d M=%s FM=%d",
+           address.c_str(), outsideAir, zone, temp, setpoint, setpointHeat, setpointCool, mode.c_str(), fanMode);
+  return text;
+}
+
+std::string Tr40::statusR2() const {
+  char text[128];
+  snprintf(text, sizeof(text), "A=00 O=%s H1A=%d H2A=%d H3A=%d C1A=%d C2A=%d FA=%d VA=%d SM=%s SCP=%s",
+           address.c_str(), stages[H1], stages[H2], stages[H3], stages[C1], stages[C2], stages[FAN],
+           ventDamper, systemMode.c_str(), stagingDelays.c_str());
+  return text;
+}
+
+bool Tr40::write(const std::string& key, const std::string& value) {
+  int number;
+  static const int timeLow[3] = {0, 0, 0};
+  static const int timeHigh[3] = {23, 59, 59};
+  static const int dateLow[3] = {1, 1, 0};
+  static const int dateHigh[3] = {12, 31, 99};
+  if (key == "SPH" && inRange(value, 40, 109, number)) {
+    setpointHeat = number;
+  } else if (key == "SPC" && inRange(value, 44, 113, number)) {
+    setpointCool = number;
+  } else if (key == "SP" && inRange(value, 40, 113, number) && (mode == "H" || mode == "EH" || mode == "C")) {
+    (mode == "C" ? setpointCool : setpointHeat) = number;
+  } else if (key == "M" && (value == "O" || value == "H" || value == "C" || value == "A" || value == "EH")) {
+    mode = value;
+  } else if (key == "FM" && (value == "0" || value == "1")) {
+    fanMode = value[0] - '0';
+  } else if (key == "SC" && (value == "0" || value == "1")) {
+    scheduleControl = value[0] - '0';
+  } else if (key == "SC" && value == "?") {
+    //Asks for the schedule control, answered in the acknowledgement
+  } else if (key == "TM" && value == "#") {
+    message.clear();
+  } else if (key == "TM" && value.size() >= 2 && value.front() == '"' && value.back() == '"' && value.size() <= 82) {
+    message = value.substr(1, value.size() - 2);
+  } else if (key == "OT" && inRange(value, -50, 124, number)) {
+    outsideTemp = number;
+  } else if (key == "TIME" && validTriple(value, ':', timeLow, timeHigh)) {
+    time = value;
+  } else if (key == "DATE" && validTriple(value, '/', dateLow, dateHigh)) {
+    date = value;
+  } else if (key == "DOW" && inRange(value, 1, 7, number)) {
+    dayOfWeek = number;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+std::string Tr40::handle(const std::string& frame) {
+  std::vector<std::string> parameters = splitParameters(frame);
+  if (parameters.size() < 2 || parameters[0] != "A=" + address || parameters[1].compare(0, 2, "O=") != 0) {
+    return "";
+  }
+  requests.push_back(frame);
+  std::string reply;
+  std::string answers;
+  for (size_t i = 2; i < parameters.size(); i++) {
+    const std::string& parameter = parameters[i];
+    size_t equals = parameter.find('=');
+    if (equals == std::string::npos) {
+      continue;
+    }
+    std::string key = parameter.substr(0, equals);
+    std::string value = parameter.substr(equals + 1);
+    if (key == "R" && value == "1") {
+      reply = statusR1();
+    } else if (key == "R" && value == "2") {
+      reply = statusR2();
+    } else if (write(key, value)) {
+      writes ++;
+      if (key == "SC") {
+        answers += " SC=" + std::to_string(scheduleControl);
+      }
+    } else {
+      rejectedWrites ++;
+    }
+  }
+  //A write is acknowledged with a frame from the thermostat, which only holds the 
+  //schedule control when it was asked for
+  if (reply.empty()) {
+    reply = "A=00 O=" + address + answers;
+  }
+  return reply + "\r";
+}
+
+bool Tr40::drawDrop() {
+  if (silent || (dropRate > 0 && std::uniform_real_distribution<double>(0, 1)(generator) < dropRate)) {
+    dropped ++;
+    return true;
+  }
+  return false;
+}
+
+bool Tr40::drawCorrupt(std::string& reply) {
+  if (corruptRate <= 0 || reply.size() < 2 || std::uniform_real_distribution<double>(0, 1)(generator) >= corruptRate) {
+    return false;
+  }
+  //Garble a byte of the frame, never its line end
+  size_t at = std::uniform_int_distribution<size_t>(0, reply.size() - 2)(generator);
+  reply[at] = (char)(reply[at] ^ 0x5a);
+  corrupted ++;
+  return true;
+}
+
+uint64_t Tr40::drawTurnaround() {
+  return turnaround + (jitter > 0 ? std::uniform_int_distribution<uint64_t>(0, jitter)(generator) : 0);
+}
+
+void Tr40::received(Bus& bus, const std::string& frame, uint64_t endedAt) {
+  std::string reply = handle(frame);
+  if (reply.empty() || drawDrop()) {
+    return;
+  }
+  drawCorrupt(reply);
+  bus.reply(reply, endedAt + drawTurnaround());
+}
+
+}  // namespace host
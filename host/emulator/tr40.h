@@ -0,0 +1,96 @@
+/* ************************ Scripted TR40 emulator ************************
+ * A TR40 thermostat on the RS485 bus, answering R=1 and R=2 in the documented
+ * formats and taking the SPH, SPC, SP, M, FM, SC, TM, OT, TIME, DATE and DOW
+ * writes. Values out of range are ignored the way the thermostat ignores them,
+ * so only a readback shows the write did not take. How long it takes to answer
+ * and how often a reply is lost or garbled can be set. The status it reports is
+ * public so a test can script it.
+ */
+#pragma once
+
+#include "sim.h"
+
+#include <random>
+#include <string>
+#include <vector>
+
+namespace host {
+
+class Tr40 : public Bus::Device {
+ public:
+  //The stages reported in R=2, in the order of the H1A..C2A and FA keys
+  enum Stage { H1, H2, H3, C1, C2, FAN, STAGE_COUNT };
+
+  explicit Tr40(const std::string& address = "1");
+
+  std::string address;
+
+  //The status reported in R=1
+  int outsideAir = 88;
+  int zone = 1;
+  int temp = 72;
+  int setpointHeat = 68;
+  int setpointCool = 76;
+  std::string mode = "H";
+  int fanMode = 0;
+  int scheduleControl = 1;
+  //The status reported in R=2. The system mode is what the stages are working at.
+  bool stages[STAGE_COUNT] = {};
+  bool ventDamper = false;
+  std::string systemMode = "H";
+  //The staging delays, a digit each for stages 1 and 2: 0 off, 1 MOT, 2 MRT
+  std::string stagingDelays = "00";
+  //What the wall display unit was last given
+  std::string message;
+  int outsideTemp = 0;
+  std::string time;
+  std::string date;
+  int dayOfWeek = 1;
+
+  //How long after a request ends the reply starts, with up to jitter more, in microseconds
+  uint64_t turnaround = 20000;
+  uint64_t jitter = 0;
+  //The chance of a request going unanswered and of a reply arriving with a garbled byte
+  double dropRate = 0;
+  double corruptRate = 0;
+  //Answers nothing at all while set
+  bool silent = false;
+
+  //What it has been asked
+  std::vector<std::string> requests;
+  unsigned long writes = 0;
+  unsigned long rejectedWrites = 0;
+  unsigned long dropped = 0;
+  unsigned long corrupted = 0;
+
+  /**
+   * @brief Handles a frame seen on the bus
+   *
+   * @param frame The frame without its line end
+   * @return The reply with its line end, empty when the frame is not for this thermostat
+   */
+  std::string handle(const std::string& frame);
+
+  std::string statusR1() const;
+  std::string statusR2() const;
+
+  //Whether the next reply is dropped or garbled, and how late it is, drawn from the rates
+  bool drawDrop();
+  bool drawCorrupt(std::string& reply);
+  uint64_t drawTurnaround();
+
+  void received(Bus& bus, const std::string& frame, uint64_t endedAt) override;
+
+ private:
+  std::mt19937 generator;
+
+  bool write(const std::string& key, const std::string& value);
+};
+
+/**
+ * @brief Splits a frame into its space separated parameters, keeping a quoted value
+ * such as TM="two words" in one piece
+ */
+std::vector<std::string> splitParameters(const std::string& frame);
+
+}  // namespace host
@@ -0,0 +1,44 @@
+/* ************************ Host test runner ************************
+ * Runs the test cases of a test executable in the order they were registered.
+ * Pass a name to run only the test cases whose names contain it.
+ */
+#include "check.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace host {
+
+namespace {
+int failures = 0;
+}
+
+std::vector<TestCase>& testCases() {
+  static std::vector<TestCase> cases;
+  return cases;
+}
+
+void fail(const char* file, int line, const std::string& message) {
+  fprintf(stderr, "%s:%d: FAILED %s\n", file, line, message.c_str());
+  failures ++;
+}
+
+}  // namespace host
+
+int main(int argc, char** argv) {
+  int failed = 0;
+  int run = 0;
+  for (const host::TestCase& test : host::testCases()) {
+    if (argc > 1 && strstr(test.name, argv[1]) == NULL) {
+      continue;
+    }
+    int before = host::failures;
+    test.run();
+    run ++;
+    bool passed = host::failures == before;
+    failed += !passed;
+    printf("%s %s\n", passed ? "[  OK  ]" : "[ FAIL ]", test.name);
+  }
+  printf("%d of %d test cases passed\n", run - failed, run);
+  return failed == 0 ? 0 : 1;
+}
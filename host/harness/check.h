@@ -0,0 +1,59 @@
+/* ************************ Host test runner ************************
+ * A TEST() registers a test case, CHECK() and CHECK_EQ() record failures without
+ * stopping the test. Every test file is its own executable so each one starts
+ * from the bridge's power on state.
+ */
+#pragma once
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace host {
+
+struct TestCase {
+  const char* name;
+  void (*run)();
+};
+
+std::vector<TestCase>& testCases();
+void fail(const char* file, int line, const std::string& message);
+
+struct RegisterTest {
+  RegisterTest(const char* name, void (*run)()) {
+    testCases().push_back(TestCase{name, run});
+  }
+};
+
+template <typename A, typename E>
+std::string describe(const char* expression, const A& actual, const E& expected) {
+  std::ostringstream text;
+  text << expression << " is " << actual << ", expected " << expected;
+  return text.str();
+}
+
+}  // namespace host
+
+#define TEST(name) \
+  static void test_##name(); \
+  static host::RegisterTest register_##name(#name, test_##name); \
+  static void test_##name()
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      host::fail(__FILE__, __LINE__, #condition); \
+    } \
+  } while (0)
+
+#define CHECK_EQ(actual, expected) \
+  do { \
+    auto actual_ = (actual); \
+    auto expected_ = (expected); \
+    if (!(actual_ == expected_)) { \
+      host::fail(__FILE__, __LINE__, host::describe(#actual, actual_, expected_)); \
+    } \
+  } while (0)
+
+//Compares C strings by their characters
+#define CHECK_STR(actual, expected) CHECK_EQ(std::string(actual), std::string(expected))
@@ -0,0 +1,105 @@
+/* ************************ Host test harness ************************
+ * Drives the bridge built from main.cpp against the simulated bus and broker.
+ * Include it after main.cpp.
+ */
+#pragma once
+
+#include "check.h"
+#include "sim.h"
+#include "tr40.h"
+
+#include <string>
+#include <vector>
+
+namespace host {
+
+//The simulated time a pass of loop() takes besides its sleep, in microseconds
+inline uint64_t passTime = 50;
+
+/**
+ * @brief Runs loop() until a time has passed on the simulated clock
+ *
+ * @param ms How long to run for, in milliseconds
+ */
+inline void runFor(unsigned long ms) {
+  uint64_t end = now() + ms * 1000ULL;
+  while (now() < end) {
+    loop();
+    advance(passTime);
+  }
+}
+
+/**
+ * @brief Runs loop() until a condition holds or a time has passed
+ *
+ * @return Whether the condition held
+ */
+template <typename Condition>
+bool runUntil(Condition done, unsigned long ms) {
+  uint64_t end = now() + ms * 1000ULL;
+  while (!done()) {
+    if (now() >= end) {
+      return false;
+    }
+    loop();
+    advance(passTime);
+  }
+  return true;
+}
+
+//A topic of a thermostat
+inline std::string topicOf(const char* key, uint8_t device = 0) {
+  return std::string(thermostats[device].topicPrefix) + "/" + key;
+}
+
+//The set topic of a key of a thermostat
+inline std::string setTopicOf(const char* key, uint8_t device = 0) {
+  return topicOf(key, device) + "/set";
+}
+
+//One of the bridge's own topics
+inline std::string bridgeTopicOf(const char* key) {
+  return std::string(bridgePrefix) + "/" + key;
+}
+
+//The last value published on a thermostat's topic, empty when there is none
+inline std::string lastValue(const char* key, uint8_t device = 0) {
+  //Held while the payload is copied, the network task may be publishing
+  std::lock_guard<std::recursive_mutex> lock(broker.mutex);
+  const Broker::Message* message = broker.last(topicOf(key, device));
+  return message != NULL ? message->payload : std::string();
+}
+
+//A value published on a thermostat's topic and when, in microseconds
+struct Published {
+  std::string value;
+  uint64_t at;
+};
+
+//The values published on a thermostat's topic since a point in the broker's log
+inline std::vector<Published> publishedSince(size_t from, const char* key, uint8_t device = 0) {
+  std::vector<Published> found;
+  std::vector<Broker::Message> messages = broker.snapshot();
+  for (size_t i = from; i < messages.size(); i++) {
+    if (messages[i].topic == topicOf(key, device)) {
+      found.push_back(Published{messages[i].payload, messages[i].at});
+    }
+  }
+  return found;
+}
+
+/**
+ * @brief Starts the bridge with the devices already attached to the bus and runs it 
+ * until it has connected to the broker
+ */
+inline void startBridge() {
+  setup();
+  runUntil([] { return broker.session.load(); }, 5000);
+}
+
+inline void startBridge(Tr40& thermostat) {
+  bus.attach(&thermostat);
+  startBridge();
+}
+
+}  // namespace host
@@ -0,0 +1,241 @@
+/* ************************ JSON reader for tests ************************
+ * A recursive descent parser for RFC 8259 JSON.
+ */
+#include "json.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace host {
+
+namespace {
+
+struct Parser {
+  const std::string& text;
+  size_t at = 0;
+  std::string error;
+
+  explicit Parser(const std::string& text) : text(text) {}
+
+  bool fail(const char* what) {
+    if (error.empty()) {
+      error = std::string(what) + " at offset " + std::to_string(at);
+    }
+    return false;
+  }
+
+  void skipSpace() {
+    while (at < text.size() && (text[at] == ' ' || text[at] == '\t' || text[at] == '\r' || text[at] == '\n')) {
+      at ++;
+    }
+  }
+
+  bool literal(const char* word) {
+    size_t length = strlen(word);
+    if (text.compare(at, length, word) != 0) {
+      return fail("unexpected characters");
+    }
+    at += length;
+    return true;
+  }
+
+  bool string(std::string& out) {
+    if (at >= text.size() || text[at] != '"') {
+      return fail("expected a string");
+    }
+    at ++;
+    while (at < text.size() && text[at] != '"') {
+      unsigned char c = text[at];
+      if (c < 0x20) {
+        return fail("control character in a string");
+      }
+      if (c != '\\') {
+        out += (char)c;
+        at ++;
+        continue;
+      }
+      if (++at >= text.size()) {
+        break;
+      }
+      char escape = text[at ++];
+      const char* plain = strchr("\"\\/bfnrt", escape);
+      if (escape != '\0' && plain != NULL) {
+        static const char decoded[] = "\"\\/\b\f\n\r\t";
+        out += decoded[plain - "\"\\/bfnrt"];
+      } else if (escape == 'u') {
+        if (at + 4 > text.size()) {
+          return fail("short \\u escape");
+        }
+        for (int i = 0; i < 4; i++) {
+          if (!isxdigit((unsigned char)text[at + i])) {
+            return fail("bad \\u escape");
+          }
+        }
+        long code = strtol(text.substr(at, 4).c_str(), NULL, 16);
+        at += 4;
+        //Enough for checking, non-ASCII characters are kept as a marker
+        out += code < 0x80 ? (char)code : '?';
+      } else {
+        return fail("bad escape");
+      }
+    }
+    if (at >= text.size()) {
+      return fail("unterminated string");
+    }
+    at ++;
+    return true;
+  }
+
+  bool number(double& out) {
+    size_t start = at;
+    if (at < text.size() && text[at] == '-') {
+      at ++;
+    }
+    if (at >= text.size() || !isdigit((unsigned char)text[at])) {
+      return fail("expected a digit");
+    }
+    if (text[at] == '0') {
+      at ++;
+    } else {
+      while (at < text.size() && isdigit((unsigned char)text[at])) {
+        at ++;
+      }
+    }
+    if (at < text.size() && text[at] == '.') {
+      at ++;
+      if (at >= text.size() || !isdigit((unsigned char)text[at])) {
+        return fail("expected a digit after the point");
+      }
+      while (at < text.size() && isdigit((unsigned char)text[at])) {
+        at ++;
+      }
+    }
+    if (at < text.size() && (text[at] == 'e' || text[at] == 'E')) {
+      at ++;
+      if (at < text.size() && (text[at] == '+' || text[at] == '-')) {
+        at ++;
+      }
+      if (at >= text.size() || !isdigit((unsigned char)text[at])) {
+        return fail("expected an exponent");
+      }
+      while (at < text.size() && isdigit((unsigned char)text[at])) {
+        at ++;
+      }
+    }
+    out = strtod(text.substr(start, at - start).c_str(), NULL);
+    return true;
+  }
+
+  bool value(Json& out, int depth) {
+    if (depth > 64) {
+      return fail("nested too deeply");
+    }
+    skipSpace();
+    if (at >= text.size()) {
+      return fail("expected a value");
+    }
+    char c = text[at];
+    if (c == '{') {
+      out.type = Json::OBJECT;
+      at ++;
+      skipSpace();
+      if (at < text.size() && text[at] == '}') {
+        at ++;
+        return true;
+      }
+      for (;;) {
+        skipSpace();
+        std::string name;
+        if (!string(name)) {
+          return false;
+        }
+        if (out.members.count(name) != 0) {
+          return fail("duplicate member");
+        }
+        skipSpace();
+        if (at >= text.size() || text[at] != ':') {
+          return fail("expected a colon");
+        }
+        at ++;
+        if (!value(out.members[name], depth + 1)) {
+          return false;
+        }
+        skipSpace();
+        if (at < text.size() && text[at] == ',') {
+          at ++;
+          continue;
+        }
+        if (at < text.size() && text[at] == '}') {
+          at ++;
+          return true;
+        }
+        return fail("expected a comma or a closing brace");
+      }
+    }
+    if (c == '[') {
+      out.type = Json::ARRAY;
+      at ++;
+      skipSpace();
+      if (at < text.size() && text[at] == ']') {
+        at ++;
+        return true;
+      }
+      for (;;) {
+        out.items.emplace_back();
+        if (!value(out.items.back(), depth + 1)) {
+          return false;
+        }
+        skipSpace();
+        if (at < text.size() && text[at] == ',') {
+          at ++;
+          continue;
+        }
+        if (at < text.size() && text[at] == ']') {
+          at ++;
+          return true;
+        }
+        return fail("expected a comma or a closing bracket");
+      }
+    }
+    if (c == '"') {
+      out.type = Json::STRING;
+      return string(out.string);
+    }
+    if (c == 't' || c == 'f') {
+      out.type = Json::BOOLEAN;
+      out.boolean = c == 't';
+      return literal(c == 't' ? "true" : "false");
+    }
+    if (c == 'n') {
+      out.type = Json::NUL;
+      return literal("null");
+    }
+    out.type = Json::NUMBER;
+    return number(out.number);
+  }
+};
+
+}  // namespace
+
+bool Json::parse(const std::string& text, Json& value, std::string& error) {
+  Parser parser(text);
+  value = Json();
+  bool valid = parser.value(value, 0);
+  if (valid) {
+    parser.skipSpace();
+    if (parser.at != text.size()) {
+      valid = parser.fail("trailing characters");
+    }
+  }
+  error = parser.error;
+  return valid;
+}
+
+const Json& Json::operator[](const std::string& name) const {
+  static const Json none;
+  auto member = members.find(name);
+  return member != members.end() ? member->second : none;
+}
+
+}  // namespace host
@@ -0,0 +1,39 @@
+/* ************************ JSON reader for tests ************************
+ * Parses the JSON documents the bridge publishes so a test can check they are
+ * well formed and look at their members. Strict: a document with trailing commas,
+ * unquoted names, control characters in strings or anything after it fails.
+ */
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace host {
+
+struct Json {
+  enum Type { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
+
+  Type type = NUL;
+  bool boolean = false;
+  double number = 0;
+  std::string string;
+  std::vector<Json> items;
+  std::map<std::string, Json> members;
+
+  /**
+   * @brief Parses a document
+   *
+   * @param text The document
+   * @param value Set to the parsed value
+   * @param error Set to what is wrong and where when the document is not valid
+   * @return false if the document is not valid JSON
+   */
+  static bool parse(const std::string& text, Json& value, std::string& error);
+
+  bool has(const std::string& name) const { return type == OBJECT && members.count(name) != 0; }
+  //A member of an object, a null value when there is none
+  const Json& operator[](const std::string& name) const;
+};
+
+}  // namespace host
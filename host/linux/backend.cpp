@@ -0,0 +1,518 @@
+/* ************************ Linux gateway backend ************************
+ * The clock, SoftwareSerial and PubSubClient of the Linux gateway: a monotonic
+ * clock, a termios serial port and an MQTT client on a TCP socket, all waited on
+ * with one epoll set.
+ */
+#include "backend.h"
+#include "mqtt.h"
+
+#include <Arduino.h>
+#include <PubSubClient.h>
+#include <SoftwareSerial.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+namespace host {
+namespace gateway {
+
+unsigned long earlyWakeups = 0;
+
+namespace {
+
+//The MQTT keep alive, in seconds. PubSubClient's default.
+const uint16_t KEEP_ALIVE = 15;
+//The most read from the serial port or the socket at once
+const size_t READ_CHUNK = 512;
+
+int epollFd = -1;
+int timerFd = -1;
+int serialFd = -1;
+int socketFd = -1;
+
+//Bytes read from the serial port that the bridge has not taken yet
+std::string serialIn;
+size_t serialTaken = 0;
+//Bytes read from the socket that do not make a whole packet yet
+std::string socketIn;
+uint16_t packetId = 0;
+//When the last packet went to and came from the broker, in milliseconds
+unsigned long lastSent = 0;
+unsigned long lastReceived = 0;
+bool pingOutstanding = false;
+//Why the last connection attempt failed, for state()
+int connectFailure = MQTT_DISCONNECTED;
+
+uint64_t monotonicMicros() {
+  timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec * 1000000ULL + time.tv_nsec / 1000;
+}
+
+const uint64_t bootTime = monotonicMicros();
+
+uint64_t uptime() {
+  return monotonicMicros() - bootTime;
+}
+
+void watch(int fd) {
+  if (epollFd < 0) {
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = timerFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &event);
+  }
+  if (fd >= 0) {
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+  }
+}
+
+void closeSocket() {
+  if (socketFd >= 0) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, socketFd, NULL);
+    close(socketFd);
+    socketFd = -1;
+  }
+  socketIn.clear();
+  pingOutstanding = false;
+}
+
+//Waits for a descriptor to be ready for up to the socket timeout
+bool waitReady(int fd, short events, uint16_t timeoutSeconds) {
+  pollfd ready = {fd, events, 0};
+  int result;
+  do {
+    result = poll(&ready, 1, timeoutSeconds * 1000);
+  } while (result < 0 && errno == EINTR);
+  return result > 0 && (ready.revents & (POLLERR | POLLNVAL)) == 0;
+}
+
+//Writes everything or gives up after the socket timeout
+bool writeAll(int fd, const std::string& bytes, uint16_t timeoutSeconds) {
+  size_t done = 0;
+  while (done < bytes.size()) {
+    ssize_t written = send(fd, bytes.data() + done, bytes.size() - done, MSG_NOSIGNAL);
+    if (written > 0) {
+      done += written;
+    } else if (written < 0 && errno == EINTR) {
+      continue;
+    } else if (written < 0 && errno == EAGAIN && waitReady(fd, POLLOUT, timeoutSeconds)) {
+      continue;
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+//Reads what the broker has sent, closing the socket when the broker has gone
+void receive() {
+  char chunk[READ_CHUNK];
+  while (socketFd >= 0) {
+    ssize_t count = recv(socketFd, chunk, sizeof(chunk), 0);
+    if (count > 0) {
+      socketIn.append(chunk, count);
+      lastReceived = millis();
+      continue;
+    }
+    if (count < 0 && (errno == EAGAIN || errno == EINTR)) {
+      return;
+    }
+    connectFailure = MQTT_CONNECTION_LOST;
+    closeSocket();
+  }
+}
+
+int openSocket(const char* domain, uint16_t port, uint16_t timeoutSeconds) {
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo* addresses;
+  char service[8];
+  snprintf(service, sizeof(service), "%u", port);
+  if (domain == NULL || getaddrinfo(domain, service, &hints, &addresses) != 0) {
+    return -1;
+  }
+  int fd = -1;
+  for (addrinfo* address = addresses; address != NULL && fd < 0; address = address->ai_next) {
+    fd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    int error = 0;
+    socklen_t size = sizeof(error);
+    if (connect(fd, address->ai_addr, address->ai_addrlen) != 0 &&
+        (errno != EINPROGRESS || !waitReady(fd, POLLOUT, timeoutSeconds) ||
+         getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) != 0 || error != 0)) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(addresses);
+  if (fd >= 0) {
+    //Status values are small and latency matters more than packing them
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  }
+  return fd;
+}
+
+speed_t speedOf(unsigned long baud) {
+  switch (baud) {
+    case 1200: return B1200;
+    case 2400: return B2400;
+    case 4800: return B4800;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    default: return B9600;
+  }
+}
+
+}  // namespace
+
+bool openSerial(const char* path) {
+  serialFd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if (serialFd < 0) {
+    return false;
+  }
+  watch(serialFd);
+  return true;
+}
+
+}  // namespace gateway
+}  // namespace host
+
+using namespace host::gateway;
+
+unsigned long millis() {
+  return uptime() / 1000;
+}
+
+unsigned long micros() {
+  return (unsigned long)uptime();
+}
+
+/**
+ * @brief Sleeps until the time is up or the bus or the broker has something for the
+ * bridge, whichever comes first
+ */
+void delay(unsigned long ms) {
+  watch(-1);
+  //A packet the last client.loop() left in the buffer is already waiting
+  if (ms == 0 || mqtt::whole(socketIn)) {
+    return;
+  }
+  itimerspec timer = {};
+  timer.it_value.tv_sec = ms / 1000;
+  timer.it_value.tv_nsec = (ms % 1000) * 1000000L;
+  timerfd_settime(timerFd, 0, &timer, NULL);
+  epoll_event events[3];
+  int count;
+  do {
+    count = epoll_wait(epollFd, events, 3, -1);
+  } while (count < 0 && errno == EINTR);
+  bool expired = false;
+  for (int i = 0; i < count; i++) {
+    expired = expired || events[i].data.fd == timerFd;
+  }
+  if (!expired) {
+    earlyWakeups ++;
+  }
+  //Disarm the timer and clear an expiry that raced the wake up
+  timer = {};
+  timerfd_settime(timerFd, 0, &timer, NULL);
+  uint64_t expirations;
+  ssize_t ignored = read(timerFd, &expirations, sizeof(expirations));
+  (void)ignored;
+}
+
+void delayMicroseconds(unsigned int us) {
+  timespec time = {(time_t)(us / 1000000), (long)(us % 1000000) * 1000L};
+  while (nanosleep(&time, &time) != 0 && errno == EINTR) {
+  }
+}
+
+void SoftwareSerial::begin(unsigned long baud) {
+  if (serialFd < 0) {
+    return;
+  }
+  termios settings;
+  if (tcgetattr(serialFd, &settings) == 0) {
+    cfmakeraw(&settings);
+    settings.c_cflag |= CLOCAL | CREAD;
+    settings.c_cflag &= ~(CSTOPB | CRTSCTS);
+    settings.c_cc[VMIN] = 0;
+    settings.c_cc[VTIME] = 0;
+    cfsetispeed(&settings, speedOf(baud));
+    cfsetospeed(&settings, speedOf(baud));
+    tcsetattr(serialFd, TCSANOW, &settings);
+  }
+  tcflush(serialFd, TCIOFLUSH);
+}
+
+size_t SoftwareSerial::write(const uint8_t* data, size_t length) {
+  //The frame is queued in the driver and the transport times it out by the baud rate
+  size_t done = 0;
+  while (serialFd >= 0 && done < length) {
+    ssize_t written = ::write(serialFd, data + done, length - done);
+    if (written > 0) {
+      done += written;
+    } else if (written < 0 && errno == EINTR) {
+      continue;
+    } else if (written < 0 && errno == EAGAIN && waitReady(serialFd, POLLOUT, 1)) {
+      continue;
+    } else {
+      break;
+    }
+  }
+  return done;
+}
+
+int SoftwareSerial::available() {
+  if (serialTaken == serialIn.size()) {
+    serialIn.clear();
+    serialTaken = 0;
+  }
+  char chunk[READ_CHUNK];
+  ssize_t count;
+  while (serialFd >= 0 && (count = ::read(serialFd, chunk, sizeof(chunk))) > 0) {
+    serialIn.append(chunk, count);
+  }
+  return serialIn.size() - serialTaken;
+}
+
+int SoftwareSerial::read() {
+  if (serialTaken == serialIn.size() && available() == 0) {
+    return -1;
+  }
+  return (uint8_t)serialIn[serialTaken ++];
+}
+
+PubSubClient& PubSubClient::setServer(const char* server, uint16_t serverPort) {
+  domain = server;
+  port = serverPort;
+  return *this;
+}
+
+PubSubClient& PubSubClient::setCallback(void (*handler)(char*, uint8_t*, unsigned int)) {
+  callback = handler;
+  return *this;
+}
+
+PubSubClient& PubSubClient::setSocketTimeout(uint16_t timeout) {
+  socketTimeout = timeout;
+  return *this;
+}
+
+bool PubSubClient::setBufferSize(uint16_t size) {
+  bufferSize = size;
+  return true;
+}
+
+bool PubSubClient::connect(const char* id, const char* user, const char* pass) {
+  return connect(id, user, pass, NULL, 0, false, NULL);
+}
+
+bool PubSubClient::connect(const char* id, const char* user, const char* pass, const char* willTopic,
+                           uint8_t willQos, bool willRetain, const char* willMessage) {
+  closeSocket();
+  int fd = openSocket(domain, port, socketTimeout);
+  if (fd < 0) {
+    connectFailure = MQTT_CONNECT_FAILED;
+    return false;
+  }
+  std::string body;
+  mqtt::appendString(body, "MQTT");
+  body += (char)4;
+  uint8_t flags = 0x02;
+  if (willTopic != NULL) {
+    flags |= 0x04 | (willQos & 0x03) << 3 | (willRetain ? 0x20 : 0);
+  }
+  if (user != NULL && *user != '\0') {
+    flags |= 0x80;
+    if (pass != NULL) {
+      flags |= 0x40;
+    }
+  }
+  body += (char)flags;
+  body += (char)(KEEP_ALIVE >> 8);
+  body += (char)(KEEP_ALIVE & 0xFF);
+  mqtt::appendString(body, id);
+  if (flags & 0x04) {
+    mqtt::appendString(body, willTopic);
+    mqtt::appendString(body, willMessage != NULL ? willMessage : "");
+  }
+  if (flags & 0x80) {
+    mqtt::appendString(body, user);
+  }
+  if (flags & 0x40) {
+    mqtt::appendString(body, pass);
+  }
+  std::string packet;
+  mqtt::append(packet, mqtt::CONNECT << 4, body);
+  if (!writeAll(fd, packet, socketTimeout)) {
+    close(fd);
+    connectFailure = MQTT_CONNECT_FAILED;
+    return false;
+  }
+
+  //Like PubSubClient, wait for the CONNACK
+  std::string received;
+  mqtt::Packet reply;
+  bool malformed = false;
+  while (!mqtt::take(received, reply, malformed)) {
+    char chunk[16];
+    ssize_t count = malformed ? -1 : recv(fd, chunk, sizeof(chunk), 0);
+    if (count > 0) {
+      received.append(chunk, count);
+    } else if (count < 0 && errno == EAGAIN && waitReady(fd, POLLIN, socketTimeout)) {
+      continue;
+    } else {
+      close(fd);
+      connectFailure = count < 0 && errno == EAGAIN ? MQTT_CONNECTION_TIMEOUT : MQTT_CONNECT_FAILED;
+      return false;
+    }
+  }
+  if (reply.type() != mqtt::CONNACK || reply.body.size() < 2 || reply.body[1] != 0) {
+    close(fd);
+    connectFailure = reply.body.size() >= 2 ? (uint8_t)reply.body[1] : MQTT_CONNECT_FAILED;
+    return false;
+  }
+  socketFd = fd;
+  socketIn = received;
+  lastSent = lastReceived = millis();
+  watch(socketFd);
+  return true;
+}
+
+bool PubSubClient::connected() {
+  receive();
+  return socketFd >= 0;
+}
+
+bool PubSubClient::subscribe(const char* topic) {
+  if (!connected()) {
+    return false;
+  }
+  packetId = packetId == 0xFFFF ? 1 : packetId + 1;
+  std::string body;
+  body += (char)(packetId >> 8);
+  body += (char)(packetId & 0xFF);
+  mqtt::appendString(body, topic);
+  body += (char)0;
+  std::string packet;
+  mqtt::append(packet, (mqtt::SUBSCRIBE << 4) | 0x02, body);
+  if (!writeAll(socketFd, packet, socketTimeout)) {
+    closeSocket();
+    return false;
+  }
+  lastSent = millis();
+  return true;
+}
+
+bool PubSubClient::publish(const char* topic, const char* payload) {
+  return publish(topic, (const uint8_t*)payload, strlen(payload), false);
+}
+
+bool PubSubClient::publish(const char* topic, const char* payload, bool retained) {
+  return publish(topic, (const uint8_t*)payload, strlen(payload), retained);
+}
+
+bool PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained) {
+  //Like PubSubClient, the fixed header, the topic and the payload must fit in the buffer
+  if (socketFd < 0 || 5 + 2 + strlen(topic) + length > bufferSize) {
+    return false;
+  }
+  std::string packet = mqtt::publish(topic, std::string((const char*)payload, length), retained);
+  if (!writeAll(socketFd, packet, socketTimeout)) {
+    connectFailure = MQTT_CONNECTION_LOST;
+    closeSocket();
+    return false;
+  }
+  lastSent = millis();
+  return true;
+}
+
+int PubSubClient::state() {
+  return socketFd >= 0 ? MQTT_CONNECTED : connectFailure;
+}
+
+bool PubSubClient::loop() {
+  if (!connected()) {
+    return false;
+  }
+  //Keep the session alive, and drop it when the broker stops answering
+  unsigned long now = millis();
+  if (now - lastReceived >= KEEP_ALIVE * 1000UL * 3 / 2) {
+    connectFailure = MQTT_CONNECTION_TIMEOUT;
+    closeSocket();
+    return false;
+  }
+  if (now - lastSent >= KEEP_ALIVE * 1000UL && !pingOutstanding) {
+    std::string ping;
+    mqtt::append(ping, mqtt::PINGREQ << 4, "");
+    if (!writeAll(socketFd, ping, socketTimeout)) {
+      closeSocket();
+      return false;
+    }
+    lastSent = now;
+    pingOutstanding = true;
+  }
+
+  //Like PubSubClient, one packet is handled on each call
+  mqtt::Packet packet;
+  bool malformed;
+  if (!mqtt::take(socketIn, packet, malformed)) {
+    if (malformed) {
+      connectFailure = MQTT_CONNECTION_LOST;
+      closeSocket();
+      return false;
+    }
+    return true;
+  }
+  if (packet.type() == mqtt::PINGRESP) {
+    pingOutstanding = false;
+  }
+  if (packet.type() != mqtt::PUBLISH || callback == NULL) {
+    return true;
+  }
+  size_t at = 0;
+  std::string topic;
+  if (!mqtt::readString(packet.body, at, topic)) {
+    return true;
+  }
+  //Only QoS 0 is subscribed to, but skip the packet id of anything else
+  if ((packet.header & 0x06) != 0) {
+    at += 2;
+  }
+  if (at > packet.body.size() || 5 + packet.body.size() > bufferSize) {
+    return true;
+  }
+  std::vector<char> topicText(topic.begin(), topic.end());
+  topicText.push_back('\0');
+  std::vector<uint8_t> payload(packet.body.begin() + at, packet.body.end());
+  unsigned int length = payload.size();
+  payload.push_back(0);
+  callback(topicText.data(), payload.data(), length);
+  return true;
+}
@@ -0,0 +1,36 @@
+/* ************************ Linux gateway backend ************************
+ * Runs the bridge on a Linux box wired to the RS485 segment, usually through a
+ * USB adapter. SoftwareSerial is a termios serial port, which may also be a pty,
+ * and PubSubClient talks MQTT 3.1.1 to a broker over TCP.
+ *
+ * The loop stays single threaded. When loop() has nothing to do it calls delay()
+ * with the time until its next poll, retry or reconnect is due. delay() arms a
+ * timerfd for that time and blocks in epoll_wait() on the timer, the serial port
+ * and the broker's socket. A byte from the bus or a message from the broker wakes
+ * it straight away, and nothing runs while it waits.
+ */
+#pragma once
+
+#include <functional>
+
+namespace host {
+
+//Called by ESP.restart(), defined with the Arduino core shim
+extern std::function<void()> onRestart;
+
+namespace gateway {
+
+/**
+ * @brief Opens the RS485 serial port. SoftwareSerial::begin() sets its baud rate and
+ * puts it in raw mode.
+ *
+ * @param path The device, such as /dev/ttyUSB0 or a pty
+ * @return false if it can not be opened, with errno set
+ */
+bool openSerial(const char* path);
+
+//Times loop() has woken from a delay() early because the bus or the broker had data
+extern unsigned long earlyWakeups;
+
+}  // namespace gateway
+}  // namespace host
@@ -0,0 +1,82 @@
+/* ************************ Linux gateway ************************
+ * The bridge in main.cpp built for a Linux box on the RS485 segment.
+ *
+ *   rcs_tr40_gateway --serial /dev/ttyUSB0 --broker 192.168.1.117[:1883] [--capture FILE]
+ *
+ * With --capture every frame on the bus is written to a capture file from startup,
+ * for bench_replay or the capture/replay topic, until "capture off" or a dump is
+ * published to the debug topic. It logs to stdout. When the broker has been unreachable for the wedge window it
+ * starts itself again, where the ESP32 would restart.
+ */
+
+//delay() wakes as soon as the bus or the broker has data, so the sleep is only capped
+//for the work no one wakes it for: the diagnostics and the MQTT keep alive
+#define IDLE_MAX_SLEEP         1000
+
+#include "main.cpp"
+#include "backend.h"
+#include "capture.h"
+
+#include <errno.h>
+#include <string>
+#include <unistd.h>
+
+namespace {
+
+void usage(const char* name) {
+  fprintf(stderr, "usage: %s --serial PATH --broker HOST[:PORT] [--capture FILE]\n", name);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* serial = NULL;
+  const char* capture = NULL;
+  std::string broker;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "--serial") == 0) {
+      serial = argv[i + 1];
+    } else if (strcmp(argv[i], "--broker") == 0) {
+      broker = argv[i + 1];
+    } else if (strcmp(argv[i], "--capture") == 0) {
+      capture = argv[i + 1];
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (serial == NULL || broker.empty() || argc % 2 == 0) {
+    usage(argv[0]);
+    return 2;
+  }
+  uint16_t port = 1883;
+  size_t colon = broker.rfind(':');
+  if (colon != std::string::npos) {
+    port = (uint16_t)atoi(broker.c_str() + colon + 1);
+    broker.erase(colon);
+  }
+  if (!host::gateway::openSerial(serial)) {
+    fprintf(stderr, "Can not open %s: %s\n", serial, strerror(errno));
+    return 1;
+  }
+  if (capture != NULL && !host::capture::openFile(capture)) {
+    fprintf(stderr, "Can not write %s: %s\n", capture, strerror(errno));
+    return 1;
+  }
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  host::onRestart = [argv] {
+    execv("/proc/self/exe", argv);
+    exit(3);
+  };
+
+  setup();
+  mqttServer = broker.c_str();
+  client.setServer(mqttServer, port);
+  if (capture != NULL) {
+    busCapture.sink = host::capture::writeRecord;
+    busCapture.enable(true);
+  }
+  for (;;) {
+    loop();
+  }
+}
@@ -0,0 +1,87 @@
+/* ************************ MQTT 3.1.1 packets ************************
+ */
+#include "mqtt.h"
+
+namespace mqtt {
+
+namespace {
+
+//Decodes the remaining length after the first byte. Returns 0 when more bytes are
+//needed, -1 when it runs past the four bytes the protocol allows, otherwise the size
+//of the fixed header.
+int remainingLength(const std::string& buffer, size_t& length) {
+  length = 0;
+  for (size_t i = 1; i < 5; i++) {
+    if (i >= buffer.size()) {
+      return 0;
+    }
+    uint8_t digit = (uint8_t)buffer[i];
+    length |= (size_t)(digit & 0x7F) << (7 * (i - 1));
+    if ((digit & 0x80) == 0) {
+      return (int)i + 1;
+    }
+  }
+  return -1;
+}
+
+}  // namespace
+
+void append(std::string& out, uint8_t header, const std::string& body) {
+  out += (char)header;
+  size_t length = body.size();
+  do {
+    uint8_t digit = length % 128;
+    length /= 128;
+    out += (char)(length > 0 ? digit | 0x80 : digit);
+  } while (length > 0);
+  out += body;
+}
+
+void appendString(std::string& out, const std::string& text) {
+  out += (char)(text.size() >> 8);
+  out += (char)(text.size() & 0xFF);
+  out += text;
+}
+
+bool take(std::string& buffer, Packet& packet, bool& malformed) {
+  size_t length;
+  int headerSize = remainingLength(buffer, length);
+  malformed = headerSize < 0;
+  if (headerSize <= 0 || buffer.size() < headerSize + length) {
+    return false;
+  }
+  packet.header = (uint8_t)buffer[0];
+  packet.body.assign(buffer, headerSize, length);
+  buffer.erase(0, headerSize + length);
+  return true;
+}
+
+bool whole(const std::string& buffer) {
+  size_t length;
+  int headerSize = remainingLength(buffer, length);
+  return headerSize > 0 && buffer.size() >= headerSize + length;
+}
+
+bool readString(const std::string& body, size_t& at, std::string& text) {
+  if (at + 2 > body.size()) {
+    return false;
+  }
+  size_t length = ((uint8_t)body[at] << 8) | (uint8_t)body[at + 1];
+  if (at + 2 + length > body.size()) {
+    return false;
+  }
+  text.assign(body, at + 2, length);
+  at += 2 + length;
+  return true;
+}
+
+std::string publish(const std::string& topic, const std::string& payload, bool retain) {
+  std::string body;
+  appendString(body, topic);
+  body += payload;
+  std::string packet;
+  append(packet, (PUBLISH << 4) | (retain ? 1 : 0), body);
+  return packet;
+}
+
+}  // namespace mqtt
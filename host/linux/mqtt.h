@@ -0,0 +1,60 @@
+/* ************************ MQTT 3.1.1 packets ************************
+ * Builds and takes apart the MQTT control packets the Linux gateway's client and
+ * the test broker exchange: CONNECT, CONNACK, PUBLISH at QoS 0, SUBSCRIBE,
+ * SUBACK, PINGREQ, PINGRESP and DISCONNECT.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+namespace mqtt {
+
+enum PacketType : uint8_t {
+  CONNECT = 1, CONNACK = 2, PUBLISH = 3, SUBSCRIBE = 8, SUBACK = 9,
+  PINGREQ = 12, PINGRESP = 13, DISCONNECT = 14,
+};
+
+struct Packet {
+  //The first byte of the fixed header, the type and its flags
+  uint8_t header = 0;
+  //Everything after the remaining length
+  std::string body;
+
+  PacketType type() const { return (PacketType)(header >> 4); }
+};
+
+/**
+ * @brief Appends a packet: its fixed header, the remaining length and the body
+ */
+void append(std::string& out, uint8_t header, const std::string& body);
+
+//Appends a UTF-8 string with its two byte length
+void appendString(std::string& out, const std::string& text);
+
+/**
+ * @brief Takes the first packet off a receive buffer
+ *
+ * @param buffer The bytes received so far, the packet is removed from the front
+ * @param packet Set to the packet
+ * @param malformed Set when the remaining length is not valid, the stream can not
+ *                  be resynchronised after that
+ * @return false if there is no whole packet yet
+ */
+bool take(std::string& buffer, Packet& packet, bool& malformed);
+
+//Whether a receive buffer holds at least one whole packet
+bool whole(const std::string& buffer);
+
+/**
+ * @brief Reads a string with its two byte length out of a packet body
+ *
+ * @param at Where it starts, moved past it
+ * @return false if the body ends first
+ */
+bool readString(const std::string& body, size_t& at, std::string& text);
+
+//A PUBLISH at QoS 0
+std::string publish(const std::string& topic, const std::string& payload, bool retain);
+
+}  // namespace mqtt
@@ -0,0 +1,144 @@
+/* ******************** Arduino core shim for host builds ********************
+ * Just enough of the Arduino core for main.cpp to build and run on Linux. The
+ * clock, the RS485 serial port and the MQTT client are provided by a backend,
+ * sim.cpp for the simulated bus and broker the tests run against, or the Linux
+ * gateway's backend for a real serial port and broker.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <algorithm>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define HIGH                 1
+#define LOW                  0
+#define INPUT                0
+#define OUTPUT               1
+
+using std::min;
+using std::max;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+inline bool isDigit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+/**
+ * @brief The Arduino String, a heap allocated character buffer. Only used by the
+ * copy of the original parser the parser benchmark compares against, so every
+ * buffer it allocates is counted in host::heapAllocations.
+ */
+class String {
+ public:
+  String(const char* text = "");
+  String(const String& other);
+  String(String&& other) noexcept;
+  explicit String(long value);
+  ~String();
+
+  String& operator=(const String& other);
+  String& operator=(String&& other) noexcept;
+  String& operator=(const char* text);
+  String& operator+=(const String& other);
+  String& operator+=(const char* text);
+  String& operator+=(char c);
+
+  friend String operator+(const String& left, const String& right);
+  friend String operator+(const String& left, const char* right);
+  friend String operator+(const char* left, const String& right);
+
+  bool operator==(const String& other) const;
+  bool operator==(const char* text) const;
+  bool operator!=(const String& other) const { return !(*this == other); }
+  bool operator!=(const char* text) const { return !(*this == text); }
+
+  unsigned int length() const { return len; }
+  const char* c_str() const { return buffer != NULL ? buffer : ""; }
+  int indexOf(char c, unsigned int from = 0) const;
+  String substring(unsigned int from) const { return substring(from, len); }
+  String substring(unsigned int from, unsigned int to) const;
+  bool startsWith(const String& prefix) const;
+  long toInt() const;
+  float toFloat() const;
+
+ private:
+  char* buffer = NULL;
+  unsigned int len = 0;
+  unsigned int capacity = 0;
+
+  void reserve(unsigned int size);
+  void assign(const char* text, unsigned int length);
+  void append(const char* text, unsigned int length);
+};
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t* data, size_t length);
+
+  size_t print(const char* text);
+  size_t print(char c);
+  size_t print(long value);
+  size_t print(const String& text) { return print(text.c_str()); }
+  size_t println(const char* text = "");
+  size_t println(const String& text) { return println(text.c_str()); }
+  int printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class Stream : public Print {
+ public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+};
+
+/**
+ * @brief The USB serial port, written to stdout. Nothing is ever received on it.
+ */
+class HardwareSerial : public Stream {
+ public:
+  void begin(unsigned long baud) {}
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t* data, size_t length) override;
+  int available() override { return 0; }
+  int read() override { return -1; }
+};
+
+extern HardwareSerial Serial;
+
+class EspClass {
+ public:
+  void restart();
+  uint32_t getFreeHeap();
+};
+
+extern EspClass ESP;
+
+//The FreeRTOS call the dual core build starts the network task with, a std::thread on the host
+typedef void (*TaskFunction_t)(void*);
+typedef int BaseType_t;
+typedef void* TaskHandle_t;
+#define pdPASS               1
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char* name, uint32_t stack, void* parameter,
+                                   unsigned int priority, TaskHandle_t* handle, int core);
@@ -0,0 +1,42 @@
+/* ********************* PubSubClient shim for host builds *********************
+ * The PubSubClient calls the bridge makes. The backend connects them to the
+ * in-process broker stand-in or, in the Linux gateway, to a broker over TCP.
+ */
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+#define MQTT_CONNECTION_TIMEOUT     -4
+#define MQTT_CONNECTION_LOST        -3
+#define MQTT_CONNECT_FAILED         -2
+#define MQTT_DISCONNECTED           -1
+#define MQTT_CONNECTED               0
+
+class PubSubClient {
+ public:
+  explicit PubSubClient(WiFiClient& client) {}
+
+  PubSubClient& setServer(const char* domain, uint16_t port);
+  PubSubClient& setCallback(void (*handler)(char*, uint8_t*, unsigned int));
+  PubSubClient& setSocketTimeout(uint16_t timeout);
+  bool setBufferSize(uint16_t size);
+
+  bool connect(const char* id, const char* user, const char* pass);
+  bool connect(const char* id, const char* user, const char* pass, const char* willTopic,
+               uint8_t willQos, bool willRetain, const char* willMessage);
+  bool connected();
+  bool subscribe(const char* topic);
+  bool publish(const char* topic, const char* payload);
+  bool publish(const char* topic, const char* payload, bool retained);
+  bool publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained);
+  int state();
+  bool loop();
+
+  //Set by the bridge, read by the backend
+  const char* domain = NULL;
+  uint16_t port = 0;
+  uint16_t socketTimeout = 15;
+  uint16_t bufferSize = 256;
+  void (*callback)(char*, uint8_t*, unsigned int) = NULL;
+};
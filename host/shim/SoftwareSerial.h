@@ -0,0 +1,17 @@
+/* ******************** SoftwareSerial shim for host builds ********************
+ * The RS485 serial port. The backend puts it on the simulated bus or, in the Linux
+ * gateway, on a termios serial port.
+ */
+#pragma once
+
+#include <Arduino.h>
+
+class SoftwareSerial : public Stream {
+ public:
+  SoftwareSerial(int rxPin, int txPin) {}
+  void begin(unsigned long baud);
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t* data, size_t length) override;
+  int available() override;
+  int read() override;
+};
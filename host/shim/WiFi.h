@@ -0,0 +1,28 @@
+/* ************************ WiFi shim for host builds ************************
+ * The host is always on the network, so WiFi is connected from the start.
+ */
+#pragma once
+
+#include <Arduino.h>
+
+#define WL_CONNECTED         3
+
+class IPAddress {
+ public:
+  String toString() const { return String("127.0.0.1"); }
+};
+
+class WiFiClass {
+ public:
+  void begin(const char* ssid, const char* password) {}
+  int status() { return WL_CONNECTED; }
+  IPAddress localIP() { return IPAddress(); }
+};
+
+extern WiFiClass WiFi;
+
+class WiFiClient {
+ public:
+  //The connect timeout, in seconds like the ESP32 core before 3.0
+  int setTimeout(uint32_t seconds) { return 0; }
+};
@@ -0,0 +1,262 @@
+/* ************************ Arduino core shim for host builds ************************
+ * The parts of the core that are the same whatever backend the bridge runs on.
+ */
+#include "sim.h"
+#include <Arduino.h>
+#include <WiFi.h>
+#include <functional>
+#include <random>
+#include <unistd.h>
+
+namespace host {
+unsigned long heapAllocations = 0;
+std::function<void()> onRestart = [] {
+  fprintf(stderr, "ESP.restart() called\n");
+  exit(3);
+};
+bool recordPins = false;
+std::vector<PinWrite> pinWrites;
+}
+
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+
+namespace {
+uint8_t pins[64];
+//The mode each pin was last set to, plus one so 0 is a pin that never was
+uint8_t modes[64];
+std::mt19937 generator(1);
+}
+
+void yield() {}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  modes[pin % sizeof(pins)] = mode + 1;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  pins[pin % sizeof(pins)] = value;
+  if (host::recordPins) {
+    host::pinWrites.push_back(host::PinWrite{pin, value, micros()});
+  }
+}
+
+int host::pinModeOf(uint8_t pin) {
+  return (int)modes[pin % sizeof(pins)] - 1;
+}
+
+int digitalRead(uint8_t pin) {
+  return pins[pin % sizeof(pins)];
+}
+
+long random(long max) {
+  return max > 0 ? (long)(generator() % (unsigned long)max) : 0;
+}
+
+long random(long min, long max) {
+  return min + random(max - min);
+}
+
+void randomSeed(unsigned long seed) {
+  generator.seed(seed);
+}
+
+void EspClass::restart() {
+  host::onRestart();
+}
+
+uint32_t EspClass::getFreeHeap() {
+  return 200000;
+}
+
+size_t Print::write(const uint8_t* data, size_t length) {
+  size_t written = 0;
+  while (written < length && write(data[written]) == 1) {
+    written ++;
+  }
+  return written;
+}
+
+size_t Print::print(const char* text) {
+  return write((const uint8_t*)text, strlen(text));
+}
+
+size_t Print::print(char c) {
+  return write((uint8_t)c);
+}
+
+size_t Print::print(long value) {
+  char text[24];
+  snprintf(text, sizeof(text), "%ld", value);
+  return print(text);
+}
+
+size_t Print::println(const char* text) {
+  return print(text) + print("\r\n");
+}
+
+int Print::printf(const char* format, ...) {
+  char text[256];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+  print(text);
+  return length;
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+  return fwrite(&c, 1, 1, stdout);
+}
+
+size_t HardwareSerial::write(const uint8_t* data, size_t length) {
+  return fwrite(data, 1, length, stdout);
+}
+
+String::String(const char* text) {
+  assign(text, strlen(text));
+}
+
+String::String(const String& other) {
+  assign(other.c_str(), other.len);
+}
+
+String::String(String&& other) noexcept : buffer(other.buffer), len(other.len), capacity(other.capacity) {
+  other.buffer = NULL;
+  other.len = 0;
+  other.capacity = 0;
+}
+
+String::String(long value) {
+  char text[24];
+  snprintf(text, sizeof(text), "%ld", value);
+  assign(text, strlen(text));
+}
+
+String::~String() {
+  free(buffer);
+}
+
+String& String::operator=(const String& other) {
+  if (this != &other) {
+    assign(other.c_str(), other.len);
+  }
+  return *this;
+}
+
+String& String::operator=(String&& other) noexcept {
+  if (this != &other) {
+    free(buffer);
+    buffer = other.buffer;
+    len = other.len;
+    capacity = other.capacity;
+    other.buffer = NULL;
+    other.len = 0;
+    other.capacity = 0;
+  }
+  return *this;
+}
+
+String& String::operator=(const char* text) {
+  assign(text, strlen(text));
+  return *this;
+}
+
+String& String::operator+=(const String& other) {
+  append(other.c_str(), other.len);
+  return *this;
+}
+
+String& String::operator+=(const char* text) {
+  append(text, strlen(text));
+  return *this;
+}
+
+String& String::operator+=(char c) {
+  append(&c, 1);
+  return *this;
+}
+
+String operator+(const String& left, const String& right) {
+  String result(left);
+  result += right;
+  return result;
+}
+
+String operator+(const String& left, const char* right) {
+  String result(left);
+  result += right;
+  return result;
+}
+
+String operator+(const char* left, const String& right) {
+  String result(left);
+  result += right;
+  return result;
+}
+
+bool String::operator==(const String& other) const {
+  return len == other.len && memcmp(c_str(), other.c_str(), len) == 0;
+}
+
+bool String::operator==(const char* text) const {
+  return strcmp(c_str(), text) == 0;
+}
+
+int String::indexOf(char c, unsigned int from) const {
+  for (unsigned int i = from; i < len; i++) {
+    if (buffer[i] == c) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+String String::substring(unsigned int from, unsigned int to) const {
+  if (from > to) {
+    std::swap(from, to);
+  }
+  to = min(to, len);
+  String result;
+  if (from < to) {
+    result.assign(buffer + from, to - from);
+  }
+  return result;
+}
+
+bool String::startsWith(const String& prefix) const {
+  return prefix.len <= len && memcmp(c_str(), prefix.c_str(), prefix.len) == 0;
+}
+
+long String::toInt() const {
+  return atol(c_str());
+}
+
+float String::toFloat() const {
+  return (float)atof(c_str());
+}
+
+void String::reserve(unsigned int size) {
+  //Like the Arduino core, the buffer is only reallocated when it has to grow
+  if (size + 1 <= capacity) {
+    return;
+  }
+  buffer = (char*)realloc(buffer, size + 1);
+  capacity = size + 1;
+  host::heapAllocations ++;
+}
+
+void String::assign(const char* text, unsigned int length) {
+  reserve(length);
+  memmove(buffer, text, length);
+  buffer[length] = '\0';
+  len = length;
+}
+
+void String::append(const char* text, unsigned int length) {
+  reserve(len + length);
+  memmove(buffer + len, text, length);
+  len += length;
+  buffer[len] = '\0';
+}
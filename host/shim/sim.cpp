@@ -0,0 +1,485 @@
+/* ************************ Simulated host backend ************************
+ * The clock, SoftwareSerial and PubSubClient of the host builds the tests and
+ * benchmarks run, put on the simulated bus and the broker stand-in.
+ */
+#include "sim.h"
+
+#include <Arduino.h>
+#include <PubSubClient.h>
+#include <SoftwareSerial.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+namespace host {
+
+Bus bus;
+Broker broker;
+
+namespace {
+
+struct Event {
+  uint64_t at;
+  std::function<void()> run;
+};
+
+//Thrown out of delay() to unwind a task that is being stopped
+struct TaskStopped {};
+
+std::atomic<uint64_t> simulated{0};
+std::atomic<bool> real{false};
+bool wrap = false;
+std::chrono::steady_clock::time_point bootTime = std::chrono::steady_clock::now();
+
+std::recursive_mutex eventMutex;
+std::vector<Event> events;
+
+std::vector<std::thread> tasks;
+std::atomic<bool> stopping{false};
+thread_local bool inTask = false;
+
+//Runs the events that are due, oldest first. Events may add more events.
+void runDue(uint64_t upTo) {
+  std::lock_guard<std::recursive_mutex> lock(eventMutex);
+  for (;;) {
+    auto next = events.end();
+    for (auto it = events.begin(); it != events.end(); ++it) {
+      if (it->at <= upTo && (next == events.end() || it->at < next->at)) {
+        next = it;
+      }
+    }
+    if (next == events.end()) {
+      return;
+    }
+    Event event = std::move(*next);
+    events.erase(next);
+    if (!real && event.at > simulated) {
+      simulated = event.at;
+    }
+    event.run();
+  }
+}
+
+void sleepFor(uint64_t micros) {
+  if (inTask && stopping) {
+    throw TaskStopped();
+  }
+  if (real) {
+    std::this_thread::sleep_for(std::chrono::microseconds(micros));
+    runDue(now());
+  } else {
+    advance(micros);
+  }
+}
+
+}  // namespace
+
+void useRealClock() {
+  real = true;
+  bootTime = std::chrono::steady_clock::now() - std::chrono::microseconds(simulated.load());
+}
+
+uint64_t now() {
+  if (real) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - bootTime).count();
+  }
+  return simulated;
+}
+
+void advance(uint64_t micros) {
+  if (real) {
+    std::this_thread::sleep_for(std::chrono::microseconds(micros));
+    runDue(now());
+    return;
+  }
+  uint64_t target = simulated + micros;
+  runDue(target);
+  if (simulated < target) {
+    simulated = target;
+  }
+}
+
+void wrapMicros(bool on) {
+  wrap = on;
+}
+
+void at(uint64_t micros, std::function<void()> event) {
+  std::lock_guard<std::recursive_mutex> lock(eventMutex);
+  events.push_back(Event{micros, std::move(event)});
+}
+
+void stopTasks() {
+  stopping = true;
+  for (std::thread& task : tasks) {
+    task.join();
+  }
+  tasks.clear();
+  stopping = false;
+}
+
+void Bus::attach(Device* device) {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  devices.push_back(device);
+}
+
+void Bus::detachAll() {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  devices.clear();
+}
+
+void Bus::reply(const std::string& bytes, uint64_t startAt) {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  uint64_t at = inbound.empty() ? startAt : std::max(startAt, inbound.back().first);
+  for (char c : bytes) {
+    at += byteTime();
+    inbound.push_back(std::make_pair(at, c));
+  }
+  std::string text = bytes;
+  while (!text.empty() && (text.back() == '\r' || text.back() == '\n')) {
+    text.pop_back();
+  }
+  replies.push_back(Frame{text, at});
+}
+
+void Bus::write(const uint8_t* data, size_t length) {
+  uint64_t start = now();
+  {
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    for (size_t i = 0; i < length; i++) {
+      char c = (char)data[i];
+      if (c != '\r' && c != '\n') {
+        line += c;
+        continue;
+      }
+      if (line.empty()) {
+        continue;
+      }
+      Frame frame{line, start + (i + 1) * byteTime()};
+      line.clear();
+      sent.push_back(frame);
+      if (onSent) {
+        onSent(frame);
+      }
+      for (Device* device : devices) {
+        device->received(*this, frame.text, frame.at);
+      }
+    }
+  }
+  //SoftwareSerial only returns once the last bit has been shifted out
+  if (!real) {
+    advance(length * byteTime());
+  }
+}
+
+int Bus::available() {
+  if (real) {
+    runDue(now());
+  }
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  uint64_t time = now();
+  int count = 0;
+  for (auto& byte : inbound) {
+    if (byte.first > time) {
+      break;
+    }
+    count ++;
+  }
+  return count;
+}
+
+int Bus::read() {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  if (inbound.empty() || inbound.front().first > now()) {
+    return -1;
+  }
+  char c = inbound.front().second;
+  inbound.pop_front();
+  return (uint8_t)c;
+}
+
+void Bus::clear() {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  sent.clear();
+  replies.clear();
+  inbound.clear();
+  line.clear();
+}
+
+void Broker::stop() {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  up = false;
+  if (session && !will.topic.empty()) {
+    will.at = now();
+    published.push_back(will);
+    if (will.retained) {
+      retained[will.topic] = will;
+    }
+  }
+  session = false;
+  subscriptions.clear();
+  inbox.clear();
+}
+
+void Broker::start() {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  up = true;
+}
+
+void Broker::send(const std::string& topic, const std::string& payload) {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  //Without a session a QoS 0 message has nowhere to go
+  if (session) {
+    inbox.push_back(Message{topic, payload, false, now()});
+  }
+}
+
+size_t Broker::pending() {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  return inbox.size();
+}
+
+size_t Broker::count(const std::string& topic) {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  size_t total = 0;
+  for (const Message& message : published) {
+    total += message.topic == topic;
+  }
+  return total;
+}
+
+const Broker::Message* Broker::last(const std::string& topic) {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  for (auto it = published.rbegin(); it != published.rend(); ++it) {
+    if (it->topic == topic) {
+      return &*it;
+    }
+  }
+  return NULL;
+}
+
+std::vector<Broker::Message> Broker::snapshot() {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  return published;
+}
+
+void Broker::clear() {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  published.clear();
+}
+
+bool Broker::matches(const std::string& filter, const std::string& topic) {
+  size_t f = 0;
+  size_t t = 0;
+  while (f < filter.size()) {
+    if (filter[f] == '#') {
+      return true;
+    }
+    if (filter[f] == '+') {
+      while (t < topic.size() && topic[t] != '/') {
+        t ++;
+      }
+      f ++;
+      continue;
+    }
+    if (t >= topic.size() || filter[f] != topic[t]) {
+      return false;
+    }
+    f ++;
+    t ++;
+  }
+  return t == topic.size();
+}
+
+bool Broker::connect(const Message& will) {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  if (!up) {
+    return false;
+  }
+  this->will = will;
+  session = true;
+  subscriptions.clear();
+  connects ++;
+  return true;
+}
+
+bool Broker::publish(const std::string& topic, const std::string& payload, bool retain) {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  if (!session) {
+    return false;
+  }
+  Message message{topic, payload, retain, now()};
+  published.push_back(message);
+  if (retain) {
+    retained[topic] = message;
+  }
+  if (onPublish) {
+    onPublish(message);
+  }
+  return true;
+}
+
+void Broker::subscribe(const std::string& filter) {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  subscriptions.push_back(filter);
+}
+
+bool Broker::deliver(Message& message) {
+  std::lock_guard<std::recursive_mutex> lock(mutex);
+  while (session && !inbox.empty()) {
+    message = inbox.front();
+    inbox.pop_front();
+    for (const std::string& filter : subscriptions) {
+      if (matches(filter, message.topic)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+}  // namespace host
+
+unsigned long millis() {
+  return host::now() / 1000;
+}
+
+unsigned long micros() {
+  uint64_t time = host::now();
+  return host::wrap ? (unsigned long)(uint32_t)time : (unsigned long)time;
+}
+
+void delay(unsigned long ms) {
+  host::sleepFor(ms * 1000ULL);
+}
+
+void delayMicroseconds(unsigned int us) {
+  host::sleepFor(us);
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task, const char* name, uint32_t stack, void* parameter,
+                                   unsigned int priority, TaskHandle_t* handle, int core) {
+  if (!host::real) {
+    fprintf(stderr, "Task %s needs host::useRealClock() to run beside loop()\n", name);
+    abort();
+  }
+  host::tasks.emplace_back([task, parameter] {
+    host::inTask = true;
+    try {
+      task(parameter);
+    } catch (const host::TaskStopped&) {
+    }
+  });
+  return pdPASS;
+}
+
+void SoftwareSerial::begin(unsigned long baud) {
+  host::bus.baud = baud;
+}
+
+size_t SoftwareSerial::write(const uint8_t* data, size_t length) {
+  host::bus.write(data, length);
+  return length;
+}
+
+int SoftwareSerial::available() {
+  return host::bus.available();
+}
+
+int SoftwareSerial::read() {
+  return host::bus.read();
+}
+
+namespace {
+//Why the last connection attempt failed, for state()
+int connectFailure = MQTT_DISCONNECTED;
+}
+
+PubSubClient& PubSubClient::setServer(const char* server, uint16_t serverPort) {
+  domain = server;
+  port = serverPort;
+  return *this;
+}
+
+PubSubClient& PubSubClient::setCallback(void (*handler)(char*, uint8_t*, unsigned int)) {
+  callback = handler;
+  return *this;
+}
+
+PubSubClient& PubSubClient::setSocketTimeout(uint16_t timeout) {
+  socketTimeout = timeout;
+  return *this;
+}
+
+bool PubSubClient::setBufferSize(uint16_t size) {
+  bufferSize = size;
+  return true;
+}
+
+bool PubSubClient::connect(const char* id, const char* user, const char* pass) {
+  return connect(id, user, pass, NULL, 0, false, NULL);
+}
+
+bool PubSubClient::connect(const char* id, const char* user, const char* pass, const char* willTopic,
+                           uint8_t willQos, bool willRetain, const char* willMessage) {
+  if (!host::real) {
+    host::advance(host::broker.connectTime);
+  }
+  host::Broker::Message will{willTopic != NULL ? willTopic : "", willMessage != NULL ? willMessage : "", willRetain, 0};
+  if (host::broker.connect(will)) {
+    return true;
+  }
+  connectFailure = MQTT_CONNECT_FAILED;
+  return false;
+}
+
+bool PubSubClient::connected() {
+  std::lock_guard<std::recursive_mutex> lock(host::broker.mutex);
+  return host::broker.session;
+}
+
+bool PubSubClient::subscribe(const char* topic) {
+  if (!connected()) {
+    return false;
+  }
+  host::broker.subscribe(topic);
+  return true;
+}
+
+bool PubSubClient::publish(const char* topic, const char* payload) {
+  return publish(topic, (const uint8_t*)payload, strlen(payload), false);
+}
+
+bool PubSubClient::publish(const char* topic, const char* payload, bool retained) {
+  return publish(topic, (const uint8_t*)payload, strlen(payload), retained);
+}
+
+bool PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained) {
+  //Like PubSubClient, the fixed header, the topic and the payload must fit in the buffer
+  if (5 + 2 + strlen(topic) + length > bufferSize) {
+    return false;
+  }
+  return host::broker.publish(topic, std::string((const char*)payload, length), retained);
+}
+
+int PubSubClient::state() {
+  return connected() ? MQTT_CONNECTED : connectFailure;
+}
+
+bool PubSubClient::loop() {
+  if (!connected()) {
+    return false;
+  }
+  //Like PubSubClient, one packet is handled on each call
+  host::Broker::Message message;
+  if (host::broker.deliver(message) && callback != NULL) {
+    if (5 + 2 + message.topic.size() + message.payload.size() > bufferSize) {
+      return true;
+    }
+    std::vector<char> topic(message.topic.begin(), message.topic.end());
+    topic.push_back('\0');
+    std::vector<uint8_t> payload(message.payload.begin(), message.payload.end());
+    payload.push_back(0);
+    callback(topic.data(), payload.data(), message.payload.size());
+  }
+  return true;
+}
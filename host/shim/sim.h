@@ -0,0 +1,218 @@
+/* ************************ Simulated host backend ************************
+ * The world the bridge runs in on the host: a clock, the RS485 bus the TR40
+ * emulators sit on and a stand-in for the MQTT broker. By default the clock is
+ * simulated and only moves when the bridge sleeps or a test moves it, so every
+ * run is repeatable. The threaded build runs on the wall clock instead.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace host {
+
+//Heap buffers allocated by String and by anything else that counts itself
+extern unsigned long heapAllocations;
+
+/**
+ * @brief Runs the clock from the wall clock instead of simulating it. Call it before
+ * setup(), the threaded build needs it so its tasks see time pass.
+ */
+void useRealClock();
+
+/**
+ * @brief The time since boot in microseconds, never wrapped
+ */
+uint64_t now();
+
+/**
+ * @brief Moves the simulated clock forward, running the events that come due
+ *
+ * @param micros How far to move it
+ */
+void advance(uint64_t micros);
+
+/**
+ * @brief Makes micros() wrap at 32 bits like the ESP32's counter does, about every
+ * 71.6 minutes. millis() keeps counting.
+ */
+void wrapMicros(bool on);
+
+/**
+ * @brief Runs an event once the clock reaches a time, to script a test
+ *
+ * @param micros The time since boot in microseconds
+ * @param event What to run
+ */
+void at(uint64_t micros, std::function<void()> event);
+
+/**
+ * @brief Called by ESP.restart() instead of restarting, the default exits the process
+ */
+extern std::function<void()> onRestart;
+
+//A digitalWrite(), with the micros() it was made at
+struct PinWrite {
+  uint8_t pin;
+  uint8_t value;
+  unsigned long at;
+};
+
+//Whether digitalWrite() is recorded in pinWrites, off so a long run does not grow it
+extern bool recordPins;
+extern std::vector<PinWrite> pinWrites;
+
+/**
+ * @brief The mode pinMode() last set a pin to, -1 when it has not been set
+ */
+int pinModeOf(uint8_t pin);
+
+/**
+ * @brief Stops the tasks started with xTaskCreatePinnedToCore() and waits for them.
+ * A task stops the next time it calls delay().
+ */
+void stopTasks();
+
+/**
+ * @brief The RS485 bus. Bytes written by the bridge reach the devices as whole
+ * frames once their last byte has left at the baud rate, and the devices' replies
+ * arrive at the bridge one byte at a time at the same rate.
+ */
+class Bus {
+ public:
+  struct Frame {
+    std::string text;
+    //When the last byte of the frame was on the wire, in microseconds
+    uint64_t at;
+  };
+
+  //A device on the bus, told of every frame the bridge sends
+  struct Device {
+    virtual ~Device() {}
+    /**
+     * @brief Called with a frame the bridge sent, without its line end
+     *
+     * @param bus The bus to reply on
+     * @param frame The frame
+     * @param endedAt When the last byte of the frame was received
+     */
+    virtual void received(Bus& bus, const std::string& frame, uint64_t endedAt) = 0;
+  };
+
+  unsigned long baud = 9600;
+  //Every frame the bridge sent, and every frame put on the wire towards it
+  std::vector<Frame> sent;
+  std::vector<Frame> replies;
+  //Told of each frame the bridge sends as it ends, for the benchmarks
+  std::function<void(const Frame&)> onSent;
+
+  void attach(Device* device);
+  void detachAll();
+
+  /**
+   * @brief Puts bytes on the wire towards the bridge
+   *
+   * @param bytes The bytes, with their line end
+   * @param startAt When the first byte starts, in microseconds. A reply that would
+   *                start before the wire is free starts once it is.
+   */
+  void reply(const std::string& bytes, uint64_t startAt);
+
+  //The time one byte takes on the wire, in microseconds
+  uint64_t byteTime() const { return (10 * 1000000ULL + baud - 1) / baud; }
+
+  //The bridge's side, through SoftwareSerial
+  void write(const uint8_t* data, size_t length);
+  int available();
+  int read();
+
+  //Forgets the frames and the bytes still on the wire
+  void clear();
+
+  std::recursive_mutex mutex;
+
+ private:
+  std::vector<Device*> devices;
+  std::string line;
+  //Bytes on their way to the bridge with the time each one has arrived by
+  std::deque<std::pair<uint64_t, char>> inbound;
+};
+
+extern Bus bus;
+
+/**
+ * @brief Stands in for the MQTT broker. It records everything the bridge publishes,
+ * keeps the retained messages and hands messages sent to the bridge's subscriptions
+ * to its callback on the next client.loop(). It can be stopped and started to drop
+ * the bridge's session.
+ */
+class Broker {
+ public:
+  struct Message {
+    std::string topic;
+    std::string payload;
+    bool retained;
+    //When it was published, in microseconds
+    uint64_t at;
+  };
+
+  //Whether the broker accepts connections
+  bool up = true;
+  //Whether the bridge has a session, read by the tests from their own thread
+  std::atomic<bool> session{false};
+  //Everything the bridge published, oldest first
+  std::vector<Message> published;
+  std::map<std::string, Message> retained;
+  std::vector<std::string> subscriptions;
+  unsigned long connects = 0;
+  //How long a connection attempt keeps the bridge waiting, in microseconds, as a
+  //connect to a broker that is down blocks on the device
+  uint64_t connectTime = 0;
+  //The bridge's will, published for it when its session is dropped (an empty topic 
+  //when it has none)
+  Message will;
+  //Told of each message the bridge publishes, for the benchmarks
+  std::function<void(const Message&)> onPublish;
+
+  //Goes down, dropping the bridge's session and its subscriptions and publishing its will
+  void stop();
+  void start();
+
+  /**
+   * @brief Sends a message to the bridge, delivered on its next client.loop() if it
+   * is subscribed to the topic
+   */
+  void send(const std::string& topic, const std::string& payload);
+  //The messages sent that the bridge has not taken yet
+  size_t pending();
+
+  //The number of publishes on a topic, and the last one (NULL when there is none)
+  size_t count(const std::string& topic);
+  const Message* last(const std::string& topic);
+  //Copies of the publishes so far, safe to take while the tasks run
+  std::vector<Message> snapshot();
+  void clear();
+
+  static bool matches(const std::string& filter, const std::string& topic);
+
+  //The client's side, through PubSubClient
+  bool connect(const Message& will);
+  bool publish(const std::string& topic, const std::string& payload, bool retain);
+  void subscribe(const std::string& filter);
+  bool deliver(Message& message);
+
+  std::recursive_mutex mutex;
+
+ private:
+  std::deque<Message> inbox;
+};
+
+extern Broker broker;
+
+}  // namespace host
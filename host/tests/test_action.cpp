@@ -0,0 +1,129 @@
+/* ************************ HVAC action resolver tests ************************
+ * Every one of the 128 combinations of the six stage bits and the system mode in an
+ * R=2 frame, in order and shuffled, with the keys in the thermostat's order and
+ * reversed. The action is resolved once per frame: it matches the precedence order,
+ * whatever order the keys came in, and is published once when it changes and not at
+ * all when it does not.
+ */
+#include "main.cpp"
+#include "harness.h"
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace host;
+
+namespace {
+
+std::mt19937 generator(25);
+
+const int COMBINATIONS = 1 << 7;
+//The bit of the combination that is the system mode, set for SM=O
+const int OFF_BIT = 1 << 6;
+const char* const stageKeys[] = {"H1A", "H2A", "H3A", "C1A", "C2A", "FA"};
+
+//The action a combination should resolve to: the highest heating stage, then the
+//highest cooling stage, then the fan, then off, and idle with nothing running
+std::string expectedAction(int combination) {
+  const char* const precedence[][2] = {
+    {"H3A", "H3"}, {"H2A", "H2"}, {"H1A", "H1"}, {"C2A", "C2"}, {"C1A", "C1"}, {"FA", "F"},
+  };
+  for (const auto& rule : precedence) {
+    for (int stage = 0; stage < 6; stage++) {
+      if ((combination & (1 << stage)) && strcmp(stageKeys[stage], rule[0]) == 0) {
+        return rule[1];
+      }
+    }
+  }
+  return (combination & OFF_BIT) ? "O" : "I";
+}
+
+//The R=2 frame reporting a combination, with the keys in the thermostat's order or reversed
+std::string frameOf(int combination, bool reversed) {
+  std::vector<std::string> fields;
+  for (int stage = 0; stage < 6; stage++) {
+    fields.push_back(std::string(stageKeys[stage]) + "=" + ((combination & (1 << stage)) ? "1" : "0"));
+  }
+  fields.push_back("VA=0");
+  fields.push_back((combination & OFF_BIT) ? "SM=O" : "SM=H");
+  fields.push_back("SCP=00");
+  if (reversed) {
+    std::reverse(fields.begin(), fields.end());
+  }
+  std::string frame = "A=00 O=1";
+  for (const std::string& field : fields) {
+    frame += " " + field;
+  }
+  return frame;
+}
+
+//Parses a frame the way busLoop() does and returns the actions it queued for publishing
+std::vector<std::string> parse(const std::string& text) {
+  char frame[RX_BUFFER_SIZE];
+  snprintf(frame, sizeof(frame), "%s", text.c_str());
+  parseReceived(frame, strlen(frame));
+  std::vector<std::string> actions;
+  StatusUpdate update;
+  while (outboundStatus.pop(update)) {
+    if (strcmp(update.key, "action") == 0) {
+      actions.push_back(update.value);
+    }
+  }
+  return actions;
+}
+
+//Parses the frame of each combination in turn and checks what it resolved and published
+void checkEach(const std::vector<int>& combinations, bool reversed) {
+  ThermostatState& state = thermostats[0].state;
+  for (int combination : combinations) {
+    std::string previous = actionNames[state.action];
+    std::string expected = expectedAction(combination);
+    std::vector<std::string> published = parse(frameOf(combination, reversed));
+    if (actionNames[state.action] != expected) {
+      fprintf(stderr, "    %s resolved to %s\n", frameOf(combination, reversed).c_str(), actionNames[state.action]);
+      CHECK(false);
+    }
+    CHECK_EQ(published.size(), (size_t)(expected != previous ? 1 : 0));
+    //The same frame again changes nothing
+    CHECK(parse(frameOf(combination, reversed)).empty());
+  }
+}
+
+}  // namespace
+
+TEST(every_stage_combination_resolves_to_its_action) {
+  parse("A=00 O=1 OA=88 Z=1 T=77 SP= 70 SPH=70 SPC=78 M=H FM=0");
+  std::vector<int> combinations;
+  for (int combination = 0; combination < COMBINATIONS; combination++) {
+    combinations.push_back(combination);
+  }
+  checkEach(combinations, false);
+  checkEach(combinations, true);
+}
+
+TEST(any_transition_between_combinations_publishes_at_most_once) {
+  std::vector<int> combinations;
+  for (int round = 0; round < 20; round++) {
+    for (int combination = 0; combination < COMBINATIONS; combination++) {
+      combinations.push_back(combination);
+    }
+  }
+  std::shuffle(combinations.begin(), combinations.end(), generator);
+  checkEach(combinations, false);
+  std::shuffle(combinations.begin(), combinations.end(), generator);
+  checkEach(combinations, true);
+}
+
+TEST(the_thermostat_mode_off_stands_in_for_a_missing_system_mode) {
+  parse("A=00 O=1 M=O");
+  parse("A=00 O=1 H1A=0 H2A=0 H3A=0 C1A=0 C2A=0 FA=0 VA=0");
+  CHECK_EQ(thermostats[0].state.action, ACTION_OFF);
+  //The fan still shows running while the system is off
+  parse("A=00 O=1 H1A=0 H2A=0 H3A=0 C1A=0 C2A=0 FA=1 VA=0");
+  CHECK_EQ(thermostats[0].state.action, ACTION_FAN);
+  parse("A=00 O=1 M=H");
+  parse("A=00 O=1 H1A=0 H2A=0 H3A=0 C1A=0 C2A=0 FA=0 VA=0");
+  CHECK_EQ(thermostats[0].state.action, ACTION_IDLE);
+}
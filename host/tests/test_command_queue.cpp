@@ -0,0 +1,285 @@
+/* ************************ Command queue tests ************************
+ * CommandQueue ordering, coalescing, overflow and packing, and several set
+ * topics from Home Assistant arriving at once.
+ */
+#include "main.cpp"
+#include "harness.h"
+
+#include <string>
+#include <vector>
+
+using namespace host;
+
+Tr40 livingRoom("1");
+
+namespace {
+
+//Empties a queue, returning the commands in the order they would be sent
+std::vector<std::string> drain(CommandQueue& queue) {
+  std::vector<std::string> sent;
+  Command command;
+  while (queue.pop(command)) {
+    sent.push_back(std::to_string(command.device) + ":" + command.text);
+  }
+  return sent;
+}
+
+}  // namespace
+
+TEST(user_commands_go_ahead_of_polls_in_arrival_order) {
+  CommandQueue queue;
+  CHECK(queue.push(0, "R=1", PRIORITY_POLL));
+  CHECK(queue.push(0, "SPH=70", PRIORITY_USER));
+  CHECK(queue.push(0, "R=2", PRIORITY_POLL));
+  CHECK(queue.push(0, "M=C", PRIORITY_USER));
+  CHECK(queue.push(1, "FM=1", PRIORITY_USER));
+  std::vector<std::string> sent = drain(queue);
+  std::vector<std::string> expected = {"0:SPH=70", "0:M=C", "1:FM=1", "0:R=1", "0:R=2"};
+  CHECK(sent == expected);
+}
+
+TEST(a_newer_write_to_a_key_replaces_the_waiting_one) {
+  CommandQueue queue;
+  queue.push(0, "SPH=70", PRIORITY_USER);
+  queue.push(0, "M=H", PRIORITY_USER);
+  queue.push(0, "SPH=72", PRIORITY_USER);
+  //Only the same key of the same device coalesces
+  queue.push(1, "SPH=60", PRIORITY_USER);
+  queue.push(0, "SP=71", PRIORITY_USER);
+  std::vector<std::string> sent = drain(queue);
+  std::vector<std::string> expected = {"0:SPH=72", "0:M=H", "1:SPH=60", "0:SP=71"};
+  CHECK(sent == expected);
+}
+
+TEST(polls_are_not_queued_twice) {
+  CommandQueue queue;
+  queue.push(0, "R=1", PRIORITY_POLL);
+  queue.push(0, "R=1", PRIORITY_POLL);
+  queue.push(0, "R=2", PRIORITY_POLL);
+  queue.push(1, "R=1", PRIORITY_POLL);
+  CHECK_EQ(queue.count, (uint8_t)3);
+}
+
+TEST(a_read_waiting_as_a_poll_is_promoted_not_queued_twice) {
+  CommandQueue queue;
+  queue.push(0, "R=2", PRIORITY_POLL);
+  queue.push(0, "R=1", PRIORITY_POLL);
+  queue.push(1, "R=1", PRIORITY_POLL);
+  CHECK(queue.push(0, "R=1", PRIORITY_USER));
+  //And a poll for a read already waiting as a user command is not added
+  CHECK(queue.push(0, "R=1", PRIORITY_POLL));
+  std::vector<std::string> sent = drain(queue);
+  std::vector<std::string> expected = {"0:R=1", "0:R=2", "1:R=1"};
+  CHECK(sent == expected);
+}
+
+TEST(a_full_queue_gives_up_polls_for_user_commands) {
+  CommandQueue queue;
+  for (uint8_t i = 0; i < COMMAND_QUEUE_SIZE; i++) {
+    CHECK(queue.push(i, "R=1", PRIORITY_POLL));
+  }
+  CHECK(!queue.push(COMMAND_QUEUE_SIZE, "R=1", PRIORITY_POLL));
+  CHECK(queue.push(0, "SPH=70", PRIORITY_USER));
+  CHECK_EQ(queue.count, (uint8_t)COMMAND_QUEUE_SIZE);
+  Command command;
+  queue.pop(command);
+  CHECK_STR(command.text, "SPH=70");
+  //The newest poll made room
+  for (uint8_t i = 0; i < COMMAND_QUEUE_SIZE - 1; i++) {
+    queue.pop(command);
+    CHECK_EQ(command.device, i);
+  }
+  CHECK(!queue.pop(command));
+}
+
+TEST(a_queue_full_of_user_commands_refuses_more) {
+  CommandQueue queue;
+  for (uint8_t i = 0; i < COMMAND_QUEUE_SIZE; i++) {
+    CHECK(queue.push(i, "SPH=70", PRIORITY_USER));
+  }
+  CHECK(!queue.push(0, "SPC=80", PRIORITY_USER));
+  //Replacing a waiting write still works when full
+  CHECK(queue.push(0, "SPH=71", PRIORITY_USER));
+  Command command;
+  queue.pop(command);
+  CHECK_STR(command.text, "SPH=71");
+}
+
+TEST(overlong_commands_are_refused) {
+  CommandQueue queue;
+  std::string text = "TM=\"" + std::string(COMMAND_MAX_LENGTH, 'x') + "\"";
+  CHECK(!queue.push(0, text.c_str(), PRIORITY_USER));
+  CHECK_EQ(queue.count, (uint8_t)0);
+}
+
+TEST(writes_for_one_device_are_packed_into_one_frame) {
+  CommandQueue queue;
+  queue.push(0, "SPH=70", PRIORITY_USER);
+  queue.push(1, "SPH=60", PRIORITY_USER);
+  queue.push(0, "M=H", PRIORITY_USER);
+  queue.push(0, "TM=\"Filter due\"", PRIORITY_USER);
+  queue.push(0, "FM=1", PRIORITY_USER);
+  queue.push(0, "R=1", PRIORITY_POLL);
+  Command command;
+  CHECK_EQ(queue.popPacked(command, PACKED_FRAME_MAX_LENGTH), (uint8_t)2);
+  CHECK_STR(command.text, "SPH=70 M=H");
+  CHECK_EQ(queue.popPacked(command, PACKED_FRAME_MAX_LENGTH), (uint8_t)1);
+  CHECK_STR(command.text, "SPH=60");
+  //A quoted message may hold spaces so it goes on its own, and FM=1 waits behind it
+  CHECK_EQ(queue.popPacked(command, PACKED_FRAME_MAX_LENGTH), (uint8_t)1);
+  CHECK_STR(command.text, "TM=\"Filter due\"");
+  CHECK_EQ(queue.popPacked(command, PACKED_FRAME_MAX_LENGTH), (uint8_t)1);
+  CHECK_STR(command.text, "FM=1");
+  //Polls are never packed
+  CHECK_EQ(queue.popPacked(command, PACKED_FRAME_MAX_LENGTH), (uint8_t)1);
+  CHECK_STR(command.text, "R=1");
+  CHECK_EQ(queue.popPacked(command, PACKED_FRAME_MAX_LENGTH), (uint8_t)0);
+}
+
+TEST(packing_stops_at_the_frame_length) {
+  CommandQueue queue;
+  queue.push(0, "SPH=70", PRIORITY_USER);
+  queue.push(0, "SPC=80", PRIORITY_USER);
+  queue.push(0, "M=H", PRIORITY_USER);
+  Command command;
+  CHECK_EQ(queue.popPacked(command, 13), (uint8_t)2);
+  CHECK_STR(command.text, "SPH=70 SPC=80");
+  CHECK_EQ(queue.popPacked(command, 13), (uint8_t)1);
+  CHECK_STR(command.text, "M=H");
+}
+
+TEST(a_shorter_write_is_not_packed_past_one_that_does_not_fit) {
+  CommandQueue queue;
+  queue.push(0, "SPH=70", PRIORITY_USER);
+  queue.push(0, "SPC=80", PRIORITY_USER);
+  queue.push(0, "M=H", PRIORITY_USER);
+  Command command;
+  CHECK_EQ(queue.popPacked(command, 12), (uint8_t)1);
+  CHECK_STR(command.text, "SPH=70");
+  CHECK_EQ(queue.popPacked(command, 12), (uint8_t)2);
+  CHECK_STR(command.text, "SPC=80 M=H");
+}
+
+TEST(writes_the_readback_cannot_check_go_alone) {
+  CommandQueue queue;
+  queue.readBack = readBackWrite;
+  queue.push(0, "SPH=70", PRIORITY_USER);
+  queue.push(0, "M=H", PRIORITY_USER);
+  queue.push(0, "OT=50", PRIORITY_USER);
+  queue.push(0, "FM=1", PRIORITY_USER);
+  queue.push(0, "SC=1", PRIORITY_USER);
+  queue.push(0, "DOW=3", PRIORITY_USER);
+  Command command;
+  CHECK_EQ(queue.popPacked(command, PACKED_FRAME_MAX_LENGTH), (uint8_t)2);
+  CHECK_STR(command.text, "SPH=70 M=H");
+  //The writes after one that goes alone wait their turn behind it
+  for (const char* alone : {"OT=50", "FM=1", "SC=1", "DOW=3"}) {
+    CHECK_EQ(queue.popPacked(command, PACKED_FRAME_MAX_LENGTH), (uint8_t)1);
+    CHECK_STR(command.text, alone);
+  }
+}
+
+TEST(another_thermostats_write_does_not_stop_the_packing) {
+  CommandQueue queue;
+  queue.push(0, "SPH=70", PRIORITY_USER);
+  queue.push(1, "OT=50", PRIORITY_USER);
+  queue.push(0, "M=H", PRIORITY_USER);
+  Command command;
+  CHECK_EQ(queue.popPacked(command, PACKED_FRAME_MAX_LENGTH), (uint8_t)2);
+  CHECK_STR(command.text, "SPH=70 M=H");
+}
+
+TEST(sets_arriving_together_all_reach_the_thermostat) {
+  startBridge(livingRoom);
+  runFor(5000);
+  broker.send(setTopicOf("M"), "C");
+  broker.send(setTopicOf("SPC"), "74");
+  broker.send(setTopicOf("FM"), "1");
+  broker.send(setTopicOf("SPC"), "75");
+  CHECK(runUntil([] { return livingRoom.mode == "C" && livingRoom.setpointCool == 75 && livingRoom.fanMode == 1; },
+                 10000));
+  //SPC=74 was replaced before it was sent
+  for (const Bus::Frame& frame : bus.sent) {
+    CHECK(frame.text.find("SPC=74") == std::string::npos);
+  }
+}
+
+namespace {
+
+struct Burst {
+  size_t frames;
+  double milliseconds;
+};
+
+//Sends a burst of sets and counts the frames and the time until the thermostat has 
+//taken them all and the readback has been published
+template <typename Done>
+Burst runBurst(const std::vector<std::pair<const char*, const char*>>& sets, Done done) {
+  runFor(2000);
+  size_t sent = bus.sent.size();
+  uint64_t start = now();
+  for (const auto& set : sets) {
+    broker.send(setTopicOf(set.first), set.second);
+  }
+  CHECK(runUntil(done, 10000));
+  Burst burst{0, (now() - start) / 1000.0};
+  for (size_t i = sent; i < bus.sent.size(); i++) {
+    burst.frames += bus.sent[i].text.find(" R=") == std::string::npos;
+  }
+  return burst;
+}
+
+bool packNothing(const char*) {
+  return false;
+}
+
+}  // namespace
+
+TEST(a_scene_goes_out_in_fewer_frames) {
+  std::vector<std::pair<const char*, const char*>> scene = {{"M", "C"}, {"SPC", "73"}, {"SPH", "65"}, {"FM", "0"}};
+  auto taken = [] {
+    return livingRoom.mode == "C" && livingRoom.setpointCool == 73 && livingRoom.setpointHeat == 65 &&
+           livingRoom.fanMode == 0 && lastValue("SPH") == "65" && thermostats[0].state.optimistic == 0 &&
+           commandQueue.count == 0 && !transactions.busy();
+  };
+  Burst packed = runBurst(scene, taken);
+  livingRoom.mode = "H";
+  livingRoom.setpointCool = 76;
+  livingRoom.setpointHeat = 68;
+  livingRoom.fanMode = 1;
+  commandQueue.readBack = packNothing;
+  Burst alone = runBurst(scene, taken);
+  commandQueue.readBack = readBackWrite;
+  fprintf(stderr, "    scene: packed %zu frames in %.1f ms, unpacked %zu frames in %.1f ms\n",
+          packed.frames, packed.milliseconds, alone.frames, alone.milliseconds);
+  //The first set goes out as soon as it arrives, the rest are packed behind it
+  CHECK(packed.frames <= 2);
+  CHECK_EQ(alone.frames, (size_t)4);
+  CHECK(packed.milliseconds < alone.milliseconds);
+}
+
+TEST(a_clock_sync_is_not_packed) {
+  Burst sync = runBurst({{"TIME", "13:05:00"}, {"DATE", "10/17/26"}, {"DOW", "7"}}, [] {
+    return livingRoom.time == "13:05:00" && livingRoom.date == "10/17/26" && livingRoom.dayOfWeek == 7 &&
+           commandQueue.count == 0 && !transactions.busy();
+  });
+  CHECK_EQ(sync.frames, (size_t)3);
+}
+
+TEST(each_packed_write_is_confirmed_or_rolled_back_on_its_own) {
+  //The thermostat takes SPH=70 and ignores M=I in the same frame, packed while the 
+  //outside temperature is being written
+  size_t sent = bus.sent.size();
+  broker.send(setTopicOf("OT"), "50");
+  broker.send(setTopicOf("SPH"), "70");
+  broker.send(setTopicOf("M"), "I");
+  CHECK(runUntil([] { return livingRoom.setpointHeat == 70 && thermostats[0].state.optimistic == 0 &&
+                             lastValue("M") == "C" && lastValue("SPH") == "70" && !transactions.busy(); }, 5000));
+  bool packed = false;
+  for (size_t i = sent; i < bus.sent.size(); i++) {
+    packed = packed || bus.sent[i].text == "A=1 O=00 SPH=70 M=I";
+  }
+  CHECK(packed);
+  CHECK_EQ(livingRoom.setpointHeat, 70);
+  CHECK_EQ(livingRoom.mode, std::string("C"));
+}
@@ -0,0 +1,293 @@
+/* ************************ Topic and discovery tests ************************
+ * Every topic is built from a device's prefix and a short key, and the Home
+ * Assistant discovery documents are built from the discoveryEntities table and a
+ * runtime sensor for each stage. The
+ * documents must be valid JSON, unique per entity and device, and point only at
+ * topics the bridge publishes or subscribes to.
+ */
+#define THERMOSTAT_LIST \
+  Thermostat("1", bridgePrefix, "Living room thermostat"), \
+  Thermostat("2", "site/zone2", "Zone 2 thermostat"),
+
+#include "main.cpp"
+#include "harness.h"
+#include "json.h"
+
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace host;
+
+Tr40 livingRoom("1");
+Tr40 zone2("2");
+
+namespace {
+
+const size_t ENTITY_COUNT = sizeof(discoveryEntities) / sizeof(discoveryEntities[0]) + STAGE_COUNT;
+
+//The keys a device publishes its status on, besides the fields
+const char* const otherStatusKeys[] = {"availability", "runtime"};
+
+struct Discovery {
+  std::string topic;
+  Json config;
+};
+
+std::vector<Discovery> retainedDiscovery() {
+  std::vector<Discovery> found;
+  for (auto& retained : broker.retained) {
+    if (retained.first.compare(0, strlen(DISCOVERY_PREFIX) + 1, DISCOVERY_PREFIX "/") != 0 ||
+        retained.first == discoveryStatusTopic) {
+      continue;
+    }
+    Discovery discovery;
+    discovery.topic = retained.first;
+    std::string error;
+    if (!Json::parse(retained.second.payload, discovery.config, error)) {
+      fprintf(stderr, "    %s: %s\n", retained.first.c_str(), error.c_str());
+    }
+    found.push_back(discovery);
+  }
+  return found;
+}
+
+//A topic in a discovery document with the ~ abbreviation expanded
+std::string expand(const Json& config, const std::string& topic) {
+  return topic.compare(0, 1, "~") == 0 ? config["~"].string + topic.substr(1) : topic;
+}
+
+//Whether Home Assistant would show an entity as available from what the broker retains
+bool isAvailable(const Json& config) {
+  if (config["avty_mode"].string != "all" || config["avty"].items.empty()) {
+    return false;
+  }
+  for (const Json& availability : config["avty"].items) {
+    auto retained = broker.retained.find(expand(config, availability["t"].string));
+    if (retained == broker.retained.end() || retained->second.payload != availability["pl_avail"].string) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool isStatusTopic(const std::string& topic) {
+  for (uint8_t device = 0; device < DEVICE_COUNT; device++) {
+    for (uint8_t field = 0; field < FIELD_COUNT; field++) {
+      if (topic == topicOf(fieldKeys[field], device)) {
+        return true;
+      }
+    }
+    for (const char* key : otherStatusKeys) {
+      if (topic == topicOf(key, device)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool isSubscribed(const std::string& topic) {
+  for (const std::string& filter : broker.subscriptions) {
+    if (Broker::matches(filter, topic)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace
+
+TEST(topics_are_a_prefix_and_a_key) {
+  char topic[TOPIC_MAX_LENGTH];
+  bridgeTopic(topic, sizeof(topic), diagnosticsTopic);
+  CHECK_STR(topic, "casa_de_bemo/living_room/rcs_tr40_thermostat/diag");
+  bridgeTopic(topic, sizeof(topic), captureResultTopic);
+  CHECK_STR(topic, "casa_de_bemo/living_room/rcs_tr40_thermostat/capture/result");
+  CHECK_STR(topicKey("site/zone2/SPH/set", thermostats[1].topicPrefix), "SPH/set");
+  //A prefix only matches at a level boundary
+  CHECK(topicKey("site/zone22/SPH/set", thermostats[1].topicPrefix) == NULL);
+  CHECK(topicKey("site/zone2", thermostats[1].topicPrefix) == NULL);
+}
+
+TEST(every_set_key_is_covered_by_a_device_subscription) {
+  startBridge(livingRoom);
+  bus.attach(&zone2);
+  for (uint8_t device = 0; device < DEVICE_COUNT; device++) {
+    for (const SetRoute& route : setRoutes) {
+      CHECK(isSubscribed(setTopicOf(route.key, device)));
+    }
+  }
+  CHECK(isSubscribed(bridgeTopicOf(debugMode)));
+  CHECK(isSubscribed(discoveryStatusTopic));
+  CHECK(isSubscribed(bridgeTopicOf(replayTopic) + "/fast"));
+  //One wildcard per device, not one subscription per key
+  CHECK(broker.subscriptions.size() < 2 * DEVICE_COUNT + 4);
+}
+
+TEST(discovery_is_retained_for_every_entity_of_every_device) {
+  std::vector<Discovery> found = retainedDiscovery();
+  CHECK_EQ(found.size(), ENTITY_COUNT * DEVICE_COUNT);
+  CHECK(broker.retained.count("homeassistant/climate/casa_de_bemo_living_room_rcs_tr40_thermostat/thermostat/config") == 1);
+  CHECK(broker.retained.count("homeassistant/sensor/site_zone2/outside_air/config") == 1);
+  //Published together at connect, before the status
+  std::vector<Broker::Message> published = broker.snapshot();
+  size_t first = published.size();
+  size_t last = 0;
+  for (size_t i = 0; i < published.size(); i++) {
+    if (published[i].topic.compare(0, 14, "homeassistant/") == 0) {
+      first = std::min(first, i);
+      last = i;
+    }
+  }
+  CHECK_EQ(last - first + 1, ENTITY_COUNT * DEVICE_COUNT);
+}
+
+TEST(discovery_documents_are_valid_and_unique) {
+  std::set<std::string> uniqueIds;
+  for (const Discovery& discovery : retainedDiscovery()) {
+    const Json& config = discovery.config;
+    CHECK_EQ(config.type, Json::OBJECT);
+    CHECK_EQ(config["uniq_id"].type, Json::STRING);
+    CHECK(uniqueIds.insert(config["uniq_id"].string).second);
+    //Available while the bridge is connected and the thermostat is available
+    CHECK_EQ(config["avty_mode"].string, std::string("all"));
+    CHECK_EQ(config["avty"].items.size(), (size_t)2);
+    if (config["avty"].items.size() == 2) {
+      const Json& bridge = config["avty"].items[0];
+      CHECK_EQ(bridge["t"].string, bridgeTopicOf(connectionTopic));
+      CHECK_EQ(bridge["pl_avail"].string, std::string(connectionOnline));
+      CHECK_EQ(bridge["pl_not_avail"].string, std::string(connectionOffline));
+      CHECK_EQ(config["avty"].items[1]["t"].string, std::string("~/availability"));
+      CHECK_EQ(config["avty"].items[1]["pl_avail"].string, std::string("available"));
+    }
+    CHECK(isAvailable(config));
+    CHECK_EQ(config["dev"]["ids"].type, Json::ARRAY);
+    CHECK_EQ(config["dev"]["ids"].items.size(), (size_t)1);
+    CHECK(config["name"].type == Json::STRING || config["name"].type == Json::NUL);
+    //The topic is <discovery prefix>/<component>/<node id>/<object id>/config, with the
+    //node id made from the prefix in ~
+    std::string nodeId = config["~"].string;
+    std::replace(nodeId.begin(), nodeId.end(), '/', '_');
+    CHECK_EQ(config["dev"]["ids"].items.empty() ? std::string() : config["dev"]["ids"].items[0].string, nodeId);
+    CHECK(discovery.topic.find("/" + nodeId + "/") != std::string::npos);
+    CHECK_EQ(config["uniq_id"].string.compare(0, nodeId.size(), nodeId), 0);
+  }
+  CHECK_EQ(uniqueIds.size(), ENTITY_COUNT * DEVICE_COUNT);
+}
+
+TEST(discovery_points_only_at_the_bridges_topics) {
+  for (const Discovery& discovery : retainedDiscovery()) {
+    for (auto& member : discovery.config.members) {
+      const std::string& key = member.first;
+      if (key.size() < 2 || key.compare(key.size() - 2, 2, "_t") != 0) {
+        continue;
+      }
+      std::string topic = expand(discovery.config, member.second.string);
+      bool command = key.find("cmd_t") != std::string::npos;
+      if (command ? !isSubscribed(topic) : !isStatusTopic(topic)) {
+        fprintf(stderr, "    %s %s is %s\n", discovery.topic.c_str(), key.c_str(), topic.c_str());
+        CHECK(false);
+      }
+    }
+  }
+}
+
+TEST(the_status_topics_in_discovery_are_published) {
+  //R=2 goes out half a period before R=1, so the temperature comes last
+  CHECK(runUntil([] { return !lastValue("T").empty() && !lastValue("T", 1).empty(); }, 60000));
+  for (uint8_t device = 0; device < DEVICE_COUNT; device++) {
+    for (const char* key : {"T", "OA", "SPH", "SPC", "M", "FM", "action", "availability"}) {
+      CHECK(!lastValue(key, device).empty());
+    }
+  }
+}
+
+TEST(every_stage_has_a_runtime_sensor_on_its_rollup_figure) {
+  for (uint8_t device = 0; device < DEVICE_COUNT; device++) {
+    std::string nodeId = thermostats[device].topicPrefix;
+    std::replace(nodeId.begin(), nodeId.end(), '/', '_');
+    for (const char* stage : stageNames) {
+      auto retained = broker.retained.find("homeassistant/sensor/" + nodeId + "/runtime_" + stage + "/config");
+      CHECK(retained != broker.retained.end());
+      if (retained == broker.retained.end()) {
+        continue;
+      }
+      Json config;
+      std::string error;
+      CHECK(Json::parse(retained->second.payload, config, error));
+      CHECK_EQ(config["stat_t"].string, std::string("~/runtime"));
+      CHECK_EQ(config["val_tpl"].string, "{{ value_json." + std::string(stage) + ".on }}");
+      CHECK_EQ(config["name"].string, "Runtime " + std::string(stage));
+    }
+  }
+}
+
+TEST(emergency_heat_is_offered_as_a_preset_of_the_climate_entity) {
+  auto retained = broker.retained.find("homeassistant/climate/site_zone2/thermostat/config");
+  CHECK(retained != broker.retained.end());
+  if (retained == broker.retained.end()) {
+    return;
+  }
+  Json config;
+  std::string error;
+  CHECK(Json::parse(retained->second.payload, config, error));
+  CHECK_EQ(config["pr_modes"].items.size(), (size_t)1);
+  CHECK_EQ(config["pr_modes"].items.empty() ? std::string() : config["pr_modes"].items[0].string, 
+           std::string("emergency heat"));
+  CHECK_EQ(config["pr_mode_stat_t"].string, std::string("~/M"));
+  CHECK_EQ(config["pr_mode_cmd_t"].string, std::string("~/M/set"));
+  //The mode route takes what the preset template sends
+  CHECK(validatePayload(*findSetRoute("M", 1), Payload{"EH", 2}));
+  CHECK(validatePayload(*findSetRoute("M", 1), Payload{"H", 1}));
+}
+
+TEST(a_discovery_topic_that_does_not_fit_is_not_published) {
+  size_t published = broker.snapshot().size();
+  unsigned long failed = failedPublishes;
+  std::string objectId(DISCOVERY_OBJECT_ID_LENGTH + 80, 'x');
+  publishDiscoveryEntity(thermostats[0], "casa_de_bemo_living_room_rcs_tr40_thermostat",
+                         DiscoveryEntity{"sensor", objectId.c_str(), "null", "\"stat_t\":\"~/OA\""});
+  //Dropped with an error rather than published on a truncated topic
+  CHECK_EQ(broker.snapshot().size(), published);
+  CHECK_EQ(failedPublishes, failed);
+}
+
+TEST(entities_are_unavailable_while_the_bridge_is_off_the_broker) {
+  //The broker publishes the bridge's will when it loses the connection
+  broker.stop();
+  CHECK_EQ(broker.retained[bridgeTopicOf(connectionTopic)].payload, std::string(connectionOffline));
+  for (const Discovery& discovery : retainedDiscovery()) {
+    CHECK(!isAvailable(discovery.config));
+  }
+  broker.start();
+  CHECK(runUntil([] { return broker.session.load(); }, 60000));
+  runFor(100);
+  for (const Discovery& discovery : retainedDiscovery()) {
+    CHECK(isAvailable(discovery.config));
+  }
+}
+
+TEST(entities_are_available_again_when_home_assistant_starts) {
+  //Home Assistant comes back with a broker that has lost what was retained, so all it 
+  //has is what the bridge sends when it hears Home Assistant is online
+  broker.retained.clear();
+  broker.send(discoveryStatusTopic, "online");
+  runFor(100);
+  std::vector<Discovery> found = retainedDiscovery();
+  CHECK_EQ(found.size(), ENTITY_COUNT * DEVICE_COUNT);
+  for (const Discovery& discovery : found) {
+    CHECK(isAvailable(discovery.config));
+  }
+}
+
+TEST(discovery_is_sent_again_when_home_assistant_starts) {
+  std::string topic = "homeassistant/select/site_zone2/schedule/config";
+  size_t count = broker.count(topic);
+  broker.send(discoveryStatusTopic, "online");
+  runFor(100);
+  CHECK_EQ(broker.count(topic), count + 1);
+  broker.send(discoveryStatusTopic, "offline");
+  runFor(100);
+  CHECK_EQ(broker.count(topic), count + 1);
+}
@@ -0,0 +1,92 @@
+/* ************************ End to end tests ************************
+ * The bridge against a TR40 emulator and the broker stand-in: connecting,
+ * polling, a write from Home Assistant and a bus that loses and garbles replies.
+ */
+#include "main.cpp"
+#include "harness.h"
+
+using namespace host;
+
+Tr40 livingRoom("1");
+
+TEST(connects_and_announces) {
+  startBridge(livingRoom);
+  CHECK(broker.session);
+  CHECK_EQ(broker.connects, 1UL);
+  bool setSubscribed = false;
+  for (const std::string& filter : broker.subscriptions) {
+    setSubscribed = setSubscribed || Broker::matches(filter, setTopicOf("SPH"));
+  }
+  CHECK(setSubscribed);
+  CHECK(broker.retained.count("homeassistant/climate/casa_de_bemo_living_room_rcs_tr40_thermostat/thermostat/config") == 1);
+  CHECK_EQ(lastValue("availability"), std::string("available"));
+}
+
+TEST(polls_and_publishes_the_status) {
+  CHECK(runUntil([] { return !lastValue("T").empty() && !lastValue("action").empty(); }, 60000));
+  CHECK_EQ(lastValue("T"), std::string("72"));
+  CHECK_EQ(lastValue("OA"), std::string("88"));
+  CHECK_EQ(lastValue("SPH"), std::string("68"));
+  CHECK_EQ(lastValue("SPC"), std::string("76"));
+  CHECK_EQ(lastValue("M"), std::string("H"));
+  CHECK_EQ(lastValue("FM"), std::string("0"));
+  CHECK_EQ(lastValue("action"), std::string("I"));
+  bool r1 = false;
+  bool r2 = false;
+  for (const Bus::Frame& frame : bus.sent) {
+    r1 = r1 || frame.text == "A=1 O=00 R=1";
+    r2 = r2 || frame.text == "A=1 O=00 R=2";
+  }
+  CHECK(r1);
+  CHECK(r2);
+}
+
+TEST(writes_a_setpoint_from_home_assistant) {
+  size_t before = bus.sent.size();
+  broker.send(setTopicOf("SPH"), "70");
+  CHECK(runUntil([] { return livingRoom.setpointHeat == 70; }, 2000));
+  bool written = false;
+  for (size_t i = before; i < bus.sent.size(); i++) {
+    written = written || bus.sent[i].text == "A=1 O=00 SPH=70";
+  }
+  CHECK(written);
+  //Published straight away and confirmed by the readback
+  CHECK(runUntil([] { return livingRoom.requests.back() == "A=1 O=00 R=1"; }, 2000));
+  runFor(500);
+  CHECK_EQ(lastValue("SPH"), std::string("70"));
+}
+
+TEST(follows_the_hvac_stages) {
+  livingRoom.stages[Tr40::H1] = true;
+  CHECK(runUntil([] { return lastValue("action") == "H1"; }, 30000));
+  livingRoom.stages[Tr40::H2] = true;
+  CHECK(runUntil([] { return lastValue("action") == "H2"; }, 30000));
+  livingRoom.stages[Tr40::H1] = false;
+  livingRoom.stages[Tr40::H2] = false;
+  CHECK(runUntil([] { return lastValue("action") == "I"; }, 30000));
+}
+
+TEST(retries_when_replies_are_lost) {
+  livingRoom.dropRate = 0.3;
+  livingRoom.corruptRate = 0.1;
+  unsigned long retries = transactions.retriesSent;
+  livingRoom.temp = 75;
+  CHECK(runUntil([] { return lastValue("T") == "75"; }, 120000));
+  runFor(120000);
+  CHECK(transactions.retriesSent > retries);
+  CHECK(livingRoom.dropped > 0);
+  livingRoom.dropRate = 0;
+  livingRoom.corruptRate = 0;
+  livingRoom.temp = 73;
+  CHECK(runUntil([] { return lastValue("T") == "73"; }, 60000));
+}
+
+TEST(stays_on_the_bus_while_the_broker_is_down) {
+  broker.stop();
+  size_t polls = livingRoom.requests.size();
+  livingRoom.temp = 71;
+  runFor(60000);
+  CHECK(livingRoom.requests.size() > polls);
+  broker.start();
+  CHECK(runUntil([] { return broker.session && lastValue("T") == "71"; }, 70000));
+}
@@ -0,0 +1,143 @@
+/* ************************ RS485 framer tests ************************
+ * FrameReader fed byte streams split at every point and with each line ending,
+ * the line length cap, and the receive ring.
+ */
+#include "main.cpp"
+#include "harness.h"
+
+#include <string>
+#include <vector>
+
+using namespace host;
+
+Tr40 livingRoom("1");
+
+namespace {
+
+//Feeds a stream to a reader in chunks of a given size, as bytes trickle in between passes
+std::vector<std::string> frame(FrameReader& reader, const std::string& stream, size_t chunk) {
+  std::vector<std::string> frames;
+  for (size_t start = 0; start < stream.size(); start += chunk) {
+    for (size_t i = start; i < std::min(stream.size(), start + chunk); i++) {
+      if (reader.push(stream[i])) {
+        frames.push_back(std::string(reader.buffer, reader.length));
+      }
+    }
+  }
+  return frames;
+}
+
+}  // namespace
+
+TEST(each_line_ending_ends_a_frame) {
+  static const char* const endings[] = {"\r", "\n", "\r\n"};
+  for (const char* ending : endings) {
+    char buffer[64];
+    FrameReader reader(buffer, sizeof(buffer));
+    std::string stream = std::string("A=00 O=1 T=77") + ending + "A=00 O=1 T=78" + ending;
+    std::vector<std::string> frames = frame(reader, stream, stream.size());
+    CHECK_EQ(frames.size(), (size_t)2);
+    if (frames.size() == 2) {
+      CHECK_STR(frames[0].c_str(), "A=00 O=1 T=77");
+      CHECK_STR(frames[1].c_str(), "A=00 O=1 T=78");
+    }
+  }
+}
+
+TEST(frames_split_at_any_point_come_out_whole) {
+  const std::string stream = "A=00 O=1 OA=88 T=77\r\nA=00 O=1 H1A=1\rA=00 O=1 M=H\n";
+  for (size_t chunk = 1; chunk <= stream.size(); chunk++) {
+    char buffer[64];
+    FrameReader reader(buffer, sizeof(buffer));
+    std::vector<std::string> frames = frame(reader, stream, chunk);
+    CHECK_EQ(frames.size(), (size_t)3);
+    if (frames.size() == 3) {
+      CHECK_STR(frames[0].c_str(), "A=00 O=1 OA=88 T=77");
+      CHECK_STR(frames[1].c_str(), "A=00 O=1 H1A=1");
+      CHECK_STR(frames[2].c_str(), "A=00 O=1 M=H");
+    }
+  }
+}
+
+TEST(empty_lines_are_skipped) {
+  char buffer[64];
+  FrameReader reader(buffer, sizeof(buffer));
+  std::vector<std::string> frames = frame(reader, "\r\n\n\rA=00 O=1\r\r\n\n", 1);
+  CHECK_EQ(frames.size(), (size_t)1);
+  CHECK_EQ(reader.overflows, 0UL);
+}
+
+TEST(frames_are_null_terminated) {
+  char buffer[16];
+  memset(buffer, 'x', sizeof(buffer));
+  FrameReader reader(buffer, sizeof(buffer));
+  for (char c : std::string("T=77\r")) {
+    reader.push(c);
+  }
+  CHECK(reader.complete);
+  CHECK_EQ(reader.length, (size_t)4);
+  CHECK_EQ(buffer[4], '\0');
+}
+
+TEST(a_line_that_fits_exactly_is_kept) {
+  char buffer[8];
+  FrameReader reader(buffer, sizeof(buffer));
+  //Seven characters and the terminator fill the buffer
+  std::vector<std::string> frames = frame(reader, "1234567\r", 1);
+  CHECK_EQ(frames.size(), (size_t)1);
+  CHECK_EQ(reader.overflows, 0UL);
+}
+
+TEST(overlong_lines_are_dropped_up_to_the_line_end) {
+  char buffer[8];
+  FrameReader reader(buffer, sizeof(buffer));
+  std::vector<std::string> frames = frame(reader, "12345678901234\r\nT=77\r\n", 3);
+  CHECK_EQ(frames.size(), (size_t)1);
+  if (frames.size() == 1) {
+    CHECK_STR(frames[0].c_str(), "T=77");
+  }
+  CHECK_EQ(reader.overflows, 1UL);
+  frames = frame(reader, "abcdefghijkl\rmnopqrstuvw\nT=1\r", 5);
+  CHECK_EQ(frames.size(), (size_t)1);
+  CHECK_EQ(reader.overflows, 3UL);
+}
+
+TEST(the_ring_keeps_order_and_refuses_when_full) {
+  RingBuffer<int, 8> ring;
+  CHECK(ring.empty());
+  for (int i = 0; i < 8; i++) {
+    CHECK(ring.push(i));
+  }
+  CHECK(ring.full());
+  CHECK(!ring.push(8));
+  int value = -1;
+  for (int i = 0; i < 8; i++) {
+    CHECK(ring.pop(value));
+    CHECK_EQ(value, i);
+  }
+  CHECK(!ring.pop(value));
+  CHECK(ring.empty());
+}
+
+TEST(the_ring_wraps_around) {
+  RingBuffer<char, 4> ring;
+  char value = 0;
+  for (int i = 0; i < 1000; i++) {
+    CHECK(ring.push((char)i));
+    CHECK(ring.push((char)(i + 1)));
+    CHECK(ring.pop(value));
+    CHECK_EQ(value, (char)i);
+    CHECK(ring.pop(value));
+    CHECK_EQ(value, (char)(i + 1));
+  }
+  CHECK_EQ(ring.size(), (size_t)0);
+}
+
+TEST(the_bridge_takes_a_reply_that_trickles_in) {
+  //A reply at 9600 baud arrives a byte every millisecond over several passes of loop()
+  startBridge(livingRoom);
+  livingRoom.temp = 81;
+  unsigned long overflows = rxFrame.overflows;
+  CHECK(runUntil([] { return lastValue("T") == "81"; }, 120000));
+  CHECK_EQ(rxFrame.overflows, overflows);
+}
@@ -0,0 +1,479 @@
+/* ************************ Linux gateway tests ************************
+ * The gateway binary run end to end as its own process. Its serial port is the
+ * slave side of a pty with a TR40 emulator on the master side, and its broker is a
+ * minimal MQTT broker on a loopback port in this process. It has to poll, publish
+ * and reconnect like the ESP32 does, write the bus to its capture file, hand a
+ * command to the bus within a millisecond and use next to no CPU while it waits.
+ */
+#include "capture.h"
+#include "check.h"
+#include "mqtt.h"
+#include "tr40.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace host;
+
+namespace {
+
+const std::string prefix = "casa_de_bemo/living_room/rcs_tr40_thermostat";
+//Where the gateway writes its capture, in the directory the test runs in
+const char* const capturePath = "test_gateway.capture";
+//The directions in a capture record, CAPTURE_RX and CAPTURE_TX in main.cpp
+const uint8_t RECEIVED = 0;
+const uint8_t SENT = 1;
+
+uint64_t wallMicros() {
+  timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec * 1000000ULL + time.tv_nsec / 1000;
+}
+
+/**
+ * @brief An MQTT broker for one client on a loopback port. It takes QoS 0 only,
+ * keeps everything published to it and can send to its client's subscriptions.
+ */
+class MiniBroker {
+ public:
+  struct Message {
+    std::string topic;
+    std::string payload;
+    bool retained;
+    uint64_t at;
+  };
+
+  uint16_t port = 0;
+  bool session = false;
+  unsigned long connects = 0;
+  //The will the client registered with its last CONNECT, an empty topic for none
+  Message will;
+  std::vector<Message> published;
+  std::vector<std::string> subscriptions;
+
+  bool start() {
+    listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t size = sizeof(address);
+    if (listener < 0 || bind(listener, (sockaddr*)&address, size) != 0 || listen(listener, 1) != 0 ||
+        getsockname(listener, (sockaddr*)&address, &size) != 0) {
+      return false;
+    }
+    port = ntohs(address.sin_port);
+    return true;
+  }
+
+  void descriptors(std::vector<pollfd>& fds) {
+    fds.push_back(pollfd{listener, POLLIN, 0});
+    if (client >= 0) {
+      fds.push_back(pollfd{client, POLLIN, 0});
+    }
+  }
+
+  void service() {
+    int accepted = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (accepted >= 0) {
+      drop();
+      client = accepted;
+    }
+    char chunk[512];
+    ssize_t count = -1;
+    while (client >= 0 && (count = recv(client, chunk, sizeof(chunk), 0)) != 0) {
+      if (count < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+          drop();
+        }
+        break;
+      }
+      received.append(chunk, count);
+    }
+    mqtt::Packet packet;
+    bool malformed;
+    while (client >= 0 && mqtt::take(received, packet, malformed)) {
+      handle(packet);
+    }
+    if (count == 0) {
+      drop();
+    }
+  }
+
+  void send(const std::string& topic, const std::string& payload) {
+    write(mqtt::publish(topic, payload, false));
+  }
+
+  //Closes the client's connection, as a broker restart would
+  void drop() {
+    if (client >= 0) {
+      close(client);
+      client = -1;
+    }
+    session = false;
+    received.clear();
+  }
+
+  const Message* last(const std::string& topic) const {
+    for (auto it = published.rbegin(); it != published.rend(); ++it) {
+      if (it->topic == topic) {
+        return &*it;
+      }
+    }
+    return NULL;
+  }
+
+  bool subscribed(const std::string& filter) const {
+    return std::find(subscriptions.begin(), subscriptions.end(), filter) != subscriptions.end();
+  }
+
+ private:
+  int listener = -1;
+  int client = -1;
+  std::string received;
+
+  void write(const std::string& bytes) {
+    if (client >= 0 && ::send(client, bytes.data(), bytes.size(), MSG_NOSIGNAL) != (ssize_t)bytes.size()) {
+      drop();
+    }
+  }
+
+  void handle(const mqtt::Packet& packet) {
+    std::string reply;
+    size_t at = 0;
+    switch (packet.type()) {
+      case mqtt::CONNECT: {
+        session = true;
+        connects ++;
+        subscriptions.clear();
+        //The protocol name, level, flags and keep alive, then the client id and the will
+        std::string skip;
+        at = 0;
+        uint8_t flags = 0;
+        if (mqtt::readString(packet.body, at, skip) && at + 4 <= packet.body.size()) {
+          flags = (uint8_t)packet.body[at + 1];
+          at += 4;
+        }
+        will = Message();
+        if (mqtt::readString(packet.body, at, skip) && (flags & 0x04)) {
+          mqtt::readString(packet.body, at, will.topic);
+          mqtt::readString(packet.body, at, will.payload);
+          will.retained = (flags & 0x20) != 0;
+        }
+        mqtt::append(reply, mqtt::CONNACK << 4, std::string("\0\0", 2));
+        break;
+      }
+      case mqtt::SUBSCRIBE: {
+        std::string granted = packet.body.substr(0, 2);
+        std::string filter;
+        for (at = 2; mqtt::readString(packet.body, at, filter) && at < packet.body.size(); at++) {
+          subscriptions.push_back(filter);
+          granted += '\0';
+        }
+        mqtt::append(reply, mqtt::SUBACK << 4, granted);
+        break;
+      }
+      case mqtt::PUBLISH: {
+        Message message;
+        if (!mqtt::readString(packet.body, at, message.topic)) {
+          break;
+        }
+        message.payload = packet.body.substr(at);
+        message.retained = (packet.header & 1) != 0;
+        message.at = wallMicros();
+        published.push_back(message);
+        break;
+      }
+      case mqtt::PINGREQ:
+        mqtt::append(reply, mqtt::PINGRESP << 4, "");
+        break;
+      case mqtt::DISCONNECT:
+        drop();
+        break;
+      default:
+        break;
+    }
+    write(reply);
+  }
+};
+
+/**
+ * @brief The RS485 segment as a pty. The gateway has the slave side, the emulator
+ * answers on the master side after its turnaround time.
+ */
+class PtyBus {
+ public:
+  struct Frame {
+    std::string text;
+    //When its first byte was read
+    uint64_t at;
+  };
+
+  std::string slavePath;
+  std::vector<Frame> frames;
+  //When a frame last went either way
+  uint64_t lastActivity = 0;
+
+  explicit PtyBus(Tr40& device) : device(device) {}
+
+  bool open() {
+    char path[64];
+    //The slave stays open here too, so the master never sees a hang up while the
+    //gateway opens and closes it
+    if (openpty(&master, &slave, path, NULL, NULL) != 0) {
+      return false;
+    }
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    slavePath = path;
+    return true;
+  }
+
+  void descriptors(std::vector<pollfd>& fds) {
+    fds.push_back(pollfd{master, POLLIN, 0});
+  }
+
+  //How long until the next reply is due, in milliseconds
+  int untilDue() const {
+    if (replies.empty()) {
+      return 1000;
+    }
+    uint64_t time = wallMicros();
+    return replies.front().first <= time ? 0 : (int)((replies.front().first - time + 999) / 1000);
+  }
+
+  bool quiet(uint64_t micros) const {
+    return replies.empty() && line.empty() && wallMicros() - lastActivity >= micros;
+  }
+
+  void service() {
+    char chunk[256];
+    ssize_t count;
+    while ((count = read(master, chunk, sizeof(chunk))) > 0) {
+      uint64_t time = wallMicros();
+      for (ssize_t i = 0; i < count; i++) {
+        if (chunk[i] != '\r' && chunk[i] != '\n') {
+          if (line.empty()) {
+            lineStart = time;
+          }
+          line += chunk[i];
+          continue;
+        }
+        if (!line.empty()) {
+          frames.push_back(Frame{line, lineStart});
+          lastActivity = time;
+          std::string reply = device.handle(line);
+          if (!reply.empty()) {
+            replies.push_back(std::make_pair(time + device.turnaround, reply));
+          }
+          line.clear();
+        }
+      }
+    }
+    while (!replies.empty() && replies.front().first <= wallMicros()) {
+      ssize_t written = write(master, replies.front().second.data(), replies.front().second.size());
+      (void)written;
+      replies.erase(replies.begin());
+      lastActivity = wallMicros();
+    }
+  }
+
+ private:
+  Tr40& device;
+  int master = -1;
+  int slave = -1;
+  std::string line;
+  uint64_t lineStart = 0;
+  std::vector<std::pair<uint64_t, std::string>> replies;
+};
+
+Tr40 livingRoom("1");
+PtyBus serialBus(livingRoom);
+MiniBroker tcpBroker;
+pid_t gateway = -1;
+
+//Serves the bus and the broker until something happens or the next reply is due
+void serve() {
+  std::vector<pollfd> fds;
+  serialBus.descriptors(fds);
+  tcpBroker.descriptors(fds);
+  poll(fds.data(), fds.size(), std::min(serialBus.untilDue(), 10));
+  serialBus.service();
+  tcpBroker.service();
+}
+
+void runFor(unsigned long ms) {
+  uint64_t end = wallMicros() + ms * 1000ULL;
+  while (wallMicros() < end) {
+    serve();
+  }
+}
+
+template <typename Condition>
+bool runUntil(Condition done, unsigned long ms) {
+  uint64_t end = wallMicros() + ms * 1000ULL;
+  while (!done()) {
+    if (wallMicros() >= end) {
+      return false;
+    }
+    serve();
+  }
+  return true;
+}
+
+std::string lastValue(const std::string& key) {
+  const MiniBroker::Message* message = tcpBroker.last(prefix + "/" + key);
+  return message != NULL ? message->payload : std::string();
+}
+
+//The gateway's CPU time so far in milliseconds, and how often it has given up the CPU
+unsigned long cpuTime() {
+  std::ifstream stat("/proc/" + std::to_string(gateway) + "/stat");
+  std::string text((std::istreambuf_iterator<char>(stat)), std::istreambuf_iterator<char>());
+  size_t end = text.rfind(')');
+  if (end == std::string::npos) {
+    return 0;
+  }
+  unsigned long user = 0;
+  unsigned long system = 0;
+  //utime and stime are the 14th and 15th fields, the 12th and 13th after the name
+  sscanf(text.c_str() + end + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &user, &system);
+  return (user + system) * 1000 / sysconf(_SC_CLK_TCK);
+}
+
+unsigned long voluntarySwitches() {
+  std::ifstream status("/proc/" + std::to_string(gateway) + "/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 24, "voluntary_ctxt_switches:") == 0) {
+      return strtoul(line.c_str() + 24, NULL, 10);
+    }
+  }
+  return 0;
+}
+
+struct StopGateway {
+  ~StopGateway() {
+    if (gateway > 0) {
+      kill(gateway, SIGTERM);
+      waitpid(gateway, NULL, 0);
+    }
+  }
+} stopGateway;
+
+}  // namespace
+
+TEST(the_gateway_connects_and_subscribes) {
+  CHECK(serialBus.open());
+  CHECK(tcpBroker.start());
+  gateway = fork();
+  if (gateway == 0) {
+    int null = ::open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    std::string address = "127.0.0.1:" + std::to_string(tcpBroker.port);
+    execl(GATEWAY_PATH, GATEWAY_PATH, "--serial", serialBus.slavePath.c_str(), "--broker", address.c_str(),
+          "--capture", capturePath, (char*)NULL);
+    _exit(127);
+  }
+  CHECK(gateway > 0);
+  CHECK(runUntil([] { return tcpBroker.subscribed(prefix + "/+/set"); }, 5000));
+  CHECK(runUntil([] { return tcpBroker.subscribed("homeassistant/status"); }, 1000));
+  CHECK(runUntil([] { return lastValue("availability") == "available"; }, 2000));
+  //The broker marks the bridge offline if the connection goes
+  CHECK_EQ(tcpBroker.will.topic, prefix + "/status/LWT");
+  CHECK_EQ(tcpBroker.will.payload, std::string("Disconnected"));
+  CHECK(tcpBroker.will.retained);
+}
+
+TEST(polls_go_out_on_the_serial_port_and_status_is_published) {
+  //The first R=1 goes out a poll period after the bridge starts, half a period after R=2
+  CHECK(runUntil([] { return lastValue("T") == "72"; }, 25000));
+  std::vector<std::string> expected = {"A=1 O=00 R=2", "A=1 O=00 R=1"};
+  CHECK(livingRoom.requests == expected);
+  CHECK(runUntil([] { return lastValue("SPH") == "68" && lastValue("M") == "H"; }, 1000));
+  CHECK_EQ(lastValue("action"), std::string("I"));
+}
+
+TEST(every_frame_on_the_bus_is_written_to_the_capture_file) {
+  std::vector<capture::Record> records;
+  CHECK(capture::readFile(capturePath, records));
+  //The polls and the replies to them, in the order they were on the bus
+  CHECK(records.size() >= 4);
+  if (records.size() >= 4) {
+    CHECK_EQ(records[0].direction, SENT);
+    CHECK_EQ(records[0].frame, std::string("A=1 O=00 R=2"));
+    CHECK_EQ(records[1].direction, RECEIVED);
+    CHECK_EQ(records[1].frame.compare(0, 9, "A=00 O=1 "), 0);
+    CHECK_EQ(records[2].frame, std::string("A=1 O=00 R=1"));
+    CHECK(records[3].frame.find("T=72") != std::string::npos);
+    CHECK(records[0].time <= records[3].time);
+  }
+}
+
+TEST(commands_reach_the_bus_within_a_millisecond) {
+  std::vector<uint64_t> latencies;
+  for (int i = 0; i < 9; i++) {
+    CHECK(runUntil([] { return serialBus.quiet(200000); }, 30000));
+    size_t seen = serialBus.frames.size();
+    uint64_t sent = wallMicros();
+    tcpBroker.send(prefix + "/SPH/set", std::to_string(60 + i));
+    bool written = runUntil([&] {
+      for (size_t frame = seen; frame < serialBus.frames.size(); frame++) {
+        if (serialBus.frames[frame].text.find("SPH=") != std::string::npos) {
+          latencies.push_back(serialBus.frames[frame].at - sent);
+          return true;
+        }
+      }
+      return false;
+    }, 2000);
+    CHECK(written);
+  }
+  CHECK_EQ(livingRoom.setpointHeat, 68);
+  CHECK(runUntil([] { return lastValue("SPH") == "68"; }, 30000));
+  std::sort(latencies.begin(), latencies.end());
+  CHECK_EQ(latencies.size(), (size_t)9);
+  if (latencies.size() == 9) {
+    printf("    set to bus: min %lu us, median %lu us, max %lu us\n", (unsigned long)latencies[0],
+           (unsigned long)latencies[4], (unsigned long)latencies[8]);
+    CHECK(latencies[4] < 1000);
+  }
+}
+
+TEST(the_gateway_sleeps_while_idle) {
+  CHECK(runUntil([] { return serialBus.quiet(200000); }, 30000));
+  unsigned long cpuBefore = cpuTime();
+  unsigned long switchesBefore = voluntarySwitches();
+  runFor(5000);
+  unsigned long cpu = cpuTime() - cpuBefore;
+  unsigned long switches = voluntarySwitches() - switchesBefore;
+  printf("    over 5 s idle: %lu ms CPU, %lu wake ups\n", cpu, switches);
+  //Under 1% of a core, and woken by the timer, the polls and their replies only
+  CHECK(cpu <= 50);
+  CHECK(switches < 100);
+}
+
+TEST(the_gateway_reconnects_after_the_broker_drops_it) {
+  unsigned long connects = tcpBroker.connects;
+  tcpBroker.drop();
+  CHECK(runUntil([&] { return tcpBroker.connects == connects + 1 && tcpBroker.subscribed(prefix + "/+/set"); }, 5000));
+  size_t published = tcpBroker.published.size();
+  CHECK(runUntil([&] {
+    for (size_t i = published; i < tcpBroker.published.size(); i++) {
+      if (tcpBroker.published[i].topic == prefix + "/availability") {
+        return true;
+      }
+    }
+    return false;
+  }, 2000));
+}
@@ -0,0 +1,137 @@
+/* ************************ Logger tests ************************
+ * The leveled logger built with INFO and DEBUG compiled out: stripped and disabled
+ * calls never evaluate their arguments, the ring keeps the newest records in order,
+ * and the debug topic sets the serial level and dumps the ring over MQTT.
+ */
+//Built as a release would be, with only errors and warnings compiled in
+#define LOG_COMPILED_LEVEL     LOG_LEVEL_WARN
+
+#include "main.cpp"
+#include "harness.h"
+
+#include <string>
+#include <vector>
+
+using namespace host;
+
+Tr40 livingRoom("1");
+
+namespace {
+
+int evaluations = 0;
+
+int evaluate() {
+  return ++ evaluations;
+}
+
+//The text of the newest record
+std::string newest() {
+  unsigned long kept = logger.kept.load();
+  return kept > 0 ? logger.records[(kept - 1) % LOG_RING_SIZE].text : "";
+}
+
+}  // namespace
+
+TEST(levels_above_the_compiled_level_are_stripped) {
+  logger.ringLevel = LOG_LEVEL_DEBUG;
+  logger.serialLevel = LOG_LEVEL_DEBUG;
+  unsigned long kept = logger.kept.load();
+  evaluations = 0;
+  LOG_INFO("info %d", evaluate());
+  LOG_DEBUG("debug %d", evaluate());
+  CHECK_EQ(evaluations, 0);
+  CHECK_EQ(logger.kept.load(), kept);
+  logger.ringLevel = LOG_RING_LEVEL;
+  logger.serialLevel = LOG_LEVEL_NONE;
+}
+
+TEST(disabled_levels_do_not_evaluate_their_arguments) {
+  logger.ringLevel = LOG_LEVEL_ERROR;
+  unsigned long kept = logger.kept.load();
+  evaluations = 0;
+  LOG_WARN("warn %d", evaluate());
+  CHECK_EQ(evaluations, 0);
+  CHECK_EQ(logger.kept.load(), kept);
+  LOG_ERROR("error %d", evaluate());
+  CHECK_EQ(evaluations, 1);
+  CHECK_EQ(logger.kept.load(), kept + 1);
+  CHECK_EQ(newest(), std::string("error 1"));
+  logger.ringLevel = LOG_RING_LEVEL;
+}
+
+TEST(the_ring_keeps_the_newest_records_in_order) {
+  unsigned long first = logger.kept.load();
+  for (int i = 0; i < LOG_RING_SIZE + 5; i++) {
+    LOG_WARN("record %d", i);
+  }
+  unsigned long kept = logger.kept.load();
+  CHECK_EQ(kept - first, (unsigned long)LOG_RING_SIZE + 5);
+  for (unsigned long i = kept - LOG_RING_SIZE; i < kept; i++) {
+    const Logger::Record& record = logger.records[i % LOG_RING_SIZE];
+    CHECK_EQ(std::string(record.text), "record " + std::to_string(i - first));
+    CHECK_EQ(record.level, (uint8_t)LOG_LEVEL_WARN);
+  }
+}
+
+TEST(records_are_stamped_and_cut_to_length) {
+  advance(1234000);
+  std::string longText(LOG_RECORD_LENGTH * 2, 'x');
+  LOG_ERROR("%s", longText.c_str());
+  const Logger::Record& record = logger.records[(logger.kept.load() - 1) % LOG_RING_SIZE];
+  CHECK_EQ(strlen(record.text), (size_t)LOG_RECORD_LENGTH - 1);
+  CHECK_EQ(record.time, millis());
+  CHECK_EQ(record.level, (uint8_t)LOG_LEVEL_ERROR);
+}
+
+TEST(serial_levels_are_parsed_from_the_debug_payload) {
+  CHECK(logger.setSerialLevel("on"));
+  CHECK_EQ(logger.serialLevel.load(), (uint8_t)LOG_LEVEL_DEBUG);
+  CHECK(logger.setSerialLevel("warn"));
+  CHECK_EQ(logger.serialLevel.load(), (uint8_t)LOG_LEVEL_WARN);
+  CHECK(logger.setSerialLevel("INFO"));
+  CHECK_EQ(logger.serialLevel.load(), (uint8_t)LOG_LEVEL_INFO);
+  CHECK(!logger.setSerialLevel("loud"));
+  CHECK_EQ(logger.serialLevel.load(), (uint8_t)LOG_LEVEL_INFO);
+  CHECK(logger.setSerialLevel("off"));
+  CHECK_EQ(logger.serialLevel.load(), (uint8_t)LOG_LEVEL_NONE);
+  //The serial level does not change what the ring keeps
+  CHECK(logger.enabled(LOG_LEVEL_INFO));
+  CHECK(!logger.enabled(LOG_LEVEL_DEBUG));
+}
+
+TEST(the_debug_topic_sets_the_level) {
+  startBridge(livingRoom);
+  broker.send(bridgeTopicOf(debugMode), "error");
+  runFor(100);
+  CHECK_EQ(logger.serialLevel.load(), (uint8_t)LOG_LEVEL_ERROR);
+  broker.send(bridgeTopicOf(debugMode), "loud");
+  runFor(100);
+  CHECK_EQ(logger.serialLevel.load(), (uint8_t)LOG_LEVEL_ERROR);
+  CHECK_EQ(newest(), std::string("Unknown debug level loud"));
+  broker.send(bridgeTopicOf(debugMode), "off");
+  runFor(100);
+  CHECK_EQ(logger.serialLevel.load(), (uint8_t)LOG_LEVEL_NONE);
+}
+
+TEST(the_ring_is_dumped_over_mqtt_oldest_first) {
+  LOG_WARN("last before the dump");
+  unsigned long kept = logger.kept.load();
+  broker.clear();
+  broker.send(bridgeTopicOf(debugMode), "dump");
+  runFor(100);
+  std::vector<std::string> dumped;
+  for (const Broker::Message& message : broker.snapshot()) {
+    if (message.topic == bridgeTopicOf(logTopic)) {
+      dumped.push_back(message.payload);
+    }
+  }
+  CHECK_EQ(dumped.size(), (size_t)LOG_RING_SIZE);
+  if (dumped.empty()) {
+    return;
+  }
+  //Each is "<time> <level> <text>"
+  const Logger::Record& oldest = logger.records[(kept - LOG_RING_SIZE) % LOG_RING_SIZE];
+  CHECK_EQ(dumped.front(), std::to_string(oldest.time) + " " + Logger::levelName(oldest.level) + " " + oldest.text);
+  const std::string& last = dumped.back();
+  CHECK(last.size() > 25 && last.compare(last.size() - 25, 25, "WARN last before the dump") == 0);
+}
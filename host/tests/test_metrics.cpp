@@ -0,0 +1,272 @@
+/* ************************ Metrics and diagnostics tests ************************
+ * The power of two histograms behind the latency figures, and the retained diag
+ * document the bridge publishes from them: well formed JSON with every figure, and
+ * counters that move when the bus misbehaves.
+ */
+#include "main.cpp"
+#include "harness.h"
+#include "json.h"
+
+#include <string>
+
+using namespace host;
+
+Tr40 livingRoom("1");
+
+namespace {
+
+const char* const diagKeys[] = {
+  "uptime", "rtt", "parse", "callback", "retries", "timeouts", "malformed", "foreign",
+  "overlong", "publishFailed", "reconnects", "idle", "outboundFull", "packedWrites", "suppressed",
+  "bufferDropped",
+};
+const char* const histogramKeys[] = {"n", "p50", "p95", "p99", "max"};
+
+//Parses the retained diag document, an empty object when there is none or it is not valid
+Json diagnostics() {
+  Json document;
+  std::string error;
+  auto retained = broker.retained.find(bridgeTopicOf(diagnosticsTopic));
+  if (retained == broker.retained.end() || !Json::parse(retained->second.payload, document, error)) {
+    return Json();
+  }
+  return document;
+}
+
+Json histogramJson(const Histogram& histogram) {
+  char buffer[96];
+  histogram.toJson(buffer, sizeof(buffer));
+  Json document;
+  std::string error;
+  Json::parse(buffer, document, error);
+  return document;
+}
+
+}  // namespace
+
+TEST(values_land_in_power_of_two_buckets) {
+  Histogram histogram;
+  histogram.record(0);
+  histogram.record(1);
+  histogram.record(2);
+  histogram.record(3);
+  histogram.record(4);
+  histogram.record(1023);
+  histogram.record(1024);
+  CHECK_EQ(histogram.counts[0], 1UL);
+  CHECK_EQ(histogram.counts[1], 1UL);
+  CHECK_EQ(histogram.counts[2], 2UL);
+  CHECK_EQ(histogram.counts[3], 1UL);
+  CHECK_EQ(histogram.counts[10], 1UL);
+  CHECK_EQ(histogram.counts[11], 1UL);
+  CHECK_EQ(histogram.samples, 7UL);
+  CHECK_EQ(histogram.max, 1024UL);
+}
+
+TEST(values_past_the_last_bucket_are_kept_in_it) {
+  Histogram histogram;
+  histogram.record(1UL << 30);
+  histogram.record(ULONG_MAX);
+  CHECK_EQ(histogram.counts[HISTOGRAM_BUCKETS - 1], 2UL);
+  CHECK_EQ(histogram.max, ULONG_MAX);
+  CHECK_EQ(histogram.percentile(50), (1UL << (HISTOGRAM_BUCKETS - 1)) - 1);
+}
+
+TEST(percentiles_are_bucket_upper_bounds) {
+  Histogram histogram;
+  //90 samples near 100 us and 10 near 5 ms
+  for (int i = 0; i < 90; i++) {
+    histogram.record(100);
+  }
+  for (int i = 0; i < 10; i++) {
+    histogram.record(5000);
+  }
+  CHECK_EQ(histogram.percentile(50), 127UL);
+  CHECK_EQ(histogram.percentile(90), 127UL);
+  CHECK_EQ(histogram.percentile(95), 5000UL);
+  CHECK_EQ(histogram.percentile(100), 5000UL);
+}
+
+TEST(percentiles_are_clamped_to_the_largest_value) {
+  Histogram histogram;
+  histogram.record(65);
+  histogram.record(70);
+  //The bucket runs to 127 but nothing above 70 was seen
+  CHECK_EQ(histogram.percentile(50), 70UL);
+  CHECK_EQ(histogram.percentile(99), 70UL);
+}
+
+TEST(an_empty_histogram_reports_zero) {
+  Histogram histogram;
+  CHECK_EQ(histogram.percentile(50), 0UL);
+  CHECK_EQ(histogram.percentile(99), 0UL);
+  Json document = histogramJson(histogram);
+  CHECK_EQ(document.type, Json::OBJECT);
+  CHECK_EQ(document["n"].number, 0.0);
+  CHECK_EQ(document["max"].number, 0.0);
+}
+
+TEST(a_histogram_writes_a_json_object) {
+  Histogram histogram;
+  for (unsigned long value = 1; value <= 1000; value++) {
+    histogram.record(value * 1000);
+  }
+  Json document = histogramJson(histogram);
+  CHECK_EQ(document.type, Json::OBJECT);
+  CHECK_EQ(document.members.size(), sizeof(histogramKeys) / sizeof(histogramKeys[0]));
+  for (const char* key : histogramKeys) {
+    CHECK_EQ(document[key].type, Json::NUMBER);
+  }
+  CHECK_EQ(document["n"].number, 1000.0);
+  CHECK_EQ(document["max"].number, 1000000.0);
+  CHECK(document["p50"].number <= document["p95"].number);
+  CHECK(document["p95"].number <= document["p99"].number);
+  CHECK(document["p99"].number <= document["max"].number);
+}
+
+TEST(the_json_reader_rejects_broken_documents) {
+  Json document;
+  std::string error;
+  CHECK(Json::parse("{\"a\":[1,2.5e3,-0],\"b\":\"x\\\"y\",\"c\":null,\"d\":true}", document, error));
+  CHECK(!Json::parse("{\"a\":1,}", document, error));
+  CHECK(!Json::parse("{a:1}", document, error));
+  CHECK(!Json::parse("{\"a\":01}", document, error));
+  CHECK(!Json::parse("{\"a\":1}}", document, error));
+  CHECK(!Json::parse("{\"a\":1,\"a\":2}", document, error));
+  CHECK(!Json::parse("\"a\tb\"", document, error));
+}
+
+TEST(the_diag_document_is_published_retained) {
+  startBridge(livingRoom);
+  CHECK(runUntil([] { return broker.retained.count(bridgeTopicOf(diagnosticsTopic)) != 0; },
+                 DIAG_PERIOD + 5000));
+  CHECK(broker.retained[bridgeTopicOf(diagnosticsTopic)].retained);
+  size_t count = broker.count(bridgeTopicOf(diagnosticsTopic));
+  runFor(DIAG_PERIOD);
+  CHECK_EQ(broker.count(bridgeTopicOf(diagnosticsTopic)), count + 1);
+}
+
+TEST(the_diag_document_is_valid_json_with_every_figure) {
+  std::string payload = broker.retained[bridgeTopicOf(diagnosticsTopic)].payload;
+  Json document;
+  std::string error;
+  CHECK(Json::parse(payload, document, error));
+  if (!error.empty()) {
+    fprintf(stderr, "    %s in %s\n", error.c_str(), payload.c_str());
+  }
+  CHECK_EQ(document.type, Json::OBJECT);
+  CHECK_EQ(document.members.size(), sizeof(diagKeys) / sizeof(diagKeys[0]));
+  for (const char* key : diagKeys) {
+    CHECK(document.has(key));
+  }
+  for (const char* histogram : {"rtt", "parse", "callback"}) {
+    CHECK_EQ(document[histogram].type, Json::OBJECT);
+    for (const char* key : histogramKeys) {
+      CHECK_EQ(document[histogram][key].type, Json::NUMBER);
+    }
+  }
+  CHECK(document["uptime"].number >= DIAG_PERIOD / 1000);
+}
+
+TEST(a_diag_document_that_fails_to_publish_is_counted) {
+  unsigned long failed = failedPublishes;
+  size_t count = broker.count(bridgeTopicOf(diagnosticsTopic));
+  //Too small for the document, as a full PubSubClient buffer would be
+  uint16_t bufferSize = client.bufferSize;
+  client.setBufferSize(64);
+  publishDiagnostics();
+  client.setBufferSize(bufferSize);
+  CHECK_EQ(broker.count(bridgeTopicOf(diagnosticsTopic)), count);
+  CHECK_EQ(failedPublishes, failed + 1);
+  //And reported in the next one
+  runFor(DIAG_PERIOD);
+  CHECK(diagnostics()["publishFailed"].number >= failed + 1);
+}
+
+TEST(round_trips_and_parse_times_are_measured) {
+  Json document = diagnostics();
+  CHECK(document["rtt"]["n"].number > 0);
+  CHECK(document["parse"]["n"].number > 0);
+  //A round trip is at least the request and the reply on the wire at 9600 baud
+  CHECK(document["rtt"]["p50"].number > 10000);
+  CHECK_EQ(document["timeouts"].number, 0.0);
+  CHECK(document["idle"].number > 0);
+}
+
+TEST(foreign_and_malformed_frames_are_counted) {
+  Json before = diagnostics();
+  uint64_t at = now() + 1000;
+  //Another bridge's device, then noise
+  bus.reply("A=00 O=9 OA=88 Z=1 T=77\r", at);
+  bus.reply("garbage\r", at);
+  runFor(DIAG_PERIOD + 1000);
+  Json after = diagnostics();
+  CHECK_EQ(after["foreign"].number, before["foreign"].number + 1);
+  CHECK_EQ(after["malformed"].number, before["malformed"].number + 1);
+}
+
+TEST(a_callback_is_timed_to_its_command_being_queued) {
+  unsigned long samples = metrics.callbackTime.samples;
+  std::string topic = setTopicOf("SPH");
+  //Nothing is queued for a value out of range, so it is not timed
+  char rejected[] = "200";
+  callback(&topic[0], (byte*)rejected, strlen(rejected));
+  runFor(100);
+  CHECK_EQ(metrics.callbackTime.samples, samples);
+  //Timed from the message arriving, not only the part of callback() it spent
+  char accepted[] = "66";
+  callback(&topic[0], (byte*)accepted, strlen(accepted));
+  CHECK_EQ(metrics.callbackTime.samples, samples);
+  advance(5000);
+  runUntil([&] { return metrics.callbackTime.samples != samples; }, 100);
+  CHECK_EQ(metrics.callbackTime.samples, samples + 1);
+  CHECK(metrics.callbackTime.max >= 5000);
+}
+
+TEST(a_stall_is_kept_with_the_scope_it_spent_longest_in) {
+  LoopProfiler profiler;
+  unsigned long startedAt = millis();
+  profiler.beginPass();
+  advance(1000);
+  profiler.enter(SCOPE_PARSE);
+  advance(STALL_THRESHOLD + 5000);
+  profiler.enter(SCOPE_PUBLISH);
+  advance(500);
+  profiler.endPass();
+  //A pass under the threshold is timed but not kept
+  profiler.beginPass();
+  advance(STALL_THRESHOLD / 2);
+  profiler.endPass();
+  CHECK_EQ(profiler.passTime.samples, 2UL);
+  CHECK_EQ(profiler.stallCount, 1UL);
+  CHECK_EQ(profiler.stalls[0].duration, STALL_THRESHOLD + 6500UL);
+  CHECK_EQ((int)profiler.stalls[0].scope, (int)SCOPE_PARSE);
+  CHECK_EQ(profiler.stalls[0].at, startedAt);
+}
+
+TEST(a_stall_across_the_micros_wrap_keeps_its_length_and_time) {
+  //micros() wraps at 32 bits, about every 71.6 minutes; take a pass across the second wrap
+  wrapMicros(true);
+  uint64_t wrapAt = 2 * (1ULL << 32);
+  advance(wrapAt - 10000 - now());
+  LoopProfiler profiler;
+  unsigned long startedAt = millis();
+  profiler.beginPass();
+  profiler.enter(SCOPE_TX);
+  advance(STALL_THRESHOLD + 10000);
+  CHECK(micros() < profiler.passStart);
+  profiler.endPass();
+  wrapMicros(false);
+  CHECK_EQ(profiler.stallCount, 1UL);
+  CHECK_EQ(profiler.stalls[0].duration, STALL_THRESHOLD + 10000UL);
+  CHECK_EQ((int)profiler.stalls[0].scope, (int)SCOPE_TX);
+  CHECK_EQ(profiler.stalls[0].at, startedAt);
+  CHECK(startedAt > wrapAt / 1000 - 1000);
+  char buffer[512];
+  profiler.toJson(buffer, sizeof(buffer));
+  Json document;
+  std::string error;
+  CHECK(Json::parse(buffer, document, error));
+  CHECK_EQ(document["worst"].items.size(), (size_t)1);
+  CHECK_EQ(document["worst"].items[0]["at"].number, (double)(startedAt / 1000));
+}
@@ -0,0 +1,128 @@
+/* ************************ Multi-device tests ************************
+ * Four thermostats on one simulated bus: polls spread fairly, replies reaching the
+ * right device, writes going ahead of the polls and every device polled at its
+ * full rate.
+ */
+#define THERMOSTAT_LIST \
+  Thermostat("1", "site/zone1", "Zone 1"), \
+  Thermostat("2", "site/zone2", "Zone 2"), \
+  Thermostat("5", "site/zone5", "Zone 5"), \
+  Thermostat("12", "site/zone12", "Zone 12"),
+#include "main.cpp"
+#include "harness.h"
+
+#include <string>
+
+using namespace host;
+
+Tr40 zones[] = {Tr40("1"), Tr40("2"), Tr40("5"), Tr40("12")};
+const uint8_t ZONE_COUNT = sizeof(zones) / sizeof(zones[0]);
+
+namespace {
+
+//The polls each zone has been sent
+size_t polls(uint8_t zone) {
+  size_t count = 0;
+  for (const std::string& request : zones[zone].requests) {
+    count += request.find(" R=") != std::string::npos;
+  }
+  return count;
+}
+
+}  // namespace
+
+TEST(every_device_is_announced) {
+  static_assert(DEVICE_COUNT == 4, "The test list replaces the default one");
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    zones[zone].temp = 70 + zone;
+    zones[zone].setpointHeat = 60 + zone;
+    bus.attach(&zones[zone]);
+  }
+  startBridge();
+  for (uint8_t device = 0; device < DEVICE_COUNT; device++) {
+    CHECK_EQ(lastValue("availability", device), std::string("available"));
+  }
+}
+
+TEST(replies_reach_their_own_device) {
+  CHECK(runUntil([] {
+    for (uint8_t device = 0; device < DEVICE_COUNT; device++) {
+      if (lastValue("T", device).empty() || lastValue("SPH", device).empty()) {
+        return false;
+      }
+    }
+    return true;
+  }, 60000));
+  for (uint8_t device = 0; device < DEVICE_COUNT; device++) {
+    CHECK_EQ(lastValue("T", device), std::to_string(70 + device));
+    CHECK_EQ(lastValue("SPH", device), std::to_string(60 + device));
+    CHECK_EQ(thermostats[device].state.temp, 70 + device);
+  }
+}
+
+TEST(polls_are_spread_fairly) {
+  size_t before[ZONE_COUNT];
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    before[zone] = polls(zone);
+  }
+  const unsigned long window = 600000;
+  runFor(window);
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    size_t count = polls(zone) - before[zone];
+    //Each device gets its full idle poll rate, give or take one poll at the window ends
+    size_t expected = window / R1_POLL_PERIOD + window / R2_POLL_PERIOD;
+    CHECK(count + 1 >= expected && count <= expected + 1);
+  }
+}
+
+TEST(polls_of_different_devices_do_not_bunch_up) {
+  //The devices start at different points of the poll period, so the polls are spread
+  //over the period instead of going out in a burst
+  size_t frames = bus.sent.size();
+  runFor(R1_POLL_PERIOD);
+  uint64_t shortestGap = UINT64_MAX;
+  for (size_t i = frames + 1; i < bus.sent.size(); i++) {
+    shortestGap = std::min(shortestGap, bus.sent[i].at - bus.sent[i - 1].at);
+  }
+  //Two polls per device per period, evenly spaced, less the time a reply takes
+  CHECK(shortestGap >= 1000ULL * R1_POLL_PERIOD / (2 * DEVICE_COUNT) - 200000);
+}
+
+TEST(writes_go_ahead_of_the_polls) {
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    broker.send(setTopicOf("SPC", zone), std::to_string(80 + zone));
+  }
+  CHECK(runUntil([] {
+    for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+      if (zones[zone].setpointCool != 80 + zone) {
+        return false;
+      }
+    }
+    return true;
+  }, 5000));
+  //A write only reaches the device it was for
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    CHECK_EQ(zones[zone].writes, 1UL);
+  }
+  runFor(5000);
+  for (uint8_t device = 0; device < DEVICE_COUNT; device++) {
+    CHECK_EQ(lastValue("SPC", device), std::to_string(80 + device));
+  }
+}
+
+TEST(a_silent_device_does_not_hold_up_the_others) {
+  zones[1].silent = true;
+  size_t before[ZONE_COUNT];
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    before[zone] = polls(zone);
+  }
+  zones[2].temp = 66;
+  runFor(120000);
+  CHECK_EQ(lastValue("T", 2), std::string("66"));
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    if (zone != 1) {
+      CHECK(polls(zone) - before[zone] + 1 >= 120000 / R1_POLL_PERIOD + 120000 / R2_POLL_PERIOD);
+    }
+  }
+  zones[1].silent = false;
+}
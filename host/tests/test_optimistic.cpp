@@ -0,0 +1,161 @@
+/* ************************ Optimistic publish tests ************************
+ * A write to a status field is published as soon as it arrives, then read back
+ * with a single R=1 once the thermostat has answered it. The readback confirms the
+ * value or rolls Home Assistant back to what the thermostat kept, and a write that
+ * goes unanswered is rolled back to the last reported value, or to "unknown" when
+ * the field has not been reported. The readback replaces an R=1 poll already waiting.
+ */
+#include "main.cpp"
+#include "harness.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace host;
+
+Tr40 livingRoom("1");
+
+namespace {
+
+//The requests the thermostat has been sent since a point in its log
+std::vector<std::string> requestsSince(size_t from) {
+  return std::vector<std::string>(livingRoom.requests.begin() + from, livingRoom.requests.end());
+}
+
+}  // namespace
+
+TEST(a_write_is_published_before_it_reaches_the_bus) {
+  startBridge(livingRoom);
+  CHECK(runUntil([] { return !lastValue("T").empty() && !lastValue("action").empty(); }, 60000));
+  size_t log = broker.snapshot().size();
+  uint64_t sentAt = now();
+  broker.send(setTopicOf("SPH"), "70");
+  CHECK(runUntil([] { return lastValue("SPH") == "70"; }, 1000));
+  //Shown in Home Assistant while the thermostat still holds the old value
+  CHECK_EQ(livingRoom.setpointHeat, 68);
+  std::vector<Published> published = publishedSince(log, "SPH");
+  CHECK(!published.empty() && published[0].at - sentAt < 2000);
+  CHECK(runUntil([] { return livingRoom.setpointHeat == 70; }, 2000));
+  runFor(1000);
+}
+
+TEST(the_write_is_read_back_once_and_confirmed) {
+  //Sent while the bus is idle, a poll already on the wire would add its round trip
+  CHECK(runUntil([] { return !transactions.busy(); }, 1000));
+  size_t log = broker.snapshot().size();
+  size_t requests = livingRoom.requests.size();
+  uint64_t sentAt = now();
+  broker.send(setTopicOf("SPC"), "80");
+  CHECK(runUntil([&] { return publishedSince(log, "SPC").size() >= 2; }, 2000));
+  std::vector<Published> published = publishedSince(log, "SPC");
+  CHECK_EQ(published[0].value, std::string("80"));
+  CHECK_EQ(published[1].value, std::string("80"));
+  //The write and the readback straight after it, with no poll between them
+  std::vector<std::string> sent = requestsSince(requests);
+  CHECK(sent.size() >= 2);
+  CHECK_EQ(sent[0], std::string("A=1 O=00 SPC=80"));
+  CHECK_EQ(sent[1], std::string("A=1 O=00 R=1"));
+  //Confirmed within two bus round trips of the command arriving
+  uint64_t confirmed = published[1].at - sentAt;
+  fprintf(stderr, "    confirmed %.1f ms after the command\n", confirmed / 1000.0);
+  CHECK(confirmed < 2 * 2 * livingRoom.turnaround + 100000);
+  runFor(2000);
+  CHECK_EQ(publishedSince(log, "SPC").size(), (size_t)2);
+  CHECK_EQ(livingRoom.setpointCool, 80);
+}
+
+TEST(a_number_with_leading_zeros_is_sent_and_published_in_its_plain_form) {
+  size_t log = broker.snapshot().size();
+  size_t requests = livingRoom.requests.size();
+  broker.send(setTopicOf("SPC"), "079");
+  CHECK(runUntil([&] { return publishedSince(log, "SPC").size() >= 2; }, 2000));
+  std::vector<Published> published = publishedSince(log, "SPC");
+  //The readback reports 79, so Home Assistant never sees 079 change to it
+  CHECK_EQ(published[0].value, std::string("79"));
+  CHECK_EQ(published[1].value, std::string("79"));
+  std::vector<std::string> sent = requestsSince(requests);
+  CHECK(!sent.empty() && sent[0] == "A=1 O=00 SPC=79");
+  //The same for a setpoint resolved from SP in heat mode
+  log = broker.snapshot().size();
+  requests = livingRoom.requests.size();
+  broker.send(setTopicOf("SP"), "0069");
+  CHECK(runUntil([&] { return publishedSince(log, "SPH").size() >= 2; }, 2000));
+  published = publishedSince(log, "SPH");
+  CHECK_EQ(published[0].value, std::string("69"));
+  CHECK_EQ(published[1].value, std::string("69"));
+  sent = requestsSince(requests);
+  CHECK(!sent.empty() && sent[0] == "A=1 O=00 SPH=69");
+  runFor(2000);
+}
+
+TEST(a_write_the_thermostat_ignores_is_rolled_back) {
+  //The TR40 reports the mode I (Invalid) but does not take it as a write
+  size_t log = broker.snapshot().size();
+  size_t requests = livingRoom.requests.size();
+  unsigned long rejected = livingRoom.rejectedWrites;
+  broker.send(setTopicOf("M"), "I");
+  CHECK(runUntil([&] { return publishedSince(log, "M").size() >= 2; }, 2000));
+  std::vector<Published> published = publishedSince(log, "M");
+  CHECK_EQ(published[0].value, std::string("I"));
+  CHECK_EQ(published[1].value, std::string("H"));
+  CHECK_EQ(livingRoom.rejectedWrites, rejected + 1);
+  std::vector<std::string> sent = requestsSince(requests);
+  CHECK(sent.size() >= 2 && sent[1] == "A=1 O=00 R=1");
+  CHECK_EQ(thermostats[0].state.optimistic, 0);
+}
+
+TEST(an_unanswered_write_is_rolled_back) {
+  size_t log = broker.snapshot().size();
+  livingRoom.silent = true;
+  broker.send(setTopicOf("FM"), "1");
+  CHECK(runUntil([&] { return publishedSince(log, "FM").size() >= 2; }, 10000));
+  std::vector<Published> published = publishedSince(log, "FM");
+  CHECK_EQ(published[0].value, std::string("1"));
+  CHECK_EQ(published[1].value, std::string("0"));
+  CHECK_EQ(thermostats[0].state.optimistic, 0);
+  //Only the reply was lost, the thermostat took the write and the next poll says so
+  livingRoom.silent = false;
+  CHECK(runUntil([] { return lastValue("FM") == "1"; }, 30000));
+}
+
+TEST(an_unanswered_write_to_a_field_never_reported_is_rolled_back_to_unknown) {
+  size_t log = broker.snapshot().size();
+  thermostats[0].state.known &= ~(1 << FIELD_FAN_MODE);
+  livingRoom.silent = true;
+  broker.send(setTopicOf("FM"), "0");
+  CHECK(runUntil([&] { return publishedSince(log, "FM").size() >= 2; }, 10000));
+  std::vector<Published> published = publishedSince(log, "FM");
+  CHECK(published.size() >= 2);
+  CHECK_EQ(published[0].value, std::string("0"));
+  CHECK_EQ(published[published.size() - 1].value, std::string("unknown"));
+  livingRoom.silent = false;
+  CHECK(runUntil([] { return lastValue("FM") == "0"; }, 30000));
+}
+
+TEST(the_readback_replaces_a_waiting_poll) {
+  //The R=1 poll is queued behind a request on the bus, and a write lands before it 
+  //is sent. The one R=1 after the write serves both.
+  CHECK(runUntil([] { return transactions.busy(); }, 60000));
+  commandQueue.push(0, "R=1", PRIORITY_POLL);
+  size_t requests = livingRoom.requests.size();
+  broker.send(setTopicOf("SPH"), "69");
+  CHECK(runUntil([] { return lastValue("SPH") == "69" && livingRoom.setpointHeat == 69; }, 2000));
+  runFor(2000);
+  std::vector<std::string> sent = requestsSince(requests);
+  CHECK(sent.size() >= 2);
+  CHECK_EQ(sent[0], std::string("A=1 O=00 SPH=69"));
+  CHECK_EQ(sent[1], std::string("A=1 O=00 R=1"));
+  CHECK_EQ(std::count(sent.begin(), sent.end(), std::string("A=1 O=00 R=1")), 1L);
+}
+
+TEST(the_single_setpoint_is_published_on_the_setpoint_it_sets) {
+  size_t log = broker.snapshot().size();
+  broker.send(setTopicOf("SP"), "71");
+  CHECK(runUntil([&] { return publishedSince(log, "SPH").size() >= 2; }, 2000));
+  std::vector<Published> published = publishedSince(log, "SPH");
+  CHECK_EQ(published[0].value, std::string("71"));
+  CHECK_EQ(published[1].value, std::string("71"));
+  CHECK_EQ(livingRoom.setpointHeat, 71);
+  CHECK(publishedSince(log, "SPC").empty());
+}
@@ -0,0 +1,192 @@
+/* ************************ Status frame parser tests ************************
+ * The key hash, the value decoders and the in place tokenizer, and that parsing a
+ * frame does not allocate.
+ */
+#include "main.cpp"
+#include "harness.h"
+
+#include <new>
+
+using namespace host;
+
+namespace {
+//Every operator new in this test counts, so a parse that allocates is caught
+unsigned long allocations = 0;
+
+//Parses a copy of a frame the way busLoop() does
+void parse(const char* text) {
+  char frame[RX_BUFFER_SIZE];
+  snprintf(frame, sizeof(frame), "%s", text);
+  parseReceived(frame, strlen(frame));
+  StatusUpdate update;
+  while (outboundStatus.pop(update)) {
+  }
+}
+}
+
+void* operator new(size_t size) {
+  allocations ++;
+  void* block = malloc(size);
+  if (block == NULL) {
+    throw std::bad_alloc();
+  }
+  return block;
+}
+
+void operator delete(void* block) noexcept {
+  free(block);
+}
+
+void operator delete(void* block, size_t size) noexcept {
+  free(block);
+}
+
+TEST(key_codes_are_unique) {
+  static const char* const keys[] = {"A", "O", "OA", "Z", "T", "SP", "SPH", "SPC", "M", "FM", "H1A", "H2A",
+                                     "H3A", "C1A", "C2A", "FA", "VA", "SM", "SF", "SC", "D1", "SCP"};
+  const size_t count = sizeof(keys) / sizeof(keys[0]);
+  for (size_t i = 0; i < count; i++) {
+    CHECK(keyCode(keys[i], strlen(keys[i])) != 0);
+    for (size_t j = i + 1; j < count; j++) {
+      CHECK(keyCode(keys[i], strlen(keys[i])) != keyCode(keys[j], strlen(keys[j])));
+    }
+  }
+  //Too long to be a TR40 key
+  CHECK_EQ(keyCode("SPHXX", 5), 0U);
+  CHECK_EQ(keyCode("", 0), 0U);
+}
+
+TEST(keys_map_to_their_status_keys) {
+  CHECK_EQ(lookupStatusKey("OA", 2), KEY_OA);
+  CHECK_EQ(lookupStatusKey("T", 1), KEY_T);
+  CHECK_EQ(lookupStatusKey("SP", 2), KEY_SP);
+  CHECK_EQ(lookupStatusKey("SPH", 3), KEY_SPH);
+  CHECK_EQ(lookupStatusKey("SPC", 3), KEY_SPC);
+  CHECK_EQ(lookupStatusKey("H1A", 3), KEY_H1A);
+  CHECK_EQ(lookupStatusKey("C2A", 3), KEY_C2A);
+  CHECK_EQ(lookupStatusKey("SCP", 3), KEY_SCP);
+  //The key is the first characters only, not the whole token
+  CHECK_EQ(lookupStatusKey("SPH=70", 3), KEY_SPH);
+  CHECK_EQ(lookupStatusKey("SPX", 3), KEY_UNKNOWN);
+  CHECK_EQ(lookupStatusKey("SPHX", 4), KEY_UNKNOWN);
+}
+
+TEST(values_decode_to_numbers_and_modes) {
+  int number = 0;
+  CHECK(parseIntValue("77", number));
+  CHECK_EQ(number, 77);
+  CHECK(parseIntValue("-12", number));
+  CHECK_EQ(number, -12);
+  CHECK(!parseIntValue("", number));
+  CHECK(!parseIntValue("-", number));
+  CHECK(!parseIntValue("7a", number));
+  CHECK(!parseIntValue("MOT", number));
+  //Only what fits the int16_t status fields, and never overflowing on the way
+  CHECK(parseIntValue("32767", number));
+  CHECK_EQ(number, 32767);
+  CHECK(parseIntValue("-32767", number));
+  CHECK_EQ(number, -32767);
+  CHECK(parseIntValue("000000000077", number));
+  CHECK_EQ(number, 77);
+  CHECK(!parseIntValue("32768", number));
+  CHECK(!parseIntValue("-32768", number));
+  CHECK(!parseIntValue("99999999999999999999999", number));
+  CHECK_EQ(parseModeValue("O"), MODE_OFF);
+  CHECK_EQ(parseModeValue("H"), MODE_HEAT);
+  CHECK_EQ(parseModeValue("C"), MODE_COOL);
+  CHECK_EQ(parseModeValue("A"), MODE_AUTO);
+  CHECK_EQ(parseModeValue("EH"), MODE_EMERGENCY_HEAT);
+  CHECK_EQ(parseModeValue("I"), MODE_INVALID);
+  CHECK_EQ(parseModeValue("X"), MODE_UNKNOWN);
+  CHECK_EQ(parseModeValue("HEAT"), MODE_UNKNOWN);
+}
+
+TEST(tokens_are_split_in_place) {
+  char frame[] = "A=00  O=1 T=77  ";
+  char* pos = frame;
+  char* end = frame + strlen(frame);
+  size_t length;
+  char* token = nextToken(pos, end, length);
+  CHECK(token == frame);
+  CHECK_EQ(length, (size_t)4);
+  token = nextToken(pos, end, length);
+  CHECK(token == frame + 6);
+  CHECK_EQ(length, (size_t)3);
+  token = nextToken(pos, end, length);
+  CHECK(token == frame + 10);
+  CHECK_EQ(length, (size_t)4);
+  CHECK(nextToken(pos, end, length) == NULL);
+}
+
+TEST(an_r1_frame_sets_the_state) {
+  ThermostatState& state = thermostats[0].state;
+  parse("A=00 O=1 OA=88 Z=1 T=77 SP= 70 SPH=70 SPC=78 M=H FM=0");
+  CHECK_EQ(state.outsideAir, 88);
+  CHECK_EQ(state.temp, 77);
+  CHECK_EQ(state.setpointHeat, 70);
+  CHECK_EQ(state.setpointCool, 78);
+  CHECK_EQ(state.mode, MODE_HEAT);
+  CHECK_EQ(state.fanMode, 0);
+  uint16_t r1Fields = (1 << FIELD_OUTSIDE_AIR) | (1 << FIELD_TEMP) | (1 << FIELD_SETPOINT_HEAT) |
+                      (1 << FIELD_SETPOINT_COOL) | (1 << FIELD_MODE) | (1 << FIELD_FAN_MODE);
+  CHECK_EQ(state.known & r1Fields, r1Fields);
+}
+
+TEST(the_single_setpoint_follows_the_mode) {
+  ThermostatState& state = thermostats[0].state;
+  //SP= with a space before the value is read as SP=66, the heating setpoint in heat mode
+  parse("A=00 O=1 SP= 66 M=H");
+  CHECK_EQ(state.setpointHeat, 66);
+  parse("A=00 O=1 M=C");
+  parse("A=00 O=1 SP=80");
+  CHECK_EQ(state.setpointCool, 80);
+  CHECK_EQ(state.setpointHeat, 66);
+  parse("A=00 O=1 M=H");
+}
+
+TEST(an_r2_frame_sets_the_stages) {
+  ThermostatState& state = thermostats[0].state;
+  parse("A=00 O=1 H1A=1 H2A=0 H3A=0 C1A=0 C2A=0 FA=0 VA=0 SM=H SCP=00");
+  CHECK_EQ(state.activeStages, (uint8_t)1);
+  CHECK_EQ(state.action, ACTION_H1);
+  parse("A=00 O=1 H1A=0 H2A=0 H3A=0 C1A=0 C2A=0 FA=0 VA=0 SM=H SCP=00");
+  CHECK_EQ(state.activeStages, (uint8_t)0);
+  CHECK_EQ(state.action, ACTION_IDLE);
+}
+
+TEST(frames_that_are_not_ours_are_counted_and_dropped) {
+  ThermostatState& state = thermostats[0].state;
+  int16_t temp = state.temp;
+  unsigned long foreign = metrics.foreignFrames;
+  unsigned long malformed = metrics.malformedFrames;
+  parse("A=00 O=7 T=50");
+  CHECK_EQ(metrics.foreignFrames, foreign + 1);
+  //Our own request echoed back, and noise
+  parse("A=1 O=00 R=1");
+  parse("T=50 A=00 O=1");
+  parse("garbage");
+  CHECK_EQ(metrics.malformedFrames, malformed + 3);
+  CHECK_EQ(state.temp, temp);
+  //Unknown keys and values that are not numbers are skipped without harm
+  parse("A=00 O=1 XYZ=1 T=hot Q T=79");
+  CHECK_EQ(state.temp, 79);
+  //A garbled run of digits is dropped, not wrapped into the field
+  parse("A=00 O=1 T=7777777777777 SPH=65536");
+  CHECK_EQ(state.temp, 79);
+  CHECK(state.setpointHeat != 0);
+}
+
+TEST(parsing_does_not_allocate) {
+  static const char* const frames[] = {
+    "A=00 O=1 OA=88 Z=1 T=77 SP= 70 SPH=70 SPC=78 M=H FM=0",
+    "A=00 O=1 H1A=1 H2A=1 H3A=0 C1A=0 C2A=0 FA=1 VA=0 SM=H SCP=12",
+    "A=00 O=1 OA=-4 Z=1 T=68 SP= 72 SPH=72 SPC=80 M=A FM=1",
+    "A=00 O=9 T=1",
+    "noise",
+  };
+  unsigned long before = allocations;
+  for (int i = 0; i < 100; i++) {
+    parse(frames[i % 5]);
+  }
+  CHECK_EQ(allocations, before);
+}
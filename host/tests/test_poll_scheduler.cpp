@@ -0,0 +1,181 @@
+/* ************************ Poll scheduler tests ************************
+ * PollScheduler on an injected clock: the idle and active periods, the command
+ * window, the phase offset and clock wrap, and the poll rate of the running bridge.
+ */
+#include "main.cpp"
+#include "harness.h"
+
+using namespace host;
+
+Tr40 livingRoom("1");
+
+namespace {
+
+unsigned long fakeNow = 0;
+
+unsigned long fakeClock() {
+  return fakeNow;
+}
+
+PollScheduler scheduler(unsigned long start, unsigned long phase = 0) {
+  PollScheduler poll;
+  poll.clock = fakeClock;
+  fakeNow = start;
+  poll.begin(phase);
+  return poll;
+}
+
+//Counts the polls of each kind over a time, stepping the clock a millisecond at a time
+void count(PollScheduler& poll, unsigned long ms, int& r1, int& r2) {
+  r1 = r2 = 0;
+  for (unsigned long i = 0; i < ms; i++) {
+    fakeNow ++;
+    const char* due = poll.nextPoll();
+    if (due != NULL) {
+      (strcmp(due, "R=1") == 0 ? r1 : r2) ++;
+    }
+  }
+}
+
+}  // namespace
+
+TEST(polls_at_the_idle_periods) {
+  PollScheduler poll = scheduler(100000);
+  int r1;
+  int r2;
+  count(poll, 10 * R1_POLL_PERIOD, r1, r2);
+  CHECK_EQ(r1, 10);
+  CHECK_EQ(r2, (int)(10 * R1_POLL_PERIOD / R2_POLL_PERIOD));
+}
+
+TEST(r1_and_r2_are_spread_apart) {
+  PollScheduler poll = scheduler(100000);
+  unsigned long r1At = 0;
+  unsigned long r2At = 0;
+  for (int i = 0; i < 2 * R1_POLL_PERIOD && (r1At == 0 || r2At == 0); i++) {
+    fakeNow ++;
+    const char* due = poll.nextPoll();
+    if (due != NULL) {
+      (strcmp(due, "R=1") == 0 ? r1At : r2At) = fakeNow;
+    }
+  }
+  CHECK(r1At != 0 && r2At != 0);
+  unsigned long apart = r1At > r2At ? r1At - r2At : r2At - r1At;
+  CHECK_EQ(apart, (unsigned long)(R2_POLL_PERIOD / 2));
+}
+
+TEST(polls_faster_while_a_stage_is_active) {
+  PollScheduler poll = scheduler(100000);
+  poll.setStageActive(true);
+  int r1;
+  int r2;
+  count(poll, 60000, r1, r2);
+  CHECK_EQ(r1, (int)(60000 / R1_ACTIVE_POLL_PERIOD));
+  CHECK_EQ(r2, (int)(60000 / R2_ACTIVE_POLL_PERIOD));
+  poll.setStageActive(false);
+  //Polls that are already overdue at the idle rate come first
+  count(poll, R1_POLL_PERIOD, r1, r2);
+  count(poll, 6 * R1_POLL_PERIOD, r1, r2);
+  CHECK_EQ(r1, 6);
+}
+
+TEST(a_command_holds_off_the_polls_then_speeds_them_up) {
+  PollScheduler poll = scheduler(100000);
+  fakeNow += R1_POLL_PERIOD - 10;
+  poll.commandQueued();
+  //The R=1 that was about to go waits for the command, and no longer
+  CHECK_EQ(poll.untilDue(), (unsigned long)COMMAND_HOLDOFF);
+  int r1;
+  int r2;
+  count(poll, COMMAND_ACTIVE_WINDOW, r1, r2);
+  CHECK_EQ(r1, (int)(COMMAND_ACTIVE_WINDOW / R1_ACTIVE_POLL_PERIOD));
+  CHECK(r2 >= (int)(COMMAND_ACTIVE_WINDOW / R2_ACTIVE_POLL_PERIOD) - 1);
+  CHECK(!poll.active(fakeNow));
+  count(poll, R1_POLL_PERIOD, r1, r2);
+  count(poll, 5 * R1_POLL_PERIOD, r1, r2);
+  CHECK_EQ(r1, 5);
+}
+
+TEST(a_poll_not_yet_due_is_not_moved_by_a_command) {
+  PollScheduler poll = scheduler(100000);
+  poll.adaptive = false;
+  fakeNow += 1000;
+  unsigned long wait = poll.untilDue();
+  poll.commandQueued();
+  CHECK_EQ(poll.untilDue(), wait);
+}
+
+TEST(a_stream_of_commands_does_not_starve_the_polls) {
+  //Writes that are not read back, such as OT from an automation, faster than the 
+  //polls and faster than the hold off
+  for (unsigned long spacing : {500UL, 2000UL, 7000UL}) {
+    PollScheduler poll = scheduler(100000);
+    int r1 = 0;
+    int r2 = 0;
+    for (unsigned long elapsed = 0; elapsed < 120000; elapsed += spacing) {
+      poll.commandQueued();
+      int polls1;
+      int polls2;
+      count(poll, spacing, polls1, polls2);
+      r1 += polls1;
+      r2 += polls2;
+    }
+    //Still polled at the active rate, the command window never closes, with each poll 
+    //waiting COMMAND_HOLDOFF at most
+    CHECK(r1 >= (int)(120000 / (R1_ACTIVE_POLL_PERIOD + COMMAND_HOLDOFF)));
+    CHECK(r2 >= (int)(120000 / (R2_ACTIVE_POLL_PERIOD + COMMAND_HOLDOFF)));
+  }
+}
+
+TEST(adaptive_mode_can_be_turned_off) {
+  PollScheduler poll = scheduler(100000);
+  poll.adaptive = false;
+  poll.setStageActive(true);
+  poll.commandQueued();
+  int r1;
+  int r2;
+  count(poll, R1_POLL_PERIOD, r1, r2);
+  count(poll, 5 * R1_POLL_PERIOD, r1, r2);
+  CHECK_EQ(r1, 5);
+}
+
+TEST(untilDue_counts_down_to_the_next_poll) {
+  PollScheduler poll = scheduler(100000);
+  CHECK_EQ(poll.untilDue(), (unsigned long)(R2_POLL_PERIOD / 2));
+  fakeNow += 1000;
+  CHECK_EQ(poll.untilDue(), (unsigned long)(R2_POLL_PERIOD / 2 - 1000));
+  fakeNow += R2_POLL_PERIOD;
+  CHECK_EQ(poll.untilDue(), 0UL);
+  CHECK(poll.nextPoll() != NULL);
+}
+
+TEST(the_phase_staggers_devices) {
+  PollScheduler first = scheduler(100000, 0);
+  PollScheduler second = scheduler(100000, R1_POLL_PERIOD / 2);
+  CHECK(first.untilDue() != second.untilDue());
+  CHECK_EQ(second.remaining(fakeNow, second.lastR1, second.r1Period), (unsigned long)(R1_POLL_PERIOD / 2));
+}
+
+TEST(survives_the_clock_wrapping) {
+  PollScheduler poll = scheduler(ULONG_MAX - R1_POLL_PERIOD);
+  int r1;
+  int r2;
+  count(poll, 5 * R1_POLL_PERIOD, r1, r2);
+  CHECK_EQ(r1, 5);
+  CHECK(fakeNow < ULONG_MAX - R1_POLL_PERIOD);
+}
+
+TEST(the_bridge_polls_less_when_idle) {
+  startBridge(livingRoom);
+  runFor(60000);
+  unsigned long idleStart = livingRoom.requests.size();
+  runFor(120000);
+  unsigned long idle = livingRoom.requests.size() - idleStart;
+  livingRoom.stages[Tr40::H1] = true;
+  runFor(30000);
+  unsigned long activeStart = livingRoom.requests.size();
+  runFor(120000);
+  unsigned long active = livingRoom.requests.size() - activeStart;
+  CHECK_EQ(idle, (unsigned long)(120000 / R1_POLL_PERIOD + 120000 / R2_POLL_PERIOD));
+  CHECK(active >= 120000 / R1_ACTIVE_POLL_PERIOD + 120000 / R2_ACTIVE_POLL_PERIOD - 2);
+}
@@ -0,0 +1,188 @@
+/* ************************ Publish buffer tests ************************
+ * What the MQTT side holds while the broker is down: the latest value of each topic
+ * in the order the topics were first held, new topics dropped and counted once it is
+ * full, and action transitions kept in order with the oldest dropped. Then a broker
+ * outage long enough to overflow it, flushed in that order on reconnect.
+ */
+#define THERMOSTAT_LIST \
+  Thermostat("1", "site/zone1", "Zone 1"), \
+  Thermostat("2", "site/zone2", "Zone 2"), \
+  Thermostat("3", "site/zone3", "Zone 3"), \
+  Thermostat("4", "site/zone4", "Zone 4"), \
+  Thermostat("5", "site/zone5", "Zone 5"),
+#include "main.cpp"
+#include "harness.h"
+#include "json.h"
+
+#include <string>
+#include <vector>
+
+using namespace host;
+
+Tr40 zones[] = {Tr40("1"), Tr40("2"), Tr40("3"), Tr40("4"), Tr40("5")};
+const uint8_t ZONE_COUNT = sizeof(zones) / sizeof(zones[0]);
+
+namespace {
+
+struct Held {
+  std::string topic;
+  std::string payload;
+};
+
+//What the buffer will flush, transitions first, in the order flushPublishBuffer() sends them
+std::vector<Held> held() {
+  std::vector<Held> found;
+  for (uint8_t i = 0; i < publishBuffer.transitionCount; i++) {
+    const PublishBuffer::Transition& transition = publishBuffer.transitions[i];
+    found.push_back(Held{std::string(transition.thermostat->topicPrefix) + "/action/transition", transition.value});
+  }
+  for (uint8_t i = 0; i < publishBuffer.count; i++) {
+    const PublishBuffer::Entry& entry = publishBuffer.entries[i];
+    found.push_back(Held{std::string(entry.thermostat->topicPrefix) + "/" + entry.key, entry.value});
+  }
+  return found;
+}
+
+//Parses the retained diag document, an empty object when there is none or it is not valid
+Json diagnostics() {
+  Json document;
+  std::string error;
+  auto retained = broker.retained.find(bridgeTopicOf(diagnosticsTopic));
+  if (retained == broker.retained.end() || !Json::parse(retained->second.payload, document, error)) {
+    return Json();
+  }
+  return document;
+}
+
+}  // namespace
+
+TEST(topics_are_held_in_order_with_their_latest_value) {
+  PublishBuffer buffer;
+  CHECK(buffer.empty());
+  CHECK(buffer.store(&thermostats[0], "T", "70"));
+  CHECK(buffer.store(&thermostats[1], "T", "65"));
+  CHECK(buffer.store(&thermostats[0], "SPH", "68"));
+  CHECK(buffer.store(&thermostats[0], "T", "71"));
+  CHECK_EQ(buffer.count, 3);
+  CHECK_STR(buffer.entries[0].key, "T");
+  CHECK_STR(buffer.entries[0].value, "71");
+  CHECK(buffer.entries[1].thermostat == &thermostats[1]);
+  CHECK_STR(buffer.entries[1].value, "65");
+  CHECK_STR(buffer.entries[2].key, "SPH");
+  CHECK_EQ(buffer.dropped, 0U);
+}
+
+TEST(a_full_buffer_drops_and_counts_new_topics) {
+  PublishBuffer buffer;
+  char key[PUBLISH_KEY_LENGTH];
+  for (int i = 0; i < PUBLISH_BUFFER_SIZE; i++) {
+    snprintf(key, sizeof(key), "k%d", i);
+    CHECK(buffer.store(&thermostats[0], key, "1"));
+  }
+  CHECK(!buffer.store(&thermostats[0], "extra", "1"));
+  CHECK(!buffer.store(&thermostats[1], "k0", "1"));
+  CHECK_EQ(buffer.dropped, 2U);
+  //A topic already held still takes its latest value
+  CHECK(buffer.store(&thermostats[0], "k0", "2"));
+  CHECK_STR(buffer.entries[0].value, "2");
+  //As does anything too long to hold
+  PublishBuffer small;
+  CHECK(!small.store(&thermostats[0], std::string(PUBLISH_KEY_LENGTH, 'k').c_str(), "1"));
+  CHECK(!small.store(&thermostats[0], "T", std::string(PUBLISH_VALUE_LENGTH, '9').c_str()));
+  CHECK_EQ(small.dropped, 2U);
+  CHECK(small.empty());
+}
+
+TEST(transitions_keep_their_order_and_drop_the_oldest) {
+  PublishBuffer buffer;
+  const char* const actions[] = {"H1", "I", "C1", "I"};
+  for (int i = 0; i < TRANSITION_BUFFER_SIZE + 3; i++) {
+    buffer.storeTransition(&thermostats[0], actions[i % 4], 1000 * i);
+  }
+  CHECK_EQ(buffer.transitionCount, TRANSITION_BUFFER_SIZE);
+  CHECK_EQ(buffer.dropped, 3U);
+  for (int i = 0; i < TRANSITION_BUFFER_SIZE; i++) {
+    CHECK_STR(buffer.transitions[i].value, actions[(i + 3) % 4]);
+    CHECK_EQ(buffer.transitions[i].time, 1000UL * (i + 3));
+  }
+  CHECK(!buffer.empty());
+}
+
+TEST(an_overflowing_outage_is_flushed_in_order_on_reconnect) {
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    bus.attach(&zones[zone]);
+  }
+  startBridge();
+  CHECK(runUntil([] {
+    for (uint8_t device = 0; device < DEVICE_COUNT; device++) {
+      if (lastValue("T", device).empty() || lastValue("action", device).empty()) {
+        return false;
+      }
+    }
+    return true;
+  }, 60000));
+  broker.stop();
+  zones[0].stages[Tr40::H1] = true;
+  runFor(60000);
+  zones[0].stages[Tr40::H1] = false;
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    zones[zone].temp = 60 + zone;
+  }
+  runFor(60000);
+  for (uint8_t zone = 0; zone < ZONE_COUNT; zone++) {
+    zones[zone].temp = 50 + zone;
+  }
+  //Every field's heartbeat comes round, more topics than the buffer holds
+  runFor(HEARTBEAT_PERIOD);
+  //Up to just before the next connection attempt, so nothing changes between here and the flush
+  unsigned long attempt = mqttReconnector.untilDue(false);
+  runFor(attempt > 1 ? attempt - 1 : 0);
+  CHECK_EQ(publishBuffer.count, PUBLISH_BUFFER_SIZE);
+  CHECK(publishBuffer.dropped > 0);
+  std::vector<Held> expected = held();
+  CHECK_EQ(publishBuffer.transitionCount, 2);
+  CHECK_EQ(expected[0].payload, std::string("H1"));
+  CHECK_EQ(expected[1].payload, std::string("I"));
+  //Only the latest temperature is held
+  for (const Held& entry : expected) {
+    if (entry.topic == topicOf("T", 0)) {
+      CHECK_EQ(entry.payload, std::string("50"));
+    }
+  }
+  unsigned int dropped = publishBuffer.dropped;
+
+  size_t log = broker.snapshot().size();
+  broker.start();
+  CHECK(runUntil([] { return broker.session.load(); }, 10));
+  runFor(100);
+  CHECK(publishBuffer.empty());
+  std::vector<Broker::Message> messages = broker.snapshot();
+  size_t first = log;
+  while (first < messages.size() && messages[first].topic != expected[0].topic) {
+    first ++;
+  }
+  //Straight after the bridge's own status, the transitions in order and then each
+  //held topic in the order it was first held, with nothing more dropped
+  CHECK(first + expected.size() <= messages.size());
+  for (size_t i = 0; i < expected.size() && first + i < messages.size(); i++) {
+    const Broker::Message& message = messages[first + i];
+    CHECK_EQ(message.topic, expected[i].topic);
+    if (i < 2) {
+      CHECK(message.payload.find("\"action\":\"" + expected[i].payload + "\"") != std::string::npos);
+    } else {
+      CHECK_EQ(message.payload, expected[i].payload);
+    }
+  }
+  //Nothing of the thermostats' goes ahead of them, and their availability follows
+  for (size_t i = log; i < first; i++) {
+    CHECK(messages[i].topic.find("site/") != 0);
+  }
+  size_t next = first + expected.size();
+  for (uint8_t device = 0; device < DEVICE_COUNT && next + device < messages.size(); device++) {
+    CHECK_EQ(messages[next + device].topic, topicOf("availability", device));
+  }
+  CHECK_EQ(publishBuffer.dropped, dropped);
+  //The count of what was lost is in the diagnostics
+  CHECK(runUntil([] { return diagnostics().has("bufferDropped"); }, DIAG_PERIOD + 1000));
+  CHECK_EQ(diagnostics()["bufferDropped"].number, (double)dropped);
+}
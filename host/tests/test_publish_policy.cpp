@@ -0,0 +1,264 @@
+/* ************************ Publish policy tests ************************
+ * A temperature trace run through each candidate policy for T side by side, the
+ * one shipped chosen from them. A noisy trace fed through the per-field deadband,
+ * minimum interval and heartbeat policies for three simulated hours, counted
+ * against publishing every change. When Home Assistant comes online or MQTT reconnects every known
+ * field is sent again within a few passes of loop(), whatever its policy is holding
+ * back, and an outage holds only the actions that changed.
+ */
+#include "main.cpp"
+#include "harness.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace host;
+
+Tr40 livingRoom("1");
+
+namespace {
+
+std::mt19937 generator(23);
+
+//Whether two publishes are at least an interval apart, to the millisecond the bridge 
+//measures it in
+bool apart(const Published& first, const Published& second, unsigned long ms) {
+  return second.at - first.at + 1000 > ms * 1000ULL;
+}
+
+//Whether every known field has been published since a point in the broker's log
+bool everyFieldSince(size_t from) {
+  for (uint8_t field = 0; field < FIELD_COUNT; field++) {
+    if ((thermostats[0].state.known & (1 << field)) && publishedSince(from, fieldKeys[field]).empty()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+//Runs the bridge for a poll period at a time, moving the temperatures by up to a degree
+//each time. Returns how many times each changed.
+void noisyTrace(unsigned long ms, unsigned long& tempChanges, unsigned long& outsideChanges) {
+  for (unsigned long elapsed = 0; elapsed < ms; elapsed += R1_POLL_PERIOD) {
+    int temp = 72 + (int)(generator() % 3) - 1;
+    int outside = livingRoom.outsideAir + (int)(generator() % 3) - 1;
+    outside = std::min(95, std::max(80, outside));
+    tempChanges += temp != livingRoom.temp;
+    outsideChanges += outside != livingRoom.outsideAir;
+    livingRoom.temp = temp;
+    livingRoom.outsideAir = outside;
+    runFor(R1_POLL_PERIOD);
+  }
+}
+
+//One T reading a poll period for some hours. The room swings three degrees either way 
+//each hour as the heating cycles, and each reading is off by up to a degree.
+std::vector<int> temperatureTrace(unsigned long hours) {
+  std::mt19937 traceGenerator(14);
+  std::vector<int> trace;
+  for (unsigned long at = 0; at < hours * 3600000UL; at += R1_POLL_PERIOD) {
+    double swing = 3 * sin(2 * M_PI * at / 3600000.0);
+    trace.push_back((int)lround(72 + swing) + (int)(traceGenerator() % 3) - 1);
+  }
+  return trace;
+}
+
+struct PolicyResult {
+  unsigned long publishes;
+  //How far the value in Home Assistant was from the thermostat's, averaged over every 
+  //second and at its worst, in degrees
+  double meanError;
+  int worstError;
+  //The longest a change of two degrees or more went unpublished, in seconds
+  unsigned long worstDelay;
+};
+
+//Publishes a trace of T through a ThermostatState under a policy, a second at a time
+PolicyResult runPolicy(const PublishPolicy& policy, const std::vector<int>& trace) {
+  PublishPolicy policies[FIELD_COUNT];
+  std::copy(publishPolicies, publishPolicies + FIELD_COUNT, policies);
+  policies[FIELD_TEMP] = policy;
+  ThermostatState state;
+  state.policies = policies;
+  PolicyResult result{0, 0, 0, 0};
+  unsigned long suppressed = 0;
+  unsigned long now = 0;
+  unsigned long behindSince = 0;
+  double totalError = 0;
+  for (int reading : trace) {
+    state.set(FIELD_TEMP, state.temp, reading);
+    for (unsigned long second = 0; second < R1_POLL_PERIOD / 1000; second++, now += 1000) {
+      unsigned long wait;
+      if (state.due(now, 0, wait, suppressed) & (1 << FIELD_TEMP)) {
+        state.dirty &= ~(1 << FIELD_TEMP);
+        state.publishedNow(FIELD_TEMP, now);
+        result.publishes ++;
+      }
+      int error = abs(state.temp - state.publishedValue[FIELD_TEMP]);
+      totalError += error;
+      result.worstError = std::max(result.worstError, error);
+      if (error < 2) {
+        behindSince = now;
+      }
+      result.worstDelay = std::max(result.worstDelay, (now - behindSince) / 1000);
+    }
+  }
+  result.meanError = totalError / (now / 1000);
+  return result;
+}
+
+}  // namespace
+
+TEST(the_temperature_policy_is_chosen_from_the_candidates) {
+  //The same six hour trace under each candidate policy for T, side by side
+  const PublishPolicy candidates[] = {
+    {0, 0, HEARTBEAT_PERIOD},      {0, 30000, HEARTBEAT_PERIOD}, {0, 60000, HEARTBEAT_PERIOD}, 
+    {0, 120000, HEARTBEAT_PERIOD}, {2, 0, HEARTBEAT_PERIOD},     {2, 30000, HEARTBEAT_PERIOD}, 
+    {2, 60000, HEARTBEAT_PERIOD},  {3, 60000, HEARTBEAT_PERIOD},
+  };
+  std::vector<int> trace = temperatureTrace(6);
+  unsigned long changes = 0;
+  for (size_t i = 1; i < trace.size(); i++) {
+    changes += trace[i] != trace[i - 1];
+  }
+  fprintf(stderr, "    %zu readings, %lu changes\n", trace.size(), changes);
+  fprintf(stderr, "    deadband interval  publishes  mean error  worst error  worst 2F delay\n");
+  PolicyResult shipped{0, 0, 0, 0};
+  for (const PublishPolicy& candidate : candidates) {
+    PolicyResult result = runPolicy(candidate, trace);
+    bool isShipped = candidate.deadband == publishPolicies[FIELD_TEMP].deadband && 
+                     candidate.minInterval == publishPolicies[FIELD_TEMP].minInterval;
+    fprintf(stderr, "    %8d %7lus %10lu %11.2f %12d %14lus%s\n", candidate.deadband, 
+            candidate.minInterval / 1000, result.publishes, result.meanError, result.worstError, 
+            result.worstDelay, isShipped ? "  <- shipped" : "");
+    if (isShipped) {
+      shipped = result;
+    }
+  }
+  //The shipped policy is one of the candidates. A two degree deadband without a minimum 
+  //interval drops the reading noise, about two thirds of the changes, while Home 
+  //Assistant stays within a degree and a real move shows on the poll that saw it. A 
+  //minimum interval on top saves a few more publishes but lets a move wait.
+  CHECK(shipped.publishes > 0);
+  CHECK(shipped.publishes * 2 < changes);
+  CHECK(shipped.worstError < publishPolicies[FIELD_TEMP].deadband);
+  CHECK_EQ(shipped.worstDelay, 0UL);
+}
+
+TEST(a_noisy_trace_is_published_less_often_than_it_changes) {
+  startBridge(livingRoom);
+  CHECK(runUntil([] { return everyFieldSince(0); }, 60000));
+  size_t log = broker.snapshot().size();
+  unsigned long tempChanges = 0;
+  unsigned long outsideChanges = 0;
+  unsigned long suppressed = metrics.suppressedPublishes;
+  noisyTrace(3 * 3600000UL, tempChanges, outsideChanges);
+  std::vector<Published> temps = publishedSince(log, "T");
+  std::vector<Published> outsides = publishedSince(log, "OA");
+  fprintf(stderr, "    T %zu publishes for %lu changes, OA %zu for %lu\n", temps.size(), tempChanges,
+          outsides.size(), outsideChanges);
+  CHECK(temps.size() * 2 < tempChanges);
+  CHECK(outsides.size() * 3 < outsideChanges);
+  CHECK(metrics.suppressedPublishes > suppressed);
+  //Between heartbeats T and OA only move by their deadbands, and OA is held to its 
+  //minimum interval
+  for (size_t i = 1; i < temps.size(); i++) {
+    int moved = abs(atoi(temps[i].value.c_str()) - atoi(temps[i - 1].value.c_str()));
+    uint64_t gap = temps[i].at - temps[i - 1].at;
+    CHECK(moved >= publishPolicies[FIELD_TEMP].deadband || gap >= HEARTBEAT_PERIOD / 2 * 1000ULL);
+  }
+  for (size_t i = 1; i < outsides.size(); i++) {
+    int moved = abs(atoi(outsides[i].value.c_str()) - atoi(outsides[i - 1].value.c_str()));
+    uint64_t gap = outsides[i].at - outsides[i - 1].at;
+    CHECK(moved >= publishPolicies[FIELD_OUTSIDE_AIR].deadband || gap >= HEARTBEAT_PERIOD / 2 * 1000ULL);
+    CHECK(apart(outsides[i - 1], outsides[i], publishPolicies[FIELD_OUTSIDE_AIR].minInterval));
+  }
+  //Unchanged fields still go out on their heartbeat
+  std::vector<Published> setpoints = publishedSince(log, "SPH");
+  CHECK(setpoints.size() >= 3 * 3600000UL / HEARTBEAT_PERIOD - 1);
+  for (size_t i = 1; i < setpoints.size(); i++) {
+    CHECK(setpoints[i].at - setpoints[i - 1].at <= (HEARTBEAT_PERIOD + R1_POLL_PERIOD) * 1000ULL);
+  }
+}
+
+TEST(home_assistant_coming_online_gets_every_field_spread_over_a_few_passes) {
+  unsigned long tempChanges = 0;
+  unsigned long outsideChanges = 0;
+  noisyTrace(60000, tempChanges, outsideChanges);
+  //OA was published moments ago, so its minimum interval holds the change back
+  size_t published = broker.snapshot().size();
+  CHECK(runUntil([&] { return !publishedSince(published, "OA").empty(); }, HEARTBEAT_PERIOD + 1000));
+  livingRoom.outsideAir = 60;
+  CHECK(runUntil([] { return thermostats[0].state.outsideAir == 60; }, R1_POLL_PERIOD + 1000));
+  CHECK_EQ(thermostats[0].state.outsideAir, 60);
+  CHECK(lastValue("OA") != "60");
+  size_t log = broker.snapshot().size();
+  uint64_t sentAt = now();
+  broker.send(discoveryStatusTopic, "online");
+  CHECK(runUntil([&] { return everyFieldSince(log); }, 1000));
+  fprintf(stderr, "    every field published %.1f ms after online\n", (now() - sentAt) / 1000.0);
+  CHECK_EQ(lastValue("OA"), std::string("60"));
+  //Spread over passes of loop(), each publishing at most its share of the fields
+  std::map<uint64_t, unsigned int> perPass;
+  for (uint8_t field = 0; field < FIELD_COUNT; field++) {
+    for (const Published& published : publishedSince(log, fieldKeys[field])) {
+      perPass[published.at] ++;
+    }
+  }
+  CHECK(perPass.size() > 1);
+  for (const auto& pass : perPass) {
+    CHECK(pass.second <= REFRESH_FIELDS_PER_PASS);
+  }
+  char value[PUBLISH_VALUE_LENGTH];
+  thermostats[0].state.format(FIELD_OUTSIDE_AIR, value, sizeof(value));
+  CHECK_EQ(lastValue("OA"), std::string(value));
+  //Once each, then back to the policies
+  runFor(10000);
+  for (uint8_t field = 0; field < FIELD_COUNT; field++) {
+    if (thermostats[0].state.known & (1 << field)) {
+      CHECK_EQ(publishedSince(log, fieldKeys[field]).size(), (size_t)1);
+    }
+  }
+}
+
+TEST(a_reconnect_publishes_every_field_again) {
+  runFor(HEARTBEAT_PERIOD / 4);
+  broker.stop();
+  runFor(2000);
+  broker.start();
+  size_t log = broker.snapshot().size();
+  CHECK(runUntil([] { return broker.session.load(); }, RECONNECT_MAX_BACKOFF + 1000));
+  CHECK(runUntil([&] { return everyFieldSince(log); }, 1000));
+  CHECK_EQ(lastValue("SPH"), std::string("68"));
+  CHECK_EQ(lastValue("M"), std::string("H"));
+}
+
+TEST(an_outage_holds_only_the_actions_that_changed) {
+  runFor(10000);
+  CHECK_EQ(lastValue("action"), std::string("I"));
+  broker.stop();
+  livingRoom.stages[Tr40::H1] = true;
+  runFor(60000);
+  livingRoom.stages[Tr40::H1] = false;
+  //Long enough for the action's heartbeat to come round twice
+  runFor(2 * HEARTBEAT_PERIOD);
+  livingRoom.stages[Tr40::C1] = true;
+  runFor(60000);
+  livingRoom.stages[Tr40::C1] = false;
+  runFor(60000);
+  size_t log = broker.snapshot().size();
+  broker.start();
+  CHECK(runUntil([] { return broker.session.load(); }, RECONNECT_MAX_BACKOFF + 1000));
+  runFor(1000);
+  std::vector<std::string> actions;
+  for (const Published& transition : publishedSince(log, "action/transition")) {
+    size_t start = transition.value.find("\"action\":\"") + 10;
+    actions.push_back(transition.value.substr(start, transition.value.find('"', start) - start));
+  }
+  std::vector<std::string> expected = {"H1", "I", "C1", "I"};
+  CHECK(actions == expected);
+}
@@ -0,0 +1,199 @@
+/* ************************ MQTT reconnect tests ************************
+ * MqttReconnector on an injected clock with a scripted connection attempt, and the
+ * running bridge through broker outages: polling carries on, the bridge comes back
+ * when the broker does, no blocking attempt is made while a request waits for its
+ * answer, and only an outage past the wedge window restarts it.
+ */
+#include "main.cpp"
+#include "harness.h"
+
+#include <vector>
+
+using namespace host;
+
+Tr40 livingRoom("1");
+
+namespace {
+
+unsigned long fakeNow = 0;
+bool brokerUp = false;
+std::vector<unsigned long> attempts;
+unsigned long restarts = 0;
+
+unsigned long fakeClock() {
+  return fakeNow;
+}
+
+bool recordAttempt() {
+  attempts.push_back(fakeNow);
+  return brokerUp;
+}
+
+void recordRestart() {
+  restarts ++;
+}
+
+MqttReconnector reconnector() {
+  MqttReconnector mqtt;
+  mqtt.clock = fakeClock;
+  mqtt.attempt = recordAttempt;
+  mqtt.restart = recordRestart;
+  fakeNow = 5000;
+  brokerUp = false;
+  attempts.clear();
+  restarts = 0;
+  //Connected, then the connection drops
+  mqtt.service(true);
+  return mqtt;
+}
+
+//Services the reconnector a millisecond at a time while it is not connected
+void run(MqttReconnector& mqtt, unsigned long ms) {
+  for (unsigned long i = 0; i < ms; i++) {
+    fakeNow ++;
+    mqtt.service(false);
+  }
+}
+
+}  // namespace
+
+TEST(a_lost_connection_is_retried_straight_away) {
+  MqttReconnector mqtt = reconnector();
+  mqtt.service(false);
+  CHECK_EQ(attempts.size(), (size_t)1);
+  CHECK_EQ(attempts[0], 5000UL);
+}
+
+TEST(attempts_back_off_exponentially_with_jitter) {
+  MqttReconnector mqtt = reconnector();
+  mqtt.service(false);
+  run(mqtt, 10 * 60 * 1000);
+  CHECK(attempts.size() > 8);
+  unsigned long backoff = RECONNECT_MIN_BACKOFF;
+  for (size_t i = 1; i < attempts.size(); i++) {
+    unsigned long gap = attempts[i] - attempts[i - 1];
+    CHECK(gap >= backoff / 2 && gap <= backoff);
+    backoff = min(backoff * 2, (unsigned long)RECONNECT_MAX_BACKOFF);
+  }
+  CHECK_EQ(restarts, 0UL);
+}
+
+TEST(the_wait_is_jittered) {
+  //Bridges that lost the broker together do not all retry together
+  std::vector<unsigned long> seconds;
+  for (int bridge = 0; bridge < 8; bridge++) {
+    MqttReconnector mqtt = reconnector();
+    mqtt.service(false);
+    run(mqtt, 40000);
+    seconds.push_back(attempts.back());
+  }
+  bool differ = false;
+  for (unsigned long at : seconds) {
+    differ = differ || at != seconds[0];
+  }
+  CHECK(differ);
+}
+
+TEST(a_reconnect_resets_the_backoff) {
+  MqttReconnector mqtt = reconnector();
+  mqtt.service(false);
+  run(mqtt, 60000);
+  brokerUp = true;
+  for (unsigned long i = 0; i < RECONNECT_MAX_BACKOFF && mqtt.reconnects == 0; i++) {
+    fakeNow ++;
+    mqtt.service(false);
+  }
+  CHECK_EQ(mqtt.reconnects, 1UL);
+  mqtt.service(true);
+  CHECK_EQ(mqtt.backoff, (unsigned long)RECONNECT_MIN_BACKOFF);
+  CHECK_EQ(mqtt.untilDue(true), ULONG_MAX);
+}
+
+TEST(untilDue_tells_when_the_next_attempt_is) {
+  MqttReconnector mqtt = reconnector();
+  CHECK_EQ(mqtt.untilDue(false), 0UL);
+  mqtt.service(false);
+  unsigned long wait = mqtt.untilDue(false);
+  CHECK(wait >= RECONNECT_MIN_BACKOFF / 2 && wait <= RECONNECT_MIN_BACKOFF);
+  fakeNow += wait;
+  CHECK_EQ(mqtt.untilDue(false), 0UL);
+}
+
+TEST(restarts_only_after_the_wedge_window) {
+  MqttReconnector mqtt = reconnector();
+  mqtt.service(false);
+  //Plenty of failures but not for long enough
+  run(mqtt, RECONNECT_WEDGE_WINDOW - 1000);
+  CHECK(attempts.size() >= RECONNECT_WEDGE_FAILURES);
+  CHECK_EQ(restarts, 0UL);
+  run(mqtt, RECONNECT_MAX_BACKOFF + 1000);
+  CHECK_EQ(restarts, 1UL);
+}
+
+TEST(polling_carries_on_while_the_broker_is_down) {
+  startBridge(livingRoom);
+  runFor(30000);
+  unsigned long reconnects = mqttReconnector.reconnects;
+  broker.stop();
+  size_t polls = livingRoom.requests.size();
+  livingRoom.temp = 65;
+  runFor(120000);
+  CHECK(livingRoom.requests.size() - polls >= 120000 / R1_POLL_PERIOD + 120000 / R2_POLL_PERIOD - 1);
+  CHECK_EQ(thermostats[0].state.temp, 65);
+  broker.start();
+  CHECK(runUntil([] { return broker.session.load(); }, RECONNECT_MAX_BACKOFF + 1000));
+  CHECK(runUntil([] { return lastValue("T") == "65"; }, 10000));
+  CHECK_EQ(mqttReconnector.reconnects, reconnects + 1);
+}
+
+TEST(no_blocking_attempt_is_made_while_a_request_waits_for_its_answer) {
+  static unsigned long attemptsMade = 0;
+  static unsigned long attemptsDuringRequests = 0;
+  mqttReconnector.attempt = [] {
+    attemptsMade ++;
+    if (transactions.busy() || rs485.busy()) {
+      attemptsDuringRequests ++;
+    }
+    return reconnect();
+  };
+  //Each attempt at the broker that is down takes as long as the socket timeout, and 
+  //one is due on every pass
+  broker.stop();
+  broker.connectTime = MQTT_SOCKET_TIMEOUT * 1000000ULL;
+  unsigned long timeouts = transactions.timeouts;
+  size_t polls = livingRoom.requests.size();
+  uint64_t end = now() + 120000 * 1000ULL;
+  while (now() < end) {
+    mqttReconnector.nextAttempt = millis();
+    loop();
+    advance(passTime);
+  }
+  broker.connectTime = 0;
+  broker.start();
+  mqttReconnector.attempt = reconnect;
+  CHECK(attemptsMade > 3);
+  CHECK_EQ(attemptsDuringRequests, 0UL);
+  CHECK_EQ(transactions.timeouts, timeouts);
+  CHECK(livingRoom.requests.size() - polls >= 120000 / R1_POLL_PERIOD + 120000 / R2_POLL_PERIOD - 1);
+  CHECK(runUntil([] { return broker.session.load(); }, RECONNECT_MAX_BACKOFF + 1000));
+}
+
+TEST(a_broker_restart_is_ridden_out) {
+  unsigned long connects = broker.connects;
+  broker.stop();
+  runFor(2000);
+  broker.start();
+  CHECK(runUntil([&] { return broker.connects == connects + 1; }, 5000));
+  CHECK_EQ(lastValue("availability"), std::string("available"));
+}
+
+TEST(a_long_outage_restarts_the_bridge) {
+  static bool restarted = false;
+  onRestart = [] { restarted = true; };
+  broker.stop();
+  runFor(RECONNECT_WEDGE_WINDOW / 2);
+  CHECK(!restarted);
+  runFor(RECONNECT_WEDGE_WINDOW / 2 + RECONNECT_MAX_BACKOFF + 1000);
+  CHECK(restarted);
+  broker.start();
+}
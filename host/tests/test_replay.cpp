@@ -0,0 +1,184 @@
+/* ************************ Capture replay tests ************************
+ * A capture sent to capture/replay is parsed into the replay's own copy of the
+ * thermostats. The live thermostat keeps being polled and published while it runs,
+ * and neither side's traffic leaks into the other: the stream and hash depend only
+ * on the capture, and the live topics only on the live thermostat.
+ */
+#include "main.cpp"
+#include "harness.h"
+#include "json.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace host;
+
+Tr40 livingRoom("1");
+
+namespace {
+
+//A capture of a thermostat reporting different values to the live one
+std::string recordedCapture(unsigned long spacing) {
+  Tr40 recorded("1");
+  recorded.temp = 60;
+  recorded.setpointHeat = 55;
+  recorded.setpointCool = 90;
+  recorded.mode = "C";
+  recorded.stages[Tr40::C1] = true;
+  recorded.systemMode = "C";
+  std::string capture;
+  unsigned long time = 1000;
+  auto record = [&](CaptureDirection direction, const std::string& frame) {
+    for (int shift = 0; shift < 32; shift += 8) {
+      capture += (char)((time >> shift) & 0xFF);
+    }
+    capture += (char)direction;
+    capture += (char)frame.size();
+    capture += frame;
+    time += spacing;
+  };
+  for (int i = 0; i < 6; i++) {
+    record(CAPTURE_TX, "A=1 O=00 R=1");
+    record(CAPTURE_RX, recorded.statusR1());
+    record(CAPTURE_TX, "A=1 O=00 R=2");
+    record(CAPTURE_RX, recorded.statusR2());
+    recorded.temp ++;
+  }
+  return capture;
+}
+
+std::vector<std::string> streamed() {
+  std::vector<std::string> found;
+  for (const Broker::Message& message : broker.snapshot()) {
+    if (message.topic == bridgeTopicOf(captureStreamTopic)) {
+      found.push_back(message.payload);
+    }
+  }
+  return found;
+}
+
+Json replayResult(const char* speed, const std::string& capture, unsigned long ms) {
+  std::string topic = bridgeTopicOf(captureResultTopic);
+  size_t results = broker.count(topic);
+  broker.send(bridgeTopicOf(replayTopic) + "/" + speed, capture);
+  Json result;
+  if (!runUntil([&] { return broker.count(topic) > results; }, ms)) {
+    return result;
+  }
+  std::string error;
+  Json::parse(broker.last(topic)->payload, result, error);
+  return result;
+}
+
+//The next diagnostics document the bridge publishes
+Json nextDiagnostics() {
+  std::string topic = bridgeTopicOf(diagnosticsTopic);
+  size_t published = broker.count(topic);
+  Json diag;
+  if (!runUntil([&] { return broker.count(topic) > published; }, DIAG_PERIOD + 1000)) {
+    return diag;
+  }
+  std::string error;
+  Json::parse(broker.last(topic)->payload, diag, error);
+  return diag;
+}
+
+}  // namespace
+
+TEST(a_replay_publishes_the_capture_on_the_stream) {
+  startBridge(livingRoom);
+  CHECK(runUntil([] { return lastValue("T") == "72"; }, 30000));
+  broker.clear();
+  Json result = replayResult("fast", recordedCapture(1000), 5000);
+  CHECK_EQ(result["frames"].number, 12.0);
+  std::vector<std::string> stream = streamed();
+  CHECK(!stream.empty());
+  std::string prefix = std::string(thermostats[0].topicPrefix) + "/";
+  CHECK(std::find(stream.begin(), stream.end(), prefix + "T 60") != stream.end());
+  CHECK(std::find(stream.begin(), stream.end(), prefix + "T 65") != stream.end());
+  CHECK(std::find(stream.begin(), stream.end(), prefix + "M C") != stream.end());
+  //None of it reached the live topics
+  CHECK_EQ(broker.count(topicOf("T")), (size_t)0);
+  CHECK_EQ(thermostats[0].state.temp, 72);
+  CHECK_EQ(thermostats[0].state.mode, MODE_HEAT);
+}
+
+TEST(live_traffic_carries_on_during_a_replay_without_touching_it) {
+  std::string capture = recordedCapture(1000);
+  Json fast = replayResult("fast", capture, 5000);
+  //A realtime replay of the same capture runs for about 24 s, through several polls
+  //of the live thermostat, whose temperature changes while it runs
+  broker.clear();
+  size_t requests = livingRoom.requests.size();
+  livingRoom.temp = 74;
+  Json realtime = replayResult("realtime", capture, 40000);
+  CHECK(livingRoom.requests.size() > requests + 1);
+  CHECK_EQ(thermostats[0].state.temp, 74);
+  CHECK_EQ(thermostats[0].state.setpointHeat, 68);
+  //Published as soon as the temperature's minimum interval allows
+  CHECK(runUntil([] { return lastValue("T") == "74"; }, 35000));
+  //The replay saw only the capture
+  CHECK_EQ(realtime["frames"].number, fast["frames"].number);
+  CHECK_EQ(realtime["publishes"].number, fast["publishes"].number);
+  CHECK_EQ(realtime["hash"].string, fast["hash"].string);
+  std::string prefix = std::string(thermostats[0].topicPrefix) + "/";
+  for (const std::string& value : streamed()) {
+    CHECK(value != prefix + "T 74");
+  }
+}
+
+TEST(every_run_of_a_capture_publishes_the_same_stream) {
+  std::string capture = recordedCapture(500);
+  broker.clear();
+  Json first = replayResult("fast", capture, 5000);
+  std::vector<std::string> firstStream = streamed();
+  broker.clear();
+  Json second = replayResult("fast", capture, 5000);
+  CHECK_EQ(first["hash"].string, second["hash"].string);
+  CHECK(firstStream == streamed());
+}
+
+TEST(bad_frames_in_a_replay_are_counted_in_its_result_not_in_diag) {
+  Json before = nextDiagnostics();
+  CHECK(before.has("malformed") && before.has("foreign"));
+  //A capture with a frame that is not a status and one from another thermostat
+  std::string capture = recordedCapture(500);
+  for (const std::string frame : {"garbage", "A=00 O=7 T=70"}) {
+    capture += std::string("\x10\x27\0\0", 4);
+    capture += (char)CAPTURE_RX;
+    capture += (char)frame.size();
+    capture += frame;
+  }
+  Json result = replayResult("fast", capture, 5000);
+  CHECK_EQ(result["malformed"].number, 1.0);
+  CHECK_EQ(result["foreign"].number, 1.0);
+  Json after = nextDiagnostics();
+  CHECK_EQ(after["malformed"].number, before["malformed"].number);
+  CHECK_EQ(after["foreign"].number, before["foreign"].number);
+}
+
+TEST(a_dump_is_handed_over_by_the_rs485_side_and_replays) {
+  broker.send(bridgeTopicOf(debugMode), "capture on");
+  CHECK(runUntil([] { return busCapture.frames >= 4; }, 30000));
+  broker.clear();
+  //Nothing is published until the RS485 side has stopped recording
+  broker.send(bridgeTopicOf(debugMode), "capture dump");
+  CHECK(runUntil([] { return busCapture.phase.load() == CAPTURE_DUMP_REQUESTED; }, 100));
+  CHECK_EQ(broker.count(bridgeTopicOf(captureTopic)), (size_t)0);
+  runFor(10);
+  CHECK_EQ((int)busCapture.phase.load(), (int)CAPTURE_OFF);
+  std::string dumped;
+  for (const Broker::Message& message : broker.snapshot()) {
+    if (message.topic == bridgeTopicOf(captureTopic)) {
+      dumped += message.payload;
+    }
+  }
+  CHECK_EQ(dumped.size(), busCapture.used);
+  //Recording stays off after the dump
+  unsigned long frames = busCapture.frames;
+  runFor(25000);
+  CHECK_EQ(busCapture.frames, frames);
+  Json result = replayResult("fast", dumped, 5000);
+  CHECK(result["frames"].number >= 2);
+}
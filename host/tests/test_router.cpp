@@ -0,0 +1,143 @@
+/* ************************ Topic router tests ************************
+ * topicKey(), the setRoutes table and callback() dispatching set topics to the
+ * RS485 side, and the wildcard subscriptions made on connect.
+ */
+#include "main.cpp"
+#include "harness.h"
+
+#include <string>
+
+using namespace host;
+
+Tr40 livingRoom("1");
+
+namespace {
+
+//Delivers a message to callback() the way PubSubClient does and returns the command
+//it handed to the RS485 side, empty when there is none
+std::string dispatch(const std::string& topic, const std::string& payload) {
+  std::vector<char> name(topic.begin(), topic.end());
+  name.push_back('\0');
+  callback(name.data(), (byte*)payload.data(), payload.size());
+  Command command;
+  std::string sent;
+  while (inboundCommands.pop(command)) {
+    sent += sent.empty() ? "" : "|";
+    sent += command.text;
+  }
+  StatusUpdate update;
+  while (outboundStatus.pop(update)) {
+  }
+  return sent;
+}
+
+//Queues a command on the RS485 side and returns what was queued and published for 
+//it, empty when nothing was queued
+std::string resolved(const char* command) {
+  uint8_t count = commandQueue.count;
+  std::string queued;
+  if (queueUserCommand(0, command, micros()) && commandQueue.count > count) {
+    queued = commandQueue.entries[count].text;
+  }
+  commandQueue.count = count;
+  StatusUpdate update;
+  while (outboundStatus.pop(update)) {
+    queued += std::string(" ") + update.key + " " + update.value;
+  }
+  return queued;
+}
+
+}  // namespace
+
+TEST(topic_keys_are_found_under_their_prefix) {
+  CHECK_STR(topicKey("a/b/SPH/set", "a/b"), "SPH/set");
+  CHECK(topicKey("a/bc/SPH/set", "a/b") == NULL);
+  CHECK(topicKey("a/b", "a/b") == NULL);
+  CHECK(topicKey("x/b/SPH/set", "a/b") == NULL);
+  CHECK_STR(topicKey("a/b/", "a/b"), "");
+}
+
+TEST(every_route_is_found_by_its_key) {
+  for (const SetRoute& route : setRoutes) {
+    CHECK(findSetRoute(route.key, strlen(route.key)) == &route);
+    CHECK_EQ(route.code, keyCode(route.key, strlen(route.key)));
+  }
+  CHECK(findSetRoute("T", 1) == NULL);
+  CHECK(findSetRoute("SPX", 3) == NULL);
+  CHECK(findSetRoute("SPHX", 4) == NULL);
+  CHECK(findSetRoute("", 0) == NULL);
+  //The key need not be null terminated
+  CHECK(findSetRoute("SPH/set", 3) == &setRoutes[1]);
+}
+
+TEST(set_topics_become_commands) {
+  CHECK_EQ(dispatch(setTopicOf("SPH"), "70"), std::string("SPH=70"));
+  CHECK_EQ(dispatch(setTopicOf("SPC"), "80"), std::string("SPC=80"));
+  CHECK_EQ(dispatch(setTopicOf("M"), "EH"), std::string("M=EH"));
+  CHECK_EQ(dispatch(setTopicOf("FM"), "1"), std::string("FM=1"));
+  CHECK_EQ(dispatch(setTopicOf("SC"), "0"), std::string("SC=0"));
+  CHECK_EQ(dispatch(setTopicOf("OT"), "-5"), std::string("OT=-5"));
+  CHECK_EQ(dispatch(setTopicOf("TIME"), "13:05:00"), std::string("TIME=13:05:00"));
+  CHECK_EQ(dispatch(setTopicOf("DATE"), "10/17/26"), std::string("DATE=10/17/26"));
+  CHECK_EQ(dispatch(setTopicOf("DOW"), "7"), std::string("DOW=7"));
+  CHECK_EQ(dispatch(setTopicOf("TM"), "Filter due"), std::string("TM=\"Filter due\""));
+  CHECK_EQ(dispatch(setTopicOf("TM"), "#"), std::string("TM=#"));
+}
+
+TEST(the_single_setpoint_is_resolved_on_the_rs485_side) {
+  //callback() never reads the mode, it only checks SP= is a number
+  CHECK_EQ(dispatch(setTopicOf("SP"), "69"), std::string("SP=69"));
+  CHECK_EQ(dispatch(setTopicOf("SP"), "hot"), std::string());
+  ThermostatState& state = thermostats[0].state;
+  state.mode = MODE_HEAT;
+  CHECK_EQ(resolved("SP=69"), std::string("SPH=69 SPH 69"));
+  CHECK_EQ(resolved("SP=110"), std::string());
+  state.mode = MODE_COOL;
+  CHECK_EQ(resolved("SP=79"), std::string("SPC=79 SPC 79"));
+  CHECK_EQ(resolved("SP=113"), std::string("SPC=113 SPC 113"));
+  state.mode = MODE_AUTO;
+  CHECK_EQ(resolved("SP=75"), std::string());
+  state.mode = MODE_UNKNOWN;
+  CHECK_EQ(resolved("SP=75"), std::string());
+}
+
+TEST(invalid_payloads_are_dropped) {
+  CHECK_EQ(dispatch(setTopicOf("SPH"), "120"), std::string());
+  CHECK_EQ(dispatch(setTopicOf("SPH"), "7O"), std::string());
+  CHECK_EQ(dispatch(setTopicOf("M"), "HEAT"), std::string());
+  CHECK_EQ(dispatch(setTopicOf("TM"), "say \"hi\""), std::string());
+  CHECK_EQ(dispatch(setTopicOf("TIME"), "24:00:00"), std::string());
+}
+
+TEST(topics_that_are_not_set_topics_are_ignored) {
+  CHECK_EQ(dispatch(topicOf("SPH"), "70"), std::string());
+  CHECK_EQ(dispatch(topicOf("SPH") + "/set/x", "70"), std::string());
+  CHECK_EQ(dispatch(setTopicOf("T"), "70"), std::string());
+  CHECK_EQ(dispatch(setTopicOf("XYZ"), "70"), std::string());
+  CHECK_EQ(dispatch("elsewhere/SPH/set", "70"), std::string());
+}
+
+TEST(the_debug_topic_sets_the_serial_level) {
+  dispatch(bridgeTopicOf("debug"), "warn");
+  CHECK_EQ(logger.serialLevel.load(), (uint8_t)LOG_LEVEL_WARN);
+  dispatch(bridgeTopicOf("debug"), "off");
+  CHECK_EQ(logger.serialLevel.load(), (uint8_t)LOG_LEVEL_NONE);
+}
+
+TEST(one_wildcard_subscription_covers_every_key) {
+  startBridge(livingRoom);
+  size_t setSubscriptions = 0;
+  for (const std::string& filter : broker.subscriptions) {
+    setSubscriptions += filter.find("/set") != std::string::npos;
+  }
+  CHECK_EQ(setSubscriptions, (size_t)DEVICE_COUNT);
+  for (const SetRoute& route : setRoutes) {
+    bool covered = false;
+    for (const std::string& filter : broker.subscriptions) {
+      covered = covered || Broker::matches(filter, setTopicOf(route.key));
+    }
+    CHECK(covered);
+  }
+  broker.send(setTopicOf("DOW"), "3");
+  CHECK(runUntil([] { return livingRoom.dayOfWeek == 3; }, 5000));
+}
@@ -0,0 +1,143 @@
+/* ************************ Runtime accumulator tests ************************
+ * The per-stage run time, cycles and short cycles, and the SCP holds, added up on
+ * the simulated clock. First the bridge polling a thermostat through an hour and
+ * publishing the rollup on <prefix>/runtime, then the accumulator on its own.
+ */
+#include "main.cpp"
+#include "harness.h"
+#include "json.h"
+
+#include <string>
+
+using namespace host;
+
+Tr40 livingRoom("1");
+
+namespace {
+
+//Moves the simulated clock on, without running the bridge
+void wait(unsigned long ms) {
+  advance(ms * 1000ULL);
+}
+
+//Parses the retained runtime rollup, an empty object when there is none or it is not valid
+Json rollup() {
+  Json document;
+  std::string error;
+  auto retained = broker.retained.find(topicOf("runtime"));
+  if (retained == broker.retained.end() || !Json::parse(retained->second.payload, document, error)) {
+    return Json();
+  }
+  return document;
+}
+
+}  // namespace
+
+TEST(an_hour_of_polling_is_published_as_a_rollup) {
+  //Heating for ten minutes, held off for two, then a short run held on for three
+  livingRoom.stages[Tr40::H1] = true;
+  livingRoom.stages[Tr40::FAN] = true;
+  startBridge(livingRoom);
+  unsigned long start = runtimes[0].periodStart;
+  runFor(600000);
+  livingRoom.stages[Tr40::H1] = false;
+  livingRoom.stagingDelays = "10";
+  runFor(120000);
+  livingRoom.stages[Tr40::H1] = true;
+  livingRoom.stagingDelays = "20";
+  runFor(180000);
+  livingRoom.stages[Tr40::H1] = false;
+  livingRoom.stagingDelays = "00";
+  CHECK(rollup().members.empty());
+  CHECK(runUntil([] { return rollup().has("seconds"); }, RUNTIME_ROLLUP_PERIOD));
+  CHECK(millis() - start >= RUNTIME_ROLLUP_PERIOD);
+  Json document = rollup();
+  CHECK_EQ(document["seconds"].number, RUNTIME_ROLLUP_PERIOD / 1000.0);
+  //Every figure is within a poll of what the thermostat did
+  const double poll = R2_POLL_PERIOD / 1000.0;
+  const Json& heat = document["H1"];
+  CHECK(heat["on"].number > 780 - 2 * poll && heat["on"].number < 780 + 2 * poll);
+  CHECK_EQ(heat["cycles"].number, 2.0);
+  CHECK_EQ(heat["short"].number, 1.0);
+  CHECK(document["fan"]["on"].number >= RUNTIME_ROLLUP_PERIOD / 1000.0 - poll);
+  CHECK_EQ(document["fan"]["cycles"].number, 1.0);
+  CHECK_EQ(document["C1"]["on"].number, 0.0);
+  CHECK_EQ(document["mot"].number, 1.0);
+  CHECK_EQ(document["mrt"].number, 1.0);
+  CHECK(document["held"].number > 300 - 2 * poll && document["held"].number < 300 + 2 * poll);
+}
+
+TEST(run_time_cycles_and_short_cycles_add_up_per_stage) {
+  RuntimeAccumulator runtime;
+  runtime.periodStart = millis();
+  runtime.stage(STAGE_H1, true);
+  wait(60000);
+  //Reported on again while it runs, not a new cycle
+  runtime.stage(STAGE_H1, true);
+  wait(60000);
+  runtime.stage(STAGE_H1, false);
+  wait(30000);
+  runtime.stage(STAGE_H1, true);
+  runtime.stage(STAGE_FAN, true);
+  wait(SHORT_CYCLE_TIME);
+  runtime.stage(STAGE_H1, false);
+  wait(10000);
+  runtime.stage(STAGE_FAN, false);
+  runtime.accrue(millis());
+  CHECK_EQ(runtime.totals.onTime[STAGE_H1], 120000UL + SHORT_CYCLE_TIME);
+  CHECK_EQ(runtime.totals.cycles[STAGE_H1], 2);
+  CHECK_EQ(runtime.totals.shortCycles[STAGE_H1], 1);
+  CHECK_EQ(runtime.totals.onTime[STAGE_FAN], SHORT_CYCLE_TIME + 10000UL);
+  CHECK_EQ(runtime.totals.cycles[STAGE_FAN], 1);
+  CHECK_EQ(runtime.totals.shortCycles[STAGE_FAN], 0);
+  CHECK_EQ(runtime.totals.onTime[STAGE_C1], 0UL);
+}
+
+TEST(the_scp_digits_are_one_hold_per_stage) {
+  RuntimeAccumulator runtime;
+  runtime.protection("00");
+  wait(1000);
+  CHECK_EQ(runtime.held, 0);
+  //Stage 1 held off by its minimum off time, counted once however often it is reported
+  runtime.protection("10");
+  wait(20000);
+  runtime.protection("10");
+  wait(20000);
+  CHECK_EQ(runtime.held, 1);
+  CHECK_EQ(runtime.totals.minOffHolds, 1);
+  CHECK_EQ(runtime.totals.minRunHolds, 0);
+  //Stage 2 held on by its minimum run time while stage 1 is still held
+  runtime.protection("12");
+  wait(20000);
+  CHECK_EQ(runtime.held, 1 | 2 << 2);
+  CHECK_EQ(runtime.totals.minOffHolds, 1);
+  CHECK_EQ(runtime.totals.minRunHolds, 1);
+  runtime.protection("00");
+  wait(20000);
+  runtime.protection("20");
+  wait(5000);
+  runtime.protection("00");
+  CHECK_EQ(runtime.held, 0);
+  CHECK_EQ(runtime.totals.minOffHolds, 1);
+  CHECK_EQ(runtime.totals.minRunHolds, 2);
+  CHECK_EQ(runtime.totals.heldTime, 65000UL);
+}
+
+TEST(anything_but_a_hold_digit_is_not_held) {
+  RuntimeAccumulator runtime;
+  const char* const values[] = {"", "0", "03", "MOT", "MRT/0", "x", NULL};
+  for (const char* value : values) {
+    runtime.protection(value);
+    wait(1000);
+  }
+  CHECK_EQ(runtime.held, 0);
+  CHECK_EQ(runtime.totals.minOffHolds, 0);
+  CHECK_EQ(runtime.totals.minRunHolds, 0);
+  CHECK_EQ(runtime.totals.heldTime, 0UL);
+  //Each digit stands on its own
+  runtime.protection("x1");
+  CHECK_EQ(runtime.held, 1 << 2);
+  runtime.protection("1");
+  CHECK_EQ(runtime.held, 1);
+  CHECK_EQ(runtime.totals.minOffHolds, 2);
+}
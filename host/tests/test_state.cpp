@@ -0,0 +1,185 @@
+/* ************************ Thermostat state tests ************************
+ * The dirty bits set by the parser and walked by the publish stage: only changed
+ * fields go out, a full outbound queue leaves them dirty, and the heartbeats of a
+ * refresh are spread out instead of going out in a burst.
+ */
+#include "main.cpp"
+#include "harness.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace host;
+
+Tr40 livingRoom("1");
+
+namespace {
+
+//Parses a frame and returns the status values it queued for publishing, key=value
+std::vector<std::string> parse(const char* text) {
+  char frame[RX_BUFFER_SIZE];
+  snprintf(frame, sizeof(frame), "%s", text);
+  parseReceived(frame, strlen(frame));
+  std::vector<std::string> queued;
+  StatusUpdate update;
+  while (outboundStatus.pop(update)) {
+    queued.push_back(std::string(update.key) + "=" + update.value);
+  }
+  return queued;
+}
+
+const char* const R1 = "A=00 O=1 OA=88 Z=1 T=77 SP= 70 SPH=70 SPC=78 M=H FM=0";
+
+}  // namespace
+
+TEST(set_marks_a_field_dirty_only_when_it_changes) {
+  ThermostatState state;
+  state.set(FIELD_TEMP, state.temp, 70);
+  CHECK_EQ(state.dirty, (uint16_t)(1 << FIELD_TEMP));
+  CHECK_EQ(state.known, (uint16_t)(1 << FIELD_TEMP));
+  state.dirty = 0;
+  state.set(FIELD_TEMP, state.temp, 70);
+  CHECK_EQ(state.dirty, (uint16_t)0);
+  state.set(FIELD_TEMP, state.temp, 71);
+  CHECK_EQ(state.dirty, (uint16_t)(1 << FIELD_TEMP));
+  //A first value is news even when it matches the power on default
+  ThermostatState fresh;
+  fresh.set(FIELD_FAN_MODE, fresh.fanMode, NO_VALUE);
+  CHECK_EQ(fresh.dirty, (uint16_t)(1 << FIELD_FAN_MODE));
+}
+
+TEST(fields_format_as_their_topics_expect) {
+  ThermostatState state;
+  char value[PUBLISH_VALUE_LENGTH];
+  state.set(FIELD_OUTSIDE_AIR, state.outsideAir, -4);
+  state.format(FIELD_OUTSIDE_AIR, value, sizeof(value));
+  CHECK_STR(value, "-4");
+  state.mode = MODE_EMERGENCY_HEAT;
+  state.format(FIELD_MODE, value, sizeof(value));
+  CHECK_STR(value, "EH");
+  state.action = ACTION_IDLE;
+  state.format(FIELD_ACTION, value, sizeof(value));
+  CHECK_STR(value, "I");
+}
+
+TEST(the_first_frame_publishes_every_field_it_carries) {
+  advance(1000000);
+  std::vector<std::string> queued = parse(R1);
+  std::vector<std::string> expected = {"OA=88", "T=77", "SPH=70", "SPC=78", "M=H", "FM=0"};
+  CHECK(queued == expected);
+  CHECK_EQ(thermostats[0].state.dirty, (uint16_t)0);
+}
+
+TEST(an_unchanged_frame_publishes_nothing) {
+  advance(1000000);
+  CHECK(parse(R1).empty());
+  advance(1000000);
+  CHECK(parse(R1).empty());
+}
+
+TEST(only_the_changed_fields_are_published) {
+  advance(1000000);
+  std::vector<std::string> queued = parse("A=00 O=1 OA=88 Z=1 T=77 SP= 71 SPH=71 SPC=78 M=H FM=1");
+  std::vector<std::string> expected = {"SPH=71", "FM=1"};
+  CHECK(queued == expected);
+}
+
+TEST(a_full_outbound_queue_leaves_the_fields_dirty) {
+  advance(1000000);
+  StatusUpdate filler;
+  filler.thermostat = &thermostats[0];
+  snprintf(filler.key, sizeof(filler.key), "x");
+  snprintf(filler.value, sizeof(filler.value), "x");
+  while (outboundStatus.push(filler)) {
+  }
+  char frame[RX_BUFFER_SIZE];
+  snprintf(frame, sizeof(frame), "%s", "A=00 O=1 SPH=72 SPC=79");
+  parseReceived(frame, strlen(frame));
+  uint16_t both = (1 << FIELD_SETPOINT_HEAT) | (1 << FIELD_SETPOINT_COOL);
+  CHECK_EQ(thermostats[0].state.dirty & both, both);
+  StatusUpdate update;
+  while (outboundStatus.pop(update)) {
+  }
+  //Sent once there is room again
+  publishChanges(thermostats[0]);
+  std::vector<std::string> queued;
+  while (outboundStatus.pop(update)) {
+    queued.push_back(std::string(update.key) + "=" + update.value);
+  }
+  std::vector<std::string> expected = {"SPH=72", "SPC=79"};
+  CHECK(queued == expected);
+  CHECK_EQ(thermostats[0].state.dirty, (uint16_t)0);
+}
+
+TEST(a_refresh_goes_out_a_few_fields_per_pass) {
+  advance(1000000);
+  ThermostatState& state = thermostats[0].state;
+  state.refreshAll();
+  std::vector<std::string> queued;
+  unsigned int passes = 0;
+  while (state.refresh != 0 && passes < FIELD_COUNT) {
+    publishChanges(thermostats[0]);
+    size_t before = queued.size();
+    StatusUpdate update;
+    while (outboundStatus.pop(update)) {
+      queued.push_back(update.key);
+    }
+    CHECK(queued.size() - before <= REFRESH_FIELDS_PER_PASS);
+    passes ++;
+  }
+  //Every known field once, whatever the policies were holding back
+  CHECK_EQ(queued.size(), (size_t)__builtin_popcount(state.known));
+  CHECK(passes > 1);
+  CHECK_EQ(state.dirty, (uint16_t)0);
+}
+
+TEST(the_refresh_is_spread_over_time) {
+  startBridge(livingRoom);
+  runFor(60000);
+  broker.clear();
+  //No value changes, so everything published from here on is a heartbeat
+  runFor(HEARTBEAT_PERIOD + 60000);
+  std::map<std::string, std::vector<uint64_t>> heartbeats;
+  for (const Broker::Message& message : broker.snapshot()) {
+    for (uint8_t field = 0; field < FIELD_COUNT; field++) {
+      if (message.topic == topicOf(fieldKeys[field])) {
+        heartbeats[message.topic].push_back(message.at);
+      }
+    }
+  }
+  //Every field the thermostat reports was refreshed, and no two fields at once. SC is
+  //only reported after it is written.
+  CHECK_EQ(heartbeats.size(), (size_t)FIELD_COUNT - 1);
+  CHECK(heartbeats.count(topicOf("SC")) == 0);
+  std::vector<uint64_t> times;
+  for (auto& field : heartbeats) {
+    CHECK(!field.second.empty());
+    times.push_back(field.second.front());
+  }
+  std::sort(times.begin(), times.end());
+  for (size_t i = 1; i < times.size(); i++) {
+    CHECK(times[i] - times[i - 1] >= HEARTBEAT_STAGGER * 1000ULL / 2);
+  }
+}
+
+TEST(working_out_the_sleep_leaves_the_publish_state_alone) {
+  advance(1000000);
+  ThermostatState& state = thermostats[0].state;
+  uint16_t bit = 1 << FIELD_OUTSIDE_AIR;
+  CHECK(state.published & bit);
+  //A change inside the outside air's deadband, not yet seen by the publish stage
+  state.outsideAir = state.publishedValue[FIELD_OUTSIDE_AIR] + 1;
+  state.dirty |= bit;
+  unsigned long suppressed = metrics.suppressedPublishes;
+  CHECK(state.nextDue(millis(), 0) > 0);
+  busIdleTime();
+  busIdleTime();
+  CHECK_EQ(state.dirty, bit);
+  CHECK_EQ(metrics.suppressedPublishes, suppressed);
+  //The publish stage drops it and counts it once
+  publishChanges(thermostats[0]);
+  CHECK(outboundStatus.empty());
+  CHECK_EQ(state.dirty, (uint16_t)0);
+  CHECK_EQ(metrics.suppressedPublishes, suppressed + 1);
+}
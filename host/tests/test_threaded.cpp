@@ -0,0 +1,114 @@
+/* ************************ Threaded build tests ************************
+ * The dual core build, with the MQTT side in networkTask() on its own std::thread
+ * and loop() on the test's thread, on the wall clock. The SPSC ring buffers are
+ * stressed between two threads, and the bridge is driven hard enough from both
+ * sides that the ThreadSanitizer build of this test finds any state the two sides
+ * share outside the queues and the phase handshakes, the diagnostics, profile and
+ * log dumps included.
+ */
+#define BRIDGE_DUAL_CORE
+//Often enough that the diagnostics go out many times while the test runs
+#define DIAG_PERIOD 200
+
+#include "main.cpp"
+#include "harness.h"
+
+#include <string>
+#include <thread>
+
+using namespace host;
+
+Tr40 livingRoom("1");
+
+namespace {
+
+//A command whose text is derived from its sequence number, so a torn copy shows
+Command numbered(uint32_t sequence) {
+  Command command;
+  snprintf(command.text, sizeof(command.text), "SEQ=%08lx %0*lu", (unsigned long)sequence,
+           (int)(sequence % 60), (unsigned long)sequence);
+  command.device = sequence & 0xFF;
+  command.priority = (sequence & 1) ? PRIORITY_USER : PRIORITY_POLL;
+  return command;
+}
+
+}  // namespace
+
+TEST(the_ring_buffer_hands_over_every_entry_in_order) {
+  const uint32_t count = 500000;
+  RingBuffer<Command, 8> ring;
+  std::thread producer([&] {
+    for (uint32_t i = 0; i < count; i++) {
+      Command command = numbered(i);
+      while (!ring.push(command)) {
+        std::this_thread::yield();
+      }
+    }
+  });
+  uint32_t received = 0;
+  unsigned long mismatches = 0;
+  Command command;
+  while (received < count) {
+    if (!ring.pop(command)) {
+      std::this_thread::yield();
+      continue;
+    }
+    Command expected = numbered(received);
+    if (strcmp(command.text, expected.text) != 0 || command.device != expected.device ||
+        command.priority != expected.priority) {
+      mismatches ++;
+    }
+    received ++;
+  }
+  producer.join();
+  CHECK_EQ(mismatches, 0UL);
+  CHECK(ring.empty());
+}
+
+TEST(the_network_side_runs_in_its_own_task) {
+  useRealClock();
+  //Polls a few times a second so the test does not wait on the 20 s periods
+  PollScheduler& scheduler = thermostats[0].pollScheduler;
+  scheduler.r1Period = scheduler.r2Period = 400;
+  scheduler.r1ActivePeriod = scheduler.r2ActivePeriod = 200;
+  livingRoom.turnaround = 2000;
+  startBridge(livingRoom);
+  CHECK(broker.session);
+  CHECK(runUntil([] { return lastValue("T") == "72" && !lastValue("action").empty(); }, 5000));
+  broker.send(setTopicOf("SPH"), "70");
+  CHECK(runUntil([] { return livingRoom.setpointHeat == 70 && lastValue("SPH") == "70"; }, 5000));
+}
+
+TEST(commands_and_status_cross_between_the_tasks_under_load) {
+  //Set topics arrive on the network task while the bus task polls, parses and 
+  //publishes, logging every frame it sends into the ring the network task dumps and 
+  //changes the serial level of. The inbound queue is bounded, so some of these are dropped.
+  logger.ringLevel = LOG_LEVEL_DEBUG;
+  size_t diagnostics = broker.count(bridgeTopicOf(diagnosticsTopic));
+  size_t profiles = broker.count(bridgeTopicOf(profileTopic));
+  size_t logs = broker.count(bridgeTopicOf(logTopic));
+  std::thread homeAssistant([] {
+    //The log level changes are read by the bus task's every log call
+    const char* const debug[] = {"capture on", "profile", "dump", "error", "profile", "off"};
+    for (int i = 0; i < 100; i++) {
+      broker.send(setTopicOf("SPH"), std::to_string(50 + i % 50));
+      broker.send(setTopicOf("SP"), std::to_string(60 + i % 30));
+      broker.send(setTopicOf("FM"), (i & 1) ? "1" : "0");
+      broker.send(bridgeTopicOf(debugMode), (i % 20 == 0) ? "capture dump" : debug[i % 6]);
+      std::this_thread::sleep_for(std::chrono::microseconds(2000));
+    }
+  });
+  runFor(1000);
+  homeAssistant.join();
+  CHECK(runUntil([] { return broker.pending() == 0 && inboundCommands.empty() && commandQueue.count == 0; }, 20000));
+  //Once the bus has caught up the last write wins and the status follows it
+  broker.send(setTopicOf("SPH"), "66");
+  broker.send(setTopicOf("FM"), "0");
+  CHECK(runUntil([] { return livingRoom.setpointHeat == 66 && lastValue("SPH") == "66"; }, 5000));
+  CHECK(runUntil([] { return livingRoom.fanMode == 0 && lastValue("FM") == "0"; }, 5000));
+  CHECK(metrics.parseTime.samples > 0);
+  CHECK(broker.count(bridgeTopicOf(diagnosticsTopic)) > diagnostics);
+  CHECK(broker.count(bridgeTopicOf(profileTopic)) > profiles);
+  CHECK(broker.count(bridgeTopicOf(logTopic)) > logs);
+  stopTasks();
+}
@@ -0,0 +1,155 @@
+/* ************************ Transaction engine tests ************************
+ * TransactionEngine on an injected clock with a recorded transmit: deadlines,
+ * retries with backoff, timeouts, late and unmatched responses, and the running
+ * bridge against a thermostat that drops replies or is drowned in noise.
+ */
+#include "main.cpp"
+#include "harness.h"
+
+#include <string>
+#include <vector>
+
+using namespace host;
+
+Tr40 livingRoom("1");
+
+namespace {
+
+unsigned long fakeNow = 0;
+std::vector<unsigned long> sendTimes;
+std::vector<TransactionResult> results;
+
+unsigned long fakeClock() {
+  return fakeNow;
+}
+
+void recordTransmit(uint8_t device, const char* request) {
+  sendTimes.push_back(fakeNow);
+}
+
+void recordCompleted(uint8_t device, const char* request, TransactionResult result) {
+  results.push_back(result);
+}
+
+TransactionEngine engine() {
+  TransactionEngine transactions;
+  transactions.clock = fakeClock;
+  transactions.transmit = recordTransmit;
+  transactions.completed = recordCompleted;
+  fakeNow = 1000;
+  sendTimes.clear();
+  results.clear();
+  return transactions;
+}
+
+//Polls the engine a millisecond at a time
+void run(TransactionEngine& transactions, unsigned long ms) {
+  for (unsigned long i = 0; i < ms; i++) {
+    fakeNow ++;
+    transactions.poll();
+  }
+}
+
+}  // namespace
+
+TEST(the_deadline_follows_the_baud_rate_and_frame_length) {
+  unsigned long shortFrame = TransactionEngine::responseTimeout(3);
+  unsigned long longFrame = TransactionEngine::responseTimeout(40);
+  CHECK(shortFrame > RESPONSE_TURNAROUND);
+  //Each character is ten bits at the bus baud rate, give or take the rounding up
+  unsigned long extra = 37UL * BITS_PER_BYTE * 1000 / RS485_BAUD;
+  CHECK(longFrame - shortFrame >= extra && longFrame - shortFrame <= extra + 1);
+}
+
+TEST(one_request_is_outstanding_at_a_time) {
+  TransactionEngine transactions = engine();
+  CHECK(transactions.begin(0, "R=1"));
+  CHECK(transactions.busy());
+  CHECK(!transactions.begin(0, "R=2"));
+  CHECK_EQ(sendTimes.size(), (size_t)1);
+  CHECK(transactions.responseReceived(0));
+  CHECK(!transactions.busy());
+  CHECK_EQ(results.size(), (size_t)1);
+  CHECK_EQ(results[0], TRANSACTION_OK);
+  CHECK(transactions.begin(0, "R=2"));
+}
+
+TEST(unanswered_requests_are_retried_with_backoff_then_time_out) {
+  TransactionEngine transactions = engine();
+  transactions.begin(0, "R=1");
+  unsigned long timeout = TransactionEngine::responseTimeout(strlen("R=1") + 12);
+  run(transactions, 10000);
+  CHECK_EQ(sendTimes.size(), (size_t)(1 + TRANSACTION_RETRIES));
+  CHECK_EQ(transactions.retriesSent, (unsigned long)TRANSACTION_RETRIES);
+  CHECK_EQ(transactions.timeouts, 1UL);
+  CHECK_EQ(results.size(), (size_t)1);
+  CHECK_EQ(results[0], TRANSACTION_TIMEOUT);
+  CHECK(!transactions.busy());
+  //The gap before each retry is the deadline and a doubling backoff
+  for (size_t i = 1; i < sendTimes.size(); i++) {
+    CHECK_EQ(sendTimes[i] - sendTimes[i - 1], timeout + (RETRY_BACKOFF << (i - 1)));
+  }
+}
+
+TEST(frames_from_other_devices_do_not_answer_or_retry) {
+  TransactionEngine transactions = engine();
+  transactions.begin(1, "R=1");
+  CHECK(!transactions.responseReceived(0));
+  CHECK(!transactions.responseReceived(2));
+  CHECK(transactions.busy());
+  CHECK_EQ(sendTimes.size(), (size_t)1);
+  CHECK(results.empty());
+  //Nor does a response when nothing is outstanding
+  CHECK(transactions.responseReceived(1));
+  CHECK(!transactions.responseReceived(1));
+  CHECK_EQ(results.size(), (size_t)1);
+}
+
+TEST(a_late_response_while_waiting_to_retry_still_counts) {
+  TransactionEngine transactions = engine();
+  transactions.begin(0, "SPH=70");
+  unsigned long timeout = TransactionEngine::responseTimeout(strlen("SPH=70") + 12);
+  run(transactions, timeout + 1);
+  CHECK(transactions.waitingToRetry);
+  CHECK(transactions.responseReceived(0));
+  CHECK_EQ(results.size(), (size_t)1);
+  CHECK_EQ(results[0], TRANSACTION_OK);
+  run(transactions, 1000);
+  CHECK_EQ(sendTimes.size(), (size_t)1);
+}
+
+TEST(untilDue_tracks_the_deadline_and_the_retry) {
+  TransactionEngine transactions = engine();
+  CHECK_EQ(transactions.untilDue(), ULONG_MAX);
+  transactions.begin(0, "R=1");
+  unsigned long timeout = TransactionEngine::responseTimeout(strlen("R=1") + 12);
+  CHECK_EQ(transactions.untilDue(), timeout);
+  run(transactions, timeout);
+  CHECK_EQ(transactions.untilDue(), (unsigned long)RETRY_BACKOFF);
+}
+
+TEST(the_bridge_recovers_from_dropped_replies) {
+  livingRoom.dropRate = 0.3;
+  startBridge(livingRoom);
+  broker.send(setTopicOf("SPH"), "64");
+  CHECK(runUntil([] { return livingRoom.setpointHeat == 64; }, 20000));
+  runFor(120000);
+  CHECK(transactions.retriesSent > 0);
+  CHECK_EQ(lastValue("SPH"), std::string("64"));
+  livingRoom.dropRate = 0;
+}
+
+TEST(noise_on_the_bus_does_not_cause_retransmits) {
+  runFor(30000);
+  size_t frames = bus.sent.size();
+  unsigned long retries = transactions.retriesSent;
+  //Traffic for another thermostat and garbage, arriving all the time
+  for (int i = 0; i < 200; i++) {
+    at(now() + i * 250000ULL, [i] { bus.reply(i % 2 ? "A=00 O=7 T=70\r" : "~~x\x01 O=\r", now()); });
+  }
+  runFor(50000);
+  CHECK_EQ(transactions.retriesSent, retries);
+  //Only the polls went out
+  CHECK(bus.sent.size() - frames <= 50000 / R1_POLL_PERIOD + 50000 / R2_POLL_PERIOD + 1);
+  CHECK(metrics.foreignFrames > 0);
+}
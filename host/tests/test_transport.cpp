@@ -0,0 +1,192 @@
+/* ************************ RS485 transport tests ************************
+ * The driver enable pin around each frame, recorded by the shim's digitalWrite():
+ * raised before the first start bit, held while the frame is on the wire and dropped
+ * the tail guard after the last stop bit. First the running bridge on the simulated
+ * bus, also with connect attempts to a broker that is down blocking the loop, then
+ * RS485Transport on an injected clock going by the baud rate and by a UART's
+ * transmit done hook.
+ */
+#include "main.cpp"
+#include "harness.h"
+
+#include <string>
+#include <vector>
+
+using namespace host;
+
+Tr40 livingRoom("1");
+
+namespace {
+
+//A pin of its own, so the bridge's direction pin is left alone
+const uint8_t TEST_PIN = 5;
+
+unsigned long fakeNow = 0;
+bool uartDone = false;
+
+unsigned long fakeClock() {
+  return fakeNow;
+}
+
+size_t discardWrite(const char* data, size_t length) {
+  return length;
+}
+
+bool fakeTxDone() {
+  return uartDone;
+}
+
+RS485Transport transport(unsigned long baud) {
+  RS485Transport rs485;
+  rs485.clock = fakeClock;
+  rs485.write = discardWrite;
+  rs485.directionPin = TEST_PIN;
+  rs485.baud = baud;
+  rs485.begin();
+  fakeNow = 1000;
+  uartDone = false;
+  return rs485;
+}
+
+//The writes to one pin recorded so far
+std::vector<PinWrite> writesTo(uint8_t pin) {
+  std::vector<PinWrite> found;
+  for (const PinWrite& write : pinWrites) {
+    if (write.pin == pin) {
+      found.push_back(write);
+    }
+  }
+  return found;
+}
+
+}  // namespace
+
+TEST(the_driver_is_enabled_for_exactly_each_frame) {
+  recordPins = true;
+  startBridge(livingRoom);
+  runFor(60000);
+  recordPins = false;
+  CHECK_EQ(pinModeOf(SSerialTxControl), OUTPUT);
+  std::vector<PinWrite> writes = writesTo(SSerialTxControl);
+  CHECK(!bus.sent.empty());
+  //Set to receive at start up, then raised and dropped once for each frame
+  CHECK_EQ(writes.size(), 1 + 2 * bus.sent.size());
+  CHECK(!writes.empty() && writes[0].value == RS485Receive);
+  for (size_t i = 0; i < bus.sent.size() && 2 + 2 * i < writes.size(); i++) {
+    const Bus::Frame& frame = bus.sent[i];
+    const PinWrite& raised = writes[1 + 2 * i];
+    const PinWrite& dropped = writes[2 + 2 * i];
+    //The frame and its line end, at the bus's baud rate
+    uint64_t startedAt = frame.at - (frame.text.size() + 1) * bus.byteTime();
+    CHECK_EQ(raised.value, RS485Transmit);
+    CHECK_EQ(dropped.value, RS485Receive);
+    CHECK(raised.at <= startedAt && startedAt - raised.at <= RS485_LEAD_GUARD);
+    //Held past the last stop bit for the tail guard, and let go within one more
+    CHECK(dropped.at >= frame.at + RS485_TAIL_GUARD);
+    CHECK(dropped.at < frame.at + 2 * RS485_TAIL_GUARD);
+    if (i + 1 < bus.sent.size()) {
+      CHECK(dropped.at < bus.sent[i + 1].at);
+    }
+  }
+}
+
+TEST(the_driver_is_off_before_each_reply_while_a_connect_attempt_blocks) {
+  //The broker is down and each connect attempt holds the loop for two seconds. One is 
+  //forced on every pass, so each frame sent is followed by one before the next pass.
+  broker.stop();
+  broker.connectTime = 2000000;
+  size_t firstReply = bus.replies.size();
+  pinWrites.clear();
+  recordPins = true;
+  uint64_t end = now() + 120000 * 1000ULL;
+  while (now() < end) {
+    mqttReconnector.nextAttempt = millis();
+    loop();
+    advance(passTime);
+  }
+  recordPins = false;
+  broker.connectTime = 0;
+  broker.start();
+  std::vector<PinWrite> writes = writesTo(SSerialTxControl);
+  CHECK(bus.replies.size() > firstReply);
+  for (size_t i = firstReply; i < bus.replies.size(); i++) {
+    const Bus::Frame& reply = bus.replies[i];
+    uint64_t startedAt = reply.at - (reply.text.size() + 1) * bus.byteTime();
+    //The last write to the pin before the thermostat starts answering
+    const PinWrite* last = NULL;
+    for (const PinWrite& write : writes) {
+      if (write.at <= startedAt) {
+        last = &write;
+      }
+    }
+    CHECK(last != NULL && last->value == RS485Receive);
+  }
+}
+
+TEST(the_frame_time_follows_the_baud_rate) {
+  //Ten bits a byte, rounded up to the next microsecond
+  CHECK_EQ(RS485Transport::frameTime(1, 9600), 1042UL);
+  CHECK_EQ(RS485Transport::frameTime(12, 9600), 12500UL);
+  CHECK_EQ(RS485Transport::frameTime(12, 19200), 6250UL);
+  CHECK_EQ(RS485Transport::frameTime(1, 115200), 87UL);
+  CHECK_EQ(RS485Transport::frameTime(0, 9600), 0UL);
+}
+
+TEST(without_a_tx_done_hook_the_driver_is_held_for_the_frame_time) {
+  RS485Transport rs485 = transport(19200);
+  CHECK_EQ(pinModeOf(TEST_PIN), OUTPUT);
+  CHECK_EQ(digitalRead(TEST_PIN), RS485Receive);
+  CHECK(rs485.send("A=00 O=1 R=1", 12));
+  CHECK_EQ(digitalRead(TEST_PIN), RS485Transmit);
+  CHECK(rs485.busy());
+  CHECK(!rs485.send("A=00 O=1 R=2", 12));
+  unsigned long frameEnd = 1000 + RS485Transport::frameTime(12, 19200);
+  fakeNow = frameEnd - 1;
+  rs485.service();
+  CHECK_EQ(digitalRead(TEST_PIN), RS485Transmit);
+  fakeNow = frameEnd;
+  rs485.service();
+  CHECK_EQ(digitalRead(TEST_PIN), RS485Transmit);
+  fakeNow = frameEnd + rs485.tailGuard - 1;
+  rs485.service();
+  CHECK_EQ(digitalRead(TEST_PIN), RS485Transmit);
+  CHECK(rs485.busy());
+  fakeNow = frameEnd + rs485.tailGuard;
+  rs485.service();
+  CHECK_EQ(digitalRead(TEST_PIN), RS485Receive);
+  CHECK(!rs485.busy());
+  CHECK_EQ(rs485.untilDue(), ULONG_MAX);
+}
+
+TEST(a_uart_that_reports_tx_done_is_followed_instead_of_the_baud_rate) {
+  RS485Transport rs485 = transport(9600);
+  rs485.txDone = fakeTxDone;
+  CHECK(rs485.send("A=00 O=1 R=1", 12));
+  //Long past the frame time, but the UART still has bits to shift out
+  fakeNow += 3 * RS485Transport::frameTime(12, 9600);
+  rs485.service();
+  CHECK_EQ(digitalRead(TEST_PIN), RS485Transmit);
+  uartDone = true;
+  unsigned long doneAt = fakeNow;
+  rs485.service();
+  CHECK_EQ(digitalRead(TEST_PIN), RS485Transmit);
+  fakeNow = doneAt + rs485.tailGuard - 1;
+  rs485.service();
+  CHECK_EQ(digitalRead(TEST_PIN), RS485Transmit);
+  fakeNow = doneAt + rs485.tailGuard;
+  rs485.service();
+  CHECK_EQ(digitalRead(TEST_PIN), RS485Receive);
+}
+
+TEST(a_uart_that_reports_tx_done_still_lets_the_loop_sleep_out_the_frame) {
+  RS485Transport rs485 = transport(9600);
+  rs485.txDone = fakeTxDone;
+  unsigned long frame = RS485Transport::frameTime(12, 9600);
+  CHECK(rs485.send("A=00 O=1 R=1", 12));
+  CHECK_EQ(rs485.untilDue(), (frame + rs485.tailGuard) / 1000);
+  fakeNow += frame / 2;
+  CHECK_EQ(rs485.untilDue(), (frame - frame / 2 + rs485.tailGuard) / 1000);
+  //Past the estimate the UART is asked on every pass until it reports the frame out
+  fakeNow += frame;
+  CHECK_EQ(rs485.untilDue(), 0UL);
+}
@@ -0,0 +1,205 @@
+/* ************************ Payload validator property tests ************************
+ * Each kind of set topic payload swept over its whole input space, or a seeded
+ * random sample of it, against a plain reference rule. Whatever the validators let
+ * through has to build a command that fits the queue and that the thermostat takes.
+ */
+#include "main.cpp"
+#include "harness.h"
+
+#include <algorithm>
+#include <random>
+#include <string>
+
+using namespace host;
+
+namespace {
+
+std::mt19937 generator(17);
+
+bool valid(const char* key, const std::string& text) {
+  const SetRoute* route = findSetRoute(key, strlen(key));
+  return route != NULL && validatePayload(*route, Payload{text.data(), text.size()});
+}
+
+//The command a payload builds, empty when it is rejected or does not fit
+std::string command(const char* key, const std::string& text) {
+  const SetRoute* route = findSetRoute(key, strlen(key));
+  Payload payload{text.data(), text.size()};
+  char buffer[COMMAND_MAX_LENGTH];
+  if (route == NULL || !validatePayload(*route, payload) || !buildCommand(*route, payload, buffer, sizeof(buffer))) {
+    return "";
+  }
+  return buffer;
+}
+
+std::string twoDigits(int value) {
+  char text[4];
+  snprintf(text, sizeof(text), "%02d", value);
+  return text;
+}
+
+std::string randomText(size_t length, const char* alphabet) {
+  std::string text;
+  size_t size = strlen(alphabet);
+  for (size_t i = 0; i < length; i++) {
+    text += alphabet[generator() % size];
+  }
+  return text;
+}
+
+}  // namespace
+
+TEST(integers_are_valid_exactly_inside_their_range) {
+  for (const SetRoute& route : setRoutes) {
+    if (route.kind != PAYLOAD_INTEGER) {
+      continue;
+    }
+    for (long value = route.min - 100; value <= route.max + 100; value++) {
+      std::string text = std::to_string(value);
+      bool inside = value >= route.min && value <= route.max;
+      CHECK_EQ(valid(route.key, text), inside);
+      CHECK_EQ(command(route.key, text), inside ? std::string(route.key) + "=" + text : std::string());
+    }
+  }
+}
+
+TEST(integers_are_only_digits_with_an_optional_minus) {
+  const char* const malformed[] = {"", "-", "+5", " 5", "5 ", "5.0", "--5", "0x10", "7O", "1e2", "5-", "1234567"};
+  for (const char* text : malformed) {
+    CHECK(!valid("OT", text));
+    CHECK(!valid("SPH", text));
+  }
+  long value;
+  for (int i = 0; i < 10000; i++) {
+    long expected = (long)(generator() % 1999999) - 999999;
+    std::string text = std::to_string(expected);
+    CHECK(parseInteger(Payload{text.data(), text.size()}, value) && value == expected);
+  }
+  //Leading zeros are still the number
+  CHECK(parseInteger(Payload{"070", 3}, value) && value == 70);
+  CHECK(valid("SPH", "070"));
+}
+
+TEST(one_of_takes_only_the_listed_values) {
+  for (const SetRoute& route : setRoutes) {
+    if (route.kind != PAYLOAD_ONE_OF) {
+      continue;
+    }
+    for (const char* const* value = route.values; *value != NULL; value++) {
+      CHECK_EQ(command(route.key, *value), std::string(route.key) + "=" + *value);
+      std::string lower = *value;
+      std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+      CHECK(lower == *value || !valid(route.key, lower));
+      CHECK(!valid(route.key, std::string(*value) + *value));
+      CHECK(!valid(route.key, std::string(" ") + *value));
+    }
+    CHECK(!valid(route.key, ""));
+  }
+  //Random short strings are only valid when they are listed
+  for (int i = 0; i < 20000; i++) {
+    std::string text = randomText(1 + generator() % 2, "01?OHCAEIhx");
+    bool listed = false;
+    for (const char* const* value = modeValues; *value != NULL; value++) {
+      listed = listed || text == *value;
+    }
+    CHECK_EQ(valid("M", text), listed);
+  }
+}
+
+TEST(times_are_hh_mm_ss_in_range) {
+  for (int hours = 0; hours < 100; hours++) {
+    for (int minutes = 0; minutes < 100; minutes++) {
+      int seconds = (hours * 7 + minutes) % 100;
+      std::string text = twoDigits(hours) + ":" + twoDigits(minutes) + ":" + twoDigits(seconds);
+      CHECK_EQ(valid("TIME", text), hours <= 23 && minutes <= 59 && seconds <= 59);
+    }
+  }
+  const char* const malformed[] = {"1:05:00", "01:05:0", "01:05:000", "01-05-00", "01:05/00", "0a:05:00", "", "01:05:00 "};
+  for (const char* text : malformed) {
+    CHECK(!valid("TIME", text));
+  }
+  CHECK_EQ(command("TIME", "23:59:59"), std::string("TIME=23:59:59"));
+}
+
+TEST(dates_are_mm_dd_yy_in_range) {
+  for (int month = 0; month < 100; month++) {
+    for (int day = 0; day < 100; day++) {
+      int year = (month * 13 + day) % 100;
+      std::string text = twoDigits(month) + "/" + twoDigits(day) + "/" + twoDigits(year);
+      CHECK_EQ(valid("DATE", text), month >= 1 && month <= 12 && day >= 1 && day <= 31);
+    }
+  }
+  const char* const malformed[] = {"1/17/26", "10/17/2026", "10-17-26", "10/17:26", "", "ab/cd/ef"};
+  for (const char* text : malformed) {
+    CHECK(!valid("DATE", text));
+  }
+  CHECK_EQ(command("DATE", "02/29/28"), std::string("DATE=02/29/28"));
+}
+
+TEST(text_is_at_most_80_characters_without_quotes) {
+  for (size_t length = 0; length <= 100; length++) {
+    std::string text = randomText(length, "abc XYZ 0123456789.,!?'-");
+    CHECK_EQ(valid("TM", text), length <= 80);
+    if (length <= 80) {
+      CHECK_EQ(command("TM", text), "TM=\"" + text + "\"");
+    }
+  }
+  for (int i = 0; i < 5000; i++) {
+    std::string text = randomText(1 + generator() % 80, "ab \"");
+    CHECK_EQ(valid("TM", text), text.find('"') == std::string::npos);
+  }
+  //A carriage return is allowed inside the quotes, other control characters are not
+  CHECK(valid("TM", "line one\rline two"));
+  CHECK(!valid("TM", "tab\there"));
+  CHECK(!valid("TM", "new\nline"));
+}
+
+TEST(a_lone_hash_clears_the_message_unquoted) {
+  CHECK_EQ(command("TM", "#"), std::string("TM=#"));
+  CHECK_EQ(command("TM", "##"), std::string("TM=\"##\""));
+  CHECK_EQ(command("TM", "# 1"), std::string("TM=\"# 1\""));
+  Tr40 thermostat("1");
+  thermostat.handle("A=1 O=00 TM=\"Filter due\"");
+  CHECK_EQ(thermostat.message, std::string("Filter due"));
+  thermostat.handle("A=1 O=00 " + command("TM", "#"));
+  CHECK_EQ(thermostat.message, std::string());
+  CHECK_EQ(thermostat.rejectedWrites, 0UL);
+}
+
+TEST(every_accepted_payload_is_a_command_the_thermostat_takes) {
+  Tr40 thermostat("1");
+  const char* const alphabet = "0123456789:/-?OHCAEIFx #ab";
+  unsigned long accepted = 0;
+  for (int i = 0; i < 200000; i++) {
+    const SetRoute& route = setRoutes[generator() % (sizeof(setRoutes) / sizeof(setRoutes[0]))];
+    if (route.kind == PAYLOAD_SETPOINT) {
+      continue;
+    }
+    std::string text = randomText(generator() % 10, alphabet);
+    std::string built = command(route.key, text);
+    if (built.empty()) {
+      continue;
+    }
+    accepted ++;
+    CHECK(built.size() < COMMAND_MAX_LENGTH);
+    //The mode I (Invalid) is only ever reported, the thermostat will not take it
+    if (built == "M=I") {
+      continue;
+    }
+    unsigned long rejected = thermostat.rejectedWrites;
+    thermostat.handle("A=1 O=00 " + built);
+    if (thermostat.rejectedWrites != rejected) {
+      fprintf(stderr, "    rejected %s\n", built.c_str());
+      CHECK(false);
+    }
+  }
+  CHECK(accepted > 1000);
+}
+
+TEST(the_longest_message_fits_the_command_queue) {
+  std::string text(80, 'x');
+  std::string built = command("TM", text);
+  CHECK_EQ(built.size(), (size_t)85);
+  CommandQueue queue;
+  CHECK(queue.push(0, built.c_str(), PRIORITY_USER));
+}
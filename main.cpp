@@ -80,10 +80,11 @@
 #include <WiFi.h>
 #include <PubSubClient.h>
 #include <SoftwareSerial.h>
-#include <iostream>
-#include <map>
-#include <string>
-using namespace std;
+#include <limits.h>
+#include <atomic>
+#ifdef RS485_HARDWARE_UART
+#include <driver/uart.h>
+#endif
 
 // Declare Constants and Pin Numbers
 #define SSerialRX            21  //Serial Receive pin 8
@@ -94,644 +95,4119 @@ using namespace std;
 #define RS485Transmit        HIGH
 #define RS485Receive         LOW
 
+//Uncomment to run the RS485 link on a hardware UART, on the same pins, instead of 
+//SoftwareSerial
+//#define RS485_HARDWARE_UART
+//The hardware UART the RS485 link runs on. The ESP32-C3 the default pins are for only 
+//has UART0 and UART1, and UART0 is the console; other ESP32s can use UART2.
+#define RS485_UART_NUM       1
+
+//Size of the fixed buffer a received RS485 frame is tokenized in. Longer lines are dropped.
+#define RX_BUFFER_SIZE       128
+//Size of the ring buffer received RS485 bytes are queued in (must be a power of two)
+#define RX_RING_SIZE         256
+//The most received bytes fed through the frame reader on each pass of loop()
+#define RX_BYTES_PER_LOOP    16
+
+//Status poll periods in milliseconds. R=1 and R=2 are offset by half a period so 
+//they do not go out back to back.
+#define R1_POLL_PERIOD         20000
+#define R2_POLL_PERIOD         20000
+//Faster poll periods used while an HVAC stage is running or just after a command
+#define R1_ACTIVE_POLL_PERIOD  10000
+#define R2_ACTIVE_POLL_PERIOD  5000
+//How long to keep polling at the active rate after a command is sent
+#define COMMAND_ACTIVE_WINDOW  30000
+//How long a poll about to fall due waits when a command is queued, so the command goes first
+#define COMMAND_HOLDOFF        1000
+//The default heartbeat, the longest a status topic goes without being republished
+#define HEARTBEAT_PERIOD       300000
+//How far apart the heartbeats of the fields are spread, so they do not all go out together
+#define HEARTBEAT_STAGGER      2000
+//The most fields of a thermostat a refresh publishes on each pass of loop(), so it is 
+//spread over several passes instead of going out in a burst
+#define REFRESH_FIELDS_PER_PASS 2
+
+//The number of commands that can be waiting to be sent to the thermostats
+#define COMMAND_QUEUE_SIZE     12
+//The longest MQTT topic built from a device topic prefix and a key
+#define TOPIC_MAX_LENGTH       96
+
+//First wait between MQTT connection attempts, doubled after each failed attempt
+#define RECONNECT_MIN_BACKOFF  1000
+//The longest wait between MQTT connection attempts
+#define RECONNECT_MAX_BACKOFF  60000
+//How long MQTT can stay unreachable before the controller is considered wedged
+#define RECONNECT_WEDGE_WINDOW (60UL * 60UL * 1000UL)
+//The fewest failed attempts within the wedge window before restarting the controller
+#define RECONNECT_WEDGE_FAILURES 20
+//How long an MQTT connection attempt may block opening the socket and then waiting on 
+//the broker, in seconds. An attempt still blocks loop() for up to both together.
+#define MQTT_CONNECT_TIMEOUT   1
+#define MQTT_SOCKET_TIMEOUT    1
+
+//The number of topics whose latest value is held while MQTT is down
+#define PUBLISH_BUFFER_SIZE    32
+//The longest key and value held in the publish buffer
+#define PUBLISH_KEY_LENGTH     13
+#define PUBLISH_VALUE_LENGTH   16
+//The number of action transitions held in order while MQTT is down, 0 to collapse 
+//them to the latest action like the other topics
+#define TRANSITION_BUFFER_SIZE 16
+
+//How often each thermostat's HVAC runtime totals are published on <prefix>/runtime, 
+//0 to turn them off. An hour by default, 86400000 for daily totals.
+#define RUNTIME_ROLLUP_PERIOD  3600000
+//A stage that runs for less than this is counted as a short cycle
+#define SHORT_CYCLE_TIME       300000
+
+//How often the diagnostics document is published on <prefix>/diag, 0 to turn it off
+#ifndef DIAG_PERIOD
+#define DIAG_PERIOD            60000
+#endif
+//A pass of loop() that takes longer than this is a stall, in microseconds
+#define STALL_THRESHOLD        20000
+//The number of worst stalls kept with the scope that took the longest in them
+#define STALL_RECORD_COUNT     5
+//Histogram buckets, bucket n counts values of n bits so the last one starts at ~1 second in microseconds
+#define HISTOGRAM_BUCKETS      21
+//The largest MQTT packet, big enough for the diagnostics document and the discovery payloads
+#define MQTT_BUFFER_SIZE       2048
+//The Home Assistant MQTT discovery prefix, set in HA's MQTT integration
+#define DISCOVERY_PREFIX       "homeassistant"
+//The longest HA component name and entity object id, with the node id they size the 
+//discovery topics
+#define DISCOVERY_COMPONENT_LENGTH 16
+#define DISCOVERY_OBJECT_ID_LENGTH 24
+
+//Bytes kept of the most recent RS485 frames while bus capture is on
+#define BUS_CAPTURE_SIZE       2048
+//The most capture bytes published in one MQTT message
+#define CAPTURE_CHUNK_SIZE     1024
+
+//On dual core ESP32s the MQTT side runs in its own task on the core the WiFi stack 
+//uses, so the RS485 side in loop() keeps steady bus timing whatever the network does. 
+//The host's threaded build defines it to run the task on a std::thread.
+#if defined(ESP32) && !defined(CONFIG_FREERTOS_UNICORE) && !defined(BRIDGE_DUAL_CORE)
+#define BRIDGE_DUAL_CORE
+#endif
+#define NETWORK_TASK_CORE      0
+#define NETWORK_TASK_STACK     8192
+#define NETWORK_TASK_PRIORITY  1
+//Commands waiting to go from the MQTT side to the RS485 side (must be a power of two)
+#define INBOUND_QUEUE_SIZE     8
+//Status values waiting to go from the RS485 side to the MQTT side (must be a power of two)
+#define OUTBOUND_QUEUE_SIZE    32
+
+//The longest loop() sleeps when there is nothing to do. At 9600 baud this is about 10 
+//characters, well inside the serial receive buffer, and keeps MQTT responsive.
+#ifndef IDLE_MAX_SLEEP
+#define IDLE_MAX_SLEEP         10
+#endif
+
+//Log levels, a record is kept when its level is at or below the level set
+#define LOG_LEVEL_NONE         0
+#define LOG_LEVEL_ERROR        1
+#define LOG_LEVEL_WARN         2
+#define LOG_LEVEL_INFO         3
+#define LOG_LEVEL_DEBUG        4
+//Log calls above this level are compiled out
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL     LOG_LEVEL_DEBUG
+#endif
+//The level kept in the log ring from startup, printing to Serial starts off
+#define LOG_RING_LEVEL         LOG_LEVEL_INFO
+//The number of log records kept for dumping over MQTT, and the longest record
+#define LOG_RING_SIZE          32
+#define LOG_RECORD_LENGTH      96
+
+//The longest command that can be queued, enough for TM="" with an 80 character message
+#define COMMAND_MAX_LENGTH     88
+//The longest request (after the A= O= header) that writes for the same thermostat are 
+//packed into, so a burst of settings goes out as one frame. 0 sends every write alone.
+#define PACKED_FRAME_MAX_LENGTH  64
+static_assert(PACKED_FRAME_MAX_LENGTH < COMMAND_MAX_LENGTH, "A packed frame must fit in a command");
+
+//RS485 bus timing used to work out how long to wait for a response
+#define RS485_BAUD             9600
+//Bits on the wire per byte (start, 8 data, stop)
+#define BITS_PER_BYTE          10
+//The longest response expected from the thermostat
+#define RESPONSE_MAX_LENGTH    80
+//How long the thermostat may take to start answering a request
+#define RESPONSE_TURNAROUND    100
+//Microseconds the driver is enabled before the first start bit, for slow transceivers
+#define RS485_LEAD_GUARD       0
+//Microseconds the driver is held after the last stop bit has left the UART
+#define RS485_TAIL_GUARD       100
+//The number of times a request is sent again when no response arrives
+#define TRANSACTION_RETRIES    2
+//Wait before the first retry, doubled for each retry after it
+#define RETRY_BACKOFF          200
+//Marks a numeric status value that has not been received yet
+#define NO_VALUE             INT16_MIN
+
+//The status keys that can be found in an R=1 or R=2 response
+enum StatusKey : uint8_t {
+  KEY_UNKNOWN, KEY_A, KEY_O, KEY_OA, KEY_Z, KEY_T, KEY_SP, KEY_SPH, KEY_SPC, KEY_M, KEY_FM,
+  KEY_H1A, KEY_H2A, KEY_H3A, KEY_C1A, KEY_C2A, KEY_FA, KEY_VA, KEY_SM, KEY_SF, KEY_SC,
+  KEY_D1, KEY_SCP
+};
+
+//The thermostat modes (O, H, C, A, EH, I)
+enum ThermostatMode : uint8_t {
+  MODE_UNKNOWN, MODE_OFF, MODE_HEAT, MODE_COOL, MODE_AUTO, MODE_EMERGENCY_HEAT, MODE_INVALID
+};
+
+//The action published to the HVAC integration based on the heating or cooling stage
+enum HvacAction : uint8_t {
+  ACTION_UNKNOWN, ACTION_OFF, ACTION_H1, ACTION_H2, ACTION_H3, ACTION_C1, ACTION_C2, ACTION_FAN, 
+  ACTION_IDLE
+};
+const char* const actionNames[] = {"", "O", "H1", "H2", "H3", "C1", "C2", "F", "I"};
+const char* const modeNames[] = {"", "O", "H", "C", "A", "EH", "I"};
+
+//The status published for each thermostat, each with its own dirty bit
+enum StateField : uint8_t {
+  FIELD_OUTSIDE_AIR, FIELD_TEMP, FIELD_SETPOINT_HEAT, FIELD_SETPOINT_COOL, FIELD_MODE,
+  FIELD_FAN_MODE, FIELD_ACTION, FIELD_SCHEDULE_CONTROL, FIELD_COUNT
+};
+//The topic under the thermostat's prefix each field is published on
+const char* const fieldKeys[FIELD_COUNT] = {"OA", "T", "SPH", "SPC", "M", "FM", "action", "SC"};
+
+//When a status field is published
+struct PublishPolicy {
+  //Changes smaller than this from the last published value are not published, 0 
+  //publishes every change
+  int16_t deadband;
+  //The shortest time between publishes, so a flapping value is damped. A change inside 
+  //it is held back and the latest value published once it has passed.
+  unsigned long minInterval;
+  //The longest time between publishes, the field's heartbeat. 0 for no heartbeat.
+  unsigned long maxInterval;
+};
+//The publish policy of each field, in StateField order
+const PublishPolicy publishPolicies[FIELD_COUNT] = {
+  {2, 60000, HEARTBEAT_PERIOD},    //OA
+  {2, 0, HEARTBEAT_PERIOD},        //T, chosen in test_publish_policy
+  {0, 0, HEARTBEAT_PERIOD},        //SPH
+  {0, 0, HEARTBEAT_PERIOD},        //SPC
+  {0, 0, HEARTBEAT_PERIOD},        //M
+  {0, 0, HEARTBEAT_PERIOD},        //FM
+  {0, 0, HEARTBEAT_PERIOD},        //action
+  {0, 0, HEARTBEAT_PERIOD},        //SC
+};
+
+/**
+ * @brief Packs up to four characters of a status key into an integer. Every key in 
+ * the TR40 protocol is at most four characters long, so the packed value is unique 
+ * per key and can be used as a compile time perfect hash in a switch statement.
+ * 
+ * @param key The status key characters
+ * @param length The number of characters in the key
+ * @return The packed key code, or 0 if the key is too long to be one of ours
+ */
+constexpr uint32_t keyCode(const char* key, size_t length) {
+  return (length == 0) ? 0 : (length > 4) ? 0 : 
+         ((uint32_t)(uint8_t)key[length - 1]) | (keyCode(key, length - 1) << 8);
+}
+
+/**
+ * @brief Packs a string literal status key for use as a case label
+ * 
+ * @param key The status key
+ * @return The packed key code
+ */
+template <size_t N>
+constexpr uint32_t keyCode(const char (&key)[N]) {
+  return keyCode(key, N - 1);
+}
+
+/**
+ * @brief A fixed size lock-free single producer/single consumer ring buffer. The 
+ * producer and the consumer may run in different tasks, on different cores or in an 
+ * interrupt. Only the producer moves head and only the consumer moves tail, and the 
+ * release/acquire pairs make an entry visible before the index that publishes it.
+ */
+template <typename T, size_t N>
+struct RingBuffer {
+  static_assert((N & (N - 1)) == 0, "RingBuffer size must be a power of two");
+  T data[N];
+  std::atomic<size_t> head{0};
+  std::atomic<size_t> tail{0};
+
+  size_t size() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+  bool full() const { return size() == N; }
+  bool empty() const { return size() == 0; }
+
+  bool push(const T& value) {
+    size_t at = head.load(std::memory_order_relaxed);
+    if (at - tail.load(std::memory_order_acquire) == N) {
+      return false;
+    }
+    data[at & (N - 1)] = value;
+    head.store(at + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T& value) {
+    size_t at = tail.load(std::memory_order_relaxed);
+    if (head.load(std::memory_order_acquire) == at) {
+      return false;
+    }
+    value = data[at & (N - 1)];
+    tail.store(at + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+/**
+ * @brief A half duplex RS485 link. The transport owns the driver enable pin. It raises 
+ * the pin to send a frame and drops it once the last stop bit has left the UART, 
+ * going by the txDone hook when the UART can report that and otherwise by the time 
+ * the frame takes at the baud rate. Nothing sleeps for a fixed time; service() is 
+ * called from loop() and releases the bus when the frame is out. When the write only 
+ * returns once the frame is out, send() waits out the short tail guard itself. The 
+ * serial port is reached through hooks so a SoftwareSerial, a hardware UART or a test 
+ * double can be put behind it.
+ */
+struct RS485Transport {
+  unsigned long (*clock)() = micros;
+  //Puts bytes into the serial port
+  size_t (*write)(const char*, size_t) = NULL;
+  int (*available)() = NULL;
+  int (*read)() = NULL;
+  //Returns true once the UART has shifted out everything written, NULL to go by the baud rate
+  bool (*txDone)() = NULL;
+
+  uint8_t directionPin = SSerialTxControl;
+  unsigned long baud = RS485_BAUD;
+  unsigned long leadGuard = RS485_LEAD_GUARD;
+  unsigned long tailGuard = RS485_TAIL_GUARD;
+
+  bool transmitting = false;
+  bool frameSent = false;
+  unsigned long txStart = 0;
+  unsigned long txTime = 0;
+  unsigned long sentAt = 0;
+
+  void begin() {
+    pinMode(directionPin, OUTPUT);
+    digitalWrite(directionPin, RS485Receive);
+  }
+
+  /**
+   * @brief The time a number of bytes take on the wire
+   * 
+   * @return The time in microseconds, rounded up
+   */
+  static unsigned long frameTime(size_t bytes, unsigned long baud) {
+    return (bytes * BITS_PER_BYTE * 1000000UL + baud - 1) / baud;
+  }
+
+  bool busy() const {
+    return transmitting;
+  }
+
+  /**
+   * @brief Enables the driver and starts sending a frame
+   * 
+   * @return false if the last frame is still being sent
+   */
+  bool send(const char* frame, size_t length) {
+    if (transmitting) {
+      return false;
+    }
+    digitalWrite(directionPin, RS485Transmit);
+    if (leadGuard > 0) {
+      delayMicroseconds(leadGuard);
+    }
+    transmitting = true;
+    frameSent = false;
+    txStart = clock();
+    txTime = frameTime(length, baud);
+    write(frame, length);
+    //SoftwareSerial only returns once the frame is out, so the bus may be free already
+    service();
+    if (transmitting && frameSent && txDone == NULL) {
+      //Only the tail guard is left, well under a millisecond. It is waited out here, 
+      //as the next service() can be seconds away behind a blocking MQTT connect 
+      //attempt and the driver would still be on when the thermostat answers.
+      unsigned long held = clock() - sentAt;
+      if (held < tailGuard) {
+        delayMicroseconds(tailGuard - held);
+      }
+      release();
+    }
+    return true;
+  }
+
+  /**
+   * @brief Drops the driver once the frame and the tail guard are over. Called from loop().
+   */
+  void service() {
+    if (!transmitting) {
+      return;
+    }
+    unsigned long now = clock();
+    if (!frameSent) {
+      if (txDone != NULL ? !txDone() : now - txStart < txTime) {
+        return;
+      }
+      frameSent = true;
+      sentAt = now;
+    }
+    if (now - sentAt >= tailGuard) {
+      release();
+    }
+  }
+
+  //Drops the driver so the thermostat can answer
+  void release() {
+    digitalWrite(directionPin, RS485Receive);
+    transmitting = false;
+  }
+
+  /**
+   * @brief How long until service() can release the bus
+   * 
+   * @return The time in whole milliseconds, 0 if it is due within the next one, 
+   *         ULONG_MAX when not transmitting
+   */
+  unsigned long untilDue() const {
+    if (!transmitting) {
+      return ULONG_MAX;
+    }
+    //With a txDone hook the frame time is only an estimate, so once it has run out 
+    //service() is due until the UART reports the frame out
+    unsigned long end = frameSent ? sentAt + tailGuard : txStart + txTime + tailGuard;
+    long wait = (long)(end - clock());
+    return wait > 0 ? wait / 1000 : 0;
+  }
+};
+
+/**
+ * @brief Assembles received bytes into complete frames. A frame may be ended by a 
+ * carriage return, a line feed or both, empty lines are ignored and lines that do 
+ * not fit in the buffer are dropped up to the next line end.
+ */
+struct FrameReader {
+  char* buffer;
+  size_t capacity;
+  size_t length = 0;
+  bool overflow = false;
+  bool complete = false;
+  //Lines dropped for being too long
+  unsigned long overflows = 0;
+
+  FrameReader(char* buffer, size_t capacity) : buffer(buffer), capacity(capacity) {}
+
+  /**
+   * @brief Adds a received byte to the frame
+   * 
+   * @param c The received byte
+   * @return true when a complete null terminated frame of length bytes is in the buffer
+   */
+  bool push(char c) {
+    if (complete) {
+      length = 0;
+      complete = false;
+    }
+    if (c == '\r' || c == '\n') {
+      //The line feed of a CR LF pair arrives as an empty line and is skipped here
+      if (overflow || length == 0) {
+        length = 0;
+        overflow = false;
+        return false;
+      }
+      buffer[length] = '\0';
+      complete = true;
+      return true;
+    }
+    if (overflow) {
+      return false;
+    }
+    if (length >= capacity - 1) {
+      overflow = true;
+      overflows ++;
+      return false;
+    }
+    buffer[length ++] = c;
+    return false;
+  }
+};
+
+/**
+ * @brief Decides when the R=1 and R=2 status polls are due 
+ * using wall clock time. In adaptive mode it polls at the active periods while an 
+ * HVAC stage is running or shortly after a command and at the idle periods otherwise.
+ * The clock can be replaced so the schedule can be driven by a simulated time.
+ */
+struct PollScheduler {
+  unsigned long (*clock)() = millis;
+  unsigned long r1Period = R1_POLL_PERIOD;
+  unsigned long r2Period = R2_POLL_PERIOD;
+  unsigned long r1ActivePeriod = R1_ACTIVE_POLL_PERIOD;
+  unsigned long r2ActivePeriod = R2_ACTIVE_POLL_PERIOD;
+  unsigned long activeWindow = COMMAND_ACTIVE_WINDOW;
+  bool adaptive = true;
+
+  unsigned long lastR1 = 0;
+  unsigned long lastR2 = 0;
+  unsigned long lastCommand = 0;
+  bool commandWindow = false;
+  bool stageActive = false;
+  //Whether a command has already held off the next R=1 or R=2, each poll waits only once
+  bool r1Held = false;
+  bool r2Held = false;
+
+  /**
+   * @brief Starts the schedule from the current time
+   * 
+   * @param phase How far into the poll period to start, used to spread the polls of 
+   *              several devices on one bus evenly over the period
+   */
+  void begin(unsigned long phase = 0) {
+    unsigned long now = clock();
+    lastR1 = now - phase;
+    lastR2 = now - phase - r2Period / 2;
+    r1Held = r2Held = false;
+  }
+
+  /**
+   * @brief Whether polling should currently run at the active periods
+   */
+  bool active(unsigned long now) {
+    if (commandWindow && now - lastCommand >= activeWindow) {
+      commandWindow = false;
+    }
+    return adaptive && (stageActive || commandWindow);
+  }
+
+  /**
+   * @brief Returns the status poll that is due, if any, and restarts its period
+   * 
+   * @return "R=1", "R=2" or NULL when no poll is due
+   */
+  const char* nextPoll() {
+    unsigned long now = clock();
+    bool fast = active(now);
+    if (now - lastR1 >= (fast ? r1ActivePeriod : r1Period)) {
+      lastR1 = now;
+      r1Held = false;
+      return "R=1";
+    }
+    if (now - lastR2 >= (fast ? r2ActivePeriod : r2Period)) {
+      lastR2 = now;
+      r2Held = false;
+      return "R=2";
+    }
+    return NULL;
+  }
+
+  /**
+   * @brief Called when a user command is queued. Polls at the active rate from then on, 
+   * and a poll about to fall due waits COMMAND_HOLDOFF so it does not collide with the 
+   * command. The polls keep their phase and each waits at most once, so a stream of 
+   * commands can not hold them off.
+   */
+  void commandQueued() {
+    unsigned long now = clock();
+    lastCommand = now;
+    commandWindow = true;
+    bool fast = active(now);
+    holdOff(now, lastR1, fast ? r1ActivePeriod : r1Period, r1Held);
+    holdOff(now, lastR2, fast ? r2ActivePeriod : r2Period, r2Held);
+  }
+
+  /**
+   * @brief Moves a poll that is due within COMMAND_HOLDOFF to COMMAND_HOLDOFF from now, 
+   * unless it has waited already
+   */
+  static void holdOff(unsigned long now, unsigned long& last, unsigned long period, bool& held) {
+    if (!held && remaining(now, last, period) < COMMAND_HOLDOFF) {
+      last = now - period + COMMAND_HOLDOFF;
+      held = true;
+    }
+  }
+
+  /**
+   * @brief Called with the HVAC stage state from each R=2 response
+   */
+  void setStageActive(bool on) {
+    stageActive = on;
+  }
+
+  /**
+   * @brief How long until the next poll is due
+   * 
+   * @return The time in milliseconds, 0 if one is already due
+   */
+  unsigned long untilDue() {
+    unsigned long now = clock();
+    bool fast = active(now);
+    unsigned long wait = remaining(now, lastR1, fast ? r1ActivePeriod : r1Period);
+    return min(wait, remaining(now, lastR2, fast ? r2ActivePeriod : r2Period));
+  }
+
+  static unsigned long remaining(unsigned long now, unsigned long last, unsigned long period) {
+    unsigned long elapsed = now - last;
+    return elapsed >= period ? 0 : period - elapsed;
+  }
+};
+
+//User commands are always sent before the background status polls
+enum CommandPriority : uint8_t { PRIORITY_POLL, PRIORITY_USER };
+
+//A command waiting to be sent to a thermostat, such as SPH=70 or R=1
+struct Command {
+  char text[COMMAND_MAX_LENGTH];
+  uint8_t device;
+  CommandPriority priority;
+  //The micros() callback() was called at, for a command from Home Assistant
+  unsigned long received;
+};
+
+/**
+ * @brief A fixed capacity queue of commands for the thermostats. User commands are 
+ * kept ahead of polls and in the order they arrived. A newer command for a key that 
+ * is already waiting for the same device replaces the older one, and a poll that is 
+ * already waiting is not queued twice.
+ */
+struct CommandQueue {
+  Command entries[COMMAND_QUEUE_SIZE];
+  uint8_t count = 0;
+  //Whether a write's outcome can be told from the readback after it. Only those writes 
+  //are packed, NULL packs every write.
+  bool (*readBack)(const char* command) = NULL;
+
+  /**
+   * @brief Queues a command
+   * 
+   * @param device The index of the thermostat the command is for
+   * @param text The command, KEY=value
+   * @param priority PRIORITY_USER for settings, PRIORITY_POLL for status requests
+   * @return false if the command was too long or the queue was full of user commands. 
+   *         A poll already waiting as a user command, or a user command replacing the 
+   *         same waiting poll, counts as queued.
+   */
+  bool push(uint8_t device, const char* text, CommandPriority priority) {
+    size_t length = strlen(text);
+    if (length >= COMMAND_MAX_LENGTH) {
+      return false;
+    }
+    //User commands coalesce on their KEY= part, polls only when they are identical
+    const char* equals = strchr(text, '=');
+    size_t keyLength = (equals == NULL || priority == PRIORITY_POLL) ? length + 1 : (size_t)(equals - text) + 1;
+
+    for (uint8_t i = 0; i < count; i++) {
+      if (entries[i].device == device && entries[i].priority == priority && 
+          strncmp(entries[i].text, text, keyLength) == 0) {
+        memcpy(entries[i].text, text, length + 1);
+        return true;
+      }
+    }
+    //A read waiting at the other priority is the same request. It is only sent once, 
+    //at the higher of the two priorities.
+    for (uint8_t i = 0; i < count; i++) {
+      if (entries[i].device == device && strcmp(entries[i].text, text) == 0) {
+        if (entries[i].priority == PRIORITY_USER) {
+          return true;
+        }
+        count --;
+        memmove(&entries[i], &entries[i + 1], (count - i) * sizeof(Command));
+        break;
+      }
+    }
+
+    if (count == COMMAND_QUEUE_SIZE) {
+      //A full queue gives up its newest poll to make room for a user command
+      if (priority == PRIORITY_POLL || entries[count - 1].priority == PRIORITY_USER) {
+        return false;
+      }
+      count --;
+    }
+
+    //User commands go in after the last waiting user command, polls at the end
+    uint8_t slot = count;
+    if (priority == PRIORITY_USER) {
+      slot = 0;
+      while (slot < count && entries[slot].priority == PRIORITY_USER) {
+        slot ++;
+      }
+      memmove(&entries[slot + 1], &entries[slot], (count - slot) * sizeof(Command));
+    }
+    memcpy(entries[slot].text, text, length + 1);
+    entries[slot].device = device;
+    entries[slot].priority = priority;
+    count ++;
+    return true;
+  }
+
+  /**
+   * @brief Takes the next command to send off the queue
+   * 
+   * @param command Where the command is copied to
+   * @return false if the queue is empty
+   */
+  bool pop(Command& command) {
+    if (count == 0) {
+      return false;
+    }
+    command = entries[0];
+    count --;
+    memmove(&entries[0], &entries[1], count * sizeof(Command));
+    return true;
+  }
+
+  /**
+   * @brief Takes the next command off the queue along with the waiting writes for the 
+   * same device that fit after it, space separated, in one frame. The writes keep the 
+   * order they were queued in, so packing stops at the first of the device's writes 
+   * that cannot be packed or does not fit.
+   * 
+   * @param command Where the command is copied to
+   * @param maxLength The longest packed command
+   * @return The number of commands taken, 0 if the queue is empty
+   */
+  uint8_t popPacked(Command& command, size_t maxLength) {
+    if (!pop(command)) {
+      return 0;
+    }
+    uint8_t taken = 1;
+    if (!packable(command)) {
+      return taken;
+    }
+    size_t length = strlen(command.text);
+    uint8_t i = 0;
+    while (i < count && entries[i].priority == PRIORITY_USER) {
+      if (entries[i].device != command.device) {
+        i ++;
+        continue;
+      }
+      //Nothing for the device is taken past a write that has to go on its own
+      size_t extra = strlen(entries[i].text);
+      if (!packable(entries[i]) || length + 1 + extra > maxLength) {
+        break;
+      }
+      command.text[length] = ' ';
+      memcpy(command.text + length + 1, entries[i].text, extra + 1);
+      length += 1 + extra;
+      taken ++;
+      count --;
+      memmove(&entries[i], &entries[i + 1], (count - i) * sizeof(Command));
+    }
+    return taken;
+  }
+
+  /**
+   * @brief Whether a command can share a frame. Only single KEY=value writes can, reads 
+   * such as R=1 are answered with a status frame of their own and a quoted message 
+   * may hold spaces. The one acknowledgement does not say which writes were taken, so 
+   * a write is only packed when the readback shows whether it was.
+   */
+  bool packable(const Command& command) const {
+    return command.priority == PRIORITY_USER && strncmp(command.text, "R=", 2) != 0 && 
+           strchr(command.text, '=') != NULL && strchr(command.text, ' ') == NULL && 
+           (readBack == NULL || readBack(command.text));
+  }
+};
+
+//The outcome of a request sent to the thermostat
+enum TransactionResult : uint8_t {
+  TRANSACTION_OK,         //A response from the thermostat was received
+  TRANSACTION_TIMEOUT,    //No response after all of the retries
+};
+
+/**
+ * @brief Runs one request/response exchange on the bus at a time. A request that is 
+ * not answered by its device before its deadline is sent again after a backoff, up to 
+ * TRANSACTION_RETRIES times, and then given up on. Frames that are not a response 
+ * from that device are never treated as an answer or cause a request to be sent again.
+ */
+struct TransactionEngine {
+  unsigned long (*clock)() = millis;
+  //Puts a request for a device on the bus
+  void (*transmit)(uint8_t, const char*) = NULL;
+  //Told the outcome of every request
+  void (*completed)(uint8_t, const char*, TransactionResult) = NULL;
+
+  uint8_t device = 0;
+  char request[COMMAND_MAX_LENGTH];
+  bool outstanding = false;
+  bool waitingToRetry = false;
+  uint8_t retries = 0;
+  unsigned long deadline = 0;
+  unsigned long retryAt = 0;
+  //When the request was last put on the bus, in microseconds
+  unsigned long sentAt = 0;
+  //Totals for the diagnostics
+  unsigned long retriesSent = 0;
+  unsigned long timeouts = 0;
+
+  /**
+   * @brief Works out how long to wait for the response to a request from the time to 
+   * send it, the thermostat turnaround and the time to receive the longest response
+   * 
+   * @param requestLength The number of characters in the request frame
+   * @return The response timeout in milliseconds
+   */
+  static unsigned long responseTimeout(size_t requestLength) {
+    unsigned long bytes = requestLength + RESPONSE_MAX_LENGTH;
+    return (bytes * BITS_PER_BYTE * 1000UL + RS485_BAUD - 1) / RS485_BAUD + RESPONSE_TURNAROUND;
+  }
+
+  bool busy() const {
+    return outstanding;
+  }
+
+  /**
+   * @brief How long until poll() has a response deadline or retry to act on
+   * 
+   * @return The time in milliseconds, 0 if one is already due, ULONG_MAX when idle
+   */
+  unsigned long untilDue() const {
+    if (!outstanding) {
+      return ULONG_MAX;
+    }
+    long wait = (long)((waitingToRetry ? retryAt : deadline) - clock());
+    return wait > 0 ? wait : 0;
+  }
+
+  /**
+   * @brief Sends a request if no other request is outstanding
+   * 
+   * @param target The index of the device to send the request to
+   * @param cmd The command to send
+   * @return false if a request is still outstanding
+   */
+  bool begin(uint8_t target, const char* cmd) {
+    if (outstanding) {
+      return false;
+    }
+    device = target;
+    strncpy(request, cmd, COMMAND_MAX_LENGTH - 1);
+    request[COMMAND_MAX_LENGTH - 1] = '\0';
+    outstanding = true;
+    retries = 0;
+    send();
+    return true;
+  }
+
+  /**
+   * @brief Called when a response addressed to us is received
+   * 
+   * @param from The index of the device that sent the response
+   * @return false if there was no request to that device waiting on a response
+   */
+  bool responseReceived(uint8_t from) {
+    //A late response that arrives while waiting to retry still answers the request
+    if (!outstanding || from != device) {
+      return false;
+    }
+    finish(TRANSACTION_OK);
+    return true;
+  }
+
+  /**
+   * @brief Checks the response deadline and sends retries. Called from loop().
+   */
+  void poll() {
+    if (!outstanding) {
+      return;
+    }
+    unsigned long now = clock();
+    if (waitingToRetry) {
+      if ((long)(now - retryAt) >= 0) {
+        send();
+      }
+    } else if ((long)(now - deadline) >= 0) {
+      if (retries < TRANSACTION_RETRIES) {
+        retryAt = now + (RETRY_BACKOFF << retries);
+        retries ++;
+        retriesSent ++;
+        waitingToRetry = true;
+      } else {
+        timeouts ++;
+        finish(TRANSACTION_TIMEOUT);
+      }
+    }
+  }
+
+  void send() {
+    waitingToRetry = false;
+    sentAt = micros();
+    transmit(device, request);
+    //Allow for the A= O= header and line end added to the request
+    deadline = clock() + responseTimeout(strlen(request) + 12);
+  }
+
+  void finish(TransactionResult result) {
+    outstanding = false;
+    waitingToRetry = false;
+    if (completed != NULL) {
+      completed(device, request, result);
+    }
+  }
+};
+
+/**
+ * @brief The last known status of a thermostat. The parser sets a field's dirty bit 
+ * whenever its value changes and the publish stage only publishes the fields whose 
+ * bits are set and that the field's PublishPolicy lets through. Numbers not received 
+ * yet are NO_VALUE.
+ */
+struct ThermostatState {
+  int16_t outsideAir = NO_VALUE;
+  int16_t temp = NO_VALUE;
+  int16_t setpointHeat = NO_VALUE;
+  int16_t setpointCool = NO_VALUE;
+  int16_t fanMode = NO_VALUE;
+  int16_t scheduleControl = NO_VALUE;
+  ThermostatMode mode = MODE_UNKNOWN;
+  HvacAction action = ACTION_UNKNOWN;
+  //The heating and cooling stages reported on in the last R=2 response, one bit per stage
+  uint8_t activeStages = 0;
+  //Fields changed since they were last published, one bit per StateField
+  uint16_t dirty = 0;
+  //Dirty fields to publish whatever their policies say, set by a refresh
+  uint16_t refresh = 0;
+  //Fields that have had a value from the thermostat
+  uint16_t known = 0;
+  //Fields published optimistically after a write, waiting on the readback to confirm them
+  uint16_t optimistic = 0;
+  //The stages reported running in the frame being parsed, one bit per RuntimeStage and 
+  //SYSTEM_OFF, and whether the frame reported any of them
+  uint8_t frameStages = 0;
+  bool stagesReported = false;
+  //Fields published at least once, with the value and time they were last published
+  uint16_t published = 0;
+  int16_t publishedValue[FIELD_COUNT] = {};
+  unsigned long publishedAt[FIELD_COUNT] = {};
+  //The publish policy of each field, another table can be put in to compare policies
+  const PublishPolicy* policies = publishPolicies;
+
+  /**
+   * @brief Sets a numeric field, marking it dirty if the value changed
+   */
+  void set(StateField field, int16_t& slot, int value) {
+    if (slot != value || !(known & (1 << field))) {
+      slot = value;
+      dirty |= 1 << field;
+      known |= 1 << field;
+    }
+    received(field);
+  }
+
+  /**
+   * @brief Called when a field is received from the thermostat. A field that was 
+   * published optimistically is published again, which confirms the written value 
+   * or rolls Home Assistant back to what the thermostat kept.
+   */
+  void received(StateField field) {
+    if (optimistic & (1 << field)) {
+      optimistic &= ~(1 << field);
+      dirty |= 1 << field;
+    }
+  }
+
+  /**
+   * @brief A field's value as a number, the deadband is measured on it
+   */
+  int value(StateField field) const {
+    switch (field) {
+      case FIELD_OUTSIDE_AIR:      return outsideAir;
+      case FIELD_TEMP:             return temp;
+      case FIELD_SETPOINT_HEAT:    return setpointHeat;
+      case FIELD_SETPOINT_COOL:    return setpointCool;
+      case FIELD_FAN_MODE:         return fanMode;
+      case FIELD_SCHEDULE_CONTROL: return scheduleControl;
+      case FIELD_MODE:             return mode;
+      case FIELD_ACTION:           return action;
+      default:                     return 0;
+    }
+  }
+
+  /**
+   * @brief Marks every known field to be published again, after Home Assistant or the 
+   * broker restarted and may not have their values
+   */
+  void refreshAll() {
+    dirty |= known;
+    refresh |= known;
+  }
+
+  /**
+   * @brief Records that a field has been published
+   */
+  void publishedNow(StateField field, unsigned long now) {
+    refresh &= ~(1 << field);
+    published |= 1 << field;
+    publishedValue[field] = value(field);
+    publishedAt[field] = now;
+  }
+
+  /**
+   * @brief Applies the publish policies. Fields being refreshed go out 
+   * REFRESH_FIELDS_PER_PASS at a time whatever their policies. Dirty fields that moved 
+   * less than their deadband are dropped, dirty fields inside their minimum interval 
+   * are held back and fields whose heartbeat has come round are added.
+   * 
+   * @param now The current time in milliseconds
+   * @param slot Spreads the heartbeats, each field's is HEARTBEAT_STAGGER apart from 
+   *             the one at the slot before it
+   * @param wait Set to how long until a held back field or heartbeat is due
+   * @param suppressed Counts the changes dropped by a deadband
+   * @return The fields to publish now, one bit per StateField
+   */
+  uint16_t due(unsigned long now, unsigned int slot, unsigned long& wait, unsigned long& suppressed) {
+    uint16_t inside = dirty & published & ~refresh;
+    for (uint8_t i = 0; i < FIELD_COUNT; i++) {
+      if ((inside & (1 << i)) && !moved((StateField)i)) {
+        dirty &= ~(1 << i);
+        suppressed ++;
+      }
+    }
+    return pending(now, slot, wait);
+  }
+
+  /**
+   * @brief How long until due() will have a field to publish, without dropping or 
+   * counting anything, for working out how long to sleep
+   * 
+   * @return The time in milliseconds, 0 if a field is due now
+   */
+  unsigned long nextDue(unsigned long now, unsigned int slot) const {
+    unsigned long wait;
+    return pending(now, slot, wait) != 0 ? 0 : wait;
+  }
+
+  //Whether a field moved at least its deadband from the value last published
+  bool moved(StateField field) const {
+    int16_t deadband = policies[field].deadband;
+    return deadband == 0 || abs(value(field) - publishedValue[field]) >= deadband;
+  }
+
+  //The fields the policies say are due, with the changes inside their deadband left out
+  uint16_t pending(unsigned long now, unsigned int slot, unsigned long& wait) const {
+    uint16_t fields = 0;
+    uint8_t refreshed = 0;
+    wait = ULONG_MAX;
+    for (uint8_t i = 0; i < FIELD_COUNT; i++) {
+      uint16_t bit = 1 << i;
+      if (!(known & bit)) {
+        continue;
+      }
+      const PublishPolicy& policy = policies[i];
+      if (!(published & bit)) {
+        fields |= dirty & bit;
+        continue;
+      }
+      if (refresh & bit) {
+        if (refreshed < REFRESH_FIELDS_PER_PASS) {
+          fields |= bit;
+          refreshed ++;
+        }
+        continue;
+      }
+      unsigned long since = now - publishedAt[i];
+      if ((dirty & bit) && moved((StateField)i)) {
+        if (since >= policy.minInterval) {
+          fields |= bit;
+          continue;
+        }
+        wait = min(wait, policy.minInterval - since);
+      }
+      if (policy.maxInterval > 0) {
+        unsigned long heartbeat = policy.maxInterval - ((slot + i) * HEARTBEAT_STAGGER) % (policy.maxInterval / 2 + 1);
+        if (since >= heartbeat) {
+          fields |= bit;
+        } else {
+          wait = min(wait, heartbeat - since);
+        }
+      }
+    }
+    return fields;
+  }
+
+  /**
+   * @brief Formats a field's value for publishing
+   * 
+   * @param field The field to format
+   * @param buffer Where the value is written
+   * @param size The size of the buffer
+   */
+  void format(StateField field, char* buffer, size_t size) const {
+    switch (field) {
+      case FIELD_OUTSIDE_AIR:      snprintf(buffer, size, "%d", outsideAir); break;
+      case FIELD_TEMP:             snprintf(buffer, size, "%d", temp); break;
+      case FIELD_SETPOINT_HEAT:    snprintf(buffer, size, "%d", setpointHeat); break;
+      case FIELD_SETPOINT_COOL:    snprintf(buffer, size, "%d", setpointCool); break;
+      case FIELD_FAN_MODE:         snprintf(buffer, size, "%d", fanMode); break;
+      case FIELD_SCHEDULE_CONTROL: snprintf(buffer, size, "%d", scheduleControl); break;
+      case FIELD_MODE:             snprintf(buffer, size, "%s", modeNames[mode]); break;
+      case FIELD_ACTION:           snprintf(buffer, size, "%s", actionNames[action]); break;
+      default:                     buffer[0] = '\0'; break;
+    }
+  }
+};
+
+//The stages runtime is kept for, in the same order as the H1A..C2A and FA status keys
+enum RuntimeStage : uint8_t { STAGE_H1, STAGE_H2, STAGE_H3, STAGE_C1, STAGE_C2, STAGE_FAN, STAGE_COUNT };
+const char* const stageNames[STAGE_COUNT] = {"H1", "H2", "H3", "C1", "C2", "fan"};
+//Set in an R=2 frame's stage bits when the thermostat reports the system is off (SM=O)
+const uint8_t SYSTEM_OFF = 1 << STAGE_COUNT;
+
+//Resolves a frame's stage bits to an action
+struct ActionRule {
+  uint8_t stages;
+  HvacAction action;
+};
+//The action of an R=2 frame is that of the first rule with one of its bits set, in 
+//order of precedence. With no rule matching nothing is running and the action is idle.
+const ActionRule actionRules[] = {
+  {1 << STAGE_H3, ACTION_H3},
+  {1 << STAGE_H2, ACTION_H2},
+  {1 << STAGE_H1, ACTION_H1},
+  {1 << STAGE_C2, ACTION_C2},
+  {1 << STAGE_C1, ACTION_C1},
+  {1 << STAGE_FAN, ACTION_FAN},
+  {SYSTEM_OFF, ACTION_OFF},
+};
+
+//What the HVAC did over one rollup period
+struct RuntimeTotals {
+  //The length of the period, in milliseconds
+  unsigned long span;
+  //How long each stage ran, in milliseconds
+  unsigned long onTime[STAGE_COUNT];
+  //How many times each stage started, and how many of its runs were short cycles
+  uint16_t cycles[STAGE_COUNT];
+  uint16_t shortCycles[STAGE_COUNT];
+  //How many times the thermostat held a stage off (MOT) or on (MRT), and for how long
+  uint16_t minOffHolds;
+  uint16_t minRunHolds;
+  unsigned long heldTime;
+};
+
+/**
+ * @brief Adds up how long each HVAC stage runs, how often it cycles and how often the 
+ * thermostat's minimum off and run times hold it, from the R=2 status. Every 
+ * RUNTIME_ROLLUP_PERIOD the totals are handed to the MQTT side as a rollup. A rollup 
+ * that has not been published yet, for instance while MQTT is down, is never 
+ * overwritten; the running totals keep growing until it has been.
+ */
+struct RuntimeAccumulator {
+  unsigned long (*clock)() = millis;
+
+  //The stages running, one bit per RuntimeStage
+  uint8_t running = 0;
+  //When each running stage started, and how far its run time has been added up to
+  unsigned long startedAt[STAGE_COUNT] = {};
+  unsigned long countedTo[STAGE_COUNT] = {};
+  //The SCP digit of stages 1 and 2, two bits each, and since when the held time was counted
+  uint8_t held = 0;
+  unsigned long heldCountedTo = 0;
+  //The running totals and when they were started
+  RuntimeTotals totals = {};
+  unsigned long periodStart = 0;
+  //The last period's totals, owned by the MQTT side while rollupReady is set
+  RuntimeTotals rollup = {};
+  std::atomic<bool> rollupReady{false};
+
+  /**
+   * @brief Records a stage turning on or off
+   * 
+   * @param stage The RuntimeStage
+   * @param on Whether the thermostat reported the stage running
+   */
+  void stage(uint8_t stage, bool on) {
+    uint8_t bit = 1 << stage;
+    if (on == ((running & bit) != 0)) {
+      return;
+    }
+    unsigned long now = clock();
+    if (on) {
+      running |= bit;
+      startedAt[stage] = now;
+      countedTo[stage] = now;
+      totals.cycles[stage] ++;
+      return;
+    }
+    accrue(now);
+    running &= ~bit;
+    if (now - startedAt[stage] < SHORT_CYCLE_TIME) {
+      totals.shortCycles[stage] ++;
+    }
+  }
+
+  /**
+   * @brief Records the SCP status, one digit each for stages 1 and 2: 0 when the stage 
+   * is not being held, 1 for MOT and 2 for MRT. Anything else is taken as not held. A 
+   * hold is counted when it starts, or when a stage goes straight from one to the other.
+   * 
+   * @param value The SCP value, such as 10
+   */
+  void protection(const char* value) {
+    uint8_t now = 0;
+    for (uint8_t part = 0; part < 2 && value != NULL && value[part] != '\0'; part++) {
+      uint8_t hold = (value[part] == '1' || value[part] == '2') ? value[part] - '0' : 0;
+      now |= hold << (2 * part);
+      if (hold == 0 || hold == ((held >> (2 * part)) & 3)) {
+        continue;
+      }
+      if (hold == 1) {
+        totals.minOffHolds ++;
+      } else {
+        totals.minRunHolds ++;
+      }
+    }
+    accrue(clock());
+    held = now;
+  }
+
+  /**
+   * @brief Closes the period into a rollup once it is due and the last rollup has 
+   * been published. Called from the RS485 side.
+   */
+  void service() {
+    if (RUNTIME_ROLLUP_PERIOD == 0 || untilDue() > 0 || rollupReady.load(std::memory_order_acquire)) {
+      return;
+    }
+    unsigned long now = clock();
+    accrue(now);
+    totals.span = now - periodStart;
+    rollup = totals;
+    rollupReady.store(true, std::memory_order_release);
+    totals = RuntimeTotals();
+    periodStart = now;
+  }
+
+  /**
+   * @brief How long until the period is due to be rolled up
+   * 
+   * @return The time in milliseconds, 0 if it is due, ULONG_MAX if rollups are off
+   */
+  unsigned long untilDue() const {
+    if (RUNTIME_ROLLUP_PERIOD == 0) {
+      return ULONG_MAX;
+    }
+    return PollScheduler::remaining(clock(), periodStart, RUNTIME_ROLLUP_PERIOD);
+  }
+
+  //Adds the run and hold time up to now to the totals
+  void accrue(unsigned long now) {
+    for (uint8_t stage = 0; stage < STAGE_COUNT; stage++) {
+      if (running & (1 << stage)) {
+        totals.onTime[stage] += now - countedTo[stage];
+        countedTo[stage] = now;
+      }
+    }
+    if (held != 0) {
+      totals.heldTime += now - heldCountedTo;
+    }
+    heldCountedTo = now;
+  }
+};
+
+/**
+ * @brief Everything the bridge keeps for one thermostat or zone controller on the bus
+ */
+struct Thermostat {
+  //This is the RS485 address of the device that gets sent to the thermostat
+  const char* address;
+  //The topic prefix shared by all of this device's topics
+  const char* topicPrefix;
+  //The device name shown in Home Assistant
+  const char* name;
+
+  //The last status received from the thermostat
+  ThermostatState state;
+  //Decides when to request information from the thermostat
+  PollScheduler pollScheduler;
+
+  Thermostat(const char* address, const char* topicPrefix, const char* name) : 
+    address(address), topicPrefix(topicPrefix), name(name) {}
+};
+
+/**
+ * @brief A Home Assistant entity announced for each thermostat through MQTT discovery. 
+ * The payload is the common members followed by config. Topics in config are written 
+ * relative to "~", which HA expands to the device's topic prefix, so the prefix is only 
+ * sent once per payload.
+ */
+struct DiscoveryEntity {
+  //The HA component, which is also part of the discovery topic
+  const char* component;
+  //Unique within the device, used in the discovery topic and the unique id
+  const char* objectId;
+  //The entity name as JSON, null to use the device name
+  const char* name;
+  //The component's own members
+  const char* config;
+};
+
+const DiscoveryEntity discoveryEntities[] = {
+  //HA has no emergency heat mode, so EH shows as heat with the emergency heat preset, 
+  //and clearing the preset goes back to heat
+  {"climate", "thermostat", "null",
+    "\"act_t\":\"~/action\","
+    "\"act_tpl\":\"{{ {'O':'off','H1':'heating','H2':'heating','H3':'heating','C1':'cooling','C2':'cooling','F':'fan'}.get(value, 'idle') }}\","
+    "\"modes\":[\"off\",\"heat\",\"cool\",\"auto\"],"
+    "\"mode_stat_t\":\"~/M\","
+    "\"mode_stat_tpl\":\"{{ {'O':'off','H':'heat','C':'cool','A':'auto','EH':'heat'}.get(value, 'off') }}\","
+    "\"mode_cmd_t\":\"~/M/set\","
+    "\"mode_cmd_tpl\":\"{{ {'off':'O','heat':'H','cool':'C','auto':'A'}[value] }}\","
+    "\"pr_modes\":[\"emergency heat\"],"
+    "\"pr_mode_stat_t\":\"~/M\","
+    "\"pr_mode_val_tpl\":\"{{ 'emergency heat' if value == 'EH' else 'none' }}\","
+    "\"pr_mode_cmd_t\":\"~/M/set\","
+    "\"pr_mode_cmd_tpl\":\"{{ 'EH' if value == 'emergency heat' else 'H' }}\","
+    "\"fan_modes\":[\"auto\",\"on\"],"
+    "\"fan_mode_stat_t\":\"~/FM\","
+    "\"fan_mode_stat_tpl\":\"{{ 'on' if value == '1' else 'auto' }}\","
+    "\"fan_mode_cmd_t\":\"~/FM/set\","
+    "\"fan_mode_cmd_tpl\":\"{{ '1' if value == 'on' else '0' }}\","
+    "\"temp_lo_stat_t\":\"~/SPH\",\"temp_lo_cmd_t\":\"~/SPH/set\","
+    "\"temp_hi_stat_t\":\"~/SPC\",\"temp_hi_cmd_t\":\"~/SPC/set\","
+    "\"curr_temp_t\":\"~/T\","
+    "\"min_temp\":40,\"max_temp\":113,\"temp_unit\":\"F\",\"precision\":1.0"},
+  {"sensor", "outside_air", "\"Outside air\"",
+    "\"stat_t\":\"~/OA\",\"dev_cla\":\"temperature\",\"unit_of_meas\":\"°F\",\"stat_cla\":\"measurement\""},
+  {"select", "schedule", "\"Schedule\"",
+    "\"stat_t\":\"~/SC\",\"val_tpl\":\"{{ 'Run' if value == '1' else 'Hold' }}\","
+    "\"cmd_t\":\"~/SC/set\",\"cmd_tpl\":\"{{ '1' if value == 'Run' else '0' }}\","
+    "\"options\":[\"Hold\",\"Run\"]"},
+};
+
+//The runtime sensor of each stage, filled in with the stage's name from stageNames
+const char* const runtimeObjectId = "runtime_%s";
+const char* const runtimeName = "\"Runtime %s\"";
+const char* const runtimeConfig = 
+  "\"stat_t\":\"~/runtime\",\"val_tpl\":\"{{ value_json.%s.on }}\",\"dev_cla\":\"duration\",\"unit_of_meas\":\"s\"";
+
+/**
+ * @brief Keeps trying to reconnect to MQTT without blocking loop(), so the RS485 side 
+ * keeps polling while the broker is away. Attempts are spaced by an exponential 
+ * backoff with random jitter. The controller is only restarted when no attempt has 
+ * succeeded for a whole wedge window, not because of a short broker outage.
+ */
+struct MqttReconnector {
+  unsigned long (*clock)() = millis;
+  //Makes one connection attempt, returns true once connected
+  bool (*attempt)() = NULL;
+  //Restarts the controller
+  void (*restart)() = NULL;
+
+  bool wasConnected = false;
+  unsigned long offlineSince = 0;
+  unsigned long nextAttempt = 0;
+  unsigned long backoff = RECONNECT_MIN_BACKOFF;
+  unsigned int failures = 0;
+  //Successful reconnects, for the diagnostics
+  unsigned long reconnects = 0;
+
+  /**
+   * @brief Called on each pass of loop() with the current connection state
+   * 
+   * @param connected Whether the MQTT client is connected
+   */
+  void service(bool connected) {
+    unsigned long now = clock();
+    if (connected) {
+      wasConnected = true;
+      return;
+    }
+    if (wasConnected) {
+      //The connection was just lost, try again straight away
+      wasConnected = false;
+      offlineSince = now;
+      nextAttempt = now;
+      backoff = RECONNECT_MIN_BACKOFF;
+      failures = 0;
+    }
+    if ((long)(now - nextAttempt) < 0) {
+      return;
+    }
+    if (attempt()) {
+      reconnects ++;
+      wasConnected = true;
+      backoff = RECONNECT_MIN_BACKOFF;
+      failures = 0;
+      return;
+    }
+    failures ++;
+    //Wait somewhere between half and all of the backoff so a fleet of bridges does 
+    //not retry in lock step after a broker restart
+    nextAttempt = clock() + backoff / 2 + random(backoff / 2 + 1);
+    backoff = (backoff >= RECONNECT_MAX_BACKOFF / 2) ? RECONNECT_MAX_BACKOFF : backoff * 2;
+    if (wedged(now) && restart != NULL) {
+      restart();
+    }
+  }
+
+  /**
+   * @brief How long until service() makes its next connection attempt
+   * 
+   * @return The time in milliseconds, 0 if one is already due, ULONG_MAX while connected
+   */
+  unsigned long untilDue(bool connected) const {
+    if (connected) {
+      return ULONG_MAX;
+    }
+    if (wasConnected) {
+      return 0;
+    }
+    long wait = (long)(nextAttempt - clock());
+    return wait > 0 ? wait : 0;
+  }
+
+  /**
+   * @brief Whether MQTT has been unreachable long enough to restart the controller
+   */
+  bool wedged(unsigned long now) const {
+    return failures >= RECONNECT_WEDGE_FAILURES && now - offlineSince >= RECONNECT_WEDGE_WINDOW;
+  }
+};
+
+//A status value on its way from the RS485 side to the MQTT side
+struct StatusUpdate {
+  const Thermostat* thermostat;
+  char key[PUBLISH_KEY_LENGTH];
+  char value[PUBLISH_VALUE_LENGTH];
+  //Published while parsing a replayed frame, so it goes to the capture stream
+  bool replayed;
+};
+
+/**
+ * @brief Holds what could not be published while MQTT was down. Only the latest value 
+ * of each topic is kept, so the buffer is flushed in one short burst when the session 
+ * comes back. Action transitions are also kept in order with the time they happened 
+ * so the runtime history is not lost. All of the memory is allocated at compile time.
+ */
+struct PublishBuffer {
+  struct Entry {
+    const Thermostat* thermostat;
+    char key[PUBLISH_KEY_LENGTH];
+    char value[PUBLISH_VALUE_LENGTH];
+  };
+  struct Transition {
+    const Thermostat* thermostat;
+    unsigned long time;
+    char value[PUBLISH_VALUE_LENGTH];
+  };
+
+  Entry entries[PUBLISH_BUFFER_SIZE];
+  uint8_t count = 0;
+  Transition transitions[TRANSITION_BUFFER_SIZE + 1];
+  uint8_t transitionCount = 0;
+  //Values that did not fit and were lost
+  unsigned int dropped = 0;
+
+  /**
+   * @brief Holds the latest value for a topic, replacing any value already held for it
+   * 
+   * @return false if the buffer was full
+   */
+  bool store(const Thermostat* thermostat, const char* key, const char* value) {
+    uint8_t i = 0;
+    while (i < count && (entries[i].thermostat != thermostat || strcmp(entries[i].key, key) != 0)) {
+      i ++;
+    }
+    if (i == PUBLISH_BUFFER_SIZE || strlen(key) >= PUBLISH_KEY_LENGTH || strlen(value) >= PUBLISH_VALUE_LENGTH) {
+      dropped ++;
+      return false;
+    }
+    if (i == count) {
+      entries[i].thermostat = thermostat;
+      strcpy(entries[i].key, key);
+      count ++;
+    }
+    strcpy(entries[i].value, value);
+    return true;
+  }
+
+  /**
+   * @brief Holds a transition that must not be collapsed, dropping the oldest when full
+   */
+  void storeTransition(const Thermostat* thermostat, const char* value, unsigned long time) {
+    if (TRANSITION_BUFFER_SIZE == 0 || strlen(value) >= PUBLISH_VALUE_LENGTH) {
+      return;
+    }
+    if (transitionCount == TRANSITION_BUFFER_SIZE) {
+      memmove(&transitions[0], &transitions[1], (TRANSITION_BUFFER_SIZE - 1) * sizeof(Transition));
+      transitionCount --;
+      dropped ++;
+    }
+    transitions[transitionCount].thermostat = thermostat;
+    transitions[transitionCount].time = time;
+    strcpy(transitions[transitionCount].value, value);
+    transitionCount ++;
+  }
+
+  bool empty() const {
+    return count == 0 && transitionCount == 0;
+  }
+};
+
+/**
+ * @brief A histogram with power of two buckets in static memory. Recording a value is 
+ * a count leading zeros and an increment, so it is cheap enough to leave on.
+ */
+struct Histogram {
+  unsigned long counts[HISTOGRAM_BUCKETS] = {0};
+  unsigned long samples = 0;
+  unsigned long max = 0;
+
+  void record(unsigned long value) {
+    uint8_t bucket = (value == 0) ? 0 : 32 - __builtin_clz((uint32_t)value);
+    if (bucket >= HISTOGRAM_BUCKETS) {
+      bucket = HISTOGRAM_BUCKETS - 1;
+    }
+    counts[bucket] ++;
+    samples ++;
+    if (value > max) {
+      max = value;
+    }
+  }
+
+  /**
+   * @brief Estimates a percentile as the upper bound of the bucket it falls in
+   * 
+   * @param percent The percentile, 0 to 100
+   * @return The value below which that percentage of the samples fall
+   */
+  unsigned long percentile(uint8_t percent) const {
+    unsigned long target = (samples * percent + 99) / 100;
+    unsigned long seen = 0;
+    for (uint8_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+      seen += counts[i];
+      if (seen >= target && seen > 0) {
+        unsigned long upper = (i == 0) ? 0 : (1UL << i) - 1;
+        return (upper < max) ? upper : max;
+      }
+    }
+    return max;
+  }
+
+  /**
+   * @brief Writes the histogram as a compact JSON object
+   * 
+   * @return The number of characters written, as snprintf
+   */
+  int toJson(char* buffer, size_t size) const {
+    return snprintf(buffer, size, "{\"n\":%lu,\"p50\":%lu,\"p95\":%lu,\"p99\":%lu,\"max\":%lu}", 
+                    samples, percentile(50), percentile(95), percentile(99), max);
+  }
+};
+
+//The parts of a pass of loop() the profiler tells apart
+enum ProfileScope : uint8_t {
+  SCOPE_LOOP, SCOPE_RX, SCOPE_PARSE, SCOPE_TX, SCOPE_MQTT, SCOPE_RECONNECT, SCOPE_PUBLISH, SCOPE_COUNT
+};
+const char* const scopeNames[SCOPE_COUNT] = {"loop", "rx", "parse", "tx", "mqtt", "reconnect", "publish"};
+
+/**
+ * @brief Times every pass of loop() into a histogram and keeps the worst stalls. The 
+ * pass is split into scopes by enter() markers, which cost a micros() call each, and 
+ * a stall is tagged with the scope that took the longest in it.
+ */
+struct LoopProfiler {
+  struct Stall {
+    unsigned long duration;
+    //When the pass started, in milliseconds since boot
+    unsigned long at;
+    ProfileScope scope;
+  };
+
+  //How long each pass took, in microseconds, not counting the idle sleep
+  Histogram passTime;
+  //The longest stalls, in no particular order
+  Stall stalls[STALL_RECORD_COUNT] = {};
+  unsigned long stallCount = 0;
+
+  ProfileScope scope = SCOPE_LOOP;
+  //When the pass started, in microseconds for timing it and in milliseconds since boot 
+  //for its stall, as micros() wraps about every 71.6 minutes
+  unsigned long passStart = 0;
+  unsigned long passStartedAt = 0;
+  unsigned long scopeStart = 0;
+  unsigned long scopeTime[SCOPE_COUNT] = {};
+
+  void beginPass() {
+    passStart = micros();
+    passStartedAt = millis();
+    scopeStart = passStart;
+    scope = SCOPE_LOOP;
+    memset(scopeTime, 0, sizeof(scopeTime));
+  }
+
+  /**
+   * @brief Marks the start of a scope, which runs until the next marker
+   */
+  void enter(ProfileScope next) {
+    unsigned long now = micros();
+    //Taken at 32 bits so a scope across the wrap is timed right where unsigned long is wider
+    scopeTime[scope] += (uint32_t)(now - scopeStart);
+    scopeStart = now;
+    scope = next;
+  }
+
+  void endPass() {
+    enter(SCOPE_LOOP);
+    unsigned long duration = (uint32_t)(scopeStart - passStart);
+    passTime.record(duration);
+    if (duration < STALL_THRESHOLD) {
+      return;
+    }
+    stallCount ++;
+    //Replace the shortest stall kept if this one is longer
+    Stall* shortest = &stalls[0];
+    for (uint8_t i = 1; i < STALL_RECORD_COUNT; i++) {
+      if (stalls[i].duration < shortest->duration) {
+        shortest = &stalls[i];
+      }
+    }
+    if (duration <= shortest->duration) {
+      return;
+    }
+    uint8_t worst = 0;
+    for (uint8_t i = 1; i < SCOPE_COUNT; i++) {
+      if (scopeTime[i] > scopeTime[worst]) {
+        worst = i;
+      }
+    }
+    shortest->duration = duration;
+    shortest->at = passStartedAt;
+    shortest->scope = (ProfileScope)worst;
+  }
+
+  /**
+   * @brief Writes the pass time histogram and the worst stalls as a JSON object
+   * 
+   * @return The number of characters written, as snprintf
+   */
+  int toJson(char* buffer, size_t size) const {
+    char pass[96];
+    passTime.toJson(pass, sizeof(pass));
+    size_t used = snprintf(buffer, size, "{\"pass\":%s,\"stalls\":%lu,\"worst\":[", pass, stallCount);
+    const char* separator = "";
+    for (uint8_t i = 0; i < STALL_RECORD_COUNT && used < size; i++) {
+      if (stalls[i].duration == 0) {
+        continue;
+      }
+      used += snprintf(buffer + used, size - used, "%s{\"us\":%lu,\"scope\":\"%s\",\"at\":%lu}", 
+                       separator, stalls[i].duration, scopeNames[stalls[i].scope], stalls[i].at / 1000);
+      separator = ",";
+    }
+    if (used < size) {
+      used += snprintf(buffer + used, size - used, "]}");
+    }
+    return used;
+  }
+};
+
+/**
+ * @brief Log records at four levels. A record is formatted only when its level is 
+ * enabled, printed to Serial at or below serialLevel and kept in a fixed ring at or 
+ * below ringLevel so the last records can be dumped over MQTT without a serial cable.
+ * Use it through the LOG_ macros so calls above LOG_COMPILED_LEVEL are compiled out 
+ * and the arguments are not evaluated unless the level is on.
+ */
+struct Logger {
+  struct Record {
+    unsigned long time;
+    uint8_t level;
+    char text[LOG_RECORD_LENGTH];
+    //One more than the record's number in kept, 0 while the slot has never been written
+    unsigned long number = 0;
+    //Held while the record is written or read out. Both tasks log and the MQTT side 
+    //dumps the ring, each only holds it for a copy.
+    std::atomic<bool> busy{false};
+  };
+
+  //Set from the debug topic on the MQTT side and read by both tasks. Relaxed is 
+  //enough, a new level only has to be seen, not ordered with anything else.
+  std::atomic<uint8_t> serialLevel{LOG_LEVEL_NONE};
+  std::atomic<uint8_t> ringLevel{LOG_RING_LEVEL};
+  Record records[LOG_RING_SIZE];
+  //The total number of records kept, the newest is at (kept - 1) % LOG_RING_SIZE. Both 
+  //tasks log, so each record claims its slot before writing it.
+  std::atomic<unsigned long> kept{0};
+
+  bool enabled(uint8_t level) const {
+    return level <= serialLevel.load(std::memory_order_relaxed) || 
+           level <= ringLevel.load(std::memory_order_relaxed);
+  }
+
+  void write(uint8_t level, const char* format, ...) __attribute__((format(printf, 3, 4))) {
+    char text[LOG_RECORD_LENGTH];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (level <= serialLevel.load(std::memory_order_relaxed)) {
+      Serial.print(levelName(level));
+      Serial.print(' ');
+      Serial.println(text);
+    }
+    if (level <= ringLevel.load(std::memory_order_relaxed)) {
+      unsigned long number = kept.fetch_add(1);
+      Record& record = records[number % LOG_RING_SIZE];
+      while (record.busy.exchange(true, std::memory_order_acquire)) {
+      }
+      record.time = millis();
+      record.level = level;
+      memcpy(record.text, text, sizeof(text));
+      record.number = number + 1;
+      record.busy.store(false, std::memory_order_release);
+    }
+  }
+
+  /**
+   * @brief Formats a kept record as "<time> <level> <text>"
+   * 
+   * @param number The record's number, counted by kept from 0
+   * @return false if its slot has been reused by a newer record or it is still being written
+   */
+  bool format(unsigned long number, char* buffer, size_t size) {
+    Record& record = records[number % LOG_RING_SIZE];
+    while (record.busy.exchange(true, std::memory_order_acquire)) {
+    }
+    bool found = record.number == number + 1;
+    if (found) {
+      snprintf(buffer, size, "%lu %s %s", record.time, levelName(record.level), record.text);
+    }
+    record.busy.store(false, std::memory_order_release);
+    return found;
+  }
+
+  static const char* levelName(uint8_t level) {
+    static const char* const names[] = {"NONE", "ERROR", "WARN", "INFO", "DEBUG"};
+    return level <= LOG_LEVEL_DEBUG ? names[level] : "?";
+  }
+
+  /**
+   * @brief Sets the serial level from a payload on the debug topic. "on" and "off" are 
+   * kept from before the levels so existing automations still work.
+   * 
+   * @return false if the payload is not a level
+   */
+  bool setSerialLevel(const char* payload) {
+    if (strcmp(payload, "on") == 0) {
+      serialLevel.store(LOG_LEVEL_DEBUG, std::memory_order_relaxed);
+      return true;
+    }
+    if (strcmp(payload, "off") == 0) {
+      serialLevel.store(LOG_LEVEL_NONE, std::memory_order_relaxed);
+      return true;
+    }
+    for (uint8_t level = LOG_LEVEL_NONE; level <= LOG_LEVEL_DEBUG; level++) {
+      if (strcasecmp(payload, levelName(level)) == 0) {
+        serialLevel.store(level, std::memory_order_relaxed);
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+//Logs a record when the level is compiled in and enabled, only then are the arguments evaluated
+#define LOG_AT(level, ...) \
+  do { \
+    if ((level) <= LOG_COMPILED_LEVEL && logger.enabled(level)) { \
+      logger.write((level), __VA_ARGS__); \
+    } \
+  } while (0)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...)  LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...)  LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+//The direction of a captured RS485 frame
+enum CaptureDirection : uint8_t { CAPTURE_RX, CAPTURE_TX };
+
+//Whether the bus is being captured, each phase of a dump hands the ring over between 
+//the MQTT and RS485 sides the way a replay's phases do
+enum CapturePhase : uint8_t {
+  //Not recording
+  CAPTURE_OFF,
+  //Recording on the RS485 side
+  CAPTURE_ON,
+  //A dump was asked for on the MQTT side, waiting for the RS485 side to stop recording
+  CAPTURE_DUMP_REQUESTED,
+  //Recording has stopped, the MQTT side owns the ring until it has published it
+  CAPTURE_DUMP_READY,
+};
+
+/**
+ * @brief Records the RS485 frames received and sent into a fixed ring of bytes, 
+ * dropping the oldest frames when it is full. Each record is a six byte header, the 
+ * time in milliseconds (four bytes, little endian), the direction and the frame 
+ * length, followed by the frame without its line end. A capture dumped over MQTT is 
+ * a run of whole records in this format and can be sent back to be replayed. A 
+ * host build can also hand each record to a sink, which the Linux gateway uses to 
+ * write a capture file.
+ */
+struct BusCapture {
+  static const size_t HEADER_SIZE = 6;
+
+  //Set from the MQTT side, the frames are recorded on the RS485 side
+  std::atomic<uint8_t> phase{CAPTURE_OFF};
+  //Given each record as it is recorded, the header and then the frame, NULL for none
+  void (*sink)(const uint8_t* header, const char* frame, size_t length) = NULL;
+  uint8_t data[BUS_CAPTURE_SIZE];
+  //Where the oldest record starts and how many bytes are held
+  size_t start = 0;
+  size_t used = 0;
+  unsigned long frames = 0;
+
+  void record(CaptureDirection direction, const char* frame, size_t length) {
+    if (phase.load(std::memory_order_acquire) != CAPTURE_ON) {
+      return;
+    }
+    length = min(length, (size_t)255);
+    size_t size = HEADER_SIZE + length;
+    while (used + size > BUS_CAPTURE_SIZE) {
+      size_t oldest = HEADER_SIZE + at(start + 5);
+      start = (start + oldest) % BUS_CAPTURE_SIZE;
+      used -= oldest;
+    }
+    unsigned long time = millis();
+    uint8_t header[HEADER_SIZE] = {(uint8_t)time, (uint8_t)(time >> 8), (uint8_t)(time >> 16), 
+                                   (uint8_t)(time >> 24), direction, (uint8_t)length};
+    size_t end = start + used;
+    for (size_t i = 0; i < HEADER_SIZE; i++) {
+      data[(end + i) % BUS_CAPTURE_SIZE] = header[i];
+    }
+    for (size_t i = 0; i < length; i++) {
+      data[(end + HEADER_SIZE + i) % BUS_CAPTURE_SIZE] = frame[i];
+    }
+    used += size;
+    frames ++;
+    if (sink != NULL) {
+      sink(header, frame, length);
+    }
+  }
+
+  uint8_t at(size_t offset) const {
+    return data[offset % BUS_CAPTURE_SIZE];
+  }
+
+  /**
+   * @brief Copies whole records into a buffer, starting at an offset from the oldest
+   * 
+   * @param offset The offset to start at, moved past the records copied
+   * @return The number of bytes copied, 0 once everything has been read
+   */
+  size_t read(size_t& offset, uint8_t* buffer, size_t size) const {
+    size_t copied = 0;
+    while (offset < used) {
+      size_t record = HEADER_SIZE + at(start + offset + 5);
+      if (copied + record > size) {
+        break;
+      }
+      for (size_t i = 0; i < record; i++) {
+        buffer[copied + i] = at(start + offset + i);
+      }
+      copied += record;
+      offset += record;
+    }
+    return copied;
+  }
+
+  void clear() {
+    start = 0;
+    used = 0;
+    frames = 0;
+  }
+
+  /**
+   * @brief Starts or stops recording. Called from the MQTT side.
+   * 
+   * @return false while a dump is under way
+   */
+  bool enable(bool on) {
+    uint8_t now = phase.load(std::memory_order_acquire);
+    if (now == CAPTURE_DUMP_REQUESTED || now == CAPTURE_DUMP_READY) {
+      return false;
+    }
+    phase.store(on ? CAPTURE_ON : CAPTURE_OFF, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief Asks for the ring to be dumped. Called from the MQTT side, which publishes 
+   * it once the RS485 side has stopped recording.
+   * 
+   * @return false while a dump is already under way
+   */
+  bool requestDump() {
+    uint8_t now = phase.load(std::memory_order_acquire);
+    if (now == CAPTURE_DUMP_REQUESTED || now == CAPTURE_DUMP_READY) {
+      return false;
+    }
+    phase.store(CAPTURE_DUMP_REQUESTED, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * @brief Hands the ring to the MQTT side once a dump was asked for. Called from the 
+   * RS485 side between frames, so no record() is under way.
+   */
+  void service() {
+    if (phase.load(std::memory_order_acquire) == CAPTURE_DUMP_REQUESTED) {
+      phase.store(CAPTURE_DUMP_READY, std::memory_order_release);
+    }
+  }
+};
+
+//Where a replay is, each phase hands the replay over between the MQTT and RS485 sides
+enum ReplayPhase : uint8_t {
+  //No replay, the MQTT side may load a capture
+  REPLAY_IDLE,
+  //Loaded by the MQTT side, waiting for the RS485 side to start it
+  REPLAY_LOADED,
+  //Being parsed on the RS485 side
+  REPLAY_RUNNING,
+  //Parsed, waiting for the MQTT side to report the result
+  REPLAY_DONE,
+};
+
+/**
+ * @brief Feeds a capture back through the parser, either as fast as possible or at 
+ * the speed it was recorded. Only the received frames are parsed. The publishes they 
+ * cause are counted and hashed so the behaviour of two versions can be compared, and 
+ * the time spent parsing gives a parser benchmark from real traffic.
+ */
+struct ReplayDriver {
+  uint8_t data[MQTT_BUFFER_SIZE];
+  size_t length = 0;
+  size_t offset = 0;
+  std::atomic<uint8_t> phase{REPLAY_IDLE};
+  bool realtime = false;
+  //Set while a replayed frame is parsed so its publishes are not sent to Home Assistant
+  bool parsing = false;
+  //The capture time of the first record and when the replay started, to pace a realtime replay
+  unsigned long firstTime = 0;
+  unsigned long startedAt = 0;
+
+  unsigned long frames = 0;
+  unsigned long publishes = 0;
+  unsigned long parseTime = 0;
+  //Frames that could not be parsed or were for other devices, kept out of the live metrics
+  unsigned long malformedFrames = 0;
+  unsigned long foreignFrames = 0;
+  //FNV-1a hash of every topic and value published during the replay
+  uint32_t hash = 2166136261UL;
+
+  /**
+   * @brief Loads a capture for the RS485 side to replay
+   * 
+   * @return false if the capture does not fit or a replay is still running
+   */
+  bool begin(const uint8_t* capture, size_t size, bool paced) {
+    if (size > sizeof(data) || phase.load(std::memory_order_acquire) != REPLAY_IDLE) {
+      return false;
+    }
+    memcpy(data, capture, size);
+    length = size;
+    offset = 0;
+    realtime = paced;
+    firstTime = (size >= BusCapture::HEADER_SIZE) ? recordTime(0) : 0;
+    startedAt = millis();
+    frames = 0;
+    publishes = 0;
+    parseTime = 0;
+    malformedFrames = 0;
+    foreignFrames = 0;
+    hash = 2166136261UL;
+    phase.store(REPLAY_LOADED, std::memory_order_release);
+    return true;
+  }
+
+  bool running() const {
+    uint8_t now = phase.load(std::memory_order_acquire);
+    return now == REPLAY_LOADED || now == REPLAY_RUNNING;
+  }
+
+  bool finished() const {
+    return offset + BusCapture::HEADER_SIZE > length;
+  }
+
+  unsigned long recordTime(size_t at) const {
+    return (unsigned long)data[at] | ((unsigned long)data[at + 1] << 8) | 
+           ((unsigned long)data[at + 2] << 16) | ((unsigned long)data[at + 3] << 24);
+  }
+
+  /**
+   * @brief Finds the next frame that is due
+   * 
+   * @param direction Set to the direction of the frame
+   * @param frame Set to the start of the frame
+   * @param size Set to the length of the frame
+   * @return false when no frame is due yet or the capture is finished
+   */
+  bool next(CaptureDirection& direction, const char*& frame, size_t& size) {
+    if (finished()) {
+      return false;
+    }
+    if (realtime && millis() - startedAt < recordTime(offset) - firstTime) {
+      return false;
+    }
+    direction = (CaptureDirection)data[offset + 4];
+    size = min((size_t)data[offset + 5], length - offset - BusCapture::HEADER_SIZE);
+    frame = (const char*)data + offset + BusCapture::HEADER_SIZE;
+    offset += BusCapture::HEADER_SIZE + size;
+    return true;
+  }
+
+  void published(const char* topic, const char* value) {
+    for (const char* c = topic; *c != '\0'; c++) {
+      hash = (hash ^ (uint8_t)*c) * 16777619UL;
+    }
+    hash = (hash ^ ' ') * 16777619UL;
+    for (const char* c = value; *c != '\0'; c++) {
+      hash = (hash ^ (uint8_t)*c) * 16777619UL;
+    }
+    hash = (hash ^ '\n') * 16777619UL;
+    publishes ++;
+  }
+};
+
+//What the RS485 side measures about itself, published on <prefix>/diag
+struct Metrics {
+  //From a request being sent to its response being parsed, in microseconds
+  Histogram roundTrip;
+  //Time to parse one frame, in microseconds
+  Histogram parseTime;
+  //From an MQTT message arriving to its command being queued, in microseconds
+  Histogram callbackTime;
+  unsigned long malformedFrames = 0;
+  unsigned long foreignFrames = 0;
+  //Time loop() has spent sleeping, in milliseconds
+  unsigned long idleTime = 0;
+  //Status values that did not fit in the outbound queue and were published later
+  unsigned long outboundFull = 0;
+  //Writes that went out in another write's frame instead of a transaction of their own
+  unsigned long packedWrites = 0;
+  //Changes not published because they were inside their field's deadband
+  unsigned long suppressedPublishes = 0;
+};
+
+//Whether the RS485 side's figures are being handed over, the phases pass the copy 
+//between the sides the way a capture dump's do
+enum FiguresPhase : uint8_t {
+  //Nothing asked for
+  FIGURES_IDLE,
+  //Asked for on the MQTT side, the RS485 side copies them on its next pass
+  FIGURES_REQUESTED,
+  //Copied, the MQTT side owns the copy until it has published it
+  FIGURES_READY,
+};
+
+//What the MQTT side wants the figures for, one bit each
+enum FiguresUse : uint8_t {
+  FIGURES_FOR_DIAGNOSTICS = 1,
+  FIGURES_FOR_PROFILE = 2,
+  //The profile printed to the serial port as well
+  FIGURES_FOR_SERIAL = 4,
+};
+
+/**
+ * @brief A copy of the figures the RS485 side keeps about itself, taken by it so the 
+ * MQTT side never reads them while they change: the metrics, its loop profile and the 
+ * counts from the transaction engine and the frame reader.
+ */
+struct BusFigures {
+  std::atomic<uint8_t> phase{FIGURES_IDLE};
+  //The FiguresUse bits asked for, only touched on the MQTT side
+  uint8_t uses = 0;
+  Metrics metrics;
+  LoopProfiler profile;
+  unsigned long retries = 0;
+  unsigned long timeouts = 0;
+  unsigned long overlong = 0;
+
+  /**
+   * @brief Asks the RS485 side for a copy. Called from the MQTT side, a use asked for 
+   * while a copy is on its way is served by that copy.
+   */
+  void request(uint8_t use) {
+    uses |= use;
+    uint8_t idle = FIGURES_IDLE;
+    phase.compare_exchange_strong(idle, FIGURES_REQUESTED, std::memory_order_acq_rel);
+  }
+};
+
 // put function declarations here:
 void setup_wifi();
+void setConnectTimeout(WiFiClient&, unsigned long);
 void callback(char*, byte*, unsigned int);
-void reconnect();
-void sendCmd(String);
-void parseReceived(String);
-void parseStatus(String, String);
-void print(String);
-void println(String);
+bool reconnect();
+void restart();
+void sendCmd(uint8_t, const char*);
+size_t rs485Write(const char*, size_t);
+int rs485Available();
+int rs485Read();
+#ifdef RS485_HARDWARE_UART
+bool rs485TxDone();
+#endif
+const char* resolveSetpoint(uint8_t, const char*, char*, size_t);
+bool readBackWrite(const char*);
+bool queueUserCommand(uint8_t, const char*, unsigned long);
+void transactionCompleted(uint8_t, const char*, TransactionResult);
+void rollBack(Thermostat&, uint16_t);
+void parseReceived(char*, size_t);
+void parseStatus(Thermostat&, StatusKey, const char*);
+void resolveAction(Thermostat&);
+bool publishStatus(const Thermostat&, const char*, const char*);
+void sendStatus(const Thermostat&, const char*, const char*);
+void drainOutbound();
+bool submitCommand(uint8_t, const char*, unsigned long);
+void busLoop();
+void networkLoop();
+unsigned long busIdleTime();
+unsigned long networkIdleTime();
+bool reconnectAllowed();
+#ifdef BRIDGE_DUAL_CORE
+void networkTask(void*);
+#endif
+void publishState(Thermostat&, uint16_t);
+unsigned long publishChanges(Thermostat&);
+void flushPublishBuffer();
+void takeFigures();
+void publishFigures();
+void publishDiagnostics();
+void publishProfile();
+void printProfile();
+void publishRuntime(uint8_t);
+void publishLog();
+void publishDiscovery();
+void publishDiscoveryEntity(const Thermostat&, const char*, const DiscoveryEntity&);
+void publishAvailability();
+void publishCapture();
+void startReplay(const uint8_t*, size_t, bool);
+void serviceReplay();
+void publishReplayed(const Thermostat&, const char*, const char*);
+void publishReplayResult();
+bool replayFlushed();
+void bridgeTopic(char*, size_t, const char*);
+const char* topicKey(const char*, const char*);
+
+
+// Replace the next variables with your SSID/Password combination
+const char* ssid = "phpwebscripting3";
+const char* password = "password";
+
+// Replace the next variables with your MQTT username/Password combination
+const char* MQTTUser = "mqtt-ha-user";
+const char* MQTTPass = "MqttPa$$word1!";
+
+// Add your MQTT Broker IP address, example:
+//const char* mqttServer = "192.168.1.144";
+const char* mqttServer = "192.168.1.117";
+
+//The topic prefix for the bridge's own topics, also used by the first thermostat. 
+//Every topic is built from a prefix and a short key so the prefix is only stored once.
+const char* const bridgePrefix = "casa_de_bemo/living_room/rcs_tr40_thermostat";
+
+//The thermostats and zone controllers sharing the RS485 bus, each with its own 
+//RS485 address, topic prefix and Home Assistant name. Add a line here for each 
+//device on the bus, or define THERMOSTAT_LIST with the lines to build for another bus.
+#ifndef THERMOSTAT_LIST
+#define THERMOSTAT_LIST \
+  Thermostat("1", bridgePrefix, "Living room thermostat"),
+#endif
+Thermostat thermostats[] = {
+  THERMOSTAT_LIST
+};
+const uint8_t DEVICE_COUNT = sizeof(thermostats) / sizeof(thermostats[0]);
+
+//Subscribe topics.  These are the things we are allowing to be set. Each device has 
+//one wildcard subscription, <prefix>/+/set, that covers every key in the setRoutes table
+const char* debugMode = "debug";
+//Home Assistant announces itself here when it starts, so discovery is sent again
+const char* discoveryStatusTopic = DISCOVERY_PREFIX "/status";
+
+//Publish topics.  This is the data that the thermostat will present to Home Assistant.
+//Each device publishes SPH, SPC, T, OA, M, FM, action, SC and availability under its
+//own topic prefix and announces them with the discoveryEntities table. The bridge 
+//publishes these keys under bridgePrefix.
+const char* connectionTopic = "status/LWT";
+//The connection topic is retained as online while the bridge is connected, and set to 
+//offline by the broker as the bridge's will when the connection is lost
+const char* connectionOnline = "Connected";
+const char* connectionOffline = "Disconnected";
+const char* diagnosticsTopic = "diag";
+const char* logTopic = "log";
+const char* profileTopic = "profile";
+//Bus capture dumps, and the publishes and result of a replay
+const char* captureTopic = "capture";
+const char* captureStreamTopic = "capture/stream";
+const char* captureResultTopic = "capture/result";
+//A capture published to capture/replay/fast or capture/replay/realtime is replayed
+const char* replayTopic = "capture/replay";
+
+// DECLARE VARIABLES 
+//The originator code identifier of the originator of the message
+const char* originator = "00";
+//The commands waiting to be sent to the thermostats
+CommandQueue commandQueue;
+//Sends the commands to the thermostats and waits for the responses
+TransactionEngine transactions;
+//The device whose poll schedule is checked first on the next pass of loop()
+uint8_t pollRotation = 0;
+//The fixed buffer that received RS485 frames are read into and parsed in place
+char rxBuffer[RX_BUFFER_SIZE];
+//Bytes taken from the RS485 serial port that are waiting to be framed
+RingBuffer<char, RX_RING_SIZE> rxRing;
+//Builds the received bytes into frames in the rxBuffer
+FrameReader rxFrame(rxBuffer, RX_BUFFER_SIZE);
+//Reconnects to MQTT in the background when the connection is lost
+MqttReconnector mqttReconnector;
+//Holds the status that could not be published while MQTT was down
+PublishBuffer publishBuffer;
+//The last action published or held for each thermostat, so heartbeats and republishes 
+//of an unchanged action are not held as transitions. Owned by the MQTT side.
+char lastAction[DEVICE_COUNT][PUBLISH_VALUE_LENGTH];
+//Set by the MQTT side when Home Assistant comes online or MQTT reconnects, the RS485 
+//side then refreshes every known field
+std::atomic<bool> republishRequested{false};
+//Latency histograms and error counts for the diagnostics topic
+Metrics metrics;
+//Profiles the passes of loop(), and of the network task when it runs on its own core. 
+//Published on <bridge>/profile with the diagnostics, publish "profile" to the debug 
+//topic to print it to the serial port.
+LoopProfiler busProfile;
+#ifdef BRIDGE_DUAL_CORE
+LoopProfiler networkProfile;
+#else
+LoopProfiler& networkProfile = busProfile;
+#endif
+//The copy of the RS485 side's figures the diagnostics and the profile are published from
+BusFigures busFigures;
+//Publishes the MQTT client refused, counted on the MQTT side
+unsigned long failedPublishes = 0;
+//When the diagnostics were last published
+unsigned long lastDiagnostics = 0;
+//Log levels and the ring of recent records. Publish a level (error, warn, info, debug, 
+//or on/off) to the debug topic to print to the serial port, or "dump" to publish the ring.
+Logger logger;
+//The RS485 frames recorded while capture is on. Publish "capture on", "capture off" 
+//or "capture dump" to the debug topic to control it.
+BusCapture busCapture;
+//The only way the two sides talk: commands from MQTT go to the RS485 side and status 
+//values from the RS485 side go to MQTT
+RingBuffer<Command, INBOUND_QUEUE_SIZE> inboundCommands;
+RingBuffer<StatusUpdate, OUTBOUND_QUEUE_SIZE> outboundStatus;
+//Replays a capture into its own copy of the thermostats, so the live states, polls 
+//and replies carry on untouched while it runs
+ReplayDriver replay;
+Thermostat replayThermostats[] = {
+  THERMOSTAT_LIST
+};
+//The HVAC runtime totals for each thermostat, kept apart from the state so a replay 
+//neither resets nor adds to them
+RuntimeAccumulator runtimes[DEVICE_COUNT];
+
+// Declare objects
+#ifdef RS485_HARDWARE_UART
+HardwareSerial RS485Serial(RS485_UART_NUM);
+#else
+SoftwareSerial RS485Serial(SSerialRX, SSerialTX); // RX, TX
+#endif
+//The RS485 link, with the driver enable pin it controls
+RS485Transport rs485;
+WiFiClient espClient;
+PubSubClient client(espClient);
+
+/**
+ * @brief the main setup method for instantiating objects
+ * 
+ */
+void setup() {
+  Serial.begin(115200);
+  // Start the serial port to the RS485 transceiver
+#ifdef RS485_HARDWARE_UART
+  RS485Serial.begin(RS485_BAUD, SERIAL_8N1, SSerialRX, SSerialTX);
+  rs485.txDone = rs485TxDone;
+#else
+  RS485Serial.begin(RS485_BAUD);
+#endif
+  rs485.write = rs485Write;
+  rs485.available = rs485Available;
+  rs485.read = rs485Read;
+  rs485.begin();
+
+  setup_wifi();
+  setConnectTimeout(espClient, MQTT_CONNECT_TIMEOUT);
+  client.setServer(mqttServer, 1883);
+  client.setCallback(callback);
+  client.setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+  client.setBufferSize(MQTT_BUFFER_SIZE);
+  mqttReconnector.attempt = reconnect;
+  mqttReconnector.restart = restart;
+  //Spread the devices' polls evenly over the poll period. Each device's R=2 goes out 
+  //half a period after its R=1, so the R=1s share the first half of the period.
+  for (uint8_t i = 0; i < DEVICE_COUNT; i++) {
+    thermostats[i].pollScheduler.begin(i * R1_POLL_PERIOD / (2 * DEVICE_COUNT));
+  }
+  transactions.transmit = sendCmd;
+  transactions.completed = transactionCompleted;
+  commandQueue.readBack = readBackWrite;
+#ifdef BRIDGE_DUAL_CORE
+  xTaskCreatePinnedToCore(networkTask, "network", NETWORK_TASK_STACK, NULL, NETWORK_TASK_PRIORITY, 
+                          NULL, NETWORK_TASK_CORE);
+#endif
+}
+
+/**
+ * @brief Sets how long opening the MQTT socket may block. WiFiClient::setTimeout() 
+ * takes seconds up to ESP32 core 2.x and milliseconds from core 3.0 on.
+ * 
+ * @param wifiClient The client the MQTT connection is opened through
+ * @param seconds The connect timeout in seconds
+ */
+void setConnectTimeout(WiFiClient& wifiClient, unsigned long seconds) {
+#if defined(ESP_ARDUINO_VERSION_MAJOR) && ESP_ARDUINO_VERSION_MAJOR >= 3
+  wifiClient.setTimeout(seconds * 1000UL);
+#else
+  wifiClient.setTimeout(seconds);
+#endif
+}
+
+/**
+ * @brief the main loop code
+ * 
+ */
+void loop() {
+  // put your main code here, to run repeatedly:
+  busProfile.beginPass();
+  busLoop();
+#ifdef BRIDGE_DUAL_CORE
+  busProfile.endPass();
+  unsigned long wait = busIdleTime();
+#else
+  networkLoop();
+  busProfile.endPass();
+  unsigned long wait = min(busIdleTime(), networkIdleTime());
+#endif
+  //Sleep until the next poll, retry or reconnect is due instead of spinning. The 
+  //Linux gateway's delay() returns early when a byte or a message arrives.
+  if (wait > 0) {
+    unsigned long sleepStart = millis();
+    delay(wait);
+    metrics.idleTime += millis() - sleepStart;
+  }
+}
+
+#ifdef BRIDGE_DUAL_CORE
+/**
+ * @brief Runs the MQTT side in its own task, pinned to the core the WiFi stack runs on
+ * 
+ */
+void networkTask(void* parameter) {
+  for (;;) {
+    networkProfile.beginPass();
+    networkLoop();
+    networkProfile.endPass();
+    //Always give up at least a tick so the idle task on this core can run
+    delay(max(networkIdleTime(), 1UL));
+  }
+}
+#endif
+
+/**
+ * @brief The RS485 side: receives and parses frames, keeps the thermostat state, 
+ * schedules the polls and runs the bus transactions. It only talks to the MQTT side 
+ * through the inbound command and outbound status queues.
+ * 
+ */
+void busLoop() {
+  // Never block waiting on a frame. Move what has arrived into the ring buffer and 
+  // frame a few bytes at a time so the rest of the loop keeps being serviced.
+  busProfile.enter(SCOPE_RX);
+  rs485.service();
+  while (!rxRing.full() && rs485.available()) {
+    rxRing.push((char)rs485.read());
+  }
+  char received;
+  for (int i = 0; i < RX_BYTES_PER_LOOP && rxRing.pop(received); i++) {
+    if (rxFrame.push(received)) {
+      busProfile.enter(SCOPE_PARSE);
+      busCapture.record(CAPTURE_RX, rxBuffer, rxFrame.length);
+      unsigned long parseStart = micros();
+      parseReceived(rxBuffer, rxFrame.length);
+      metrics.parseTime.record(micros() - parseStart);
+      break;
+    }
+  }
+
+  if (replay.running()) {
+    busProfile.enter(SCOPE_PARSE);
+    serviceReplay();
+  }
+  busCapture.service();
+  if (busFigures.phase.load(std::memory_order_acquire) == FIGURES_REQUESTED) {
+    takeFigures();
+  }
+
+  busProfile.enter(SCOPE_LOOP);
+  //Commands from Home Assistant
+  Command inbound;
+  while (inboundCommands.pop(inbound)) {
+    queueUserCommand(inbound.device, inbound.text, inbound.received);
+  }
+
+  // Status is requested at different intervals. Requesting information at different 
+  // intervals helps prevent data errors on the serial transmission.
+  // Each device's schedule is checked in turn, starting one device further along on 
+  // each pass, so no device is always first in line for the bus.
+  for (uint8_t i = 0; i < DEVICE_COUNT; i++) {
+    uint8_t device = (pollRotation + i) % DEVICE_COUNT;
+    Thermostat& thermostat = thermostats[device];
+    const char* poll = thermostat.pollScheduler.nextPoll();
+    if (poll != NULL) {
+      commandQueue.push(device, poll, PRIORITY_POLL);
+    }
+  }
+  pollRotation = (pollRotation + 1) % DEVICE_COUNT;
+  for (uint8_t i = 0; i < DEVICE_COUNT; i++) {
+    runtimes[i].service();
+  }
+  //Held back changes, heartbeats and fields that did not fit in the outbound queue
+  busProfile.enter(SCOPE_PUBLISH);
+  if (republishRequested.exchange(false, std::memory_order_acquire)) {
+    for (uint8_t i = 0; i < DEVICE_COUNT; i++) {
+      thermostats[i].state.refreshAll();
+    }
+  }
+  if (!outboundStatus.full()) {
+    for (uint8_t i = 0; i < DEVICE_COUNT; i++) {
+      publishChanges(thermostats[i]);
+    }
+  }
+
+  //Send the next command once the last one has been answered or given up on and the 
+  //last frame has left the transmitter
+  busProfile.enter(SCOPE_TX);
+  transactions.poll();
+  Command next;
+  if (!transactions.busy() && !rs485.busy()) {
+    uint8_t taken = commandQueue.popPacked(next, PACKED_FRAME_MAX_LENGTH);
+    if (taken > 0) {
+      metrics.packedWrites += taken - 1;
+      transactions.begin(next.device, next.text);
+    }
+  }
+}
+
+/**
+ * @brief The MQTT side: keeps the connection up, publishes the status values the RS485 
+ * side has queued and hands commands from Home Assistant to it through callback().
+ * 
+ */
+void networkLoop() {
+  // Attempts are spaced out, so the thermostats keep being polled while MQTT is down
+  networkProfile.enter(SCOPE_RECONNECT);
+  if (reconnectAllowed()) {
+    mqttReconnector.service(client.connected());
+  }
+  networkProfile.enter(SCOPE_PUBLISH);
+  drainOutbound();
+  if (!publishBuffer.empty() && client.connected()) {
+    flushPublishBuffer();
+  }
+  if (replay.phase.load(std::memory_order_acquire) == REPLAY_DONE) {
+    publishReplayResult();
+  }
+  if (busCapture.phase.load(std::memory_order_acquire) == CAPTURE_DUMP_READY) {
+    publishCapture();
+  }
+  for (uint8_t i = 0; i < DEVICE_COUNT && client.connected(); i++) {
+    if (runtimes[i].rollupReady.load(std::memory_order_acquire)) {
+      publishRuntime(i);
+    }
+  }
+  if (DIAG_PERIOD > 0 && millis() - lastDiagnostics >= DIAG_PERIOD && client.connected()) {
+    lastDiagnostics = millis();
+    busFigures.request(FIGURES_FOR_DIAGNOSTICS | FIGURES_FOR_PROFILE);
+  }
+  if (busFigures.phase.load(std::memory_order_acquire) == FIGURES_READY) {
+    publishFigures();
+  }
+
+  //Commands from Home Assistant are handled in here, by callback()
+  networkProfile.enter(SCOPE_MQTT);
+  client.loop();
+}
+
+/**
+ * @brief How long the RS485 side can sleep until its next piece of work is due. The 
+ * serial receive buffer keeps filling while it sleeps, so the sleep is capped at 
+ * IDLE_MAX_SLEEP and is 0 whenever anything is already waiting to be handled.
+ * 
+ * @return The time in milliseconds
+ */
+unsigned long busIdleTime() {
+  if (!rxRing.empty() || rs485.available() || !inboundCommands.empty() || 
+      republishRequested.load(std::memory_order_acquire) || 
+      busCapture.phase.load(std::memory_order_acquire) == CAPTURE_DUMP_REQUESTED || 
+      busFigures.phase.load(std::memory_order_acquire) == FIGURES_REQUESTED) {
+    return 0;
+  }
+  //Whatever is left to publish waits for the MQTT side to make room in the queue
+  bool outboundRoom = !outboundStatus.full();
+  if (replay.running()) {
+    return outboundRoom ? 0 : 1;
+  }
+  if (!transactions.busy() && !rs485.busy() && commandQueue.count > 0) {
+    return 0;
+  }
+  unsigned long wait = IDLE_MAX_SLEEP;
+  for (uint8_t device = 0; device < DEVICE_COUNT; device++) {
+    if (outboundRoom) {
+      wait = min(wait, thermostats[device].state.nextDue(millis(), device * FIELD_COUNT));
+    }
+    wait = min(wait, thermostats[device].pollScheduler.untilDue());
+    wait = min(wait, runtimes[device].untilDue());
+  }
+  wait = min(wait, transactions.untilDue());
+  return min(wait, rs485.untilDue());
+}
+
+/**
+ * @brief How long the MQTT side can sleep, capped at IDLE_MAX_SLEEP so the MQTT 
+ * receive buffer is read in time
+ * 
+ * @return The time in milliseconds
+ */
+unsigned long networkIdleTime() {
+  bool connected = client.connected();
+  if (!outboundStatus.empty() || (connected && !publishBuffer.empty())) {
+    return 0;
+  }
+  if (replay.phase.load(std::memory_order_acquire) == REPLAY_DONE || 
+      busCapture.phase.load(std::memory_order_acquire) == CAPTURE_DUMP_READY || 
+      busFigures.phase.load(std::memory_order_acquire) == FIGURES_READY) {
+    return 0;
+  }
+  //A held back attempt is woken for by the RS485 side once its transaction is over
+  unsigned long reconnectWait = reconnectAllowed() ? mqttReconnector.untilDue(connected) : ULONG_MAX;
+  return min((unsigned long)IDLE_MAX_SLEEP, reconnectWait);
+}
+
+/**
+ * @brief Whether an MQTT connection attempt may be made now. On a single core the 
+ * attempt blocks loop() for up to MQTT_CONNECT_TIMEOUT + MQTT_SOCKET_TIMEOUT, so none 
+ * is made while a request is on the bus or waiting for its answer.
+ */
+bool reconnectAllowed() {
+#ifdef BRIDGE_DUAL_CORE
+  return true;
+#else
+  return !transactions.busy() && !rs485.busy();
+#endif
+}
+
+/**
+ * @brief Set up the wifi object
+ * 
+ */
+void setup_wifi() {
+  delay(10);
+  // We start by connecting to a WiFi network
+  LOG_INFO("Connecting to %s", ssid);
+
+  WiFi.begin(ssid, password);
+
+  while (WiFi.status() != WL_CONNECTED) {
+    delay(500);
+  }
+
+  LOG_INFO("WiFi connected, IP address: %s", WiFi.localIP().toString().c_str());
+}
+
+/**
+ * @brief A set topic payload, read in place from the MQTT receive buffer. It is not 
+ * null terminated.
+ */
+struct Payload {
+  const char* data;
+  size_t length;
+
+  bool equals(const char* text) const {
+    return strlen(text) == length && memcmp(data, text, length) == 0;
+  }
+
+  /**
+   * @brief Copies the payload into a buffer as a null terminated string
+   * 
+   * @return false if it does not fit
+   */
+  bool copyTo(char* buffer, size_t size) const {
+    if (length >= size) {
+      return false;
+    }
+    memcpy(buffer, data, length);
+    buffer[length] = '\0';
+    return true;
+  }
+};
+
+//How the payload of a set topic is checked
+enum PayloadKind : uint8_t {
+  //A whole number, optionally negative, from min to max
+  PAYLOAD_INTEGER,
+  //One of the values listed
+  PAYLOAD_ONE_OF,
+  //hh:mm:ss
+  PAYLOAD_TIME,
+  //mm/dd/yy
+  PAYLOAD_DATE,
+  //Up to max characters without double quotes, sent enclosed in double quotes. A lone 
+  //# is sent as it is, it clears the message.
+  PAYLOAD_TEXT,
+  //The single setpoint, checked and sent as SPH or SPC depending on the mode
+  PAYLOAD_SETPOINT,
+};
+
+//A settable key and how its payload is checked
+struct SetRoute {
+  uint32_t code;
+  const char* key;
+  const char* description;
+  PayloadKind kind;
+  long min;
+  long max;
+  //The allowed values for PAYLOAD_ONE_OF, ending with NULL
+  const char* const* values;
+  //Logged when the payload is rejected
+  const char* error;
+  //The status field the key writes, published optimistically and read back with R=1, 
+  //FIELD_COUNT when the key has no status field
+  StateField field;
+};
+
+//SC=n - Schedule control where “n” is 0 (Hold); 1 (Run); or ?. Run starts
+//       execution of setpoint schedule, Hold stops schedule execution and 
+//       holds current setpoint..
+const char* const scheduleControlValues[] = {"0", "1", "?", NULL};
+//M=a - Mode where a = O (Off), H(Heat), C(Cool), A(Auto), EH(Emergency Heat) or I (Invalid).
+const char* const modeValues[] = {"O", "H", "C", "A", "EH", "I", NULL};
+//FM=x - Fan Mode where x = 0 (Off or Auto) or 1 (On).
+const char* const fanModeValues[] = {"0", "1", NULL};
+
+//The keys that can be set through <prefix>/KEY/set. A new settable key only needs an entry here.
+const SetRoute setRoutes[] = {
+  {keyCode("SP"),   "SP",   "SetPoint",            PAYLOAD_SETPOINT, 0,   0,   NULL, 
+    "The setpoint must be a number and can only be set in heat or cool mode", FIELD_COUNT},
+  {keyCode("SPH"),  "SPH",  "Heating SetPoint",    PAYLOAD_INTEGER,  40,  109, NULL, 
+    "The heating setpoint must be a number between 40 and 109", FIELD_SETPOINT_HEAT},
+  {keyCode("SPC"),  "SPC",  "Cooling SetPoint",    PAYLOAD_INTEGER,  44,  113, NULL, 
+    "The cooling setpoint must be a number between 44 and 113", FIELD_SETPOINT_COOL},
+  {keyCode("SC"),   "SC",   "schedule control",    PAYLOAD_ONE_OF,   0,   0,   scheduleControlValues, 
+    "The schedule control can only be 0 (Hold), 1 (Run) or ?", FIELD_COUNT},
+  {keyCode("M"),    "M",    "Mode",                PAYLOAD_ONE_OF,   0,   0,   modeValues, 
+    "The mode must be one of O, H, C, A, EH or I", FIELD_MODE},
+  {keyCode("FM"),   "FM",   "Fan Mode",            PAYLOAD_ONE_OF,   0,   0,   fanModeValues, 
+    "The fan mode must be either 0 or 1", FIELD_FAN_MODE},
+  {keyCode("TM"),   "TM",   "Text Message",        PAYLOAD_TEXT,     0,   80,  NULL, 
+    "The text message must be at most 80 characters and cannot contain double quotes", FIELD_COUNT},
+  {keyCode("OT"),   "OT",   "Outside Temperature", PAYLOAD_INTEGER,  -50, 124, NULL, 
+    "The outside temp must be a number between -50 and 124", FIELD_COUNT},
+  {keyCode("TIME"), "TIME", "Time",                PAYLOAD_TIME,     0,   0,   NULL, 
+    "The time must be hh:mm:ss", FIELD_COUNT},
+  {keyCode("DATE"), "DATE", "Date",                PAYLOAD_DATE,     0,   0,   NULL, 
+    "The date must be mm/dd/yy", FIELD_COUNT},
+  {keyCode("DOW"),  "DOW",  "Day of the week",     PAYLOAD_INTEGER,  1,   7,   NULL, 
+    "The day of the week must be a number between 1 (Sunday) and 7 (Saturday)", FIELD_COUNT},
+};
+
+/**
+ * @brief Reads a whole number, optionally negative
+ * 
+ * @param payload The characters to read
+ * @param value Set to the number
+ * @return false if the characters are not a number of at most six digits
+ */
+bool parseInteger(const Payload& payload, long& value) {
+  size_t i = (payload.length > 0 && payload.data[0] == '-') ? 1 : 0;
+  if (payload.length == i || payload.length - i > 6) {
+    return false;
+  }
+  long number = 0;
+  for (size_t j = i; j < payload.length; j++) {
+    if (!isDigit(payload.data[j])) {
+      return false;
+    }
+    number = number * 10 + (payload.data[j] - '0');
+  }
+  value = (i == 1) ? -number : number;
+  return true;
+}
+
+/**
+ * @brief Checks a payload is three two digit numbers with a separator between them, 
+ * such as hh:mm:ss, and that each is in its range
+ * 
+ * @param payload The payload to check
+ * @param separator The character between the numbers
+ * @param min The lowest value of each number
+ * @param max The highest value of each number
+ * @return true if the payload is valid
+ */
+bool validateTriple(const Payload& payload, char separator, const uint8_t min[3], const uint8_t max[3]) {
+  if (payload.length != 8 || payload.data[2] != separator || payload.data[5] != separator) {
+    return false;
+  }
+  for (uint8_t i = 0; i < 3; i++) {
+    char tens = payload.data[i * 3];
+    char ones = payload.data[i * 3 + 1];
+    if (!isDigit(tens) || !isDigit(ones)) {
+      return false;
+    }
+    uint8_t value = (tens - '0') * 10 + (ones - '0');
+    if (value < min[i] || value > max[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Checks the payload of a set topic against its route, logging why it is rejected
+ * 
+ * @param route The route of the set topic, after resolveSetRoute()
+ * @param payload The payload to check
+ * @return true if the payload is valid
+ */
+bool validatePayload(const SetRoute& route, const Payload& payload) {
+  bool valid = false;
+  switch (route.kind) {
+    case PAYLOAD_INTEGER: {
+      long value;
+      valid = parseInteger(payload, value) && value >= route.min && value <= route.max;
+      break;
+    }
+    case PAYLOAD_ONE_OF:
+      for (const char* const* value = route.values; *value != NULL && !valid; value++) {
+        valid = payload.equals(*value);
+      }
+      break;
+    case PAYLOAD_TIME: {
+      static const uint8_t min[3] = {0, 0, 0};
+      static const uint8_t max[3] = {23, 59, 59};
+      valid = validateTriple(payload, ':', min, max);
+      break;
+    }
+    case PAYLOAD_DATE: {
+      static const uint8_t min[3] = {1, 1, 0};
+      static const uint8_t max[3] = {12, 31, 99};
+      valid = validateTriple(payload, '/', min, max);
+      break;
+    }
+    case PAYLOAD_TEXT:
+      //Carriage returns are allowed inside the quotes, other control characters are not
+      valid = payload.length <= (size_t)route.max;
+      for (size_t i = 0; i < payload.length && valid; i++) {
+        char c = payload.data[i];
+        valid = c != '"' && (c == '\r' || (uint8_t)c >= ' ');
+      }
+      break;
+    case PAYLOAD_SETPOINT: {
+      //Only a number here, its range is that of the setpoint it resolves to
+      long value;
+      valid = parseInteger(payload, value);
+      break;
+    }
+  }
+  if (!valid) {
+    LOG_WARN("%s", route.error);
+  }
+  return valid;
+}
+
+/**
+ * @brief Builds the KEY=value command for a validated payload. Numbers are written 
+ * out in their plain form, so 070 is sent and published as 70, the way the thermostat 
+ * reports it back.
+ * 
+ * @param route The route of the set topic, after resolveSetRoute()
+ * @param payload The validated payload
+ * @param buffer Where to write the command
+ * @param size The size of the buffer
+ * @return false if the command does not fit
+ */
+bool buildCommand(const SetRoute& route, const Payload& payload, char* buffer, size_t size) {
+  long number;
+  if ((route.kind == PAYLOAD_INTEGER || route.kind == PAYLOAD_SETPOINT) && parseInteger(payload, number)) {
+    int used = snprintf(buffer, size, "%s=%ld", route.key, number);
+    return used >= 0 && (size_t)used < size;
+  }
+  bool quoted = route.kind == PAYLOAD_TEXT && !payload.equals("#");
+  const char* format = quoted ? "%s=\"%.*s\"" : "%s=%.*s";
+  int used = snprintf(buffer, size, format, route.key, (int)payload.length, payload.data);
+  return used >= 0 && (size_t)used < size;
+}
+
+/**
+ * @brief Finds the route for a settable key
+ * 
+ * @param key The key characters (not necessarily null terminated)
+ * @param length The number of characters in the key
+ * @return The route, or NULL if the key cannot be set
+ */
+const SetRoute* findSetRoute(const char* key, size_t length) {
+  uint32_t code = keyCode(key, length);
+  if (code == 0) {
+    return NULL;
+  }
+  for (const SetRoute& route : setRoutes) {
+    if (route.code == code) {
+      return &route;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Whether the outcome of a write shows in the R=1 readback after it. Only writes 
+ * to a status field do; the TR40 takes or ignores TM, OT, TIME, DATE, DOW and SC 
+ * without reporting them.
+ * 
+ * @param command The KEY=value write
+ * @return true if the readback confirms or rolls back each such write on its own
+ */
+bool readBackWrite(const char* command) {
+  const char* equals = strchr(command, '=');
+  const SetRoute* route = (equals != NULL) ? findSetRoute(command, equals - command) : NULL;
+  return route != NULL && route->field != FIELD_COUNT;
+}
+
+/**
+ * @brief Picks the route a payload is checked and sent with. The single setpoint (SP) 
+ * sets the heating or cooling setpoint depending on what mode the thermostat is in. 
+ * Called from the RS485 side, which keeps the mode.
+ * 
+ * @param route The route of the set topic
+ * @param thermostat The thermostat the payload is for
+ * @return The route to use, or NULL if the key cannot be set in the current mode
+ */
+const SetRoute* resolveSetRoute(const SetRoute* route, const Thermostat& thermostat) {
+  if (route->kind != PAYLOAD_SETPOINT) {
+    return route;
+  }
+  if (thermostat.state.mode == MODE_HEAT) {
+    return findSetRoute("SPH", 3);
+  } else if (thermostat.state.mode == MODE_COOL) {
+    return findSetRoute("SPC", 3);
+  }
+  return NULL;
+}
+
+/**
+ * @brief This is to process incoming messages
+ * 
+ * @param topic The topic we are subscribed to
+ * @param message The payload for that topic
+ * @param length The length of the payload string
+ */
+void callback(char* topic, byte* message, unsigned int length) {
+  unsigned long start = micros();
+  //The payload is checked where it is, nothing is copied or allocated for it
+  Payload payload = {(const char*)message, length};
+  LOG_DEBUG("Message arrived on topic: %s. Message: %.*s", topic, (int)length, payload.data);
+
+  if (strcmp(topic, discoveryStatusTopic) == 0) {
+    if (payload.equals("online")) {
+      publishDiscovery();
+      publishAvailability();
+      republishRequested.store(true, std::memory_order_release);
+    }
+    return;
+  }
+  const char* bridgeKey = topicKey(topic, bridgePrefix);
+  if (bridgeKey != NULL && strcmp(bridgeKey, debugMode) == 0) {
+    char level[8];
+    if (payload.equals("dump")) {
+      publishLog();
+    } else if (payload.equals("profile")) {
+      busFigures.request(FIGURES_FOR_PROFILE | FIGURES_FOR_SERIAL);
+    } else if (payload.equals("capture on") || payload.equals("capture off")) {
+      if (!busCapture.enable(payload.equals("capture on"))) {
+        LOG_WARN("The capture is being dumped");
+      }
+    } else if (payload.equals("capture dump")) {
+      //Recording stops so the ring does not change under the dump, networkLoop() 
+      //publishes it once the RS485 side has let go of it
+      if (!busCapture.requestDump()) {
+        LOG_WARN("The capture is already being dumped");
+      }
+    } else if (!payload.copyTo(level, sizeof(level)) || !logger.setSerialLevel(level)) {
+      LOG_WARN("Unknown debug level %.*s", (int)length, payload.data);
+    }
+    return;
+  }
+  const char* replayKey = (bridgeKey != NULL) ? topicKey(bridgeKey, replayTopic) : NULL;
+  if (replayKey != NULL) {
+    startReplay(message, length, strcmp(replayKey, "realtime") == 0);
+    return;
+  }
+
+  //Find the device the topic is for and strip its prefix so only the short key is 
+  //left to dispatch on
+  const char* key = NULL;
+  uint8_t device = 0;
+  for (; device < DEVICE_COUNT; device++) {
+    key = topicKey(topic, thermostats[device].topicPrefix);
+    if (key != NULL) {
+      break;
+    }
+  }
+  if (key == NULL) {
+    return;
+  }
+
+  //Check to see if the received message is for one of our thermostat control topics
+  const char* slash = strchr(key, '/');
+  if (slash == NULL || strcmp(slash, "/set") != 0) {
+    return;
+  }
+  const SetRoute* route = findSetRoute(key, slash - key);
+  if (route == NULL) {
+    return;
+  }
+  LOG_INFO("Set the %s", route->description);
+  //The mode belongs to the RS485 side, so SP= is sent on as it is and resolved there
+  char command[COMMAND_MAX_LENGTH];
+  if (!validatePayload(*route, payload)) {
+    return;
+  }
+  if (!buildCommand(*route, payload, command, sizeof(command))) {
+    LOG_WARN("The %s command is too long", route->key);
+    return;
+  }
+  if (submitCommand(device, command, start) && route->field != FIELD_COUNT) {
+    //Show the requested value straight away, as the command sends it. The readback 
+    //after the write confirms it.
+    const char* value = strchr(command, '=') + 1;
+    if (strlen(value) < PUBLISH_VALUE_LENGTH) {
+      sendStatus(thermostats[device], fieldKeys[route->field], value);
+    }
+  }
+}
+
+/**
+ * @brief Describes a PubSubClient connection state
+ * 
+ * @param state The value returned by client.state()
+ * @return The name of the state
+ */
+const char* mqttStateName(int state) {
+  switch (state) {
+    case -4: return "MQTT CONNECTION TIMEOUT";
+    case -3: return "MQTT CONNECTION LOST";
+    case -2: return "MQTT CONNECT FAILED";
+    case -1: return "MQTT DISCONNECTED";
+    case 0:  return "MQTT CONNECTED";
+    case 1:  return "MQTT CONNECT BAD PROTOCOL";
+    case 2:  return "MQTT CONNECT BAD CLIENT ID";
+    case 3:  return "MQTT CONNECT UNAVAILABLE";
+    case 4:  return "MQTT CONNECT BAD CREDENTIALS";
+    case 5:  return "MQTT CONNECT UNAUTHORIZED";
+    default: return "MQTT UNKNOWN STATE";
+  }
+}
+
+/**
+ * @brief Makes one attempt to reconnect to the MQTT server
+ * 
+ * @return true if the connection was made
+ */
+bool reconnect() {
+  LOG_INFO("Attempting MQTT connection");
+  // Attempt to connect, with the broker told to mark the bridge offline if it goes away
+  char willTopic[TOPIC_MAX_LENGTH];
+  bridgeTopic(willTopic, sizeof(willTopic), connectionTopic);
+  if (client.connect("ESP8266Client", MQTTUser, MQTTPass, willTopic, 0, true, connectionOffline)) {
+    LOG_INFO("MQTT connected");
+    // Subscribe
+
+    char topic[TOPIC_MAX_LENGTH];
+    for (uint8_t i = 0; i < DEVICE_COUNT; i++) {
+      snprintf(topic, sizeof(topic), "%s/+/set", thermostats[i].topicPrefix);
+      client.subscribe(topic);
+    }
+    bridgeTopic(topic, sizeof(topic), debugMode);
+    client.subscribe(topic);
+    client.subscribe(discoveryStatusTopic);
+    snprintf(topic, sizeof(topic), "%s/%s/+", bridgePrefix, replayTopic);
+    client.subscribe(topic);
+
+    publishDiscovery();
+    //Bring Home Assistant up to date with what changed while we were away. Flushed 
+    //before the availability, so nothing is shown as available until it is current.
+    flushPublishBuffer();
+    publishAvailability();
+    //Then have every field sent again in case the broker lost what was retained
+    republishRequested.store(true, std::memory_order_release);
+    return true;
+  }
+  LOG_WARN("MQTT connection failed, rc=%s", mqttStateName(client.state()));
+  return false;
+}
+
+/**
+ * @brief Restarts the controller when MQTT has been unreachable for too long
+ * 
+ */
+void restart() {
+  LOG_ERROR("MQTT unreachable for too long, restarting");
+  ESP.restart();
+}
+
+/**
+ * @brief Maps a status key to its StatusKey field
+ * 
+ * @param key The status key characters (not necessarily null terminated)
+ * @param length The number of characters in the key
+ * @return The matching StatusKey, or KEY_UNKNOWN
+ */
+StatusKey lookupStatusKey(const char* key, size_t length) {
+  switch (keyCode(key, length)) {
+    case keyCode("A"):   return KEY_A;
+    case keyCode("O"):   return KEY_O;
+    case keyCode("OA"):  return KEY_OA;
+    case keyCode("Z"):   return KEY_Z;
+    case keyCode("T"):   return KEY_T;
+    case keyCode("SP"):  return KEY_SP;
+    case keyCode("SPH"): return KEY_SPH;
+    case keyCode("SPC"): return KEY_SPC;
+    case keyCode("M"):   return KEY_M;
+    case keyCode("FM"):  return KEY_FM;
+    case keyCode("H1A"): return KEY_H1A;
+    case keyCode("H2A"): return KEY_H2A;
+    case keyCode("H3A"): return KEY_H3A;
+    case keyCode("C1A"): return KEY_C1A;
+    case keyCode("C2A"): return KEY_C2A;
+    case keyCode("FA"):  return KEY_FA;
+    case keyCode("VA"):  return KEY_VA;
+    case keyCode("SM"):  return KEY_SM;
+    case keyCode("SF"):  return KEY_SF;
+    case keyCode("SC"):  return KEY_SC;
+    case keyCode("D1"):  return KEY_D1;
+    case keyCode("SCP"): return KEY_SCP;
+    default:             return KEY_UNKNOWN;
+  }
+}
+
+/**
+ * @brief Decodes a status value into an integer without allocating
+ * 
+ * @param value The null terminated value string
+ * @param result Where the decoded number is stored
+ * @return true if the whole value was a (optionally negative) number from -INT16_MAX 
+ *         to INT16_MAX, which the int16_t status fields hold without reaching NO_VALUE
+ */
+bool parseIntValue(const char* value, int& result) {
+  bool negative = (*value == '-');
+  if (negative) {
+    value ++;
+  }
+  if (!isDigit(*value)) {
+    return false;
+  }
+  int number = 0;
+  while (isDigit(*value)) {
+    number = number * 10 + (*value - '0');
+    //A long run of digits is a garbled frame, stopped before it can overflow
+    if (number > INT16_MAX) {
+      return false;
+    }
+    value ++;
+  }
+  result = negative ? -number : number;
+  return *value == '\0';
+}
+
+/**
+ * @brief Decodes a mode value (O, H, C, A, EH or I)
+ * 
+ * @param value The null terminated value string
+ * @return The matching ThermostatMode, or MODE_UNKNOWN
+ */
+ThermostatMode parseModeValue(const char* value) {
+  switch (keyCode(value, strlen(value))) {
+    case keyCode("O"):  return MODE_OFF;
+    case keyCode("H"):  return MODE_HEAT;
+    case keyCode("C"):  return MODE_COOL;
+    case keyCode("A"):  return MODE_AUTO;
+    case keyCode("EH"): return MODE_EMERGENCY_HEAT;
+    case keyCode("I"):  return MODE_INVALID;
+    default:            return MODE_UNKNOWN;
+  }
+}
+
+/**
+ * @brief Finds the next space separated status string in a frame
+ * 
+ * @param pos The current position in the frame, moved past the status string found
+ * @param end The end of the frame
+ * @param length Set to the number of characters in the status string found
+ * @return The start of the status string, or NULL at the end of the frame
+ */
+char* nextToken(char*& pos, char* end, size_t& length) {
+  //Skip the separators, which may already have been terminated in place
+  while (pos < end && (*pos == ' ' || *pos == '\0')) {
+    pos ++;
+  }
+  if (pos == end) {
+    return NULL;
+  }
+  char* token = pos;
+  while (pos < end && *pos != ' ') {
+    pos ++;
+  }
+  length = pos - token;
+  return token;
+}
+
+/**
+ * @brief Used to parse data received from the RS485 network connected to the thermostat.
+ * The frame is tokenized in place, so no memory is allocated while parsing.
+ * 
+ * @param frame The null terminated frame to parse, it is modified while parsing
+ * @param length The number of characters in the frame
+ */
+void parseReceived(char* frame, size_t length) {
+  
+  char* end = frame + length;
+  char* pos = frame;
+  //Set once the A= and O= header fields have matched our originator and one of our 
+  //devices' addresses
+  Thermostat* thermostat = NULL;
+  uint8_t device = 0;
+  bool originated = false;
+  //A replayed frame goes into the replay's copies and counts, never the live ones
+  Thermostat* devices = replay.parsing ? replayThermostats : thermostats;
+  unsigned long& malformedFrames = replay.parsing ? replay.malformedFrames : metrics.malformedFrames;
+  unsigned long& foreignFrames = replay.parsing ? replay.foreignFrames : metrics.foreignFrames;
+
+  LOG_DEBUG("Message: %s", frame);
+  
+  size_t tokenLength;
+  for (char* token = nextToken(pos, end, tokenLength); token != NULL; token = nextToken(pos, end, tokenLength)) {
+    token[tokenLength] = '\0';
+    //Now we need to split the status string into it's Type and Value
+    char* equals = strchr(token, '=');
+    if (equals == NULL) {
+      if (!originated) {
+        malformedFrames ++;
+        break;
+      }
+      continue;
+    }
+    StatusKey key = lookupStatusKey(token, equals - token);
+    char* value = equals + 1;
+    //Some fields are sent with a space after the equals sign (SP= 70), so take the 
+    //next token as the value when it is not a status string of its own
+    if (*value == '\0') {
+      char* peek = pos;
+      size_t valueLength;
+      char* valueToken = nextToken(peek, end, valueLength);
+      if (valueToken != NULL && memchr(valueToken, '=', valueLength) == NULL) {
+        valueToken[valueLength] = '\0';
+        value = valueToken;
+        pos = peek;
+      }
+    }
+
+    //Check if the message came from the originator (the thermostat) and is from the 
+    //serial address of one of our devices
+    if (!originated) {
+      if (key != KEY_A || strcmp(value, originator) != 0) {
+        malformedFrames ++;
+        break;
+      }
+      originated = true;
+      continue;
+    }
+    if (thermostat == NULL) {
+      if (key != KEY_O) {
+        malformedFrames ++;
+        break;
+      }
+      for (device = 0; device < DEVICE_COUNT; device++) {
+        if (strcmp(value, devices[device].address) == 0) {
+          thermostat = &devices[device];
+          break;
+        }
+      }
+      if (thermostat == NULL) {
+        foreignFrames ++;
+        break;
+      }
+      thermostat->state.frameStages = 0;
+      thermostat->state.stagesReported = false;
+      continue;
+    }
+    parseStatus(*thermostat, key, value);
+  }
+
+  if (thermostat != NULL) {
+    if (thermostat->state.stagesReported) {
+      resolveAction(*thermostat);
+    }
+    //Publish what changed in this frame
+    publishChanges(*thermostat);
+    unsigned long sentAt = transactions.sentAt;
+    if (!replay.parsing && transactions.responseReceived(device)) {
+      metrics.roundTrip.record(micros() - sentAt);
+    }
+    LOG_DEBUG("Response received and processed");
+  } else {
+    //Echoes, noise and traffic for other addresses are dropped
+    LOG_DEBUG("Frame not addressed to us, dropped");
+  }
+  
+} //End parseReceived
+
+/**
+ * @brief Told the outcome of each request sent to a thermostat. A request may carry 
+ * several packed writes, the one response answers them all.
+ * 
+ * @param device The index of the thermostat the request was sent to
+ * @param request The command that was sent
+ * @param result Whether a response was received
+ */
+void transactionCompleted(uint8_t device, const char* request, TransactionResult result) {
+  if (result != TRANSACTION_OK) {
+    LOG_WARN("No response to %s from thermostat %s", request, thermostats[device].address);
+  }
+  //A write to a status field was published optimistically. Once the thermostat has 
+  //answered it, read the fields straight back to confirm them; when there was no 
+  //answer put back the last values the thermostat reported. The readback takes the 
+  //place of an R=1 poll already waiting.
+  uint16_t fields = 0;
+  const char* parameter = request;
+  while (*parameter != '\0') {
+    const char* next = strchr(parameter, ' ');
+    const char* parameterEnd = (next != NULL) ? next : parameter + strlen(parameter);
+    const char* equals = (const char*)memchr(parameter, '=', parameterEnd - parameter);
+    const SetRoute* route = (equals != NULL) ? findSetRoute(parameter, equals - parameter) : NULL;
+    if (route != NULL && route->field != FIELD_COUNT) {
+      fields |= 1 << route->field;
+    }
+    parameter = (next != NULL) ? next + 1 : parameterEnd;
+  }
+  if (fields == 0) {
+    return;
+  }
+  Thermostat& thermostat = thermostats[device];
+  if (result == TRANSACTION_OK) {
+    thermostat.state.optimistic |= fields;
+    commandQueue.push(device, "R=1", PRIORITY_USER);
+  } else {
+    thermostat.state.optimistic &= ~fields;
+    rollBack(thermostat, fields);
+  }
+}
 
+/**
+ * @brief Puts back what was published optimistically for writes that did not go 
+ * through: the last value the thermostat reported, or "unknown" for a field it has 
+ * not reported yet so the written value does not stay up in Home Assistant.
+ * 
+ * @param thermostat The thermostat the writes were for
+ * @param fields The fields the writes were published on
+ */
+void rollBack(Thermostat& thermostat, uint16_t fields) {
+  publishState(thermostat, fields);
+  uint16_t unknown = fields & ~thermostat.state.known;
+  while (unknown != 0) {
+    StateField field = (StateField)__builtin_ctz(unknown);
+    unknown &= unknown - 1;
+    if (!publishStatus(thermostat, fieldKeys[field], "unknown")) {
+      metrics.outboundFull ++;
+    }
+  }
+}
 
-// Replace the next variables with your SSID/Password combination
-const char* ssid = "phpwebscripting3";
-const char* password = "password";
+/**
+ * @brief Resolves the action once an R=2 frame has been parsed, from all of the stage 
+ * bits it reported and the actionRules, and marks it dirty only if it changed. A 
+ * frame without a system mode is taken as off when the thermostat mode is off.
+ * 
+ * @param thermostat The thermostat the frame came from
+ */
+void resolveAction(Thermostat& thermostat) {
+  ThermostatState& state = thermostat.state;
+  uint8_t stages = state.frameStages;
+  if (state.mode == MODE_OFF) {
+    stages |= SYSTEM_OFF;
+  }
+  HvacAction action = ACTION_IDLE;
+  for (const ActionRule& rule : actionRules) {
+    if (stages & rule.stages) {
+      action = rule.action;
+      break;
+    }
+  }
+  if (state.action != action || !(state.known & (1 << FIELD_ACTION))) {
+    LOG_DEBUG("Action is now %s", actionNames[action]);
+    state.action = action;
+    state.dirty |= 1 << FIELD_ACTION;
+    state.known |= 1 << FIELD_ACTION;
+  }
+}
 
-// Replace the next variables with your MQTT username/Password combination
-const char* MQTTUser = "mqtt-ha-user";
-const char* MQTTPass = "MqttPa$$word1!";
+/**
+ * @brief Used to parse a status parameter sent from a thermostat into its state
+ * 
+ * @param thermostat The thermostat that sent the status
+ * @param key The status type
+ * @param Value The status value
+ */
+void parseStatus(Thermostat& thermostat, StatusKey key, const char* Value) {
+  ThermostatState& state = thermostat.state;
+  int number = 0;
+  bool numeric = parseIntValue(Value, number);
 
-// Add your MQTT Broker IP address, example:
-//const char* mqttServer = "192.168.1.144";
-const char* mqttServer = "192.168.1.117";
+  //Keep track of which heating and cooling stages are running so the status is 
+  //polled more often while the HVAC is working
+  if (numeric && key >= KEY_H1A && key <= KEY_C2A) {
+    uint8_t stage = 1 << (key - KEY_H1A);
+    state.activeStages = (number != 0) ? (state.activeStages | stage) : (state.activeStages & ~stage);
+    thermostat.pollScheduler.setStageActive(state.activeStages != 0);
+  }
+  //Replayed frames are old news to the runtime totals
+  if (numeric && key >= KEY_H1A && key <= KEY_FA && !replay.parsing) {
+    runtimes[&thermostat - thermostats].stage(key - KEY_H1A, number != 0);
+  }
+  //The action is resolved from all of the frame's stages once it has been parsed
+  if (numeric && key >= KEY_H1A && key <= KEY_FA) {
+    state.frameStages |= (number != 0) ? 1 << (key - KEY_H1A) : 0;
+    state.stagesReported = true;
+  }
 
-//Subscribe topics.  These are the things we are allowing to be set
-const char* setTempTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/SP/set";
-const char* setHeatTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/SPH/set";
-const char* setCoolTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/SPC/set";
-const char* setModeTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/M/set";
-const char* setFanModeTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/FM/set";
-const char* setTextMessageTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/TM/set";
-const char* setScheduleControlTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/SC/set";
-const char* setOutsideTempTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/OT/set";
-const char* setTimeTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/TIME/set";
-const char* setDateTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/DATE/set";
-const char* setDayOfWeekTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/DOW/set";
-const char* debugMode = "casa_de_bemo/living_room/rcs_tr40_thermostat/debug";
-
-//Publish topics.  This is the data that the thermostat will present to Home Assistant
-const char* connectionTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/status/LWT";
-const char* availabilityTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/availability";
-const char* setpointHeatTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/SPH";
-const char* setpointCoolTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/SPC";
-const char* currentTempTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/T";
-const char* outsideAirTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/OA";
-const char* modeTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/M";
-const char* fanModeTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/FM";
-//These topics are being commented for now to try and use the action topic from the 
-//MQTT HVAC integration.
-/*
-const char* heatStage1Topic = "casa_de_bemo/living_room/rcs_tr40_thermostat/H1A";
-const char* heatStage2Topic = "casa_de_bemo/living_room/rcs_tr40_thermostat/H2A";
-const char* heatStage3Topic = "casa_de_bemo/living_room/rcs_tr40_thermostat/H3A";
-const char* coolStage1Topic = "casa_de_bemo/living_room/rcs_tr40_thermostat/C1A";
-const char* coolStage2Topic = "casa_de_bemo/living_room/rcs_tr40_thermostat/C2A";
-*/
-const char* actionTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/action";
-const char* fanStatusTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/FA";
-const char* stagingDelaysTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/SCP";
-const char* systemModeTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/SM";
-const char* scheduleControlTopic = "casa_de_bemo/living_room/rcs_tr40_thermostat/SC";
+  switch (key) {
+    case KEY_OA:
+      //Outside Air
+      if (numeric)
+        state.set(FIELD_OUTSIDE_AIR, state.outsideAir, number);
+      break;
+    case KEY_T:
+      //Current temperature
+      LOG_DEBUG("Current temperature=%s", Value);
+      if (numeric)
+        state.set(FIELD_TEMP, state.temp, number);
+      break;
+    case KEY_SP:
+      //Set Point (for single setpoint systems)  Set the heating or cooling depending 
+      //on what mode we are in
+      if (!numeric) {
+        break;
+      }
+      if (state.mode == MODE_HEAT || state.mode == MODE_EMERGENCY_HEAT) {
+        LOG_DEBUG("Single setpoint Heat=%s", Value);
+        state.set(FIELD_SETPOINT_HEAT, state.setpointHeat, number);
+      } else if (state.mode == MODE_COOL) {
+        LOG_DEBUG("Single setpoint cool=%s", Value);
+        state.set(FIELD_SETPOINT_COOL, state.setpointCool, number);
+      }
+      break;
+    case KEY_SPH:
+      //Heating set point
+      LOG_DEBUG("Heating set point=%s", Value);
+      if (numeric)
+        state.set(FIELD_SETPOINT_HEAT, state.setpointHeat, number);
+      break;
+    case KEY_SPC:
+      //Cooling set point
+      LOG_DEBUG("Cooling set point=%s", Value);
+      if (numeric)
+        state.set(FIELD_SETPOINT_COOL, state.setpointCool, number);
+      break;
+    case KEY_M: {
+      //RCS thermostat mode 
+      ThermostatMode mode = parseModeValue(Value);
+      LOG_DEBUG("mode=%s", Value);
+      if (mode != MODE_UNKNOWN) {
+        state.received(FIELD_MODE);
+      }
+      if (mode != MODE_UNKNOWN && state.mode != mode) {
+        state.mode = mode;
+        state.dirty |= 1 << FIELD_MODE;
+        state.known |= 1 << FIELD_MODE;
+        if (mode == MODE_OFF) {
+            LOG_DEBUG("Set to Off");
+        } else if (mode == MODE_HEAT) {
+            LOG_DEBUG("Set to Heating");
+        } else if (mode == MODE_COOL) {
+            LOG_DEBUG("Set to Cooling");
+        } else if (mode == MODE_AUTO) {
+            LOG_DEBUG("Set to AutoChangeOver");
+        } else if (mode == MODE_EMERGENCY_HEAT) {
+            LOG_DEBUG("Set to Emergency Heat");
+        }
+      }
+      break;
+    }
+    case KEY_FM:
+      //RCS current fan mode (0=off 1=on)
+      if (numeric && state.fanMode != number) {
+        if (number == 1) {
+          LOG_DEBUG("Set fan mode to ContinuousOn");
+        } else {
+          LOG_DEBUG("Set fan mode to Auto");
+        }
+      }
+      if (numeric)
+        state.set(FIELD_FAN_MODE, state.fanMode, number);
+      break;
+    //Type 2 status message types, the heating and cooling stages (H1A, H2A, H3A, C1A, 
+    //C2A) and fan (FA) are collected above and resolved into the action by 
+    //resolveAction() at the end of the frame
+    //{% set values = {'O':'Off', 'H1':'Stage 1 heating', 'H2':'Stage 2 heating', 'H3':'Stage 3 heating', 'C1':'Stage 1 heating', 'C2':'Stage 2 cooling', 'I':'Idle', 'F':'Fan'} %}
+    case KEY_SM:
+      //RCS system mode
+      if (strcmp(Value, "O") == 0)
+        state.frameStages |= SYSTEM_OFF;
+      state.stagesReported = true;
+      break;
+    case KEY_SC:
+      //RCS schedule control
+      if (numeric && number == 0) {
+        LOG_DEBUG("Schedule control is set to Hold");
+      } else if (numeric && number == 1) {
+        LOG_DEBUG("Schedule control is set to Run");
+      } else {
+        LOG_DEBUG("Unknown schedule control response");
+      }
+      if (numeric)
+        state.set(FIELD_SCHEDULE_CONTROL, state.scheduleControl, number);
+      break;
+    case KEY_SCP:
+      //This is for MOT (Minimum Off Time) and MRT (Minimum Run Time) statuses for 
+      //stages 1 and 2, counted in the runtime totals
+      if (!replay.parsing)
+        runtimes[&thermostat - thermostats].protection(Value);
+      break;
+    case KEY_VA:
+      //Vent damper not used
+    case KEY_D1:
+      //Damper #1 not used
+    default:
+      break;
+  }
+  
+} //End parseStatus
 
-// DECLARE VARIABLES 
-//the last sent heat set point
-String lastSetpointHeat;
-//the last sent cool set point
-String lastSetpointCool;
-//The last mode received from the thermostat (O, H, C, A, EH)
-String lastMode = "";
-//The last fan mode received from the thermostat
-String lastFanMode = "";
-//The last temperature received from the thermostat
-String lastTemp = "";
-//The last action based on the heating or cooling stage
-String lastAction = "";
-//This is the RS485 address of this node that gets sent to the thermostat
-String serialAddr = "1";
-//The originator code identifier of the originator of the message
-String originator = "00";
-//Placeholder for the last command sent
-String lastSent = "";
-//The command to be sent to the thermostat
-String command = "";
-//Counter used in place of sleep to request information at certain intervals
-int updateCounter = 0;
-int refreshCounter = 0;
-//The last outside air value received for display on the WDU
-float lastOutsideAir = 0;
-//Tell whether a command was sent or not.
-boolean commandSent = false;
-//Tells the code when to send a refresh of the received RS485 data sent from the thermostat
-boolean refresh = true;
-boolean processedR1 = false;
-boolean processedR2 = false;
-
-//Tells whether we are reconnecting to MQTT or not
-boolean reconnecting = false;
-//Setting this to true will print debug messages to the serial port
-boolean debugPrint = false;
-//The number of reconnect attempts.  Used to reset if over a certain number of tries
-int reconnectCount = 0;
-
-std::map<int, String> st = {{-4, "MQTT CONNECTION TIMEOUT"},
-                            {-3, "MQTT CONNECTION LOST"},
-                            {-2, "MQTT CONNECT FAILED"},
-                            {-1, "MQTT DISCONNECTED"},
-                            {0, "MQTT CONNECTED"},
-                            {1, "MQTT CONNECT BAD PROTOCOL"},
-                            {2, "MQTT CONNECT BAD CLIENT ID"},
-                            {3, "MQTT CONNECT UNAVAILABLE"},
-                            {4, "MQTT CONNECT BAD CREDENTIALS"},
-                            {5, "MQTT CONNECT UNAUTHORIZED"}};
+/**
+ * @brief Publishes the given fields of a thermostat's state and clears their dirty 
+ * bits. Only the set bits are visited. A field that does not fit in the outbound 
+ * queue is left dirty.
+ * 
+ * @param thermostat The thermostat to publish
+ * @param fields The fields to publish, one bit per StateField
+ */
+void publishState(Thermostat& thermostat, uint16_t fields) {
+  ThermostatState& state = thermostat.state;
+  char value[PUBLISH_VALUE_LENGTH];
+  fields &= state.known;
+  while (fields != 0) {
+    StateField field = (StateField)__builtin_ctz(fields);
+    fields &= fields - 1;
+    state.format(field, value, sizeof(value));
+    if (!publishStatus(thermostat, fieldKeys[field], value)) {
+      //Left dirty and sent once the MQTT side has caught up
+      state.dirty |= (1 << field) | fields;
+      metrics.outboundFull ++;
+      return;
+    }
+    state.dirty &= ~(1 << field);
+    state.publishedNow(field, millis());
+  }
+}
 
-// Declare objects
-SoftwareSerial RS485Serial(SSerialRX, SSerialTX); // RX, TX
-WiFiClient espClient;
-PubSubClient client(espClient);
+/**
+ * @brief Publishes the fields of a thermostat that its publish policies say are due. 
+ * A replay publishes every change, so its stream does not depend on the clock.
+ * 
+ * @param thermostat The thermostat to publish
+ * @return How long until the next field is due, in milliseconds
+ */
+unsigned long publishChanges(Thermostat& thermostat) {
+  if (replay.parsing) {
+    publishState(thermostat, thermostat.state.dirty);
+    return ULONG_MAX;
+  }
+  unsigned long wait;
+  uint16_t fields = thermostat.state.due(millis(), (&thermostat - thermostats) * FIELD_COUNT, wait, 
+                                         metrics.suppressedPublishes);
+  publishState(thermostat, fields);
+  return fields != 0 ? 0 : wait;
+}
 
 /**
- * @brief the main setup method for instantiating objects
+ * @brief Queues a status value on one of a thermostat's topics for the MQTT side. 
+ * Called from the RS485 side.
  * 
+ * @param thermostat The thermostat the value is for
+ * @param key The topic under the thermostat's topic prefix
+ * @param value The value to publish
+ * @return false if the outbound queue was full
  */
-void setup() {
-  Serial.begin(115200);
-  // Start the software serial port, to another device
-  RS485Serial.begin(9600);   // set the data rate
+bool publishStatus(const Thermostat& thermostat, const char* key, const char* value) {
+  StatusUpdate update;
+  update.thermostat = &thermostat;
+  snprintf(update.key, sizeof(update.key), "%s", key);
+  snprintf(update.value, sizeof(update.value), "%s", value);
+  update.replayed = replay.parsing;
+  return outboundStatus.push(update);
+}
 
-  setup_wifi();
-  client.setServer(mqttServer, 1883);
-  client.setCallback(callback);
+/**
+ * @brief Publishes the status values queued by the RS485 side
+ * 
+ */
+void drainOutbound() {
+  StatusUpdate update;
+  while (outboundStatus.pop(update)) {
+    if (update.replayed) {
+      publishReplayed(*update.thermostat, update.key, update.value);
+    } else {
+      sendStatus(*update.thermostat, update.key, update.value);
+    }
+  }
 }
 
 /**
- * @brief the main loop code
+ * @brief Publishes a status value on one of a thermostat's topics. When MQTT is down 
+ * the value is held in the publish buffer and sent once the connection is back, and 
+ * an action that differs from the last one is also held as a transition. Called from 
+ * the MQTT side.
  * 
+ * @param thermostat The thermostat the value is for
+ * @param key The topic under the thermostat's topic prefix
+ * @param value The value to publish
  */
-void loop() {
-  // put your main code here, to run repeatedly:
+void sendStatus(const Thermostat& thermostat, const char* key, const char* value) {
+  char topic[TOPIC_MAX_LENGTH];
+  snprintf(topic, sizeof(topic), "%s/%s", thermostat.topicPrefix, key);
+  char* action = NULL;
+  if (strcmp(key, "action") == 0) {
+    action = lastAction[&thermostat - thermostats];
+  }
+  if (client.connected() && publishBuffer.empty()) {
+    if (client.publish(topic, value)) {
+      if (action != NULL) {
+        snprintf(action, PUBLISH_VALUE_LENGTH, "%s", value);
+      }
+      return;
+    }
+    failedPublishes ++;
+  }
+  publishBuffer.store(&thermostat, key, value);
+  if (action != NULL && strcmp(action, value) != 0) {
+    publishBuffer.storeTransition(&thermostat, value, millis());
+    snprintf(action, PUBLISH_VALUE_LENGTH, "%s", value);
+  }
+}
 
-  String dataIn;
-  
-  if (RS485Serial.available()) {
-    dataIn = RS485Serial.readStringUntil('\n');
-    parseReceived(dataIn);
+/**
+ * @brief Publishes everything held in the publish buffer. Held action transitions go 
+ * out in order on <prefix>/action/transition with how many seconds ago they happened, 
+ * then the latest value of each topic is published.
+ * 
+ */
+void flushPublishBuffer() {
+  char topic[TOPIC_MAX_LENGTH];
+  char payload[48];
+  unsigned long now = millis();
+  uint8_t sent = 0;
+  for (; sent < publishBuffer.transitionCount; sent++) {
+    const PublishBuffer::Transition& transition = publishBuffer.transitions[sent];
+    snprintf(topic, sizeof(topic), "%s/action/transition", transition.thermostat->topicPrefix);
+    snprintf(payload, sizeof(payload), "{\"action\":\"%s\",\"ago\":%lu}", 
+             transition.value, (now - transition.time) / 1000);
+    if (!client.publish(topic, payload)) {
+      break;
+    }
   }
+  memmove(&publishBuffer.transitions[0], &publishBuffer.transitions[sent], 
+          (publishBuffer.transitionCount - sent) * sizeof(PublishBuffer::Transition));
+  publishBuffer.transitionCount -= sent;
 
-  if (!client.connected()) {
-    reconnecting = true;
-    reconnect();
+  for (sent = 0; sent < publishBuffer.count; sent++) {
+    const PublishBuffer::Entry& entry = publishBuffer.entries[sent];
+    snprintf(topic, sizeof(topic), "%s/%s", entry.thermostat->topicPrefix, entry.key);
+    if (!client.publish(topic, entry.value)) {
+      break;
+    }
   }
+  memmove(&publishBuffer.entries[0], &publishBuffer.entries[sent], 
+          (publishBuffer.count - sent) * sizeof(PublishBuffer::Entry));
+  publishBuffer.count -= sent;
+}
 
-  // The updateCounter is used to request information at different intervals. Requesting 
-  // information at different intervals helps prevent data errors on the serial transmission.
-  updateCounter ++;
-  refreshCounter ++;
-  
-  if (updateCounter == 100000) {
-    command = "R=1";
-  } else if (updateCounter == 200000) {
-    command = "R=2";
-    updateCounter = 0;
+/**
+ * @brief Copies the RS485 side's figures for the MQTT side and hands the copy over. 
+ * Called from the RS485 side once they have been asked for.
+ * 
+ */
+void takeFigures() {
+  busFigures.metrics = metrics;
+  busFigures.profile = busProfile;
+  busFigures.retries = transactions.retriesSent;
+  busFigures.timeouts = transactions.timeouts;
+  busFigures.overlong = rxFrame.overflows;
+  busFigures.phase.store(FIGURES_READY, std::memory_order_release);
+}
+
+/**
+ * @brief Publishes what the RS485 side's figures were asked for and hands them back. 
+ * Called from the MQTT side once the copy is ready.
+ * 
+ */
+void publishFigures() {
+  if (busFigures.uses & FIGURES_FOR_SERIAL) {
+    printProfile();
+  }
+  if (busFigures.uses & FIGURES_FOR_DIAGNOSTICS) {
+    publishDiagnostics();
   }
-  //every minute we should send a data refresh
-  if (refreshCounter == 600000) {
-    refresh = true;
-    refreshCounter = 0;
+  if (busFigures.uses & FIGURES_FOR_PROFILE) {
+    publishProfile();
   }
+  busFigures.uses = 0;
+  busFigures.phase.store(FIGURES_IDLE, std::memory_order_release);
+}
 
-  if (command != "") {
-    sendCmd(command);
+/**
+ * @brief Publishes the loop profile as a retained JSON document on <bridge>/profile, 
+ * as "loop" or, when the network side has its own task, as "bus" and "network". The 
+ * RS485 side's profile is taken from its last copy of its figures.
+ * 
+ */
+void publishProfile() {
+  char payload[MQTT_BUFFER_SIZE - TOPIC_MAX_LENGTH];
+  size_t used = 0;
+#ifdef BRIDGE_DUAL_CORE
+  used += snprintf(payload, sizeof(payload), "{\"bus\":");
+  used += busFigures.profile.toJson(payload + used, sizeof(payload) - used);
+  if (used < sizeof(payload)) {
+    used += snprintf(payload + used, sizeof(payload) - used, ",\"network\":");
+  }
+  if (used < sizeof(payload)) {
+    used += networkProfile.toJson(payload + used, sizeof(payload) - used);
+  }
+#else
+  used += snprintf(payload, sizeof(payload), "{\"loop\":");
+  used += busFigures.profile.toJson(payload + used, sizeof(payload) - used);
+#endif
+  if (used < sizeof(payload)) {
+    used += snprintf(payload + used, sizeof(payload) - used, "}");
   }
+  if (used >= sizeof(payload)) {
+    LOG_ERROR("Profile does not fit in the MQTT buffer");
+    return;
+  }
+  char topic[TOPIC_MAX_LENGTH];
+  bridgeTopic(topic, sizeof(topic), profileTopic);
+  if (!client.publish(topic, payload, true)) {
+    failedPublishes ++;
+  }
+}
 
-  client.loop();
+/**
+ * @brief Prints the loop profile to the serial port, a line for the pass times and a 
+ * line for each of the worst stalls. The RS485 side's profile is taken from its last 
+ * copy of its figures.
+ * 
+ */
+void printProfile() {
+  const LoopProfiler* profiles[] = {&busFigures.profile, &networkProfile};
+#ifdef BRIDGE_DUAL_CORE
+  const char* names[] = {"bus", "network"};
+  const uint8_t count = 2;
+#else
+  const char* names[] = {"loop", "network"};
+  const uint8_t count = 1;
+#endif
+  for (uint8_t i = 0; i < count; i++) {
+    const LoopProfiler& profile = *profiles[i];
+    Serial.printf("%s pass p50 %lu p95 %lu p99 %lu max %lu us, %lu stalls\n", names[i], 
+                  profile.passTime.percentile(50), profile.passTime.percentile(95), 
+                  profile.passTime.percentile(99), profile.passTime.max, profile.stallCount);
+    for (uint8_t j = 0; j < STALL_RECORD_COUNT; j++) {
+      const LoopProfiler::Stall& stall = profile.stalls[j];
+      if (stall.duration > 0) {
+        Serial.printf("%s stall %lu us in %s at %lu s\n", names[i], stall.duration, 
+                      scopeNames[stall.scope], stall.at / 1000);
+      }
+    }
+  }
 }
 
 /**
- * @brief Set up the wifi object
+ * @brief Publishes a thermostat's last runtime rollup as a retained JSON document on 
+ * <prefix>/runtime: the length of the period in seconds and, for each stage, its run 
+ * time in seconds, duty cycle in percent, cycles and short cycles, then how often and 
+ * for how long the minimum off and run times held the stages. The rollup is handed 
+ * back to the RS485 side once it has been published, so one that could not be is 
+ * sent again after a reconnect.
  * 
+ * @param device The index of the thermostat
  */
-void setup_wifi() {
-  delay(10);
-  // We start by connecting to a WiFi network
-  println("");
-  print("Connecting to ");
-  println(ssid);
+void publishRuntime(uint8_t device) {
+  const RuntimeTotals& rollup = runtimes[device].rollup;
+  char payload[MQTT_BUFFER_SIZE - TOPIC_MAX_LENGTH];
+  size_t used = snprintf(payload, sizeof(payload), "{\"seconds\":%lu", rollup.span / 1000);
+  for (uint8_t stage = 0; stage < STAGE_COUNT && used < sizeof(payload); stage++) {
+    unsigned long permille = rollup.span > 0 ? (unsigned long)(rollup.onTime[stage] * 1000ULL / rollup.span) : 0;
+    used += snprintf(payload + used, sizeof(payload) - used, 
+                     ",\"%s\":{\"on\":%lu,\"duty\":%lu.%lu,\"cycles\":%u,\"short\":%u}", 
+                     stageNames[stage], rollup.onTime[stage] / 1000, permille / 10, permille % 10, 
+                     rollup.cycles[stage], rollup.shortCycles[stage]);
+  }
+  if (used < sizeof(payload)) {
+    used += snprintf(payload + used, sizeof(payload) - used, ",\"mot\":%u,\"mrt\":%u,\"held\":%lu}", 
+                     rollup.minOffHolds, rollup.minRunHolds, rollup.heldTime / 1000);
+  }
+  if (used >= sizeof(payload)) {
+    LOG_ERROR("Runtime rollup does not fit in the MQTT buffer");
+    runtimes[device].rollupReady.store(false, std::memory_order_release);
+    return;
+  }
+  char topic[TOPIC_MAX_LENGTH];
+  snprintf(topic, sizeof(topic), "%s/runtime", thermostats[device].topicPrefix);
+  if (client.publish(topic, payload, true)) {
+    runtimes[device].rollupReady.store(false, std::memory_order_release);
+  } else {
+    failedPublishes ++;
+  }
+}
 
-  WiFi.begin(ssid, password);
+/**
+ * @brief Publishes the latency histograms and error counts as a retained JSON 
+ * document on <prefix>/diag. The RS485 side's figures are taken from its last copy of 
+ * them.
+ * 
+ */
+void publishDiagnostics() {
+  const Metrics& figures = busFigures.metrics;
+  char roundTrip[96];
+  char parseTime[96];
+  char callbackTime[96];
+  figures.roundTrip.toJson(roundTrip, sizeof(roundTrip));
+  figures.parseTime.toJson(parseTime, sizeof(parseTime));
+  figures.callbackTime.toJson(callbackTime, sizeof(callbackTime));
 
-  while (WiFi.status() != WL_CONNECTED) {
-    delay(500);
-    print(".");
+  char payload[MQTT_BUFFER_SIZE - TOPIC_MAX_LENGTH];
+  int used = snprintf(payload, sizeof(payload), 
+                      "{\"uptime\":%lu,\"rtt\":%s,\"parse\":%s,\"callback\":%s,\"retries\":%lu,"
+                      "\"timeouts\":%lu,\"malformed\":%lu,\"foreign\":%lu,\"overlong\":%lu,"
+                      "\"publishFailed\":%lu,\"reconnects\":%lu,\"idle\":%lu,\"outboundFull\":%lu,\"packedWrites\":%lu,\"suppressed\":%lu,"
+                      "\"bufferDropped\":%u}", 
+                      millis() / 1000, roundTrip, parseTime, callbackTime, busFigures.retries, 
+                      busFigures.timeouts, figures.malformedFrames, figures.foreignFrames, 
+                      busFigures.overlong, failedPublishes, mqttReconnector.reconnects, 
+                      figures.idleTime / 1000, figures.outboundFull, 
+                      figures.packedWrites, figures.suppressedPublishes, publishBuffer.dropped);
+  if (used < 0 || used >= (int)sizeof(payload)) {
+    LOG_ERROR("Diagnostics document too long");
+    return;
   }
+  char topic[TOPIC_MAX_LENGTH];
+  bridgeTopic(topic, sizeof(topic), diagnosticsTopic);
+  if (!client.publish(topic, payload, true)) {
+    failedPublishes ++;
+  }
+}
 
-  println("");
-  println("WiFi connected");
-  println("IP address: ");
-  println((String)WiFi.localIP());
+/**
+ * @brief Publishes the records in the log ring, oldest first, on <prefix>/log
+ * 
+ */
+void publishLog() {
+  unsigned long last = logger.kept.load();
+  unsigned long first = last > LOG_RING_SIZE ? last - LOG_RING_SIZE : 0;
+  char topic[TOPIC_MAX_LENGTH];
+  bridgeTopic(topic, sizeof(topic), logTopic);
+  char payload[LOG_RECORD_LENGTH + 24];
+  for (unsigned long i = first; i < last; i++) {
+    if (!logger.format(i, payload, sizeof(payload))) {
+      continue;
+    }
+    if (!client.publish(topic, payload)) {
+      break;
+    }
+  }
 }
 
 /**
- * @brief This is to process incoming messages
+ * @brief Publishes the bus capture, oldest frame first, in messages of whole records 
+ * on <prefix>/capture. Called from the MQTT side once the RS485 side has handed the 
+ * ring over, and leaves recording off.
  * 
- * @param topic The topic we are subscribed to
- * @param message The payload for that topic
- * @param length The length of the payload string
  */
-void callback(char* topic, byte* message, unsigned int length) {
-  print("Message arrived on topic: ");
-  print(topic);
-  print(". Message: ");
-  String messageTemp;
-  boolean numeric = false;
-  boolean doubleQuotes = false;
-  
-  for (int i = 0; i < length; i++) {
-    if (isDigit((char)message[i])) {
-      numeric = (i == 0 || numeric) ? true : false;
-    } else {
-      numeric = false;
+void publishCapture() {
+  char topic[TOPIC_MAX_LENGTH];
+  bridgeTopic(topic, sizeof(topic), captureTopic);
+  uint8_t chunk[CAPTURE_CHUNK_SIZE];
+  size_t offset = 0;
+  for (size_t size = busCapture.read(offset, chunk, sizeof(chunk)); size > 0; 
+       size = busCapture.read(offset, chunk, sizeof(chunk))) {
+    if (!client.publish(topic, chunk, size, false)) {
+      break;
+    }
+  }
+  busCapture.phase.store(CAPTURE_OFF, std::memory_order_release);
+}
+
+/**
+ * @brief Loads a capture received over MQTT for the RS485 side to replay
+ * 
+ * @param capture The capture records
+ * @param length The number of bytes in the capture
+ * @param realtime Whether to replay at the recorded speed instead of as fast as possible
+ */
+void startReplay(const uint8_t* capture, size_t length, bool realtime) {
+  if (!replay.begin(capture, length, realtime)) {
+    LOG_WARN("The capture is too long to replay or a replay is already running");
+    return;
+  }
+  LOG_INFO("Replaying %u bytes of capture", (unsigned int)length);
+}
+
+/**
+ * @brief Parses the replayed frames that are due into replayThermostats. They start 
+ * the replay from an empty state so every run of the same capture publishes the same 
+ * stream. Called from the RS485 side while a replay is running, between the live 
+ * frames and polls.
+ * 
+ */
+void serviceReplay() {
+  if (replay.phase.load(std::memory_order_acquire) == REPLAY_LOADED) {
+    for (uint8_t device = 0; device < DEVICE_COUNT; device++) {
+      replayThermostats[device].state = ThermostatState();
     }
-    if ((char)message[i] == '"') {
-      doubleQuotes = (!doubleQuotes) ? false : true;
+    replay.startedAt = millis();
+    replay.phase.store(REPLAY_RUNNING, std::memory_order_release);
+  }
+  CaptureDirection direction;
+  const char* frame;
+  size_t length;
+  char buffer[RX_BUFFER_SIZE];
+  //A frame is only parsed once every field of the last one has been queued and the 
+  //outbound queue has room for all of its fields
+  while (replayFlushed() && OUTBOUND_QUEUE_SIZE - outboundStatus.size() >= FIELD_COUNT && 
+         replay.next(direction, frame, length)) {
+    if (direction != CAPTURE_RX || length >= sizeof(buffer)) {
+      continue;
     }
-    //print(message[i].str());
-    messageTemp += (char)message[i];
+    memcpy(buffer, frame, length);
+    buffer[length] = '\0';
+    replay.parsing = true;
+    unsigned long parseStart = micros();
+    parseReceived(buffer, length);
+    replay.parseTime += micros() - parseStart;
+    replay.parsing = false;
+    replay.frames ++;
+  }
+  if (!replayFlushed() || !replay.finished()) {
+    return;
   }
-  println(messageTemp);
+  replay.phase.store(REPLAY_DONE, std::memory_order_release);
+}
 
-  //Check to see if the received message is for one of our thermostat control topics
-  
-  //Both the SetHeatTopic (SPH) and setCoolTopic (SPC) also check the setTempTopic. When
-  //checking the setTempTopic it will check the last mode of the thermostat and perform 
-  //the same actions for SPH when the mode is "H" and SPC when the mode is "C".  This
-  //allows for a singleplace for setting the temperature based on what mode it is in.
-
-  //SPH=xx - Heating SetPoint where xx = 40 to 109 degrees F.
-  if (String(topic) == setHeatTopic || (String(topic) == setTempTopic && lastMode =="H")) {
-    println("Set the Heating SetPoint");
-    if (numeric && messageTemp.toInt()>39 && messageTemp.toInt() < 110) {
-      command = "SPH=" + messageTemp;
-      updateCounter = 0;
-    } else {
-      if(!numeric) {
-        println("Must be a number");
-      } else {
-        println("The heating setpoint must be a number between 40 and 109");
-      }
+/**
+ * @brief Queues the fields the replay left dirty when the outbound queue was full
+ * 
+ * @return true once no field is left dirty
+ */
+bool replayFlushed() {
+  bool flushed = true;
+  replay.parsing = true;
+  for (Thermostat& thermostat : replayThermostats) {
+    if (thermostat.state.dirty != 0) {
+      publishState(thermostat, thermostat.state.dirty);
+      flushed = flushed && thermostat.state.dirty == 0;
     }
-  } else 
-  //SPC=xx - Cooling SetPoint where xx = 44 to 113 degrees F.
-  if (String(topic) == setCoolTopic || (String(topic) == setTempTopic && lastMode =="C")) {
-    println("Set the Cooling SetPoint");
-    if (numeric && messageTemp.toInt()>43 && messageTemp.toInt() < 114) {
-      command = "SPC=" + messageTemp;
-      updateCounter = 0;
-    } else {
-      if(!numeric) {
-        println("Must be a number");
-      } else {
-        println("The cooling setpoint must be a number between 44 and 113");
-      }
-    }
-  } else 
-  //SC=n - Schedule control where “n” is 0 (Hold); 1 (Run); or ?. Run starts
-  //       execution of setpoint schedule, Hold stops schedule execution and 
-  //       holds current setpoint..
-  if (String(topic) == setScheduleControlTopic) {
-    println("Set the schedule control");
-    if (messageTemp == "0" || messageTemp == "1" || messageTemp == "?") {
-      command = "SC=" + messageTemp;
-      updateCounter = 0;
-    } else {
-      println("The schedule control can only be 0 (Hold), 1 (Run) or ?");
-    }
-  } else 
-  //M=a - Mode where a = O (Off), H(Heat), C(Cool), A(Auto), EH(Emergency Heat) or I (Invalid).
-  if (String(topic) == setModeTopic) {
-    println("Set the Mode");
-    if (messageTemp == "O" || messageTemp == "H" || messageTemp == "C" || messageTemp == "A" || messageTemp == "EH" || messageTemp == "I") {
-      command = "M=" + messageTemp;
-      updateCounter = 0;
-    } else {
-      println("The mode must be one of O, H, C, A, EH or I");
-    }
-  } else 
-  //FM=x - Fan Mode where x = 0 (Off or Auto) or 1 (On).
-  if (String(topic) == setFanModeTopic) {
-    println("Set the Fan Mode");
-    if (messageTemp == "0" || messageTemp == "1") {
-      command = "FM=" + messageTemp;
-      updateCounter = 0;
-    } else {
-      println("The fan mode must be either 0 or 1");
-    }
-  } else 
-  //TM=”abcde...” where “a...” = character string, 80 characters max or #.
-  if (String(topic) == setTextMessageTopic) {
-    println("Set the Text Message");
-    if (length <= 80 && !doubleQuotes) {
-      command = "TM=" + messageTemp;
-      updateCounter = 0;
-    } else {
-      if (length > 80) {
-        println("The text message must be less than 80 characters");
-      } else {
-        println("The text message cannot contain double quotes");
+  }
+  replay.parsing = false;
+  return flushed;
+}
+
+/**
+ * @brief Reports a finished replay on <prefix>/capture/result. Called from the MQTT side.
+ * 
+ */
+void publishReplayResult() {
+  //The replay's publishes were all queued before it finished
+  drainOutbound();
+  char topic[TOPIC_MAX_LENGTH];
+  bridgeTopic(topic, sizeof(topic), captureResultTopic);
+  char payload[224];
+  snprintf(payload, sizeof(payload), 
+           "{\"frames\":%lu,\"publishes\":%lu,\"malformed\":%lu,\"foreign\":%lu,\"hash\":\"%08lx\","
+           "\"parseMicros\":%lu,\"framesPerSecond\":%lu}", 
+           replay.frames, replay.publishes, replay.malformedFrames, replay.foreignFrames, 
+           (unsigned long)replay.hash, replay.parseTime, 
+           replay.parseTime > 0 ? (unsigned long)(replay.frames * 1000000ULL / replay.parseTime) : 0);
+  client.publish(topic, payload);
+  replay.phase.store(REPLAY_IDLE, std::memory_order_release);
+}
+
+/**
+ * @brief Takes a publish made while parsing a replayed frame. It is counted in the 
+ * replay's hash and sent on <prefix>/capture/stream instead of its own topic.
+ * 
+ */
+void publishReplayed(const Thermostat& thermostat, const char* key, const char* value) {
+  char topic[TOPIC_MAX_LENGTH];
+  snprintf(topic, sizeof(topic), "%s/%s", thermostat.topicPrefix, key);
+  replay.published(topic, value);
+  char streamTopic[TOPIC_MAX_LENGTH];
+  bridgeTopic(streamTopic, sizeof(streamTopic), captureStreamTopic);
+  char payload[TOPIC_MAX_LENGTH + PUBLISH_VALUE_LENGTH + 2];
+  snprintf(payload, sizeof(payload), "%s %s", topic, value);
+  if (client.connected()) {
+    client.publish(streamTopic, payload);
+  }
+}
+
+/**
+ * @brief Publishes the retained Home Assistant discovery payloads for every thermostat: 
+ * the entities in discoveryEntities and a runtime sensor for each stage
+ * 
+ */
+void publishDiscovery() {
+  char nodeId[TOPIC_MAX_LENGTH];
+  char objectId[DISCOVERY_OBJECT_ID_LENGTH];
+  char name[32];
+  char config[192];
+  for (uint8_t device = 0; device < DEVICE_COUNT; device++) {
+    const Thermostat& thermostat = thermostats[device];
+    //The node id is the topic prefix with the slashes, which HA does not allow, replaced
+    snprintf(nodeId, sizeof(nodeId), "%s", thermostat.topicPrefix);
+    for (char* c = nodeId; *c != '\0'; c++) {
+      if (*c == '/') {
+        *c = '_';
       }
     }
-  } else 
-  //OT=xxx, where “xxx” = temperature in degrees.
-  if (String(topic) == setOutsideTempTopic) {
-    println("Set the Outside Temperature");
-    if (numeric && messageTemp.toInt()>= -50 && messageTemp.toInt() < 125) {
-      command = "OT=" + messageTemp;
-      updateCounter = 0;
-    } else {
-      if(!numeric) {
-        println("Must be a number");
-      } else {
-        println("The outside temp must be a number between -50 and 125");
-      }
-    }
-  } else 
-  //TIME=hh:mm:ss, where hh is hours (00-23), mm is minutes (00-59), ss is seconds (00-59).
-  if (String(topic) == setTimeTopic) {
-    println("Set the Time");
-    command = "TIME=" + messageTemp;
-    updateCounter = 0;
-  } else 
-  //DATE=mm/dd/yy, where mm is month (01-12), dd is day of month (1-31), yy is year (00-99).
-  if (String(topic) == setDateTopic) {
-    println("Set the Date");
-    command = "DATE=" + messageTemp;
-    updateCounter = 0;
-  } else 
-  //DOW=n, where n = 1-7, Sun=1, Sat=7
-  if (String(topic) == setDayOfWeekTopic) {
-    println("Set the Day of the week");
-    command = "DOW=" + messageTemp;
-    updateCounter = 0;
-  }
-  //
-  if (String(topic) == debugMode) {
-    debugPrint = (messageTemp == "on") ? true : false;
-  }
-}
-
-/**
- * @brief Used to reconnect to the MQTT server
- * 
- */
-void reconnect() {
-  // Loop until we're reconnected
-  while (!client.connected()) {
-    print("Attempting MQTT connection...");
-    // Attempt to connect
-    if (client.connect("ESP8266Client", MQTTUser, MQTTPass)) {
-      println("connected");
-      // Subscribe
-
-      client.subscribe(setTempTopic);
-      client.subscribe(setHeatTopic);
-      client.subscribe(setCoolTopic);
-      client.subscribe(setModeTopic);
-      client.subscribe(setFanModeTopic);
-      client.subscribe(setScheduleControlTopic);
-      client.subscribe(setTextMessageTopic);
-      client.subscribe(setOutsideTempTopic);
-      client.subscribe(setTimeTopic);
-      client.subscribe(setDateTopic);
-      client.subscribe(setDayOfWeekTopic);
-      client.subscribe(debugMode);
-
-      client.publish(connectionTopic, "Connected");
-      client.publish(availabilityTopic, "available");
-      reconnectCount = 0;
-      reconnecting = false;
-    } else {
-      print("failed, rc=");
-      print(st[client.state()]);
-      println(" try again in 5 seconds");
-      // Wait 5 seconds before retrying
-      delay(5000);
-      reconnectCount ++;
-      println("reconnect count = " + String (reconnectCount));
-      //Check if we had 6 reconnecton attempts (30 seconds) and if so, restart 
-      //the controller to refresh things
-      if (reconnectCount == 6) {
-        ESP.restart();
-      }
+    for (const DiscoveryEntity& entity : discoveryEntities) {
+      publishDiscoveryEntity(thermostat, nodeId, entity);
+    }
+    for (uint8_t stage = 0; stage < STAGE_COUNT; stage++) {
+      snprintf(objectId, sizeof(objectId), runtimeObjectId, stageNames[stage]);
+      snprintf(name, sizeof(name), runtimeName, stageNames[stage]);
+      snprintf(config, sizeof(config), runtimeConfig, stageNames[stage]);
+      publishDiscoveryEntity(thermostat, nodeId, DiscoveryEntity{"sensor", objectId, name, config});
     }
   }
 }
 
 /**
- * @brief Used to parse data received from the RS485 network connected to the thermostat
+ * @brief Publishes the retained discovery payload of one entity of a thermostat
  * 
- * @param Message The message string to parse
+ * @param thermostat The thermostat the entity belongs to
+ * @param nodeId The thermostat's node id, its topic prefix with the slashes replaced
+ * @param entity The entity
  */
-void parseReceived(String Message) {
-  
-  String StatusData;
-  //int Count;
-  String StatusString;
-  String Status;
-  String Type;
-  String Value;
-
-  int Index;
-  int Start;
-  int End;
-  int StatIndex;
-
-  Index = Message.indexOf(' ');
-  Start = 0;
-  
-  println("Message: " + Message);
-  
-  //Check if the message came from the originator (the thermostat) and is for 
-  //the serial address of this node
-  if (Message.startsWith("A=" + originator + " O=" + serialAddr)) {
-    while (End != Message.length()) {
-      End = (Index == -1) ? Message.length() : Index;
-      //Get the status string to process
-      StatusString = Message.substring(Start, End);
-      //Change our start position to 1 over the last space found
-      Start = Index + 1;
-      //Find the end of the next status string
-      Index = Message.indexOf(' ', Start);
-  
-      //Now we need to process the status string into it's Type and Value
-      StatIndex = StatusString.indexOf('=');
-      Type = StatusString.substring(0, StatIndex);
-      Value = StatusString.substring(StatIndex + 1);
-      parseStatus(Type, Value);
-    } 
-    //Clear the commandSent
-    commandSent = false;
-    //Check if we processed an R1 status message
-    if (command == "R=1") {
-      processedR1 = true;
-    }
-    //Check if we processed an R2 status message
-    if (command == "R=2") {
-      processedR2 = true;
-    }
-    //When on a refresh cycle we need to make sure we process both R1 and R2 status 
-    //messages before we consider the refresh complete and set the refresh to false
-    if (processedR1 && processedR2) {
-      refresh = processedR1 = processedR2 = false;
-    }
-    command = "";
-    println("");
-    println("Response received and processed");
-    println("");
-  } else {
-    sendCmd(lastSent);
+void publishDiscoveryEntity(const Thermostat& thermostat, const char* nodeId, const DiscoveryEntity& entity) {
+  //<prefix>/<component>/<node id>/<object id>/config, the node id is a topic prefix
+  char topic[sizeof(DISCOVERY_PREFIX) + DISCOVERY_COMPONENT_LENGTH + TOPIC_MAX_LENGTH + 
+             DISCOVERY_OBJECT_ID_LENGTH + sizeof("///config")];
+  char payload[MQTT_BUFFER_SIZE - 2 * TOPIC_MAX_LENGTH];
+  int used = snprintf(topic, sizeof(topic), DISCOVERY_PREFIX "/%s/%s/%s/config", 
+                      entity.component, nodeId, entity.objectId);
+  if (used < 0 || used >= (int)sizeof(topic)) {
+    LOG_ERROR("Discovery topic for %s too long", entity.objectId);
+    return;
   }
-  
-} //End parseReceived
+  used = snprintf(payload, sizeof(payload), 
+                      "{\"~\":\"%s\",\"name\":%s,\"uniq_id\":\"%s_%s\","
+                      "\"avty\":[{\"t\":\"%s/%s\",\"pl_avail\":\"%s\",\"pl_not_avail\":\"%s\"},"
+                      "{\"t\":\"~/availability\",\"pl_avail\":\"available\"}],\"avty_mode\":\"all\","
+                      "\"dev\":{\"ids\":[\"%s\"],\"name\":\"%s\",\"mf\":\"RCS\",\"mdl\":\"TR40\"},%s}", 
+                      thermostat.topicPrefix, entity.name, nodeId, entity.objectId, 
+                      bridgePrefix, connectionTopic, connectionOnline, connectionOffline, nodeId, 
+                      thermostat.name, entity.config);
+  if (used < 0 || used >= (int)sizeof(payload)) {
+    LOG_ERROR("Discovery payload for %s too long", entity.objectId);
+    return;
+  }
+  if (!client.publish(topic, payload, true)) {
+    failedPublishes ++;
+  }
+}
 
 /**
- * @brief Used to parse a status parameter sent from the thermostat
+ * @brief Publishes every thermostat's availability and then the bridge's connection 
+ * topic, retained so Home Assistant finds them when it starts after the bridge has 
+ * connected. An entity is available while both are online.
  * 
- * @param type The status type
- * @param Value The status value
  */
-void parseStatus(String Type, String Value) {  
-  if (Type == "OA") {
-    //Outside Air - only publish if the value has changed
-    if (lastOutsideAir != Value.toFloat() || refresh)
-      client.publish(outsideAirTopic, Value.c_str());
-    lastOutsideAir = Value.toFloat();
-  } else if (Type == "T") {
-    //Current temperature - only publish if the value has changed
-    println("Current temperature=" + Value);
-    if (lastTemp != Value || refresh)
-      client.publish(currentTempTopic, Value.c_str());
-    lastTemp = Value;
-  } else if (Type == "SP") {
-    //Set Point (for single setpoint systems)  Set the heating or cooling depending 
-    //on what mode we are in
-    if ((lastMode == "H" || lastMode == "EH") && (lastSetpointHeat != Value || refresh)) {
-      println("Single setpoint Heat=" + Value);
-      client.publish(setpointHeatTopic, Value.c_str());
-      lastSetpointHeat = Value;
-    } else if (lastMode == "C" && (lastSetpointCool != Value || refresh)) {
-      println("Single setpoint cool=" + Value);
-      client.publish(setpointCoolTopic, Value.c_str());
-      lastSetpointCool = Value;
-    }
-  } else if (Type == "SPH") {
-    //Heating set point
-    println("Heating set point=" + Value);
-    if (lastSetpointHeat != Value || refresh)
-      client.publish(setpointHeatTopic, Value.c_str());
-    lastSetpointHeat = Value;
-  } else if (Type == "SPC") {
-    //Cooling set point
-    println("Cooling set point=" + Value);
-    if (lastSetpointCool != Value || refresh)
-      client.publish(setpointCoolTopic, Value.c_str());
-    lastSetpointCool = Value;
-  } else if (Type == "M") {
-    //RCS thermostat mode 
-    println("mode=" + Value);
-    println("Set energy mode to normal");
-    if (lastMode != Value || refresh) {
-      client.publish(modeTopic, Value.c_str());
-      lastMode = Value;
-      if (Value == "O") {
-          println("Set to Off");
-      } else if (Value == "H") {
-          println("Set to Heating");
-      } else if (Value == "C") {
-          println("Set to Cooling");
-      } else if (Value == "A") {
-          println("Set to AutoChangeOver");
-      } else if (Value == "EH") {
-          println("Set to Emergency Heat");
-      }
-    }
-  } else if (Type == "FM") {
-    //RCS current fan mode (0=off 1=on)
-    if (lastFanMode != Value || refresh) {
-      client.publish(fanModeTopic, Value.c_str());
-      lastFanMode = Value;
-      if (Value == "1") {
-        println("Set fan mode to ContinuousOn");
-      } else {
-        println("Set fan mode to Auto");
-      }
-    }
-  //Type 2 status message types
-  //{% set values = {'O':'Off', 'H1':'Stage 1 heating', 'H2':'Stage 2 heating', 'H3':'Stage 3 heating', 'C1':'Stage 1 heating', 'C2':'Stage 2 cooling', 'I':'Idle', 'F':'Fan'} %}
-  } else if (Type == "H1A" && Value == "1" && (lastAction != "H1" || refresh)) {
-    //RCS heating stage 1
-    println("Set to heating Stage 1 Min");
-    client.publish(actionTopic, "H1");
-    lastAction = "H1";
-  } else if (Type == "H2A" && Value == "1" && (lastAction != "H2" || refresh)) {
-    //RCS heating stage 2
-    println("Set to heating Stage 2 Normal");
-    client.publish(actionTopic, "H2");
-    lastAction = "H2";
-  } else if (Type == "H3A" && Value == "1" && (lastAction != "H3" || refresh)) {
-    //RCS heating stage 3
-    println("Set to heating Stage 3 Max");
-    client.publish(actionTopic, "H3");
-    lastAction = "H3";
-  } else if (Type == "C1A" && Value == "1" && (lastAction != "C1" || refresh)) {
-    //RCS cooling stage 1
-    println("Set to cooling Stage 1 Normal");
-    client.publish(actionTopic, "C1");
-    lastAction = "C1";
-  } else if (Type == "C2A" && Value == "1" && (lastAction != "C2" || refresh)) {
-    //RCS cooling stage 2
-   println("Set to cooling Stage 2 Max");
-    client.publish(actionTopic, "C2");
-    lastAction = "C2";
-  // We may receive values of 0 for both C1A and H1A we may get an on/Auto cycling if one or the 
-  // other is on. To prevent this we must verify the mode we are in and only set it to auto if 
-  // the heating or cooling stage with a 0 value matches the mode we are in
-  } else if (((Type == "C1A" && lastMode == "C") || (Type == "H1A" && (lastMode == "H" || lastMode == "EH"))) && Value == "0" && (lastAction != "O" || refresh)) {
-    //send(msgFanStatus.set("Off"));
-    println("Set fan status to off");
-    client.publish(actionTopic, "O");
-    lastAction = "O";
-  } else if (Type == "FA" && (lastAction != "F" || refresh)) {
-    //RCS fan status
-     //client.publish(fanStatusTopic, Value.c_str()); 
-     client.publish(actionTopic, "F"); 
-    lastAction = "F";
-    if (Value == "1") {
-      println("Set flow mode to ContinuousOn");
-    } else {
-      println("Set fan speed to auto");
-    }
-  } else if (Type == "SC") {
-    //RCS schedule control
-     client.publish(scheduleControlTopic, Value.c_str());
-    if (Value == "0") {
-      println("Schedule control is set to Hold");
-    } else if (Value == "1") {
-      println("Schedule control is set to Run");
-    }else {
-      println("Unknown schedule control response");
-    }
-  } else if (Type == "VA") {
-    //Vent damper not used
-  } else if (Type == "D1") {
-    //Damper #1 not used
-  } else if (Type == "SCP") {
-    //This is for MOT (Minimum Off Time) and MRT (Minimum Run Time) statuses for 
-    //stages 1 and 2.  I may find a way to implement this, but for now it is not used
-    
-    //String stg1 = Value.substring(0, 1);
-    //String stg2 = Value.substring(0, Value.length() - 1);
+void publishAvailability() {
+  char topic[TOPIC_MAX_LENGTH];
+  for (uint8_t device = 0; device < DEVICE_COUNT; device++) {
+    snprintf(topic, sizeof(topic), "%s/availability", thermostats[device].topicPrefix);
+    if (!client.publish(topic, "available", true)) {
+      failedPublishes ++;
+    }
   }
-  
-} //End parseStatus
+  bridgeTopic(topic, sizeof(topic), connectionTopic);
+  if (!client.publish(topic, connectionOnline, true)) {
+    failedPublishes ++;
+  }
+}
 
 /**
- * @brief Sends a command out to the RS485 network
+ * @brief Builds one of the bridge's own topics
  * 
- * @param cmd The command to send
+ * @param buffer Where to write the topic
+ * @param size The size of the buffer
+ * @param key The key after the bridge prefix
  */
-void sendCmd(String cmd) {
-  //Assemble the command string using the defined serial address and originator codes
-  String commandStr = "A=" + serialAddr + " O=" + originator + " " + cmd;
-  println("");
-  println("Command sent: " + commandStr);
-  // Enable RS485 Transmit only for the duration of the send
-  digitalWrite(SSerialTxControl, RS485Transmit);
-  RS485Serial.print(commandStr + "\r");
-  lastSent = cmd;
-  //Return to RS485 receive mode  
-  digitalWrite(SSerialTxControl, RS485Receive);
-  delay(50);
-  commandSent = true;
-  command = "";
-} //End sendCmd
+void bridgeTopic(char* buffer, size_t size, const char* key) {
+  snprintf(buffer, size, "%s/%s", bridgePrefix, key);
+}
+
+/**
+ * @brief Finds the key of a topic under a prefix
+ * 
+ * @param topic The full topic
+ * @param prefix The topic prefix
+ * @return The part of the topic after "<prefix>/", NULL when the topic is not under the prefix
+ */
+const char* topicKey(const char* topic, const char* prefix) {
+  size_t prefixLength = strlen(prefix);
+  if (strncmp(topic, prefix, prefixLength) != 0 || topic[prefixLength] != '/') {
+    return NULL;
+  }
+  return topic + prefixLength + 1;
+}
+
+/**
+ * @brief Turns SP=value into the SPH or SPC command of the thermostat's mode and 
+ * publishes it optimistically, the way callback() does for the other status fields
+ * 
+ * @param device The index of the thermostat the command is for
+ * @param value The setpoint, already checked to be a number
+ * @param buffer Where to write the command
+ * @param size The size of the buffer
+ * @return The command, or NULL if the mode has no setpoint or the value is out of its range
+ */
+const char* resolveSetpoint(uint8_t device, const char* value, char* buffer, size_t size) {
+  const SetRoute* route = findSetRoute("SP", 2);
+  const SetRoute* target = resolveSetRoute(route, thermostats[device]);
+  if (target == NULL) {
+    LOG_WARN("%s", route->error);
+    return NULL;
+  }
+  Payload payload{value, strlen(value)};
+  if (!validatePayload(*target, payload) || !buildCommand(*target, payload, buffer, size)) {
+    return NULL;
+  }
+  publishStatus(thermostats[device], fieldKeys[target->field], value);
+  return buffer;
+}
+
+/**
+ * @brief Queues a command from Home Assistant to be sent ahead of the status polls. 
+ * SP= is resolved to the setpoint of the thermostat's mode first.
+ * 
+ * @param device The index of the thermostat the command is for
+ * @param cmd The command to queue
+ * @param received The micros() the MQTT message arrived at
+ * @return false if the queue was full or an SP= could not be resolved
+ */
+bool queueUserCommand(uint8_t device, const char* cmd, unsigned long received) {
+  char resolved[COMMAND_MAX_LENGTH];
+  if (strncmp(cmd, "SP=", 3) == 0) {
+    cmd = resolveSetpoint(device, cmd + 3, resolved, sizeof(resolved));
+    if (cmd == NULL) {
+      return false;
+    }
+  }
+  if (commandQueue.push(device, cmd, PRIORITY_USER)) {
+    thermostats[device].pollScheduler.commandQueued();
+    metrics.callbackTime.record(micros() - received);
+    return true;
+  }
+  LOG_WARN("Command queue is full, dropped %s", cmd);
+  //Put back the value the command was optimistically published with
+  const char* equals = strchr(cmd, '=');
+  const SetRoute* route = (equals != NULL) ? findSetRoute(cmd, equals - cmd) : NULL;
+  if (route != NULL && route->field != FIELD_COUNT) {
+    rollBack(thermostats[device], 1 << route->field);
+  }
+  return false;
+}
 
 /**
- * @brief used to easily turn on and off debug printing to the serial port with Serial.print
+ * @brief Hands a command from Home Assistant to the RS485 side. Called from callback().
  * 
- * @param Message The string message to print to the serial port
+ * @param device The index of the thermostat the command is for
+ * @param cmd The command
+ * @param received The micros() the MQTT message arrived at
+ * @return false if the inbound queue was full
  */
-void print(String Message) {
-  if (debugPrint) 
-    Serial.print(Message);
+bool submitCommand(uint8_t device, const char* cmd, unsigned long received) {
+  Command command;
+  strncpy(command.text, cmd, COMMAND_MAX_LENGTH - 1);
+  command.text[COMMAND_MAX_LENGTH - 1] = '\0';
+  command.device = device;
+  command.priority = PRIORITY_USER;
+  command.received = received;
+  if (inboundCommands.push(command)) {
+    return true;
+  }
+  LOG_WARN("Inbound queue is full, dropped %s", cmd);
+  return false;
 }
 
 /**
- * @brief used to easily turn on and off debug printing to the serial port with Serial.println
+ * @brief Sends a command out to the RS485 network
  * 
- * @param Message The string message to print to the serial port 
+ * @param device The index of the thermostat to send the command to
+ * @param cmd The command to send
+ */
+void sendCmd(uint8_t device, const char* cmd) {
+  //Assemble the command string using the device's serial address and originator codes
+  char commandStr[COMMAND_MAX_LENGTH + 16];
+  snprintf(commandStr, sizeof(commandStr), "A=%s O=%s %s\r", thermostats[device].address, originator, cmd);
+  LOG_DEBUG("Command sent: %s", commandStr);
+  //The capture leaves out the line end, as it does for received frames
+  busCapture.record(CAPTURE_TX, commandStr, strlen(commandStr) - 1);
+  //The transport enables the driver only for as long as the frame is on the wire
+  if (!rs485.send(commandStr, strlen(commandStr))) {
+    LOG_ERROR("RS485 transmitter busy, command not sent");
+  }
+} //End sendCmd
+
+/**
+ * @brief Hooks that put the RS485 transport on the RS485Serial port
  */
-void println(String Message) {
-  if (debugPrint) 
-    Serial.println(Message);
+size_t rs485Write(const char* data, size_t length) {
+  return RS485Serial.write((const uint8_t*)data, length);
+}
+
+int rs485Available() {
+  return RS485Serial.available();
+}
+
+int rs485Read() {
+  return RS485Serial.read();
+}
+
+#ifdef RS485_HARDWARE_UART
+bool rs485TxDone() {
+  //Checks the UART's transmit done status without waiting
+  return uart_wait_tx_done((uart_port_t)RS485_UART_NUM, 0) == ESP_OK;
 }
+#endif